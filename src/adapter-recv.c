@@ -2,9 +2,16 @@
 #include "adapter.h"
 #include "thread.h"
 #include "proto-dns-compressor.h"
+#include "proto-dns-cookie.h"
 #include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-rrl.h"
+#include "proto-dns-stats.h"
+#include "proto-dns-timing.h"
 #include "resolver.h"
 #include "thread.h"
+#include "util-acl.h"
 #include "db-rrset.h"
 
 #include <string.h>
@@ -66,13 +73,13 @@ network_receive(struct Frame *frame,
     frame->time_secs = secs;
     frame->time_usecs = usecs;
     frame->net_protocol = 0;
+    timing_sample(&frame->timer);
 
     /*
      * PARSE FIRST THEN PROCESS REQ:[d7Unn4]
      *
-     * This parses Ethernet, IP, UDP, and DNS.
-     *
-     * TODO: this will change a bit once I add TCP handling
+     * This parses Ethernet, IP, UDP, and DNS. For TCP, it stops at the
+     * TCP header, since the DNS request may take more than one segment.
      */
     proto_ethernet_parse(frame, px, 0, length);
 
@@ -93,11 +100,16 @@ network_receive(struct Frame *frame,
     case NET_ICMP:
         proto_icmp_process(frame, frame->icmp);
         return;
+    case NET_TCP:
+        proto_tcp_process(frame, frame->tcp);
+        return;
     default:
         return;
     case NET_DNS:
-        if (!frame->dns->is_valid)
+        if (!frame->dns->is_valid) {
+            stats_drop(STATS_DROP_MALFORMED);
             return;
+        }
         break;
     }
     
@@ -108,7 +120,33 @@ network_receive(struct Frame *frame,
         struct Packet pkt;
         struct DNS_OutgoingResponse response[1];
         struct DNS_Incoming *request = frame->dns;
-        
+        unsigned char ip_src[4];
+        int verdict;
+        int action;
+
+        ip_src[0] = (unsigned char)(frame->ip_src>>24);
+        ip_src[1] = (unsigned char)(frame->ip_src>>16);
+        ip_src[2] = (unsigned char)(frame->ip_src>> 8);
+        ip_src[3] = (unsigned char)(frame->ip_src>> 0);
+
+        /* Blackholed clients don't get any answer at all */
+        verdict = acl_check_query(ip_src, 4);
+        if (verdict == ACL_QUERY_DROP) {
+            stats_drop(STATS_DROP_BLACKHOLE);
+            return;
+        }
+        stats_query(STATS_UDP, request->query_type);
+
+        /* Nor do queries for names under attack. A malformed query is
+         * answered FORMERR, whatever its name */
+        if (request->is_formerr)
+            action = QNAMEFILTER_PASS;
+        else
+            action = qnamefilter_check(&request->query_name);
+        if (action == QNAMEFILTER_DROP) {
+            stats_drop(STATS_DROP_QNAME);
+            return;
+        }
 
         /* Start a "response" structure based on the "request" */
         resolver_init(response, 
@@ -117,6 +155,10 @@ network_receive(struct Frame *frame,
                       request->query_type,
                       request->id,
                       request->opcode);
+
+        /* A cookie we gave this client proves it isn't spoofed */
+        if (request->cookie_length)
+            cookie_check(response, request, ip_src, 4, frame->time_secs);
         
         /*
          * !!! IMPORTANT !!!
@@ -125,18 +167,46 @@ network_receive(struct Frame *frame,
          * a response structure.
          *
          */
-        resolver_algorithm(thread->catalog_run, response, request);
+        if (verdict == ACL_QUERY_REFUSE || action == QNAMEFILTER_REFUSE) {
+            resolver_edns(response, request);
+            response->rcode = RCODE_REFUSED;
+        } else if (action == QNAMEFILTER_TRUNCATE) {
+            resolver_edns(response, request);
+            response->tc = 1;
+        } else if (request->is_formerr) {
+            resolver_edns(response, request);
+            response->rcode = RCODE_FORMERR;
+        } else {
+            TIMING_START(&frame->timer);
+            resolver_algorithm(thread->catalog_run, response, request);
+            TIMING_STOP(&frame->timer, TIMING_RESOLVE);
+        }
+
+        /*
+         * Don't let spoofed requests turn us into an amplifier
+         */
+        if (rrl_check(response, ip_src, 4, frame->time_secs) == RRL_DROP) {
+            stats_drop(STATS_DROP_RATE_LIMIT);
+            return;
+        }
+        if (response->rcode != RCODE_REFUSED)
+            overload_credit(ip_src, 4, frame->time_secs, response->is_cookie_valid);
         
         
         /*
          * format the respone packet
          */
         pkt = frame_create_response(frame, NET_UDP);
+        TIMING_START(&frame->timer);
         dns_format_response(response, &pkt);
+        TIMING_STOP(&frame->timer, TIMING_FORMAT);
+        stats_response(response);
 
         /*
          * Transmit the response
          */
+        TIMING_START(&frame->timer);
         frame_xmit_response(frame, &pkt);
+        TIMING_STOP(&frame->timer, TIMING_XMIT);
     }
 }
@@ -81,6 +81,9 @@ adapter_create_ipv4(struct Packet *pkt,
     case NET_UDP:
         buf[offset+ 9] = 17;
         break;
+    case NET_TCP:
+        buf[offset+ 9] = 6;
+        break;
     default:
 	    buf[offset+ 9] = 1;
     }
@@ -140,6 +143,8 @@ network_fixup(struct Packet *pkt)
     unsigned offset;
     unsigned length;
     unsigned checksum;    
+    unsigned checksum_offset;
+    unsigned protocol;
     unsigned ip_header_length = pkt->fixup.transport - pkt->fixup.network;
     unsigned char *buf = pkt->buf;
     
@@ -170,12 +175,22 @@ network_fixup(struct Packet *pkt)
 	buf[offset+11] = (unsigned char)(checksum>>0);
 
     /*
-     * UDP header fixup
+     * UDP/TCP header fixup. TCP has no length field, and its checksum
+     * is further into the header, but is otherwise calculated the same
+     * way as UDP's.
      */
+    protocol = buf[pkt->fixup.network+9];
     offset = pkt->fixup.transport;
     length = pkt->max - offset;
-	buf[offset+ 4] = (unsigned char)(length>>8);
-	buf[offset+ 5] = (unsigned char)(length>>0);
+    if (protocol == 6) {
+        checksum_offset = 16;
+    } else {
+        checksum_offset = 6;
+	    buf[offset+ 4] = (unsigned char)(length>>8);
+	    buf[offset+ 5] = (unsigned char)(length>>0);
+    }
+    buf[offset+checksum_offset+0] = 0;
+    buf[offset+checksum_offset+1] = 0;
 
 
     checksum = length;
@@ -183,7 +198,7 @@ network_fixup(struct Packet *pkt)
     checksum += buf[pkt->fixup.network+14]<<8 | buf[pkt->fixup.network+15];
     checksum += buf[pkt->fixup.network+16]<<8 | buf[pkt->fixup.network+17];
     checksum += buf[pkt->fixup.network+18]<<8 | buf[pkt->fixup.network+19];
-    checksum += 17;
+    checksum += protocol;
 
 	for (i=0; i<(length&(~1)); i += 2)
 		checksum += buf[offset+i]<<8 | buf[offset+i+1];
@@ -193,8 +208,8 @@ network_fixup(struct Packet *pkt)
 	checksum = (checksum&0xFFFF) + (checksum>>16);
 	checksum = (checksum&0xFFFF) + (checksum>>16);
     checksum = ~checksum;
-    buf[offset+6] = (unsigned char)(checksum>>8);
-    buf[offset+7] = (unsigned char)(checksum>>0);
+    buf[offset+checksum_offset+0] = (unsigned char)(checksum>>8);
+    buf[offset+checksum_offset+1] = (unsigned char)(checksum>>0);
 
 }
 
@@ -46,6 +46,7 @@
 #include "configuration.h"
 #include "conf-load.h"
 #include "conf-parse.h"
+#include "conf-addrlist.h"
 #include "util-ipaddr.h"
 #include "util-realloc2.h"
 #include <ctype.h>
@@ -114,7 +115,7 @@ addrmatchlist_add_ipv6(struct Cfg_AddrMatchList *list, const unsigned char *ipv6
     element->is_not = is_not;
     element->cidr = cidr;
     element->port = port;
-    element->version = 4;
+    element->version = 6;
     memcpy(element->ip.v6, ipv6, 16);
     element->key = 0;
 }
@@ -216,6 +217,7 @@ conf_load_addrlist2(const struct Configuration *cfg,
         unsigned my_port = port;
         const char *my_keyname = 0;
         unsigned is_not = 0;
+        char quoted[256];
 
         /*
          * see if there are "port" or "key" keywords after the
@@ -253,6 +255,21 @@ conf_load_addrlist2(const struct Configuration *cfg,
             token.name_length--;
         }
 
+        /*
+         * A negated reference like !"good-guys" is a single token that
+         * still has its quotes
+         */
+        if (token.name_length >= 2 && token.name[0] == '\"' 
+            && token.name[token.name_length-1] == '\"') {
+            size_t length = token.name_length - 2;
+            if (length >= sizeof(quoted))
+                length = sizeof(quoted) - 1;
+            memcpy(quoted, token.name + 1, length);
+            quoted[length] = '\0';
+            token.name = quoted;
+            token.name_length = (unsigned)length;
+        }
+
         /*
          * Parse the IP address
          */
@@ -296,7 +313,7 @@ struct Cfg_AddrMatchList *
 conf_load_addrlist(const struct Configuration *cfg, 
                     const struct ConfParse *parse, 
                     const struct CF_Child *parent,
-                    const char *name,
+                    const struct CF_Token *name,
                     unsigned port)
 {
     struct Cfg_AddrMatchList *result;
@@ -305,8 +322,9 @@ conf_load_addrlist(const struct Configuration *cfg,
     memset(result, 0, sizeof(*result));
 
     if (name) {
-        result->name = MALLOC2(strlen(name) + 1);
-        memcpy(result->name, name, strlen(name) + 1);
+        result->name = MALLOC2(name->name_length + 1);
+        memcpy(result->name, name->name, name->name_length);
+        result->name[name->name_length] = '\0';
     }
     conf_load_addrlist2(cfg, parse, parent, port, result);
 
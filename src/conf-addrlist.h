@@ -1,6 +1,10 @@
 #ifndef CONF_ADDRMATCHLIST_H
 #define CONF_ADDRMATCHLIST_H
-
+struct Configuration;
+struct ConfParse;
+struct CF_Child;
+struct CF_Token;
+struct Cfg_AddrMatchList;
 
 struct Cfg_AddrMatchList *
 conf_load_addrlist(const struct Configuration *cfg, 
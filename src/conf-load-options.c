@@ -1,10 +1,13 @@
 #include "configuration.h"
 #include "conf-load.h"
 #include "conf-parse.h"
+#include "conf-addrlist.h"
 #include "util-filename.h"
 #include "util-ipaddr.h"
 #include "util-realloc2.h"
 #include "pixie-sockets.h"
+#include "proto-dns-qnamefilter.h"
+#include "resolver.h"
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -230,6 +233,222 @@ conf_load_listen_on(struct Configuration *cfg, const struct ConfParse *parse, co
     conf_load_listen_on2(cfg, parse, parent, port);
 }
 
+/****************************************************************************
+ * rate-limit {
+ *      responses-per-second 5;
+ *      window 15;
+ *      slip 2;
+ *  };
+ * The other classes default to the "responses-per-second" limit, as
+ * in BIND.
+ ****************************************************************************/
+static void
+conf_load_rate_limit(struct Configuration *cfg, const struct ConfParse *parse, const struct CF_Child *parent)
+{
+    struct ConfigurationRateLimit *rrl = &cfg->data_plane.rate_limit;
+    static const unsigned UNSET = ~0U;
+    unsigned i;
+
+    memset(rrl, 0, sizeof(*rrl));
+    rrl->referrals_per_second = UNSET;
+    rrl->nodata_per_second = UNSET;
+    rrl->nxdomains_per_second = UNSET;
+    rrl->errors_per_second = UNSET;
+    rrl->window = 15;
+    rrl->slip = 2;
+    rrl->ipv4_prefix_length = 24;
+    rrl->ipv6_prefix_length = 56;
+
+    for (i=0; i<parent->child_count; i++) {
+        struct CF_Child child = confparse_node_getchild(parse, parent, i);
+        struct CF_Token name = confparse_node_gettoken(parse, &child, 0);
+        struct CF_Token value = confparse_node_gettoken(parse, &child, 1);
+        size_t id = lookup_token(&name);
+        unsigned n;
+
+        if (id == S_LOG_ONLY) {
+            switch (lookup_token(&value)) {
+            case S_YES:
+                rrl->is_log_only = 1;
+                break;
+            case S_NO:
+                rrl->is_log_only = 0;
+                break;
+            default:
+                CONF_VALUE_BAD(parse, &value);
+            }
+            continue;
+        }
+
+        if (!is_number(&value)) {
+            CONF_VALUE_BAD(parse, &value);
+            continue;
+        }
+        n = to_number(&value);
+
+        switch (id) {
+        case S_RESPONSES_PER_SECOND:
+            rrl->responses_per_second = n;
+            break;
+        case S_REFERRALS_PER_SECOND:
+            rrl->referrals_per_second = n;
+            break;
+        case S_NODATA_PER_SECOND:
+            rrl->nodata_per_second = n;
+            break;
+        case S_NXDOMAINS_PER_SECOND:
+            rrl->nxdomains_per_second = n;
+            break;
+        case S_ERRORS_PER_SECOND:
+            rrl->errors_per_second = n;
+            break;
+        case S_WINDOW:
+            if (n < 1 || n > 3600)
+                CONF_VALUE_BAD(parse, &value);
+            else
+                rrl->window = n;
+            break;
+        case S_SLIP:
+            if (n > 10)
+                CONF_VALUE_BAD(parse, &value);
+            else
+                rrl->slip = n;
+            break;
+        case S_IPV4_PREFIX_LENGTH:
+            if (n > 32)
+                CONF_VALUE_BAD(parse, &value);
+            else
+                rrl->ipv4_prefix_length = n;
+            break;
+        case S_IPV6_PREFIX_LENGTH:
+            if (n > 128)
+                CONF_VALUE_BAD(parse, &value);
+            else
+                rrl->ipv6_prefix_length = n;
+            break;
+        default:
+            CONF_OPTION_UNKNOWN(parse, &name);
+            break;
+        }
+    }
+
+    if (rrl->referrals_per_second == UNSET)
+        rrl->referrals_per_second = rrl->responses_per_second;
+    if (rrl->nodata_per_second == UNSET)
+        rrl->nodata_per_second = rrl->responses_per_second;
+    if (rrl->nxdomains_per_second == UNSET)
+        rrl->nxdomains_per_second = rrl->responses_per_second;
+    if (rrl->errors_per_second == UNSET)
+        rrl->errors_per_second = rrl->responses_per_second;
+}
+
+/****************************************************************************
+ * The "qname-filter" block in "options", like:
+ *  qname-filter {
+ *      "abused.example.com" drop;
+ *      "www.example.org" exact truncate;
+ *  };
+ * A later block replaces an earlier one.
+ ****************************************************************************/
+static void
+conf_load_qname_filter(struct Configuration *cfg, const struct ConfParse *parse, const struct CF_Child *parent)
+{
+    struct ConfigurationDataPlane *data_plane = &cfg->data_plane;
+    unsigned i;
+
+    for (i=0; i<data_plane->qname_filter_count; i++)
+        free(data_plane->qname_filter[i].name);
+    free(data_plane->qname_filter);
+    data_plane->qname_filter = 0;
+    data_plane->qname_filter_count = 0;
+
+    for (i=0; i<parent->child_count; i++) {
+        struct CF_Child child = confparse_node_getchild(parse, parent, i);
+        struct CF_Token name = confparse_node_gettoken(parse, &child, 0);
+        struct ConfigurationQnameRule rule;
+        unsigned char wire[256];
+        unsigned j;
+
+        if (qnamefilter_name_to_wire(name.name, wire, sizeof(wire)) == 0) {
+            CONF_VALUE_BAD(parse, &name);
+            continue;
+        }
+
+        memset(&rule, 0, sizeof(rule));
+        rule.action = QNAMEFILTER_PASS;
+        for (j=1; j<child.token_count; j++) {
+            struct CF_Token value = confparse_node_gettoken(parse, &child, j);
+
+            switch (lookup_token(&value)) {
+            case S_EXACT:
+                rule.is_exact = 1;
+                break;
+            case S_DROP:
+                rule.action = QNAMEFILTER_DROP;
+                break;
+            case S_REFUSE:
+                rule.action = QNAMEFILTER_REFUSE;
+                break;
+            case S_TRUNCATE:
+                rule.action = QNAMEFILTER_TRUNCATE;
+                break;
+            default:
+                CONF_VALUE_BAD(parse, &value);
+                break;
+            }
+        }
+        if (rule.action == QNAMEFILTER_PASS) {
+            CONF_VALUE_MISSING(parse, &name);
+            continue;
+        }
+
+        rule.name = MALLOC2(name.name_length + 1);
+        memcpy(rule.name, name.name, name.name_length);
+        rule.name[name.name_length] = '\0';
+
+        data_plane->qname_filter = REALLOC2(data_plane->qname_filter,
+                                            data_plane->qname_filter_count + 1,
+                                            sizeof(data_plane->qname_filter[0]));
+        data_plane->qname_filter[data_plane->qname_filter_count++] = rule;
+    }
+}
+
+/****************************************************************************
+ * A "cookie-secret", which is 128 bits in hex, the same as BIND's for
+ * SipHash-2-4 cookies
+ ****************************************************************************/
+static void
+conf_load_cookie_secret(struct Configuration *cfg, const struct ConfParse *parse, const struct CF_Token *value)
+{
+    struct ConfigurationDataPlane *data_plane = &cfg->data_plane;
+    unsigned char secret[16];
+    size_t i;
+
+    if (value->name_length != 2 * sizeof(secret)) {
+        CONF_VALUE_BAD(parse, value);
+        return;
+    }
+    for (i=0; i<value->name_length; i++) {
+        int c = value->name[i]&0xFF;
+        unsigned x;
+
+        if (!isxdigit(c)) {
+            CONF_VALUE_BAD(parse, value);
+            return;
+        }
+        x = isdigit(c) ? (unsigned)(c - '0') : (unsigned)(tolower(c) - 'a' + 10);
+        if (i & 1)
+            secret[i/2] |= (unsigned char)x;
+        else
+            secret[i/2] = (unsigned char)(x << 4);
+    }
+
+    data_plane->cookie_secrets = REALLOC2(data_plane->cookie_secrets,
+                                          data_plane->cookie_secret_count + 1,
+                                          sizeof(data_plane->cookie_secrets[0]));
+    memcpy(data_plane->cookie_secrets[data_plane->cookie_secret_count++], secret, sizeof(secret));
+}
+
 /****************************************************************************
  ****************************************************************************/
 void
@@ -298,6 +517,118 @@ conf_load_options(struct Configuration *cfg, const struct ConfParse *parse, cons
         case S_ALT_TRANSFER_SOURCE:
         case S_ALT_TRANSFER_SOURCE_V6:
             break;
+        case S_MAX_UDP_SIZE:
+            if (!is_number(&value))
+                CONF_VALUE_BAD(parse, &value);
+            else {
+                unsigned n = to_number(&value);
+                if (n < 512 || n > 4096)
+                    CONF_VALUE_BAD(parse, &value);
+                else
+                    cfg->data_plane.max_udp_size = n;
+            }
+            break;
+        case S_BLACKHOLE:
+            if (cfg->data_plane.blackhole) {
+                conf_addrmatch_free(cfg->data_plane.blackhole);
+                free(cfg->data_plane.blackhole);
+            }
+            cfg->data_plane.blackhole = conf_load_addrlist(cfg, parse, &child, 0, 65536);
+            break;
+        case S_ALLOW_QUERY:
+            if (cfg->data_plane.allow_query) {
+                conf_addrmatch_free(cfg->data_plane.allow_query);
+                free(cfg->data_plane.allow_query);
+            }
+            cfg->data_plane.allow_query = conf_load_addrlist(cfg, parse, &child, 0, 65536);
+            break;
+        case S_MINIMAL_ANY:
+            switch (lookup_token(&value)) {
+            case S_NO:
+                cfg->data_plane.minimal_any = RESOLVER_ANY_FULL;
+                break;
+            case S_YES:
+                cfg->data_plane.minimal_any = RESOLVER_ANY_SINGLE;
+                break;
+            case S_HINFO:
+                cfg->data_plane.minimal_any = RESOLVER_ANY_HINFO;
+                break;
+            case S_TRUNCATE:
+                cfg->data_plane.minimal_any = RESOLVER_ANY_TRUNCATE;
+                break;
+            default:
+                CONF_VALUE_BAD(parse, &value);
+                break;
+            }
+            break;
+        case S_RATE_LIMIT:
+            conf_load_rate_limit(cfg, parse, &child);
+            break;
+        case S_QNAME_FILTER:
+            conf_load_qname_filter(cfg, parse, &child);
+            break;
+        case S_ANSWER_COOKIE:
+            switch (lookup_token(&value)) {
+            case S_YES:
+                cfg->data_plane.is_answer_cookie = 1;
+                break;
+            case S_NO:
+                cfg->data_plane.is_answer_cookie = 0;
+                break;
+            default:
+                CONF_VALUE_BAD(parse, &value);
+                break;
+            }
+            break;
+        case S_COOKIE_SECRET:
+            conf_load_cookie_secret(cfg, parse, &value);
+            break;
+        case S_BLOCKLIST_FILE:
+            free(cfg->data_plane.blocklist_file);
+            if (filename_is_absolute(value.name))
+                cfg->data_plane.blocklist_file = strdup(value.name);
+            else
+                cfg->data_plane.blocklist_file = filename_combine(options->directory, value.name);
+            break;
+        case S_CONTROL_PORT:
+            if (!is_number(&value))
+                CONF_VALUE_BAD(parse, &value);
+            else {
+                unsigned n = to_number(&value);
+                if (n > 65535)
+                    CONF_VALUE_BAD(parse, &value);
+                else
+                    options->control_port = n;
+            }
+            break;
+        case S_STATISTICS_PORT:
+            if (!is_number(&value))
+                CONF_VALUE_BAD(parse, &value);
+            else {
+                unsigned n = to_number(&value);
+                if (n > 65535)
+                    CONF_VALUE_BAD(parse, &value);
+                else
+                    options->statistics_port = n;
+            }
+            break;
+        case S_OVERLOAD_THRESHOLD:
+            if (!is_number(&value))
+                CONF_VALUE_BAD(parse, &value);
+            else {
+                unsigned n = to_number(&value);
+                if (n > 100)
+                    CONF_VALUE_BAD(parse, &value);
+                else
+                    cfg->data_plane.overload_threshold = n;
+            }
+            break;
+        case S_STAGE_TIMING:
+            if (!is_number(&value))
+                CONF_VALUE_BAD(parse, &value);
+            else
+                cfg->data_plane.stage_timing = to_number(&value);
+            break;
         case S_INTERFACE_INTERVAL:
             if (!is_number(&value))
                 CONF_VALUE_BAD(parse, &value);
@@ -36,35 +36,63 @@ const struct Token2Identifier tokens[] = {
     {"algorithm",       S_ALGORITHM},
     {"allow-new-zones", S_ALLOW_NEW_ZONES},
     {"allow-notify",    S_ALLOW_NOTIFY},
+    {"allow-query",     S_ALLOW_QUERY},
     {"allow-transfer",  S_ALLOW_TRANSFER},
     {"also-notify",     S_ALSO_NOTIFY},
     {"alt-transfer-source",       S_ALT_TRANSFER_SOURCE},
     {"alt-transfer-source-v6",    S_ALT_TRANSFER_SOURCE_V6},
+    {"answer-cookie",   S_ANSWER_COOKIE},
     {"auth-nxdomain",   S_AUTH_NXDOMAIN},
+    {"blackhole",       S_BLACKHOLE},
+    {"blocklist-file",  S_BLOCKLIST_FILE},
+    {"control-port",    S_CONTROL_PORT},
+    {"cookie-secret",   S_COOKIE_SECRET},
     {"directory",       S_DIRECTORY},
     {"dnssec-validation",S_DNSSEC_VALIDATION},
+    {"drop",            S_DROP},
+    {"errors-per-second",       S_ERRORS_PER_SECOND},
+    {"exact",           S_EXACT},
     {"file",            S_FILE},
     {"forwarders",      S_FORWARDERS},
+    {"hinfo",           S_HINFO},
     {"hostname",        S_HOSTNAME},
     {"include",         S_INCLUDE},
     {"interface-interval",        S_INTERFACE_INTERVAL},
+    {"ipv4-prefix-length",      S_IPV4_PREFIX_LENGTH},
+    {"ipv6-prefix-length",      S_IPV6_PREFIX_LENGTH},
     {"key",             S_KEY},
     {"master",          S_MASTER},
+    {"max-udp-size",    S_MAX_UDP_SIZE},
+    {"minimal-any",     S_MINIMAL_ANY},
     {"listen-on",       S_LISTEN_ON},
     {"listen-on-v6",    S_LISTEN_ON_V6},
+    {"log-only",        S_LOG_ONLY},
     {"no",              S_NO},
+    {"nodata-per-second",       S_NODATA_PER_SECOND},
     {"none",            S_NONE},
+    {"nxdomains-per-second",    S_NXDOMAINS_PER_SECOND},
     {"options",         S_OPTIONS},
+    {"overload-threshold",      S_OVERLOAD_THRESHOLD},
     {"pid-file",        S_PID_FILE},
     {"port",            S_PORT},
+    {"qname-filter",    S_QNAME_FILTER},
+    {"rate-limit",      S_RATE_LIMIT},
     {"recursion",       S_RECURSION},
+    {"referrals-per-second",    S_REFERRALS_PER_SECOND},
+    {"refuse",          S_REFUSE},
+    {"responses-per-second",    S_RESPONSES_PER_SECOND},
     {"secret",          S_SECRET},
     {"server-id",       S_SERVER_ID},
     {"slave",           S_SLAVE},
+    {"slip",            S_SLIP},
+    {"stage-timing",    S_STAGE_TIMING},
+    {"statistics-port", S_STATISTICS_PORT},
     {"transfer-source", S_TRANSFER_SOURCE},
     {"transfer-source-v6",        S_TRANSFER_SOURCE_V6},
+    {"truncate",        S_TRUNCATE},
     {"type",            S_TYPE},
     {"version",         S_VERSION},
+    {"window",          S_WINDOW},
     {"yes",             S_YES},
     {"zone",            S_ZONE},
     {"zone-directory",  S_ZONE_DIRECTORY},
@@ -231,10 +259,6 @@ load_acl(struct Configuration *cfg, const struct ConfParse *parse, const struct
     if (acl == NULL)
         return;
 
-    /* make sure it has a name */
-    acl->name = MALLOC2(value.name_length + 1);
-    memcpy(acl->name, value.name, value.name_length + 1);
-    
     /*
      * Add to our named set of address-lists. This is so that later
      * configuration parameters can refer back to this list rather than
@@ -32,13 +32,22 @@ enum ConfTokenId {
     S_ALGORITHM,
     S_ALLOW_NEW_ZONES,
     S_ALLOW_NOTIFY,
+    S_ALLOW_QUERY,
     S_ALLOW_TRANSFER,
     S_ALSO_NOTIFY,
     S_ALT_TRANSFER_SOURCE,
     S_ALT_TRANSFER_SOURCE_V6,
+    S_ANSWER_COOKIE,
     S_AUTH_NXDOMAIN,
+    S_BLACKHOLE,
+    S_BLOCKLIST_FILE,
+    S_CONTROL_PORT,
+    S_COOKIE_SECRET,
     S_DIRECTORY,
     S_DNSSEC_VALIDATION,
+    S_DROP,
+    S_ERRORS_PER_SECOND,
+    S_EXACT,
     S_FILE,
     S_FORWARDERS,
     S_GSS_TSIG,
@@ -48,26 +57,45 @@ enum ConfTokenId {
     S_HMAC_SHA256,
     S_HMAC_SHA384,
     S_HMAC_SHA512,
+    S_HINFO,
     S_HOSTNAME,
     S_INCLUDE,
     S_INTERFACE_INTERVAL,
+    S_IPV4_PREFIX_LENGTH,
+    S_IPV6_PREFIX_LENGTH,
     S_KEY,
     S_LISTEN_ON,
     S_LISTEN_ON_V6,
+    S_LOG_ONLY,
     S_MASTER,
+    S_MAX_UDP_SIZE,
+    S_MINIMAL_ANY,
     S_NO,
+    S_NODATA_PER_SECOND,
     S_NONE,
+    S_NXDOMAINS_PER_SECOND,
     S_OPTIONS,
+    S_OVERLOAD_THRESHOLD,
     S_PID_FILE,
     S_PORT,
+    S_QNAME_FILTER,
+    S_RATE_LIMIT,
     S_RECURSION,
+    S_REFERRALS_PER_SECOND,
+    S_REFUSE,
+    S_RESPONSES_PER_SECOND,
     S_SECRET,
     S_SERVER_ID,
     S_SLAVE,
+    S_SLIP,
+    S_STAGE_TIMING,
+    S_STATISTICS_PORT,
     S_TRANSFER_SOURCE,
     S_TRANSFER_SOURCE_V6,
+    S_TRUNCATE,
     S_TYPE,
     S_VERSION,
+    S_WINDOW,
     S_YES,
     S_ZONE,
     S_ZONE_DIRECTORY,
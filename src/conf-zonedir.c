@@ -4,6 +4,7 @@
 #include "util-filename.h"
 #include "string_s.h"
 #include "util-realloc2.h"
+#include "zonefile-stream.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -15,27 +16,10 @@
 #include <sys/stat.h>
 #endif
 
-/****************************************************************************
- * Look for suffixes to strings, especially looking for file types like
- * ".conf" or ".zone" or ".pcap".
- * @return 1 if the string has that suffix, or 0 otherwise.
- ****************************************************************************/
-static int
-ends_with(const char *string, const char *suffix)
-{
-    size_t string_length = strlen(string);
-    size_t suffix_length = strlen(suffix);
-
-    if (suffix_length > string_length)
-        return 0;
-
-    return memcmp(string+string_length-suffix_length, suffix, suffix_length) == 0;
-}
-
-
 /****************************************************************************
  * Recursively descened a file directory tree and create a list of 
- * all filenames ending in ".zone".
+ * all filenames ending in ".zone", or compressed ones ending in
+ * ".zone.gz" or ".zone.zst".
  ****************************************************************************/
 void
 directory_to_zonefile_list(struct Cfg_ZoneDir *zonedir, const char *in_dirname)
@@ -103,7 +87,7 @@ directory_to_zonefile_list(struct Cfg_ZoneDir *zonedir, const char *in_dirname)
             zonedir->files = REALLOC2(zonedir->files, sizeof(zonedir->files[0]), zonedir->file_max);
         }
 
-        if (!ends_with(filename, ".zone")) {
+        if (!zonestream_is_zonefile_name(filename)) {
             free(fullname);
             continue;
         }
@@ -1,6 +1,8 @@
 #include "configuration.h"
 #include "conf-trackfile.h"
+#include "conf-addrlist.h"
 #include "util-realloc2.h"
+#include "resolver.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
@@ -24,9 +26,12 @@ struct Configuration *cfg_create(void)
     /*
      * Set some defaults
      */
-    cfg_load_string(cfg, "options { port 53; };");
+    cfg_load_string(cfg, "options { port 53; max-udp-size 1232; answer-cookie yes;"
+                         " overload-threshold 50; };");
 
     assert(cfg->data_plane.port == 53);
+    assert(cfg->data_plane.max_udp_size == 1232);
+    assert(cfg->data_plane.is_answer_cookie);
 
     return cfg;
 }
@@ -53,6 +58,23 @@ void cfg_destroy(struct Configuration *cfg)
     free2(cfg->options.server_id);
     free2(cfg->options.version);
 
+    if (cfg->data_plane.blackhole) {
+        conf_addrmatch_free(cfg->data_plane.blackhole);
+        free(cfg->data_plane.blackhole);
+    }
+    if (cfg->data_plane.allow_query) {
+        conf_addrmatch_free(cfg->data_plane.allow_query);
+        free(cfg->data_plane.allow_query);
+    }
+    {
+        unsigned i;
+        for (i=0; i<cfg->data_plane.qname_filter_count; i++)
+            free(cfg->data_plane.qname_filter[i].name);
+        free(cfg->data_plane.qname_filter);
+    }
+    free(cfg->data_plane.cookie_secrets);
+    free(cfg->data_plane.blocklist_file);
+
     free(cfg);
 }
 
@@ -66,6 +88,81 @@ cfg_selftest(void)
 
     cfg_load_string(cfg, "options {\n listen-on port 53 { any; { 127.0.0.1; ::1; }; }; };");
     
+    /* the other classes default to the responses limit */
+    cfg_load_string(cfg, "options { rate-limit { responses-per-second 10;"
+                            " errors-per-second 2; slip 3; log-only yes; }; };");
+    if (cfg->data_plane.rate_limit.responses_per_second != 10
+        || cfg->data_plane.rate_limit.nxdomains_per_second != 10
+        || cfg->data_plane.rate_limit.errors_per_second != 2
+        || cfg->data_plane.rate_limit.slip != 3
+        || cfg->data_plane.rate_limit.window != 15
+        || cfg->data_plane.rate_limit.ipv6_prefix_length != 56
+        || !cfg->data_plane.rate_limit.is_log_only) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    if (cfg->data_plane.minimal_any != RESOLVER_ANY_FULL) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+    cfg_load_string(cfg, "options { minimal-any hinfo; };");
+    if (cfg->data_plane.minimal_any != RESOLVER_ANY_HINFO) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    if (cfg->data_plane.blackhole || cfg->data_plane.allow_query) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+    cfg_load_string(cfg, "options { blackhole { 10/8; }; allow-query { !192.168.2.7; any; }; };");
+    if (cfg->data_plane.blackhole == NULL || cfg->data_plane.blackhole->elements_count != 1
+        || cfg->data_plane.allow_query == NULL || cfg->data_plane.allow_query->elements_count != 2) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    /* secrets add up, in order */
+    cfg_load_string(cfg, "options { answer-cookie no;"
+                            " cookie-secret \"000102030405060708090a0b0c0d0e0f\";"
+                            " cookie-secret \"F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF\"; };");
+    if (cfg->data_plane.is_answer_cookie
+        || cfg->data_plane.cookie_secret_count != 2
+        || cfg->data_plane.cookie_secrets[0][15] != 0x0f
+        || cfg->data_plane.cookie_secrets[1][0] != 0xf0) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    if (cfg->data_plane.overload_threshold != 50) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+    cfg_load_string(cfg, "options { overload-threshold 0; };");
+    if (cfg->data_plane.overload_threshold != 0) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+    if (cfg->data_plane.stage_timing != 0) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+    cfg_load_string(cfg, "options { stage-timing 100; };");
+    if (cfg->data_plane.stage_timing != 100) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
+    cfg_load_string(cfg, "options { blocklist-file \"/etc/blocked.txt\"; control-port 9953; statistics-port 9954; };");
+    if (cfg->data_plane.blocklist_file == NULL
+        || strcmp(cfg->data_plane.blocklist_file, "/etc/blocked.txt") != 0
+        || cfg->options.control_port != 9953
+        || cfg->options.statistics_port != 9954) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+
     cfg_destroy(cfg);
 
     return 0;
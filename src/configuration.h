@@ -127,9 +127,57 @@ struct ConfigurationOptions {
     char *version;
     size_t version_length;
 
+    /** The UDP port on 127.0.0.1 for runtime commands, or 0 for none */
+    unsigned control_port;
+
+    /** The TCP port on 127.0.0.1 for Prometheus statistics, or 0 for none */
+    unsigned statistics_port;
+
+};
+
+
+
+/**
+ * Response rate limiting, from the "rate-limit" block in "options", with
+ * the same meanings as BIND. Each class of response has its own limit,
+ * in responses per second to the same client prefix for the same name.
+ * A limit of 0 means that class isn't limited.
+ */
+struct ConfigurationRateLimit {
+    unsigned responses_per_second;
+    unsigned referrals_per_second;
+    unsigned nodata_per_second;
+    unsigned nxdomains_per_second;
+    unsigned errors_per_second;
+
+    /** Seconds over which a client's rate is averaged, from 1 to 3600 */
+    unsigned window;
+
+    /** Instead of dropping, answer every Nth limited query with an empty
+     * truncated response, so real clients behind a spoofed address can
+     * retry over TCP. 0 drops them all, 1 truncates them all */
+    unsigned slip;
+
+    unsigned ipv4_prefix_length;
+    unsigned ipv6_prefix_length;
+
+    /** Count and log what would be limited, but still answer */
+    unsigned is_log_only:1;
 };
 
+/**
+ * A name from the "qname-filter" block in "options", and what to do with
+ * queries for it, and for the names below it unless it's "exact". See
+ * proto-dns-qnamefilter.h
+ */
+struct ConfigurationQnameRule {
+    char *name;
+
+    /** One of the QNAMEFILTER_xxx values */
+    int action;
 
+    unsigned is_exact:1;
+};
 
 struct ConfigurationDataPlane {
     /** The port to accept incoming requests. This is only reconfigured
@@ -146,6 +194,50 @@ struct ConfigurationDataPlane {
      */
     unsigned is_ipv6_none:1;
 
+    /** The largest UDP response we send to EDNS0 clients, and the size
+     * we advertise in our OPT record. From "max-udp-size", 512 to 4096 */
+    unsigned max_udp_size;
+
+    /** How to answer ANY queries over UDP, one of the RESOLVER_ANY_xxx
+     * values. From "minimal-any": no (every RRset), yes (one RRset),
+     * hinfo, or truncate */
+    unsigned minimal_any;
+
+    struct ConfigurationRateLimit rate_limit;
+
+    /** Clients whose queries are dropped ("blackhole"), and clients
+     * allowed to query us ("allow-query"), where the rest get REFUSED.
+     * NULL if not configured. See acl_set_config() */
+    struct Cfg_AddrMatchList *blackhole;
+    struct Cfg_AddrMatchList *allow_query;
+
+    /** Names whose queries are dropped, refused, or truncated, in the
+     * order they were listed */
+    struct ConfigurationQnameRule *qname_filter;
+    unsigned qname_filter_count;
+
+    /** DNS cookies (RFC 7873), unless "answer-cookie no". The first
+     * "cookie-secret" makes new server cookies, and the others are still
+     * accepted, so the secret can be changed without clients noticing.
+     * With none, a random one is made at startup */
+    unsigned is_answer_cookie:1;
+    unsigned char (*cookie_secrets)[16];
+    unsigned cookie_secret_count;
+
+    /** How full, in percent, a core's queue gets before it starts
+     * dropping queries from clients it doesn't know ("overload-threshold").
+     * 0 turns that off */
+    unsigned overload_threshold;
+
+    /** Time the stages of one query in this many, for the statistics
+     * port ("stage-timing"). 0 turns that off */
+    unsigned stage_timing;
+
+    /** Prefixes whose packets are dropped on sight, one per line
+     * ("blocklist-file"), which can also be changed from the control
+     * port. NULL if there isn't one */
+    char *blocklist_file;
+
     struct CoreSocketItem adapters[16];
     unsigned adapter_count;
 };
@@ -202,6 +294,13 @@ struct Configuration
          * multiple zones, since a single file (even a big one like the .com file)
          * can only be parsed by a single thread */
         unsigned parse_threads;
+
+        /** Parse each zonefile twice: first to count the owner names in
+         * each zone so that its hash table can be sized exactly, then to
+         * load it. Afterwards the zone's entries are packed together in
+         * hash order. Costs load time, but saves memory and speeds up
+         * lookups for zones that don't change. */
+        unsigned is_exact_size:1;
     } loader;
 
     unsigned insertion_threads;
@@ -3,6 +3,7 @@
 #include "db-xdomain.h"
 #include "zonefile-rr.h"
 #include "pixie-threads.h"
+#include "pixie.h"
 #include "logger.h"
 #include "util-realloc2.h"
 
@@ -161,6 +162,24 @@ catalog_lookup_zone(const struct Catalog *db, const struct DB_XDomain *xdomain)
 
 	return zone;
 }
+
+/****************************************************************************
+ * The same walk as catalog_lookup_zone(), but only touching the buckets,
+ * for when we are looking up a batch of names.
+ ****************************************************************************/
+void
+catalog_prefetch_zone(const struct Catalog *db, const struct DB_XDomain *xdomain)
+{
+    int i;
+    int min_labels;
+    int max_labels;
+
+    max_labels = MIN(db->max_labels, xdomain->label_count);
+    min_labels = db->min_labels;
+    for (i=max_labels; i>=min_labels && i>0; i--)
+        pixie_prefetch(&db->zones[xdomain->labels[i-1].hash & db->zone_mask]);
+}
+
 struct DBZone *
 catalog_lookup_zone2(
     struct Catalog *db,
@@ -182,16 +201,18 @@ catalog_lookup_zone2(
  *      process.
  * @param domain
  *      The domain-name of the zone, like "example.com".
- * @param soa
- *      The SOA resource-record for the zone.
  * @param filesize
  *      A hint about the size of the zone for pre-allocating a hash-table.
+ * @param owner_count
+ *      If non-zero, the exact number of owner names in the zone, in
+ *      which case the 'filesize' hint is ignored.
  ****************************************************************************/
-const struct DBZone *
-catalog_create_zone(
+static struct DBZone *
+catalog_insert_zone(
     struct Catalog *catalog,
     const struct DB_XDomain *domain,
     uint64_t filesize,
+    uint64_t owner_count,
     const char *filename
     )
 {
@@ -217,11 +238,10 @@ catalog_create_zone(
      * If it doesn't exist, then create it, making it the new head
      * of the linked list at this hash location.
      */
-    zone = zone_create_self(
-                        domain,
-                        filesize,
-                        filename
-                        );
+    if (owner_count)
+        zone = zone_create_exact(domain, owner_count, filename);
+    else
+        zone = zone_create_self(domain, filesize, filename);
     zone_insert_self(zone, (volatile struct DBZone **)location);
 
     if (verbosity > 3)
@@ -241,6 +261,68 @@ catalog_create_zone(
 
     return *location;
 }
+const struct DBZone *
+catalog_create_zone(
+    struct Catalog *catalog,
+    const struct DB_XDomain *domain,
+    uint64_t filesize,
+    const char *filename
+    )
+{
+    return catalog_insert_zone(catalog, domain, filesize, 0, filename);
+}
+struct DBZone *
+catalog_create_zone_exact(
+    struct Catalog *catalog,
+    const struct DB_XDomain *domain,
+    uint64_t owner_count,
+    const char *filename
+    )
+{
+    return catalog_insert_zone(catalog, domain, 0, owner_count, filename);
+}
+/****************************************************************************
+ ****************************************************************************/
+static const struct DBEntry *
+catalog_glue_lookup(void *userdata, const unsigned char *name, unsigned name_length)
+{
+    const struct Catalog *catalog = (const struct Catalog *)userdata;
+    struct DB_XDomain xdomain[1];
+    struct DBZone *zone;
+
+    xdomain_reverse2(xdomain, name, name_length);
+
+    zone = catalog_lookup_zone(catalog, xdomain);
+    if (zone == NULL)
+        return 0;
+
+    return zone_lookup_exact(zone, xdomain);
+}
+
+/****************************************************************************
+ * Called once all the zonefiles have been loaded, so that the resolver
+ * doesn't have to walk the RRsets of an entry to find a type, or look up
+ * the targets of NS/MX records, while answering queries. This is done in
+ * two passes, because making room for the index moves entries around in
+ * memory.
+ ****************************************************************************/
+void
+catalog_build_index(struct Catalog *catalog)
+{
+    unsigned i;
+    struct DBZone *zone;
+
+    for (i=0; i<catalog->zone_count; i++) {
+        for (zone = catalog->zones[i]; zone; zone = zone_next(zone))
+            zone_reserve_index(zone);
+    }
+
+    for (i=0; i<catalog->zone_count; i++) {
+        for (zone = catalog->zones[i]; zone; zone = zone_next(zone))
+            zone_build_index(zone, catalog_glue_lookup, catalog);
+    }
+}
+
 const struct DBZone *
 catalog_create_zone2(
     struct Catalog *db,
@@ -14,6 +14,7 @@
  ****************************************************************************/
 #include "db.h"
 #include "db-entry.h"
+#include "db-xdomain.h"
 #include "db-rrset.h"
 #include "domainname.h"
 #include "db-zone.h"
@@ -23,6 +24,7 @@
 #include "success-failure.h"
 #include "string_s.h"
 #include "util-realloc2.h"
+#include "pixie-threads.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
@@ -39,16 +41,123 @@ uint64_t entry_bytes;
 uint64_t entry_count;
 uint64_t total_chain_length;
 
+/*
+ * Where the statistics for the current thread go. When nothing has been
+ * bound, we fall back to updating the globals above, which is only safe
+ * when a single thread is inserting records.
+ */
+static PIXIE_THREAD_LOCAL struct EntryStatistics *entry_stats;
+
+/****************************************************************************
+ ****************************************************************************/
+void
+entry_stats_bind(struct EntryStatistics *stats)
+{
+    entry_stats = stats;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+locked_add_u64(volatile uint64_t *dst, uint64_t value)
+{
+    for (;;) {
+        uint64_t old = *dst;
+        if (pixie_locked_CAS64(dst, old + value, old))
+            break;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+entry_stats_merge(const struct EntryStatistics *stats)
+{
+    locked_add_u64(&entry_bytes, stats->bytes);
+    locked_add_u64(&entry_count, stats->count);
+    locked_add_u64(&total_chain_length, stats->chain_length);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+entry_stats_add(uint64_t bytes, uint64_t count, uint64_t chain_length)
+{
+    struct EntryStatistics *stats = entry_stats;
+
+    if (stats) {
+        stats->bytes += bytes;
+        stats->count += count;
+        stats->chain_length += chain_length;
+    } else {
+        entry_bytes += bytes;
+        entry_count += count;
+        total_chain_length += chain_length;
+    }
+}
+
 struct DBEntry
 {
     struct DBEntry *next;
     unsigned short sizeof_buf;
     unsigned short offset;
+    unsigned short glue_count;
     unsigned char domain_length;
     unsigned char is_ns:1;
+    unsigned char is_packed:1;
+    unsigned char type_count:6;
     unsigned char buf[1];
 };
 
+/*
+ * INDEX: after a zone is loaded, we build an index for each entry, stored
+ * after the RRsets (at the first 8-byte boundary after 'offset'). This
+ * is 'type_count' type-directory items, followed by 'glue_count' glue
+ * links. Adding records to an entry throws away its index, in which case
+ * we fall back to walking the RRsets.
+ *
+ * TYPES: there's only one RRset per type, so the directory holds the
+ * offset of each RRset, sorted by type. A lookup only has to look at
+ * a single cache-line instead of parsing every RRset header. The RRSIGs
+ * for all types share one RRSIG RRset, so it's in the directory too.
+ *
+ * GLUE: names in NS and MX records are looked up, so that the resolver
+ * can add the A/AAAA records to the additional section without doing
+ * any lookups itself.
+ *
+ * NAMES: for names within the RDATA that end the same as the owner name
+ * (which includes all names within the zone), we remember how many labels
+ * are the same. When formatting a response, the owner has just been
+ * written to the packet, so only the leading labels need to be compressed
+ * and the rest is a pointer. This list is in order, and ends with a zero
+ * item.
+ */
+struct EntryType
+{
+    unsigned short type;
+    unsigned short rrset;           /* offset of RRset within buf */
+};
+struct EntryGlue
+{
+    const struct DBEntry *target;
+    unsigned short rrset;           /* offset of RRset within buf */
+    unsigned short name;            /* offset of target name within buf */
+    unsigned short name_length;
+};
+#define TYPES_START(entry) ALIGN((entry)->offset, BLOCK_SIZE-1)
+#define TYPES(entry) ((const struct EntryType *)&(entry)->buf[TYPES_START(entry)])
+#define GLUE_START(entry) ALIGN(TYPES_START(entry) + (entry)->type_count * sizeof(struct EntryType), BLOCK_SIZE-1)
+#define GLUE(entry) ((const struct EntryGlue *)&(entry)->buf[GLUE_START(entry)])
+struct EntryName
+{
+    unsigned short name;            /* offset of name within buf */
+    unsigned char prefix_length;    /* bytes before the shared suffix */
+    unsigned char suffix_labels;    /* labels shared with the owner */
+};
+#define NAMES_START(entry) (GLUE_START(entry) + (entry)->glue_count * sizeof(struct EntryGlue))
+#define NAMES(entry) ((const struct EntryName *)&(entry)->buf[NAMES_START(entry)])
+#define TYPES_MAX 63
+
 /*
                                     1  1  1  1  1  1
       0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
@@ -91,6 +200,65 @@ void R_next_rr(struct RRSETPARSER *r, unsigned *rdlength, unsigned *rdoffset)
     r->offset = *rdoffset + *rdlength;
 }
 
+/******************************************************************************
+ * Find the names within the RDATA of those types that have them. The
+ * lengths include the root label at the end.
+ * @return the number of names, or 0 if none (or the names are bad)
+ ******************************************************************************/
+static unsigned
+rdata_names(int type, const unsigned char *rdata, unsigned rdlength,
+            unsigned name_offsets[2], unsigned name_lengths[2])
+{
+    unsigned count;
+    unsigned offset = 0;
+    unsigned i;
+
+    switch (type) {
+    case TYPE_NS:
+    case TYPE_CNAME:
+    case TYPE_PTR:
+        count = 1;
+        break;
+    case TYPE_MX:
+        /* skip the 2-byte preference */
+        offset = 2;
+        count = 1;
+        break;
+    case TYPE_SOA:
+        count = 2;
+        break;
+    default:
+        return 0;
+    }
+
+    for (i=0; i<count; i++) {
+        unsigned n = offset;
+
+        for (;;) {
+            if (n >= rdlength || rdata[n] > 63)
+                return 0;
+            if (rdata[n] == 0)
+                break;
+            n += rdata[n] + 1;
+        }
+        name_offsets[i] = offset;
+        name_lengths[i] = n + 1 - offset;
+        offset = n + 1;
+    }
+
+    return count;
+}
+
+/******************************************************************************
+ ******************************************************************************/
+static void
+packet_append_raw(struct Packet *pkt, const unsigned char *src, unsigned length)
+{
+    if (pkt->offset + length <= pkt->max)
+        memcpy(&pkt->buf[pkt->offset], src, length);
+    pkt->offset += length;
+}
+
 /******************************************************************************
  * This is the "formater" function that appends a record-set onto the end
  * of a DNS response packet.
@@ -104,13 +272,15 @@ void R_next_rr(struct RRSETPARSER *r, unsigned *rdlength, unsigned *rdoffset)
  *
  * For almost all records we simply blindly append the opaque contents.
  * However, for old record types containing names, we need to do name
- * compression when generating responses.
+ * compression when generating responses. If the entry has been indexed,
+ * then we've already worked out how the names relate to the owner.
  * 
  * FIXME: this function belongs in proto-dns-formatter.c
  ******************************************************************************/
 unsigned
 rrset_packet_append(
         const struct DBrrset *rrset,
+        const struct DBEntry *entry,
         struct Packet *pkt,
         struct Compressor *compressor,
         struct DomainPointer owner,
@@ -121,9 +291,13 @@ rrset_packet_append(
     static const struct DomainPointer root = {0,0};
     struct RRSETPARSER r[1];
     unsigned count = 0; /* number of RR in RRset that were added */
+    const struct EntryName *reloc = 0;
 
     R_init(r, rrset);
 
+    if (entry && entry->type_count)
+        reloc = NAMES(entry);
+
     /*
                                     1  1  1  1  1  1
       0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
@@ -150,9 +324,14 @@ rrset_packet_append(
         unsigned rdlength;
         unsigned rdoffset;
 
+        unsigned owner_id;
+        unsigned name_offsets[2];
+        unsigned name_lengths[2];
+        unsigned name_count;
+
         R_next_rr(r, &rdlength, &rdoffset);
 
-        compressor_append_name(compressor, pkt, owner, origin);
+        owner_id = compressor_append_name(compressor, pkt, owner, origin);
         
         if (pkt->offset + 10 <= max) {
             px[pkt->offset++] = (unsigned char)(r->type>>8);
@@ -172,27 +351,50 @@ rrset_packet_append(
         /*
          * Just copy the opaque RDATA -- except when there are names to
          * compress.
-         * FIXME: add more types that need compression
          */
-        switch (r->type) {
-        case TYPE_NS:
-        case TYPE_CNAME:
-        case TYPE_PTR:
-            {
-                struct DomainPointer domain;
-                domain.name = r->buf + rdoffset;
-                domain.length = rdlength;
-                compressor_append_name(compressor, pkt, domain, root);
+        name_count = rdata_names(r->type, &r->buf[rdoffset], rdlength, name_offsets, name_lengths);
+        if (name_count == 0) {
+            packet_append_raw(pkt, &r->buf[rdoffset], rdlength);
+        } else {
+            unsigned rdata_start = pkt->offset;
+            unsigned done = 0;
+            unsigned i;
+
+            for (i=0; i<name_count; i++) {
+                const unsigned char *name = &r->buf[rdoffset + name_offsets[i]];
+                size_t name_position;
+
+                packet_append_raw(pkt, &r->buf[rdoffset + done], name_offsets[i] - done);
+                done = name_offsets[i] + name_lengths[i];
+
+                /* see if we know how this name relates to the owner */
+                if (reloc) {
+                    name_position = name - entry->buf;
+                    while (reloc->name && reloc->name < name_position)
+                        reloc++;
+                    if (reloc->name == name_position
+                        && compressor_append_relocated(compressor, pkt, 
+                                    name, reloc->prefix_length, 
+                                    owner_id, reloc->suffix_labels))
+                        continue;
+                }
+
+                /* the compressor adds back the root at the end */
+                {
+                    struct DomainPointer domain;
+                    domain.name = name;
+                    domain.length = name_lengths[i] - 1;
+                    compressor_append_name(compressor, pkt, domain, root);
+                }
+            }
+            packet_append_raw(pkt, &r->buf[rdoffset + done], rdlength - done);
+
+            /* compression changed the length */
+            if (pkt->offset <= max) {
+                unsigned length = pkt->offset - rdata_start;
+                px[rdata_start - 2] = (unsigned char)(length>>8);
+                px[rdata_start - 1] = (unsigned char)(length>>0);
             }
-            break;
-        case TYPE_A:
-        case TYPE_AAAA:
-        case TYPE_TXT:
-        case TYPE_SRV:
-        default:
-            if (pkt->offset + rdlength <= max)
-                memcpy(&px[pkt->offset], &r->buf[rdoffset], rdlength);
-            pkt->offset += rdlength;
         }
         count++;
     }
@@ -200,6 +402,16 @@ rrset_packet_append(
     return count;
 }
 
+/****************************************************************************
+ ****************************************************************************/
+int
+rrset_type(const struct DBrrset *rrset)
+{
+    const unsigned char *buf = (const unsigned char *)rrset;
+
+    return buf[2]<<8 | buf[3];
+}
+
 /****************************************************************************
  ****************************************************************************/
 const struct DBrrset *
@@ -209,6 +421,18 @@ rrset_first(const struct DBEntry *entry, int type)
     size_t max = entry->offset; /* offset=start of free space */
     size_t offset = entry->domain_length;
 
+    /* Use the type directory if we have one */
+    if (entry->type_count && type != TYPE_ANY) {
+        const struct EntryType *types = TYPES(entry);
+        unsigned i;
+
+        for (i=0; i<entry->type_count && types[i].type <= type; i++) {
+            if (types[i].type == type)
+                return (struct DBrrset *)&buf[types[i].rrset];
+        }
+        return 0;
+    }
+
     /* Hunt through the linear list of RRsets and return the first one
      * that matches */
     while (offset < max) {
@@ -235,6 +459,10 @@ rrset_next(const struct DBEntry *entry, int type, const struct DBrrset *rrset)
     size_t offset = (const unsigned char*)rrset - buf;
     struct RRSETPARSER r[1];
 
+    /* There's only one RRset of each type */
+    if (entry->type_count && type != TYPE_ANY)
+        return 0;
+
     /* skip this one */
     R_init(r, &buf[offset]);
     offset += r->max;
@@ -253,33 +481,34 @@ rrset_next(const struct DBEntry *entry, int type, const struct DBrrset *rrset)
     return 0; /* reached end of list */
 }
 
-#if 0
 /****************************************************************************
+ * Get the glue entries for an RRset (such as the address records for the
+ * name-servers in an NS RRset). Call repeatedly, starting with '*index'
+ * set to zero, until this returns NULL.
+ * @param name
+ *      Receives the name of the glue record, which is the name from
+ *      the RDATA, so that it'll compress against the RRset.
  ****************************************************************************/
 const struct DBEntry *
-rrset_get_glue(const struct DBZone *zone, const struct DBEntry *entry, const struct DBrrset *rr, struct DomainPointer *domain_pointer)
+rrset_get_glue(const struct DBEntry *entry, const struct DBrrset *rrset, unsigned *index, struct DomainPointer *name)
 {
-    const unsigned char *buf = entry->buf;
-    //size_t length = entry->offset;
-    size_t offset = (const unsigned char *)rr - buf;
-    int type;
+    const struct EntryGlue *glue = GLUE(entry);
+    size_t rrset_offset = (const unsigned char *)rrset - entry->buf;
+    unsigned i;
 
-    /* Get the 'type' of this resource-entry */
-    type = GET_TYPE(buf, offset);
+    for (i = *index; i < entry->glue_count; i++) {
+        if (glue[i].rrset != rrset_offset)
+            continue;
 
-    /* Handle 'CNAME' and 'NS' records */
-    switch (type) {
-    case TYPE_NS:
-    case TYPE_CNAME:
-    case TYPE_PTR:
-        domain_pointer->length = GET_RDLENGTH(buf, offset);
-        domain_pointer->name = buf+offset+HDR_LENGTH;
-        return zone_lookup_exact2(zone, domain_pointer->name, domain_pointer->length);
-    default:
-        return 0;
+        name->name = entry->buf + glue[i].name;
+        name->length = glue[i].name_length;
+        *index = i + 1;
+        return glue[i].target;
     }
+
+    *index = i;
+    return 0;
 }
-#endif
 
 
 /****************************************************************************
@@ -562,7 +791,7 @@ again:
         }
 
         resize_chunk:
-        entry_bytes += (unsigned short)ALIGN(marshalled_length + 2, BLOCK_SIZE-1);
+        entry_stats_add((unsigned short)ALIGN(marshalled_length + 2, BLOCK_SIZE-1), 0, 0);
 
         new_size = entry->sizeof_buf + (unsigned short)ALIGN(marshalled_length + 2, BLOCK_SIZE-1);
         if (new_size > 0xFFFF) {
@@ -572,7 +801,16 @@ again:
         } else
             entry->sizeof_buf = (unsigned short)new_size;
 
-        *p_record = REALLOC2(*p_record, offsetof(struct DBEntry, buf) + entry->sizeof_buf + 1, 1);
+        if (entry->is_packed) {
+            /* Packed entries live inside a larger allocation, so they can't
+             * be realloc()ed. Instead, move it out into its own memory */
+            struct DBEntry *tmp;
+            tmp = MALLOC2(offsetof(struct DBEntry, buf) + entry->sizeof_buf + 1);
+            if (tmp)
+                memcpy(tmp, entry, offsetof(struct DBEntry, buf) + entry->offset);
+            *p_record = tmp;
+        } else
+            *p_record = REALLOC2(*p_record, offsetof(struct DBEntry, buf) + entry->sizeof_buf + 1, 1);
 
         entry = *p_record;
         if (entry == 0) {
@@ -580,6 +818,9 @@ again:
             exit(1);
         }
         entry->buf[entry->sizeof_buf] = 0xa3; /*fuzzing sentry*/
+        entry->is_packed = 0;
+        entry->type_count = 0;
+        entry->glue_count = 0;
         assert(entry->offset <= entry->sizeof_buf);
         goto again;
     }
@@ -667,6 +908,10 @@ again:
     if (type == TYPE_NS)
         (*p_record)->is_ns = 1;
 
+    /* Adding records overwrites the index, if there was one */
+    (*p_record)->type_count = 0;
+    (*p_record)->glue_count = 0;
+
     //print_entry(*p_record, stderr);
     return Success;
 }
@@ -725,7 +970,7 @@ entry_create_self(
             continue;
         break;
     }
-    total_chain_length += chain_length;
+    entry_stats_add(0, 0, chain_length);
 
     /* If we cannot find the entry, then create a new
      * one */
@@ -754,8 +999,7 @@ entry_create_self(
         entry->next = 0;
         (*p_record) = entry;
 
-        entry_count++;
-        entry_bytes += size_to_malloc;
+        entry_stats_add(size_to_malloc, 1, 0);
 
     }
 
@@ -771,6 +1015,389 @@ entry_create_self(
     }
 }
 
+/****************************************************************************
+ * Find the target name within a record that may need glue.
+ * @return 1 if the record has a target name, 0 otherwise
+ ****************************************************************************/
+static int
+glue_name(const unsigned char *rrset, int type, unsigned rdoffset, unsigned rdlength, unsigned *name_offset, unsigned *name_length)
+{
+    unsigned name_offsets[2];
+    unsigned name_lengths[2];
+
+    if (type != TYPE_NS && type != TYPE_MX)
+        return 0;
+    if (rdata_names(type, &rrset[rdoffset], rdlength, name_offsets, name_lengths) == 0)
+        return 0;
+
+    *name_offset = rdoffset + name_offsets[0];
+    *name_length = name_lengths[0];
+    return 1;
+}
+
+/****************************************************************************
+ * Count the number of records that could have glue, which is how much
+ * room we need to reserve for glue links.
+ ****************************************************************************/
+static unsigned
+entry_glue_max(const struct DBEntry *entry)
+{
+    unsigned offset;
+    unsigned count = 0;
+
+    for (offset = entry->domain_length; offset < entry->offset; ) {
+        struct RRSETPARSER r[1];
+        R_init(r, &entry->buf[offset]);
+
+        if (r->type == TYPE_NS || r->type == TYPE_MX) {
+            while (r->offset < r->max) {
+                unsigned rdlength;
+                unsigned rdoffset;
+                R_next_rr(r, &rdlength, &rdoffset);
+                count++;
+            }
+        }
+        offset += r->max;
+    }
+    return count;
+}
+
+/****************************************************************************
+ * Count the number of RRsets, which is the size of the type directory
+ ****************************************************************************/
+static unsigned
+entry_type_max(const struct DBEntry *entry)
+{
+    unsigned offset;
+    unsigned count = 0;
+
+    for (offset = entry->domain_length; offset < entry->offset; ) {
+        struct RRSETPARSER r[1];
+        R_init(r, &entry->buf[offset]);
+        count++;
+        offset += r->max;
+    }
+    return count;
+}
+
+/****************************************************************************
+ * Count the number of names in RDATA, not including the zero item at the
+ * end of the list
+ ****************************************************************************/
+static unsigned
+entry_names_max(const struct DBEntry *entry)
+{
+    unsigned offset;
+    unsigned count = 0;
+
+    for (offset = entry->domain_length; offset < entry->offset; ) {
+        struct RRSETPARSER r[1];
+        R_init(r, &entry->buf[offset]);
+
+        while (r->offset < r->max) {
+            unsigned rdlength;
+            unsigned rdoffset;
+            unsigned name_offsets[2];
+            unsigned name_lengths[2];
+
+            R_next_rr(r, &rdlength, &rdoffset);
+            count += rdata_names(r->type, &r->buf[rdoffset], rdlength, name_offsets, name_lengths);
+        }
+        offset += r->max;
+    }
+    return count;
+}
+
+/****************************************************************************
+ * The size of the buffer needed to hold the RRsets plus the index
+ ****************************************************************************/
+static size_t
+entry_index_end(const struct DBEntry *entry)
+{
+    unsigned type_count = entry_type_max(entry);
+    unsigned glue_count = entry_glue_max(entry);
+    unsigned name_count = entry_names_max(entry);
+    size_t end;
+
+    end = ALIGN(TYPES_START(entry) + type_count * sizeof(struct EntryType), BLOCK_SIZE-1);
+    end += glue_count * sizeof(struct EntryGlue);
+    end += (name_count + 1) * sizeof(struct EntryName);
+
+    /* There's no index for entries that are empty, or that are already
+     * huge */
+    if (type_count == 0 || type_count > TYPES_MAX || end > 0xFFFF - BLOCK_SIZE)
+        return entry->offset;
+    return end;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+entry_chain_free(struct DBEntry *entry)
+{
+    while (entry) {
+        struct DBEntry *next = entry->next;
+
+        if (!entry->is_packed)
+            free(entry);
+        entry = next;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+entry_chain_reserve_index(struct DBEntry **p_entry)
+{
+    for ( ; *p_entry; p_entry = &(*p_entry)->next) {
+        struct DBEntry *entry = *p_entry;
+        size_t needed = entry_index_end(entry);
+        struct DBEntry *tmp;
+
+        if (needed <= entry->sizeof_buf)
+            continue;
+
+        /* Grow the entry, which moves it, so this must be done for all
+         * entries before any are linked */
+        tmp = MALLOC2(offsetof(struct DBEntry, buf) + needed + 1);
+        memcpy(tmp, entry, offsetof(struct DBEntry, buf) + entry->offset);
+        entry_stats_add(needed - entry->sizeof_buf, 0, 0);
+        tmp->sizeof_buf = (unsigned short)needed;
+        tmp->buf[tmp->sizeof_buf] = 0xA3; /*fuzzing sentry*/
+        tmp->is_packed = 0;
+        tmp->type_count = 0;
+        tmp->glue_count = 0;
+        if (!entry->is_packed)
+            free(entry);
+        *p_entry = tmp;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+entry_has_address(const struct DBEntry *entry)
+{
+    return rrset_first(entry, TYPE_A) != NULL || rrset_first(entry, TYPE_AAAA) != NULL;
+}
+
+/****************************************************************************
+ * Fill in the type directory, in order of type, using insertion sort
+ * since there are usually only a few.
+ ****************************************************************************/
+static void
+entry_build_types(struct DBEntry *entry)
+{
+    struct EntryType *types = (struct EntryType *)TYPES(entry);
+    unsigned count = 0;
+    unsigned offset;
+
+    for (offset = entry->domain_length; offset < entry->offset; ) {
+        struct RRSETPARSER r[1];
+        unsigned i;
+
+        R_init(r, &entry->buf[offset]);
+
+        for (i = count; i > 0 && types[i-1].type > r->type; i--)
+            types[i] = types[i-1];
+        types[i].type = (unsigned short)r->type;
+        types[i].rrset = (unsigned short)offset;
+        count++;
+
+        offset += r->max;
+    }
+
+    entry->type_count = (unsigned char)count;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+entry_link_glue(struct DBEntry *entry, ENTRY_GLUE_LOOKUP lookup, void *userdata)
+{
+    struct EntryGlue *glue = (struct EntryGlue *)GLUE(entry);
+    unsigned count = 0;
+    unsigned offset;
+
+    for (offset = entry->domain_length; offset < entry->offset; ) {
+        struct RRSETPARSER r[1];
+        R_init(r, &entry->buf[offset]);
+
+        while ((r->type == TYPE_NS || r->type == TYPE_MX) && r->offset < r->max) {
+            unsigned rdlength;
+            unsigned rdoffset;
+            unsigned name_offset;
+            unsigned name_length;
+            const struct DBEntry *target;
+
+            R_next_rr(r, &rdlength, &rdoffset);
+            if (!glue_name(&entry->buf[offset], r->type, rdoffset, rdlength, &name_offset, &name_length))
+                continue;
+
+            target = lookup(userdata, &entry->buf[offset + name_offset], name_length);
+            if (target == NULL || !entry_has_address(target))
+                continue;
+
+            glue[count].target = target;
+            glue[count].rrset = (unsigned short)offset;
+            glue[count].name = (unsigned short)(offset + name_offset);
+            /* names in the rdata end with the root label, but when
+             * formatting the response, the root is appended as
+             * the origin */
+            glue[count].name_length = (unsigned short)(name_length - 1);
+            count++;
+        }
+        offset += r->max;
+    }
+
+    assert(count <= entry_glue_max(entry));
+    entry->glue_count = (unsigned short)count;
+}
+
+/****************************************************************************
+ * For each name in the RDATA, count how many labels at the end are the
+ * same as the owner name. This must be done after the glue is linked,
+ * since the list comes after the glue.
+ ****************************************************************************/
+static void
+entry_build_names(struct DBEntry *entry, struct DomainPointer origin)
+{
+    struct EntryName *names = (struct EntryName *)NAMES(entry);
+    const unsigned char *owner_labels[128];
+    unsigned owner_count = 0;
+    unsigned count = 0;
+    unsigned offset;
+    unsigned i;
+
+    /* The owner labels, skipping the '*' of wildcards, since responses
+     * use the query name as the owner */
+    for (i=0; i<entry->domain_length && owner_count<128; i += entry->buf[i] + 1) {
+        if (i == 0 && entry->buf[0] == 1 && entry->buf[1] == '*')
+            continue;
+        owner_labels[owner_count++] = &entry->buf[i];
+    }
+    for (i=0; i<origin.length && owner_count<128; i += origin.name[i] + 1)
+        owner_labels[owner_count++] = &origin.name[i];
+
+    for (offset = entry->domain_length; offset < entry->offset; ) {
+        struct RRSETPARSER r[1];
+        R_init(r, &entry->buf[offset]);
+
+        while (r->offset < r->max) {
+            unsigned rdlength;
+            unsigned rdoffset;
+            unsigned name_offsets[2];
+            unsigned name_lengths[2];
+            unsigned name_count;
+            unsigned j;
+
+            R_next_rr(r, &rdlength, &rdoffset);
+            name_count = rdata_names(r->type, &r->buf[rdoffset], rdlength, name_offsets, name_lengths);
+
+            for (j=0; j<name_count; j++) {
+                const unsigned char *name = &r->buf[rdoffset + name_offsets[j]];
+                const unsigned char *labels[128];
+                unsigned label_count = 0;
+                unsigned shared = 0;
+
+                for (i=0; name[i] && label_count<128; i += name[i] + 1)
+                    labels[label_count++] = &name[i];
+
+                while (shared < label_count && shared < owner_count) {
+                    const unsigned char *lhs = labels[label_count - shared - 1];
+                    const unsigned char *rhs = owner_labels[owner_count - shared - 1];
+                    if (lhs[0] != rhs[0] || memcasecmp(lhs+1, rhs+1, lhs[0]) != 0)
+                        break;
+                    shared++;
+                }
+                if (shared == 0)
+                    continue;
+
+                names[count].name = (unsigned short)(name - entry->buf);
+                names[count].prefix_length = (unsigned char)(labels[label_count - shared] - name);
+                names[count].suffix_labels = (unsigned char)shared;
+                count++;
+            }
+        }
+        offset += r->max;
+    }
+
+    assert(count <= entry_names_max(entry));
+    names[count].name = 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+entry_chain_build_index(struct DBEntry *entry, struct DomainPointer origin, ENTRY_GLUE_LOOKUP lookup, void *userdata)
+{
+    for ( ; entry; entry = entry->next) {
+        size_t end = entry_index_end(entry);
+
+        entry->type_count = 0;
+        entry->glue_count = 0;
+        if (end == entry->offset || end > entry->sizeof_buf)
+            continue;
+
+        entry_build_types(entry);
+        entry_link_glue(entry, lookup, userdata);
+        entry_build_names(entry, origin);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static size_t
+entry_packed_size(const struct DBEntry *entry)
+{
+    /* header, the data, room for the index, then the fuzzing sentry byte */
+    return ALIGN(offsetof(struct DBEntry, buf) + entry_index_end(entry) + 1, BLOCK_SIZE-1);
+}
+
+size_t
+entry_chain_packed_size(const struct DBEntry *entry)
+{
+    size_t total = 0;
+
+    for (; entry; entry = entry->next)
+        total += entry_packed_size(entry);
+    return total;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+struct DBEntry *
+entry_pack_chain(struct DBEntry *entry, void *dst)
+{
+    unsigned char *p = (unsigned char *)dst;
+    struct DBEntry *head = 0;
+    struct DBEntry **p_next = &head;
+
+    while (entry) {
+        struct DBEntry *next = entry->next;
+        struct DBEntry *result = (struct DBEntry *)p;
+
+        memcpy(result, entry, offsetof(struct DBEntry, buf) + entry->offset);
+        result->sizeof_buf = (unsigned short)entry_index_end(entry);
+        result->type_count = 0;
+        result->glue_count = 0;
+        result->buf[result->sizeof_buf] = 0xA3; /*fuzzing sentry*/
+        result->is_packed = 1;
+        result->next = 0;
+        p += entry_packed_size(result);
+
+        /* entries already packed belong to the zone's previous arena */
+        if (!entry->is_packed)
+            free(entry);
+
+        *p_next = result;
+        p_next = &result->next;
+        entry = next;
+    }
+
+    return head;
+}
+
 /****************************************************************************
  ****************************************************************************/
 const struct DBEntry *
@@ -842,3 +1469,79 @@ entry_name(const struct DBEntry *entry)
 
     return result;
 }
+
+/****************************************************************************
+ ****************************************************************************/
+const struct DBEntry *
+entry_next(const struct DBEntry *entry)
+{
+    return entry->next;
+}
+
+/****************************************************************************
+ * Packed zones depend on the exact size of an entry's header, and on each
+ * packed entry taking exactly entry_packed_size() bytes
+ ****************************************************************************/
+int
+entry_selftest(void)
+{
+    static const struct DomainPointer names[2] = {
+        {(const unsigned char *)"\3www\7example\3com", 17},
+        {(const unsigned char *)"\4mail\7example\3com", 18},
+    };
+    static const unsigned char rdata[4] = {192, 0, 2, 1};
+    struct DBEntry *chain = 0;
+    struct DBEntry *packed;
+    unsigned char *arena;
+    size_t sizes[2] = {0, 0};
+    size_t total;
+    unsigned i;
+
+    /* the next pointer, then 8 bytes of lengths and flags, then the name */
+    if (offsetof(struct DBEntry, sizeof_buf) != sizeof(struct DBEntry *)
+        || offsetof(struct DBEntry, domain_length) != sizeof(struct DBEntry *) + 6
+        || offsetof(struct DBEntry, buf) != sizeof(struct DBEntry *) + 8) {
+        fprintf(stderr, "entry: header is %u bytes, expected %u\n",
+                (unsigned)offsetof(struct DBEntry, buf),
+                (unsigned)sizeof(struct DBEntry *) + 8);
+        return 1;
+    }
+
+    for (i=0; i<2; i++) {
+        struct DB_XDomain xdomain[1];
+
+        xdomain_reverse3(xdomain, &names[i], 0);
+        entry_create_self(&chain, xdomain, 2, TYPE_A, 60, sizeof(rdata), rdata);
+    }
+    entry_chain_reserve_index(&chain);
+
+    /* each is the header, the name and RRsets, room for the index and the
+     * sentry byte, rounded up to 8 bytes */
+    for (i=0, packed=chain; packed && i < 2; packed=packed->next, i++)
+        sizes[i] = ALIGN(offsetof(struct DBEntry, buf) + entry_index_end(packed) + 1, BLOCK_SIZE-1);
+    total = entry_chain_packed_size(chain);
+    if (i != 2 || total != sizes[0] + sizes[1] || sizes[0] % BLOCK_SIZE || sizes[1] % BLOCK_SIZE) {
+        fprintf(stderr, "entry: packed size %u, expected %u\n",
+                (unsigned)total, (unsigned)(sizes[0] + sizes[1]));
+        entry_chain_free(chain);
+        return 1;
+    }
+
+    /* packed back to back, with nothing spare */
+    arena = MALLOC2(total);
+    packed = entry_pack_chain(chain, arena);
+    if ((unsigned char *)packed != arena
+        || (unsigned char *)packed->next != arena + sizes[0]
+        || packed->next->next != NULL
+        || !packed->is_packed
+        || packed->buf[packed->sizeof_buf] != 0xA3
+        || packed->next->buf[packed->next->sizeof_buf] != 0xA3
+        || (size_t)(&packed->next->buf[packed->next->sizeof_buf] + 1 - arena) > total
+        || (size_t)(&packed->next->buf[packed->next->sizeof_buf] + 1 - arena) + BLOCK_SIZE <= total) {
+        fprintf(stderr, "entry: packed layout wrong\n");
+        free(arena);
+        return 1;
+    }
+    free(arena);
+    return 0;
+}
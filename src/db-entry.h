@@ -9,6 +9,33 @@ extern "C" {
 
 struct DB_XDomain;
 struct DBEntry;
+struct DomainPointer;
+
+/**
+ * Statistics about entries created while loading zonefiles. Each
+ * insertion thread keeps its own copy, so that the threads don't fight
+ * over the same cache-lines, then merges them into the process-wide
+ * totals when it's done.
+ */
+struct EntryStatistics
+{
+    uint64_t bytes;
+    uint64_t count;
+    uint64_t chain_length;
+};
+
+/**
+ * Direct the statistics for entries created by the current thread into
+ * the given structure. Pass NULL to go back to updating the process-wide
+ * totals directly.
+ */
+void entry_stats_bind(struct EntryStatistics *stats);
+
+/**
+ * Add per-thread statistics into the process-wide totals. This is
+ * thread-safe.
+ */
+void entry_stats_merge(const struct EntryStatistics *stats);
 
 void entry_create_self(struct DBEntry **p_record, const struct DB_XDomain *xdomain, unsigned zone_label_count, 
     int type, unsigned ttl, unsigned rdlength, const unsigned char *rdata);
@@ -16,10 +43,60 @@ const struct DBEntry *entry_find(const struct DBEntry *record, const struct DB_X
 
 unsigned entry_chain_length(const struct DBEntry *record);
 
+/**
+ * The number of bytes needed to hold a copy of all the entries in this
+ * hash chain with no spare room at the end, for use with entry_pack_chain().
+ */
+size_t entry_chain_packed_size(const struct DBEntry *record);
+
+/**
+ * Move all the entries in the chain, in order, into caller-provided memory
+ * (at least entry_chain_packed_size() bytes), freeing the originals. Adding
+ * records to a packed entry later on still works, but moves it back out
+ * into its own allocation.
+ * @return the new head of the chain
+ */
+struct DBEntry *entry_pack_chain(struct DBEntry *record, void *dst);
+
+/**
+ * Looks up the entry for a fully-qualified name, for linking glue. Returns
+ * NULL if we don't have that name.
+ */
+typedef const struct DBEntry *(*ENTRY_GLUE_LOOKUP)(void *userdata, const unsigned char *name, unsigned name_length);
+
+/**
+ * Indexing entries is done in two steps once everything has been loaded.
+ * First, make room for the index in every entry in the chain. This may
+ * move entries, so must be done for all zones before the second step.
+ */
+void entry_chain_reserve_index(struct DBEntry **p_record);
+
+/**
+ * Second, build the directory of RRset types used by rrset_first(), and
+ * for NS and MX records, look up the target names and remember those
+ * that have A/AAAA records, see rrset_get_glue(). Also work out how the
+ * names in RDATA relate to the owner name (whose zone is 'origin'), see
+ * rrset_packet_append().
+ */
+void entry_chain_build_index(struct DBEntry *record, struct DomainPointer origin, ENTRY_GLUE_LOOKUP lookup, void *userdata);
+
 int entry_is_delegation(const struct DBEntry *record);
 
 struct DomainPointer entry_name(const struct DBEntry *record);
 
+/**
+ * Free every entry in the chain, except those packed into a zone's
+ * arena, which go when the arena does.
+ */
+void entry_chain_free(struct DBEntry *record);
+
+/**
+ * The next entry in the same hash chain, or NULL at the end.
+ */
+const struct DBEntry *entry_next(const struct DBEntry *record);
+
+int entry_selftest(void);
+
 #ifdef __cplusplus
 }
 #endif
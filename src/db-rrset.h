@@ -11,8 +11,9 @@ struct DBZone;
 
 const struct DBrrset *rrset_first(const struct DBEntry *record, int type);
 const struct DBrrset *rrset_next(const struct DBEntry *record, int type, const struct DBrrset *rrset);
-const struct DBEntry *rrset_get_glue(const struct DBZone *zone, const struct DBEntry *record, const struct DBrrset *rrset, struct DomainPointer *name);
+int rrset_type(const struct DBrrset *rrset);
+const struct DBEntry *rrset_get_glue(const struct DBEntry *record, const struct DBrrset *rrset, unsigned *index, struct DomainPointer *name);
 void rrset_names_from_glue(const struct DBrrset *rrset, struct DomainPointer *name, struct DomainPointer *origin);
-unsigned rrset_packet_append(const struct DBrrset *rrset, struct Packet *pkt, struct Compressor *compressor, struct DomainPointer name, struct DomainPointer origin);
+unsigned rrset_packet_append(const struct DBrrset *rrset, const struct DBEntry *record, struct Packet *pkt, struct Compressor *compressor, struct DomainPointer name, struct DomainPointer origin);
 
 #endif
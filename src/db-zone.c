@@ -2,9 +2,12 @@
 #include "db-entry.h"
 #include "db-rrset.h"
 #include "zonefile-rr.h"
+#include "zonefile-insertion.h"
 #include "domainname.h"
 #include "pixie-threads.h"
+#include "pixie.h"
 #include "util-realloc2.h"
+#include "unusedparm.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +42,20 @@ struct DBZone
     unsigned entry_mask;
     struct DBEntry **records;
 
+    /* When the zone has been packed, all the entries live here, in
+     * hash-table order, see zone_pack() */
+    unsigned char *arena;
+
+    /* Existence filter over every name in the zone, and the apex entry
+     * holding the SOA, so that names that don't exist can be answered
+     * without searching the hash table, see zone_build_filter() */
+    struct {
+        uint64_t *buckets;
+        unsigned mask;
+        unsigned is_stale;
+        const struct DBEntry *apex;
+    } negative;
+
     /** Tracks the timestamp/size of the file(s) that contains all the zone
      * data in order to detect when any files have changed */
     struct Conf_TrackFile *file_tracker;
@@ -112,6 +129,11 @@ zone_create_record(
         ; //assert(hash_index == zone->hash);
     }
 
+    /* The filter doesn't know about this name, and the entries may move,
+     * so stop using it until the zone is indexed again */
+    if (zone->negative.buckets)
+        zone->negative.is_stale = 1;
+
     /* Now finish the creation of the label */
     entry_create_self(
                 &zone->records[hash_index & zone->entry_mask],
@@ -135,6 +157,8 @@ void zone_create_record2(struct DBZone *zone,
 
 }
 
+static int zone_filter_has(const struct DBZone *zone, uint64_t hash);
+
 /****************************************************************************
  ****************************************************************************/
 const struct DBEntry *
@@ -158,6 +182,10 @@ zone_lookup_wildcard(const struct DBZone *zone, const struct DB_XDomain *xdomain
         wdomain.labels[i].hash = hash;
         wdomain.hash = hash;
 
+        /* most zones have no "*" at most of the places we look */
+        if (!zone_filter_has(zone, hash))
+            continue;
+
         record = entry_find(
                     zone->records[hash & zone->entry_mask],
                     &wdomain,
@@ -185,6 +213,10 @@ zone_lookup_delegation(const struct DBZone *zone, const struct DB_XDomain *xdoma
 
         hash = xdomain->labels[i].hash;
 
+        /* the name we compare against can't be a cut if it isn't there */
+        if (i > 0 && !zone_filter_has(zone, xdomain->labels[i-1].hash))
+            continue;
+
         record = entry_find(
                     zone->records[hash & zone->entry_mask],
                     xdomain,
@@ -220,6 +252,26 @@ zone_lookup_exact(const struct DBZone *zone, const struct DB_XDomain *xdomain)
                 zone->label_count,
                 xdomain->label_count);
 }
+
+/****************************************************************************
+ ****************************************************************************/
+void
+zone_prefetch_bucket(const struct DBZone *zone, const struct DB_XDomain *xdomain)
+{
+    pixie_prefetch(&zone->records[xdomain->hash & zone->entry_mask]);
+    if (zone->negative.buckets)
+        pixie_prefetch(&zone->negative.buckets[xdomain->hash & zone->negative.mask]);
+}
+
+void
+zone_prefetch_entry(const struct DBZone *zone, const struct DB_XDomain *xdomain)
+{
+    const struct DBEntry *entry = zone->records[xdomain->hash & zone->entry_mask];
+
+    if (entry)
+        pixie_prefetch(entry);
+}
+
 const struct DBEntry *
 zone_lookup_exact2(const struct DBZone *zone, const unsigned char *name, unsigned length)
 {
@@ -265,19 +317,22 @@ zone_name(const struct DBZone *zone, struct DomainPointer *origin)
 
 
 /****************************************************************************
- * Given a zone, find the "SOA" record associated with that zone.
- * TODO: right now, this just does a name lookup, which is slow. In the
- *  future I plan to copy the SOA record to the zone itself, to optimize
- *  lookups.
+ * Given a zone, find the "SOA" record associated with that zone. Once the
+ * zone has been indexed, we remember the entry so that negative answers
+ * don't need a name lookup.
  ****************************************************************************/
 const struct DBrrset *
-zone_get_soa_rr(const struct DBZone *zone)
+zone_get_soa_rr(const struct DBZone *zone, const struct DBEntry **p_record)
 {
     const struct DBrrset *rrset;
     const struct DBEntry *record;
 
-    record = zone_lookup_self(zone);
+    if (zone->negative.apex && !zone->negative.is_stale)
+        record = zone->negative.apex;
+    else
+        record = zone_lookup_self(zone);
     rrset = rrset_first(record, TYPE_SOA);
+    *p_record = record;
 
     return rrset;
 }
@@ -322,11 +377,8 @@ zone_insert_self(struct DBZone *zone, volatile struct DBZone **location)
 
 /****************************************************************************
  ****************************************************************************/
-struct DBZone *
-zone_create_self(
-    const struct DB_XDomain *xdomain,
-    uint64_t filesize,
-    const char *filename)
+static struct DBZone *
+zone_create_buckets(const struct DB_XDomain *xdomain, uint64_t entry_count)
 {
 	struct DBZone *zone;
 	uint64_t hash = xdomain->hash;
@@ -342,8 +394,12 @@ zone_create_self(
     zone->delegation.longest = 0;
     zone->delegation.shortest = UINT_MAX;
 
-    /* Allocate space for records */
-    zone->entry_count = (unsigned)pow2(filesize/64);
+    /* Allocate space for records. There must be at least as many buckets
+     * as there are insertion threads, because the threads partition the
+     * buckets among themselves */
+    zone->entry_count = (unsigned)pow2(entry_count);
+    if (zone->entry_count < MAX_INSERTION_THREADS)
+        zone->entry_count = MAX_INSERTION_THREADS;
     
     
     zone->entry_mask = zone->entry_count - 1;
@@ -359,6 +415,308 @@ zone_create_self(
     return zone;
 }
 
+/****************************************************************************
+ * Create a zone, guessing the size of the hash table from the size of the
+ * file. This is only a rough guess, since files vary a lot in how many
+ * bytes they use per owner name.
+ ****************************************************************************/
+struct DBZone *
+zone_create_self(
+    const struct DB_XDomain *xdomain,
+    uint64_t filesize,
+    const char *filename)
+{
+    return zone_create_buckets(xdomain, filesize/64);
+}
+
+/****************************************************************************
+ * Create a zone when we already know how many distinct owner names it
+ * will contain, such as from a counting pass over the zonefile.
+ ****************************************************************************/
+struct DBZone *
+zone_create_exact(
+    const struct DB_XDomain *xdomain,
+    uint64_t owner_count,
+    const char *filename)
+{
+    return zone_create_buckets(xdomain, owner_count);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+zone_destroy(struct DBZone *zone)
+{
+    unsigned i;
+
+    if (zone == NULL)
+        return;
+    for (i=0; i<zone->entry_count; i++)
+        entry_chain_free(zone->records[i]);
+    free(zone->records);
+    free(zone->arena);
+    free(zone->negative.buckets);
+    free(zone);
+}
+
+/****************************************************************************
+ * Once a zone has been loaded, move all its entries into a single
+ * allocation, in the same order as the hash table. This removes the
+ * slack at the end of each entry, and means walking a chain touches
+ * adjacent memory instead of hopping around the heap.
+ * @return the number of bytes used by the packed entries
+ ****************************************************************************/
+uint64_t
+zone_pack(struct DBZone *zone)
+{
+    unsigned char *old_arena = zone->arena;
+    unsigned char *arena;
+    size_t total = 0;
+    size_t offset = 0;
+    unsigned i;
+
+    for (i=0; i<zone->entry_count; i++)
+        total += entry_chain_packed_size(zone->records[i]);
+    if (total == 0)
+        return 0;
+
+    arena = MALLOC2(total);
+    if (arena == NULL)
+        return 0; /* not fatal, the zone just stays unpacked */
+
+    for (i=0; i<zone->entry_count; i++) {
+        size_t size = entry_chain_packed_size(zone->records[i]);
+        zone->records[i] = entry_pack_chain(zone->records[i], arena + offset);
+        offset += size;
+    }
+
+    zone->arena = arena;
+    free(old_arena);
+    return total;
+}
+
+/****************************************************************************
+ * NEGATIVE FILTER
+ *
+ * Random-subdomain floods ("x8f2k.example.com", "q0z3a.example.com", ...)
+ * ask for names that don't exist, which is the worst case for the hash
+ * table: the bucket and every entry chained from it must be compared
+ * before we know the answer is NXDOMAIN. So after loading, we build a
+ * cuckoo filter over the hash of every name in the zone, including the
+ * empty non-terminals between owner names and the apex. Each bucket is
+ * four 16-bit fingerprints packed into 64-bits, and a name can only be
+ * in one of two buckets, so testing a name touches at most two
+ * cache-lines. There are no false negatives, and fewer than 1 in 8000
+ * names that don't exist get through to the normal lookup.
+ ****************************************************************************/
+#define FILTER_MAX_KICKS 500
+
+static unsigned
+filter_fingerprint(uint64_t hash)
+{
+    unsigned fingerprint = (unsigned)(hash >> 48);
+
+    /* zero marks an empty slot */
+    return fingerprint ? fingerprint : 1;
+}
+
+static unsigned
+filter_alternate(unsigned index, unsigned fingerprint, unsigned mask)
+{
+    return (index ^ (fingerprint * 0x5bd1e995)) & mask;
+}
+
+static int
+filter_bucket_has(uint64_t bucket, unsigned fingerprint)
+{
+    unsigned i;
+
+    for (i=0; i<4; i++) {
+        if (((bucket >> (i*16)) & 0xFFFF) == fingerprint)
+            return 1;
+    }
+    return 0;
+}
+
+static int
+filter_bucket_add(uint64_t *bucket, unsigned fingerprint)
+{
+    unsigned i;
+
+    for (i=0; i<4; i++) {
+        if (((*bucket >> (i*16)) & 0xFFFF) == 0) {
+            *bucket |= (uint64_t)fingerprint << (i*16);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+filter_contains(const uint64_t *buckets, unsigned mask, uint64_t hash)
+{
+    unsigned fingerprint = filter_fingerprint(hash);
+    unsigned index = (unsigned)hash & mask;
+
+    if (filter_bucket_has(buckets[index], fingerprint))
+        return 1;
+    index = filter_alternate(index, fingerprint, mask);
+    return filter_bucket_has(buckets[index], fingerprint);
+}
+
+/**
+ * @return 0 if the filter is too full, in which case a fingerprint has
+ * been lost, and the filter has to be rebuilt bigger
+ */
+static int
+filter_insert(uint64_t *buckets, unsigned mask, uint64_t hash, unsigned *seed)
+{
+    unsigned fingerprint = filter_fingerprint(hash);
+    unsigned index = (unsigned)hash & mask;
+    unsigned i;
+
+    /* Ancestors are shared by many names, so most insertions are
+     * duplicates, which a cuckoo filter can't hold more than a few of */
+    if (filter_contains(buckets, mask, hash))
+        return 1;
+
+    if (filter_bucket_add(&buckets[index], fingerprint))
+        return 1;
+    index = filter_alternate(index, fingerprint, mask);
+    if (filter_bucket_add(&buckets[index], fingerprint))
+        return 1;
+
+    /* Both buckets are full, so kick out a random fingerprint and move
+     * it to its other bucket, and so on */
+    for (i=0; i<FILTER_MAX_KICKS; i++) {
+        unsigned slot;
+        unsigned victim;
+
+        *seed = *seed * 1103515245 + 12345;
+        slot = (*seed >> 16) & 3;
+
+        victim = (unsigned)(buckets[index] >> (slot*16)) & 0xFFFF;
+        buckets[index] &= ~(0xFFFFULL << (slot*16));
+        buckets[index] |= (uint64_t)fingerprint << (slot*16);
+
+        fingerprint = victim;
+        index = filter_alternate(index, fingerprint, mask);
+        if (filter_bucket_add(&buckets[index], fingerprint))
+            return 1;
+    }
+    return 0;
+}
+
+static int
+filter_add_names(const struct DBZone *zone, uint64_t *buckets, unsigned mask)
+{
+    unsigned seed = 1;
+    unsigned i;
+
+    for (i=0; i<zone->entry_count; i++) {
+        const struct DBEntry *entry;
+
+        for (entry = zone->records[i]; entry; entry = entry_next(entry)) {
+            struct DomainPointer name = entry_name(entry);
+            struct DB_XDomain xdomain[1];
+            unsigned j;
+
+            xdomain_reverse3(xdomain, &name, &zone->domain);
+
+            /* The owner name, then each of its ancestors up to and
+             * including the apex */
+            for (j=xdomain->label_count; j>=zone->label_count && j>0; j--) {
+                if (!filter_insert(buckets, mask, xdomain->labels[j-1].hash, &seed))
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void
+zone_build_filter(struct DBZone *zone)
+{
+    uint64_t *buckets;
+    unsigned bucket_count;
+    unsigned name_count = 0;
+    unsigned i;
+
+    free(zone->negative.buckets);
+    zone->negative.buckets = 0;
+    zone->negative.mask = 0;
+    zone->negative.is_stale = 0;
+    zone->negative.apex = zone_lookup_self(zone);
+
+    /* Start at about 75% full if there are no empty non-terminals, and
+     * grow if the ancestors don't fit */
+    for (i=0; i<zone->entry_count; i++)
+        name_count += entry_chain_length(zone->records[i]);
+    bucket_count = (unsigned)pow2(name_count/3 + 1);
+
+    for (;;) {
+        buckets = REALLOC2(0, bucket_count, sizeof(buckets[0]));
+        if (buckets == NULL)
+            return; /* not fatal, lookups just don't get filtered */
+        memset(buckets, 0, bucket_count * sizeof(buckets[0]));
+
+        if (filter_add_names(zone, buckets, bucket_count - 1))
+            break;
+
+        free(buckets);
+        if (bucket_count >= 0x10000000)
+            return;
+        bucket_count *= 2;
+    }
+
+    zone->negative.mask = bucket_count - 1;
+    zone->negative.buckets = buckets;
+}
+
+/****************************************************************************
+ * Whether the name with this hash might be in the zone. Without a usable
+ * filter, anything might be.
+ ****************************************************************************/
+static int
+zone_filter_has(const struct DBZone *zone, uint64_t hash)
+{
+    if (zone->negative.buckets == NULL || zone->negative.is_stale)
+        return 1;
+    return filter_contains(zone->negative.buckets, zone->negative.mask, hash);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+zone_name_may_exist(const struct DBZone *zone, const struct DB_XDomain *xdomain)
+{
+    if (xdomain->label_count <= zone->label_count)
+        return 1;
+    return zone_filter_has(zone, xdomain->hash);
+}
+
+/****************************************************************************
+ * See entry_chain_reserve_index() and entry_chain_build_index()
+ ****************************************************************************/
+void
+zone_reserve_index(struct DBZone *zone)
+{
+    unsigned i;
+
+    for (i=0; i<zone->entry_count; i++)
+        entry_chain_reserve_index(&zone->records[i]);
+}
+void
+zone_build_index(struct DBZone *zone, ENTRY_GLUE_LOOKUP lookup, void *userdata)
+{
+    unsigned i;
+
+    for (i=0; i<zone->entry_count; i++)
+        entry_chain_build_index(zone->records[i], zone->domain, lookup, userdata);
+
+    zone_build_filter(zone);
+}
+
 /****************************************************************************
  ****************************************************************************/
 struct DBZone *
@@ -382,3 +740,150 @@ zone_entry_by_index(const struct DBZone *zone, unsigned index)
 
     return zone->records[index];
 }
+
+/****************************************************************************
+ ****************************************************************************/
+static const struct DBEntry *
+selftest_glue_lookup(void *userdata, const unsigned char *name, unsigned name_length)
+{
+    UNUSEDPARM(userdata);
+    UNUSEDPARM(name);
+    UNUSEDPARM(name_length);
+    return 0;
+}
+
+static struct DBZone *
+selftest_filter_zone(const char **names)
+{
+    struct DB_XDomain xdomain[1];
+    struct DBZone *zone;
+    unsigned count;
+    unsigned i;
+
+    for (count=0; names[count]; count++)
+        ;
+    xdomain_reverse2(xdomain, (const unsigned char *)"\7example\3com", 13);
+    zone = zone_create_exact(xdomain, count, "<selftest>");
+
+    for (i=0; names[i]; i++) {
+        xdomain_reverse2(xdomain, (const unsigned char *)names[i], (unsigned)strlen(names[i])+1);
+        zone_create_record(zone, xdomain, TYPE_A, 60, 4, (const unsigned char *)"\x0a\0\0\1");
+    }
+
+    zone_reserve_index(zone);
+    zone_build_index(zone, selftest_glue_lookup, 0);
+    return zone;
+}
+
+static int
+selftest_may_exist(const struct DBZone *zone, const char *name)
+{
+    struct DB_XDomain xdomain[1];
+
+    xdomain_reverse2(xdomain, (const unsigned char *)name, (unsigned)strlen(name)+1);
+    return zone_name_may_exist(zone, xdomain);
+}
+
+static const struct DBEntry *
+selftest_wildcard(const struct DBZone *zone, const char *name)
+{
+    struct DB_XDomain xdomain[1];
+
+    xdomain_reverse2(xdomain, (const unsigned char *)name, (unsigned)strlen(name)+1);
+    return zone_lookup_wildcard(zone, xdomain);
+}
+
+int
+zone_selftest(void)
+{
+    static const char *names[] = {
+        "\7example\3com",
+        "\3www\7example\3com",
+        "\1a\1b\1c\7example\3com",
+        "\1*\4wild\7example\3com",
+        0};
+    static const char *empty_non_terminals[] = {
+        "\1b\1c\7example\3com",
+        "\1c\7example\3com",
+        "\4wild\7example\3com",
+        0};
+    static char many[20000][24];
+    const char *many_names[20001];
+    const struct DBEntry *entry;
+    struct DBZone *zone;
+    unsigned false_positives = 0;
+    unsigned i;
+
+    zone = selftest_filter_zone(names);
+    if (zone->negative.buckets == NULL)
+        goto fail;
+
+    /* No false negatives, including names that only exist because
+     * there's something below them */
+    for (i=0; names[i]; i++) {
+        if (!selftest_may_exist(zone, names[i]))
+            goto fail;
+    }
+    for (i=0; empty_non_terminals[i]; i++) {
+        if (!selftest_may_exist(zone, empty_non_terminals[i]))
+            goto fail;
+    }
+    if (!selftest_may_exist(zone, "\3WwW\7Example\3COM"))
+        goto fail;
+
+    /* Random names should almost all be rejected */
+    for (i=0; i<10000; i++) {
+        char name[32];
+
+        sprintf(name, "\6r%05u\7example\3com", i);
+        false_positives += selftest_may_exist(zone, name);
+    }
+    if (false_positives > 10)
+        goto fail;
+
+    /* The wildcard walk still finds wildcards, but not where there are
+     * none */
+    if (selftest_wildcard(zone, "\1x\4wild\7example\3com") == NULL
+        || selftest_wildcard(zone, "\1x\5other\7example\3com") != NULL)
+        goto fail;
+
+    /* The SOA comes from the remembered apex */
+    if (zone_get_soa_rr(zone, &entry) != NULL || entry != zone_lookup_self(zone))
+        goto fail;
+
+    /* New records aren't in the filter, so it has to stop being used */
+    {
+        struct DB_XDomain xdomain[1];
+
+        xdomain_reverse2(xdomain, (const unsigned char *)"\3new\7example\3com", 17);
+        zone_create_record(zone, xdomain, TYPE_A, 60, 4, (const unsigned char *)"\x0a\0\0\2");
+        if (!selftest_may_exist(zone, "\3new\7example\3com"))
+            goto fail;
+        zone_build_index(zone, selftest_glue_lookup, 0);
+        if (!selftest_may_exist(zone, "\3new\7example\3com"))
+            goto fail;
+    }
+
+    /* Enough names that the filter has to kick fingerprints around and
+     * grow, since it's first sized by counting only the owner names */
+    for (i=0; i<20000; i++) {
+        sprintf(many[i], "\1x\5n%04u\7example\3com", i % 10000);
+        many[i][3] = (char)('a' + i/10000);
+        many_names[i] = many[i];
+    }
+    many_names[i] = 0;
+    zone_destroy(zone);
+    zone = selftest_filter_zone(many_names);
+    if (zone->negative.buckets == NULL)
+        goto fail;
+    for (i=0; i<20000; i++) {
+        if (!selftest_may_exist(zone, many[i]) || !selftest_may_exist(zone, many[i]+2))
+            goto fail;
+    }
+
+    zone_destroy(zone);
+    return 0;
+fail:
+    zone_destroy(zone);
+    return 1;
+}
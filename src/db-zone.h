@@ -5,6 +5,7 @@ extern "C" {
 #endif
 #include <stdint.h>
 #include "zonefile-rr.h"
+#include "db-entry.h"
 
 
 struct DBZone;
@@ -17,6 +18,49 @@ struct DBZone *zone_create_self(
     uint64_t filesize,
     const char *filename);
 
+/**
+ * Like zone_create_self(), but with the hash table sized from the exact
+ * number of owner names instead of guessed from the filesize.
+ */
+struct DBZone *zone_create_exact(
+    const struct DB_XDomain *xdomain,
+    uint64_t owner_count,
+    const char *filename);
+
+/**
+ * Free the zone, its entries and its filter.
+ */
+void zone_destroy(struct DBZone *zone);
+
+/**
+ * Compact a fully loaded zone, see the comments in db-zone.c.
+ */
+uint64_t zone_pack(struct DBZone *zone);
+
+/**
+ * Once all zones are loaded, index the RRset types of each entry and link
+ * NS/MX records to their glue. Call zone_reserve_index() on all zones
+ * before calling zone_build_index() on any.
+ */
+void zone_reserve_index(struct DBZone *zone);
+void zone_build_index(struct DBZone *zone, ENTRY_GLUE_LOOKUP lookup, void *userdata);
+
+/**
+ * Build the filter used by zone_name_may_exist(). This is called by
+ * zone_build_index(), and adding records afterwards disables the filter
+ * until it's built again.
+ */
+void zone_build_filter(struct DBZone *zone);
+
+/**
+ * Quickly test whether a name might be in the zone, either as an owner
+ * name or an empty non-terminal. If this returns 0, the name definitely
+ * isn't there, so there's no point doing zone_lookup_exact(). False
+ * positives are rare. The delegation and wildcard walks check each name
+ * they try against the same filter.
+ */
+int zone_name_may_exist(const struct DBZone *zone, const struct DB_XDomain *xdomain);
+
 void zone_create_record(
     struct DBZone *zone, 
     const struct DB_XDomain *xdomain, 
@@ -34,12 +78,20 @@ void zone_create_record2(struct DBZone *zone,
     );
 struct DBZone *zone_follow_chain(struct DBZone *zone, const struct DB_XDomain *xdomain, unsigned max_labels);
 const struct DBEntry *zone_lookup_exact(const struct DBZone *zone, const struct DB_XDomain *xdomain);
+
+/**
+ * Start fetching what zone_lookup_exact() will touch, in two steps: first
+ * the hash bucket, then (once the bucket has arrived) the first entry in
+ * the bucket
+ */
+void zone_prefetch_bucket(const struct DBZone *zone, const struct DB_XDomain *xdomain);
+void zone_prefetch_entry(const struct DBZone *zone, const struct DB_XDomain *xdomain);
 const struct DBEntry *zone_lookup_exact2(const struct DBZone *zone, const unsigned char *name, unsigned length);
 const struct DBEntry *zone_lookup_wildcard(const struct DBZone *zone, const struct DB_XDomain *xdomain);
 const struct DBEntry *zone_lookup_delegation(const struct DBZone *zone, const struct DB_XDomain *xdomain);
 const struct DBEntry *zone_lookup_delegation2(const struct DBZone *zone, struct DomainPointer domain);
 
-const struct DBrrset *zone_get_soa_rr(const struct DBZone *zone);
+const struct DBrrset *zone_get_soa_rr(const struct DBZone *zone, const struct DBEntry **p_record);
 void zone_name_from_record(const struct DBZone *zone, const struct DBEntry *record, struct DomainPointer *name, struct DomainPointer *origin);
 void zone_name(const struct DBZone *zone, struct DomainPointer *origin);
 uint64_t zone_hash(const struct DBZone *zone);
@@ -48,6 +100,8 @@ void zone_insert_self(struct DBZone *zone, volatile struct DBZone **next);
 
 const struct DBEntry *zone_entry_by_index(const struct DBZone *zone, unsigned i);
 
+int zone_selftest(void);
+
 
 #ifdef __cplusplus
 }
@@ -57,6 +57,25 @@ catalog_create_zone(
     const char *filename
     );
 
+/**
+ * Like catalog_create_zone(), but when we know exactly how many owner
+ * names the zone will have, from a counting pass over the zonefile. If
+ * the zone already exists, the existing zone is returned unchanged.
+ */
+struct DBZone *
+catalog_create_zone_exact(
+    struct Catalog *catalog,
+    const struct DB_XDomain *xdomain,
+    uint64_t owner_count,
+    const char *filename
+    );
+
+/**
+ * Once all zones are loaded, index the RRset types of every entry and
+ * precompute the glue for NS/MX records.
+ */
+void catalog_build_index(struct Catalog *catalog);
+
 /* called with an SOA record to create a zone */    
 const struct DBZone *
 catalog_create_zone2(struct Catalog *db, 
@@ -71,6 +90,12 @@ catalog_lookup_zone(
     const struct Catalog *db,
     const struct DB_XDomain *xdomain
     );
+/* start fetching the hash buckets catalog_lookup_zone() will look at */
+void
+catalog_prefetch_zone(
+    const struct Catalog *db,
+    const struct DB_XDomain *xdomain
+    );
 struct DBZone *
 catalog_lookup_zone2(
     struct Catalog *db,
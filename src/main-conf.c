@@ -7,6 +7,7 @@
 #include "util-ipaddr.h"
 #include "zonefile-parse.h"
 #include "zonefile-load.h"
+#include "zonefile-stream.h"
 #include "success-failure.h"
 #include "pixie.h"
 #include "pixie-nic.h"
@@ -14,6 +15,7 @@
 #include "pixie-threads.h"
 #include "util-realloc2.h"
 #include <ctype.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <stdint.h>
 #include <sys/stat.h>
@@ -81,19 +83,209 @@ combine_filename(const char *dirname, const char *filename)
 
 
 
+/****************************************************************************
+ * A single zonefile that needs to be parsed. We build a flat list of these
+ * from both the individual "zone" statements and the "zonedir" directory
+ * scans, so that the parser threads don't need to know where a file
+ * came from.
+ ****************************************************************************/
+struct XParseWork {
+    const char *filename;
+    uint64_t filesize;
+};
+
+/****************************************************************************
+ * The shared work-queue. The list is sorted largest file first. Parser
+ * threads grab the next unclaimed file with an atomic increment, so that
+ * a thread that finishes early "steals" work that would otherwise have
+ * waited behind a huge file. Putting the largest files first means that
+ * the biggest file starts immediately, and the small files fill in the
+ * gaps at the end.
+ ****************************************************************************/
+struct XParseQueue {
+    struct XParseWork *list;
+    unsigned count;
+    volatile unsigned next;
+};
+
 /****************************************************************************
  ****************************************************************************/
 struct XParseThread {
     struct Catalog *db_load;
-    size_t start_index;
-    size_t end_index;
+    struct XParseQueue *queue;
+    unsigned index;
     enum SuccessFailure status;
     size_t thread_handle;
     uint64_t total_bytes;
     uint64_t total_files;
+    uint64_t start_time;
+    uint64_t stop_time;
     struct Configuration *cfg;
 };
 
+/****************************************************************************
+ * Sort function, for putting the largest files at the front of the list
+ ****************************************************************************/
+static int
+xparse_compare_size(const void *lhs, const void *rhs)
+{
+    const struct XParseWork *left = (const struct XParseWork *)lhs;
+    const struct XParseWork *right = (const struct XParseWork *)rhs;
+
+    if (left->filesize > right->filesize)
+        return -1;
+    else if (left->filesize < right->filesize)
+        return 1;
+    else
+        return strcmp(left->filename, right->filename);
+}
+
+/****************************************************************************
+ * Build the sorted list of all zonefiles that need to be parsed.
+ ****************************************************************************/
+static void
+xparse_queue_init(struct XParseQueue *queue, struct Configuration *cfg)
+{
+    size_t i;
+    size_t j;
+    unsigned count = 0;
+
+    queue->list = REALLOC2(0, cfg->zones_length + cfg->zonedirs_filecount + 1, sizeof(queue->list[0]));
+
+    for (i=0; i<cfg->zonedirs_length; i++) {
+        const struct Cfg_ZoneDir *zonedir = cfg->zonedirs[i];
+        for (j=0; j<zonedir->file_count; j++) {
+            queue->list[count].filename = zonedir->files[j].filename;
+            queue->list[count].filesize = zonedir->files[j].size;
+            count++;
+        }
+    }
+    for (i=0; i<cfg->zones_length; i++) {
+        struct Cfg_Zone *zone = cfg->zones[i];
+
+        /* Zones named on the command-line or in "zone" statements
+         * don't have their size filled in yet, so get it now, since
+         * it's needed both for sorting and for sizing the zone's
+         * hash table */
+        if (zone->file_size == 0) {
+            struct stat s;
+            if (stat(zone->file, &s) == 0) {
+                zone->file_size = s.st_size;
+                zone->file_timestamp = s.st_mtime;
+            }
+        }
+
+        queue->list[count].filename = zone->file;
+        queue->list[count].filesize = zone->file_size;
+        count++;
+    }
+
+    qsort(queue->list, count, sizeof(queue->list[0]), xparse_compare_size);
+
+    queue->count = count;
+    queue->next = 0;
+}
+
+/****************************************************************************
+ * Grab the next file from the shared queue.
+ * @return the next file to parse, or NULL if there's no more work.
+ ****************************************************************************/
+static const struct XParseWork *
+xparse_queue_next(struct XParseQueue *queue)
+{
+    unsigned index;
+
+    /* Claim the next index with a compare-and-swap, retrying if another
+     * thread got there first */
+    for (;;) {
+        index = queue->next;
+        if (index >= queue->count)
+            return 0;
+        if (pixie_locked_CAS32(&queue->next, index + 1, index))
+            return &queue->list[index];
+    }
+}
+
+/****************************************************************************
+ * Decide how many parser threads to run. The parser threads are
+ * heavy-weight (each one has its own pool of parse-blocks and its own
+ * insertion threads), so we don't want many of them. They mostly help in
+ * overlapping file I/O with parsing, so we use half the cores, but never
+ * more threads than files.
+ ****************************************************************************/
+static unsigned
+xparse_thread_count(const struct Configuration *cfg, unsigned file_count)
+{
+    unsigned count;
+
+    if (cfg->loader.parse_threads)
+        count = cfg->loader.parse_threads;
+    else {
+        count = pixie_cpu_get_count() / 2;
+        if (count > 8)
+            count = 8;
+    }
+
+    if (count > file_count)
+        count = file_count;
+    if (count == 0)
+        count = 1;
+    return count;
+}
+
+/****************************************************************************
+ * Feed the contents of the file into the parser. The file is read (and
+ * decompressed, if it's a .gz or .zst file) on another thread.
+ ****************************************************************************/
+static enum SuccessFailure
+xparse_file(struct ZoneFileParser *parser, struct ZoneStream *stream)
+{
+    for (;;) {
+        const unsigned char *buf;
+        size_t length;
+
+        buf = zonestream_next(stream, &length);
+        if (buf == NULL)
+            break;
+
+        zonefile_parse(
+            parser,
+            buf,
+            length
+            );
+    }
+
+    return zonestream_close(stream);
+}
+
+/****************************************************************************
+ * The first pass of an exact-size load: count the owner names in each
+ * zone in the file, then create the zones with hash tables of exactly
+ * the right size. Counting is done in this thread, without insertion
+ * threads, since it just updates a small table.
+ ****************************************************************************/
+static struct ZoneCounter *
+xparse_count_file(struct Catalog *db, const char *filename)
+{
+    static const struct DomainPointer root = {(const unsigned char*)"\0",1};
+    struct ZoneCounter *counter;
+    struct ZoneFileParser *parser;
+    struct ZoneStream *stream;
+
+    stream = zonestream_open(filename);
+    if (stream == NULL)
+        return 0;
+
+    counter = zonecount_create(db);
+    parser = zonefile_begin(root, 60, zonestream_size_hint(stream), filename, zonefile_count, counter, 0);
+    xparse_file(parser, stream);
+    zonefile_end(parser);
+
+    zonecount_create_zones(counter, filename);
+
+    return counter;
+}
+
 /****************************************************************************
  ****************************************************************************/
 static void
@@ -104,13 +296,13 @@ conf_zonefiles_parse_thread(void *v)
     struct Configuration *cfg = p->cfg;
     struct ZoneFileParser *parser;
     static const struct DomainPointer root = {(const unsigned char*)"\0",1};
-    size_t directory_index;
-    size_t file_index;
-    size_t current_index;
+    const struct XParseWork *work;
 
     fflush(stderr);
     fflush(stdout);
 
+    p->start_time = pixie_gettime();
+    p->status = Success;
 
     /*
      * Start the parsing
@@ -121,63 +313,34 @@ conf_zonefiles_parse_thread(void *v)
                 cfg->options.directory,
                 zonefile_load, 
                 db,
-                cfg->insertion_threads
+                cfg->loader.load_threads
                 );
 
     /*
-     * Find the starting point. This converts the single
-     * integer number into a [directory, file] index pair.
+     * 'for all zonefiles in the queue...'
      */
-    current_index = 0;
-    for (directory_index = 0; directory_index < cfg->zonedirs_length; directory_index++) {
-        struct Cfg_ZoneDir *zonedir = cfg->zonedirs[directory_index];
-        current_index += zonedir->file_count;
-        if (current_index >= p->start_index)
-            break;
-    }
-    file_index = current_index - p->start_index;
-
-
-    
-    /*
-     * 'for all zonefiles in this directory...'
-     */
-    if (directory_index < cfg->zonedirs_length)
-    while (current_index < p->end_index) {
-        const char *filename;
-        FILE *fp;
-        int err;
-        uint64_t filesize;
-        struct Cfg_ZoneDir *zonedir;
-        
-        /* If we've gone past the end of this directory,
-         * then start parsing the next directory */
-        zonedir = cfg->zonedirs[directory_index];
-        if (file_index >= zonedir->file_count) {
-            file_index = 0;
-            directory_index++;
-            if (directory_index >= cfg->zonedirs_length)
-                break;
-            zonedir = cfg->zonedirs[directory_index];
-        }
+    while ((work = xparse_queue_next(p->queue)) != NULL) {
+        const char *filename = work->filename;
+        struct ZoneCounter *counter = 0;
+        struct ZoneStream *stream;
 
-        filename = zonedir->files[file_index].filename;
-        filesize = zonedir->files[file_index].size;
-        current_index++;
-        file_index++;
+        if (cfg->loader.is_exact_size)
+            counter = xparse_count_file(db, filename);
 
         /*
          * Open the file
          */
         fflush(stdout);
         fflush(stderr);
-        err = fopen_s(&fp, filename, "rb");
-        if (err || fp == NULL) {
-            perror(filename);
+        stream = zonestream_open(filename);
+        if (stream == NULL) {
             p->status = Failure;
-            return;
+            if (counter)
+                zonecount_destroy(counter);
+            continue;
         }
-        p->total_bytes += filesize;
+        p->total_bytes += work->filesize;
+        p->total_files++;
 
         /*
          * Set parameters
@@ -186,100 +349,33 @@ conf_zonefiles_parse_thread(void *v)
             parser,
             root,   /* . domain origin */
             60,     /* one minute ttl */
-            filesize, 
+            zonestream_size_hint(stream),
             filename);
 
         /*
-         * Continue parsing the file until end, reporting progress as we
-         * go along
-         */
-        for (;;) {
-            unsigned char buf[65536];
-            size_t bytes_read;
-
-            bytes_read = fread((char*)buf, 1, sizeof(buf), fp);
-            if (bytes_read == 0)
-                break;
-
-            zonefile_parse(
-                parser,
-                buf,
-                bytes_read
-                );
-
-        }
-        fclose(fp);
-    }
-
-    /* We are done parsing the directories. Now let's parse
-     * the individual zonefiles */
-    while (current_index < p->end_index) {
-        const char *filename;
-        FILE *fp;
-        int err;
-        uint64_t filesize;
-        struct Cfg_Zone *zone;
-        
-        if (file_index >= cfg->zones_length)
-            break;
-        zone = cfg->zones[file_index];
-
-        filename = zone->file;
-        filesize = zone->file_size;
-        current_index++;
-        file_index++;
-
-        /*
-         * Open the file
+         * Continue parsing the file until end
          */
-        fflush(stdout);
-        fflush(stderr);
-        err = fopen_s(&fp, filename, "rb");
-        if (err || fp == NULL) {
-            perror(filename);
+        if (xparse_file(parser, stream) != Success)
             p->status = Failure;
-            return;
-        }
-        p->total_bytes += filesize;
-
-        /*
-         * Set parameters
-         */
-        zonefile_begin_again(
-            parser,
-            root,   /* . domain origin */
-            60,     /* one minute ttl */
-            filesize, 
-            filename);
 
         /*
-         * Continue parsing the file until end, reporting progress as we
-         * go along
+         * With exact-sizing, the zones in this file are now complete, so
+         * wait for the insertion threads to finish with them, then pack
+         * them
          */
-        for (;;) {
-            unsigned char buf[65536];
-            size_t bytes_read;
-
-            bytes_read = fread((char*)buf, 1, sizeof(buf), fp);
-            if (bytes_read == 0)
-                break;
-
-            zonefile_parse(
-                parser,
-                buf,
-                bytes_read
-                );
-
+        if (counter) {
+            zonefile_flush(parser);
+            zonecount_pack_zones(counter);
+            zonecount_destroy(counter);
         }
-        fclose(fp);
     }
 
-    if (zonefile_end(parser) == Success) {
-        p->status = Success;
-    } else {
+    if (zonefile_end(parser) != Success) {
         fprintf(stderr, "%s: failure\n", "");
         p->status = Failure;
     }
+
+    p->stop_time = pixie_gettime();
 }
 
 /****************************************************************************
@@ -290,86 +386,81 @@ conf_zonefiles_parse(   struct Catalog *db_load,
                         uint64_t *out_total_files,
                         uint64_t *out_total_bytes)
 {
-    struct XParseThread p[16];
+    struct XParseQueue queue[1];
+    struct XParseThread *p;
     size_t exit_code;
-    size_t parse_thread_count = 4;
-    size_t i;
-    size_t start_index;
+    unsigned parse_thread_count;
+    unsigned i;
     enum SuccessFailure status = Success;
-    size_t in_total_files;
-
-    //LOG(2, "loading %llu zonefiles\n", conf->zonefiles.total_files);
 
     /*
      * Make sure we have some zonefiles to parse
      */
-    in_total_files = cfg->zones_length + cfg->zonedirs_filecount;
-    if (in_total_files == 0)
+    if (cfg->zones_length + cfg->zonedirs_filecount == 0)
         return Failure; /* none found */
 
-    /* The parser threads are heavy-weight, so therefore
-     * we shouldn't have a lot of them unless we have
-     * a lot of files to parse */
-    if (in_total_files < 10)
-        parse_thread_count = 1;
-    else if (in_total_files < 5000)
-        parse_thread_count = 2;
-    else
-        parse_thread_count = 4;
-    
+    /*
+     * Build the work queue, sorted largest file first
+     */
+    xparse_queue_init(queue, cfg);
+    zonestream_init();
+    parse_thread_count = xparse_thread_count(cfg, queue->count);
 
     /*
-     * Divide the list of names into equal sized chunks,
-     * and launch a parsing thread for each one. The primary 
-     * optimization that's happening here is that that each
-     * of the threads will stall waiting for file I/O, during
-     * which time other threads can be active. Each individual
-     * file can be parsed with only a single thread, of course,
-     * because zonefiles are stateful. However, two unrelated
-     * files can be parsed at the same time.
+     * Launch the parsing threads. The primary optimization that's
+     * happening here is that that each of the threads will stall waiting
+     * for file I/O, during which time other threads can be active. Each
+     * individual file can be parsed with only a single thread, of course,
+     * because zonefiles are stateful. However, two unrelated files can be
+     * parsed at the same time.
      */
-    start_index = 0;
+    p = REALLOC2(0, parse_thread_count, sizeof(p[0]));
+    memset(p, 0, parse_thread_count * sizeof(p[0]));
     for (i=0; i<parse_thread_count; i++) {
-        size_t end_index;
-
-        if (start_index >= in_total_files) {
-            parse_thread_count = i;
-            break;
-        }
-
-        /*
-         * Figure out the index
-         */
-        end_index = start_index + in_total_files/parse_thread_count;
-
         p[i].db_load = db_load;
-        p[i].start_index = start_index;
-        p[i].end_index = end_index;
+        p[i].queue = queue;
+        p[i].index = i;
         p[i].cfg = cfg;
-        p[i].total_bytes = 0;
-        p[i].total_files = 0;
 
         if (parse_thread_count > 1) {
             p[i].thread_handle = pixie_begin_thread(conf_zonefiles_parse_thread, 0, &p[i]);
         } else {
             p[i].thread_handle = 0;
-            conf_zonefiles_parse_thread(p);
+            conf_zonefiles_parse_thread(&p[i]);
         }
-
-        start_index = end_index;
     }
 
     /*
      * Wait for them all to end, and collect statistics.
      */
     for (i=0; i<parse_thread_count; i++) {
-        pixie_join(p[i].thread_handle, &exit_code);
+        uint64_t elapsed;
+
+        if (p[i].thread_handle)
+            pixie_join(p[i].thread_handle, &exit_code);
         *out_total_bytes += p[i].total_bytes;
-        *out_total_files = p[i].total_files;
+        *out_total_files += p[i].total_files;
         if (p[i].status != Success)
             status = Failure;
+
+        elapsed = p[i].stop_time - p[i].start_time;
+        LOG_INFO(C_CONFIG, "parse-thread[%u]: %" PRIu64 " files, %" PRIu64 " bytes, %u.%02u seconds\n",
+            i,
+            p[i].total_files,
+            p[i].total_bytes,
+            (unsigned)(elapsed/1000000),
+            (unsigned)((elapsed/10000)%100));
     }
 
+    free(p);
+    free(queue->list);
+
+    /*
+     * Now that all the zones are loaded, index the entries and
+     * precompute the glue for referrals and the additional section
+     */
+    catalog_build_index(db_load);
+
     return status;
 }
 
@@ -468,6 +559,26 @@ parseInt(const char *str)
     return result;
 }
 
+/***************************************************************************
+ ***************************************************************************/
+static unsigned
+parseBoolean(const char *str)
+{
+    if (str == NULL || str[0] == '\0')
+        return 1; /* "--exact-size" on its own turns it on */
+    if (isdigit(str[0] & 0xFF))
+        return parseInt(str) != 0;
+    switch (tolower(str[0] & 0xFF)) {
+    case 't': /* true */
+    case 'y': /* yes */
+        return 1;
+    case 'o': /* on/off */
+        return tolower(str[1] & 0xFF) == 'n';
+    default:
+        return 0;
+    }
+}
+
 /***************************************************************************
  * Parses the number of seconds (for rotating files mostly). We do a little
  * more than just parse an integer. We support strings like:
@@ -590,7 +701,9 @@ conf_set_parameter(struct Configuration *cfg, const char *name, const char *valu
     } else if (EQUALS("load-threads", name) || EQUALS("load-thread", name)) {
         cfg->loader.load_threads = (unsigned)parseInt(value);
     } else if (EQUALS("parse-threads", name) || EQUALS("parse-thread", name)) {
-        cfg->loader.load_threads = (unsigned)parseInt(value);
+        cfg->loader.parse_threads = (unsigned)parseInt(value);
+    } else if (EQUALS("exact-size", name) || EQUALS("load-exact-size", name)) {
+        cfg->loader.is_exact_size = parseBoolean(value);
     } else {
         fprintf(stderr, "CONF: unknown config option: %s=%s\n", name, value);
     }
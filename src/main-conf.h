@@ -5,6 +5,7 @@
 #include "configuration-adapter.h"
 
 struct Configuration;
+struct TcpWorker;
 
 struct CoreSocketSet
 {
@@ -62,7 +63,10 @@ struct CoreWorkerThread
      * Set by the config-thread telling this worker-thread that it's
      * time to cleanup and exit */
     volatile unsigned should_end;
-    
+
+    /** Connections to the TCP listeners that this thread is handling,
+     * or NULL if we don't do TCP on this platform */
+    struct TcpWorker *tcp;
 };
 
 struct Core
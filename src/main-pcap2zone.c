@@ -70,6 +70,7 @@ grab_dns_response(struct Catalog *catalog, const unsigned char *px, unsigned off
     char unsigned tmp_buffer[65536];
     unsigned tmp_offset;
     unsigned src_offset;
+    unsigned next_offset;
 
     /* kludge */
     px += offset;
@@ -85,14 +86,18 @@ grab_dns_response(struct Catalog *catalog, const unsigned char *px, unsigned off
     if (!dns->qr)
         return Failure;
 
-    for (i=dns->qdcount; i<dns->rr_count; i++) {
+    next_offset = dns->answer_offset;
+    for (i=0; i<dns->ancount + dns->nscount + dns->arcount; i++) {
         int type;
         int xclass;
         unsigned ttl;
         unsigned rdlength;
         const unsigned char *rdata;
 
-        offset = dns->rr_offset[i];
+        offset = next_offset;
+        next_offset = dns_rr_skip(px, offset, max);
+        if (next_offset > max)
+            break;
 
         /* extract the domain name */
         dns_extract_name(px, offset, max, &domain);
@@ -0,0 +1,230 @@
+#include "main-server-control.h"
+#include "logger.h"
+#include "pixie-sockets.h"
+#include "pixie-timer.h"
+#include "proto-dns-stats.h"
+#include "string_s.h"
+#include "util-blocklist.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32)
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <unistd.h>
+#endif
+
+static SOCKET control_fd = -1;
+static unsigned control_port;
+static SOCKET statistics_fd = -1;
+static unsigned statistics_port;
+
+/****************************************************************************
+ * Open a socket of this type on the loopback address, so that it's only
+ * reachable from this machine.
+ ****************************************************************************/
+static SOCKET
+control_listen(int type, unsigned port, const char *name)
+{
+    struct sockaddr_in sin;
+    SOCKET fd;
+
+    fd = socket(AF_INET, type, 0);
+    if (fd == -1) {
+        LOG_ERR(C_NETWORK, "%s: couldn't create socket() %u\n", name, WSAGetLastError());
+        return -1;
+    }
+
+    if (type == SOCK_STREAM) {
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&yes, sizeof(yes));
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0x7f000001);
+    sin.sin_port = htons((unsigned short)port);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+        LOG_ERR(C_NETWORK, "%s: couldn't bind to 127.0.0.1:%u %u\n", name, port, WSAGetLastError());
+        closesocket(fd);
+        return -1;
+    }
+    if (type == SOCK_STREAM && listen(fd, 8) != 0) {
+        LOG_ERR(C_NETWORK, "%s: couldn't listen() %u\n", name, WSAGetLastError());
+        closesocket(fd);
+        return -1;
+    }
+
+    LOG_INFO(C_NETWORK, "%s: listening on 127.0.0.1:%u\n", name, port);
+    return fd;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+control_set_config(unsigned port, unsigned stats_port)
+{
+    if (port != control_port) {
+        if (control_fd != -1) {
+            closesocket(control_fd);
+            control_fd = -1;
+        }
+        control_port = 0;
+        if (port) {
+            control_fd = control_listen(SOCK_DGRAM, port, "control");
+            if (control_fd != -1)
+                control_port = port;
+        }
+    }
+
+    if (stats_port != statistics_port) {
+        if (statistics_fd != -1) {
+            closesocket(statistics_fd);
+            statistics_fd = -1;
+        }
+        statistics_port = 0;
+        if (stats_port) {
+            statistics_fd = control_listen(SOCK_STREAM, stats_port, "statistics");
+            if (statistics_fd != -1)
+                statistics_port = stats_port;
+        }
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+control_command(void)
+{
+    struct sockaddr_storage sa;
+    socklen_t sizeof_sa = sizeof(sa);
+    char buf[4096];
+    char reply[256];
+    int length;
+
+    length = recvfrom(control_fd, buf, sizeof(buf), 0, (struct sockaddr *)&sa, &sizeof_sa);
+    if (length <= 0)
+        return;
+
+    if (blocklist_update(buf, length, reply, sizeof(reply)) == 0)
+        LOG_INFO(C_SECURITY, "control: blocklist changed, %s", reply);
+    else
+        LOG_ERR(C_SECURITY, "control: %s", reply);
+
+    sendto(control_fd, reply, (int)strlen(reply), 0, (struct sockaddr *)&sa, sizeof_sa);
+}
+
+/****************************************************************************
+ * Answer one HTTP request on the statistics port, then hang up. This runs
+ * on the main thread, so a client that connects and then says nothing, or
+ * doesn't read what we send, only gets a second before we give up on it.
+ ****************************************************************************/
+static void
+control_statistics(void)
+{
+    struct sockaddr_storage sa;
+    socklen_t sizeof_sa = sizeof(sa);
+    SOCKET fd;
+    fd_set readfds;
+    struct timeval ts;
+    char request[1024];
+    char header[256];
+    char *body = NULL;
+    size_t body_length = 0;
+    int length;
+
+    fd = accept(statistics_fd, (struct sockaddr *)&sa, &sizeof_sa);
+    if (fd == -1)
+        return;
+
+#if defined(WIN32)
+    {
+        DWORD timeout = 1000;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+    }
+#else
+    ts.tv_sec = 1;
+    ts.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&ts, sizeof(ts));
+#endif
+
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    ts.tv_sec = 1;
+    ts.tv_usec = 0;
+    if (select((int)fd + 1, &readfds, 0, 0, &ts) <= 0)
+        goto end;
+    length = recv(fd, request, sizeof(request) - 1, 0);
+    if (length <= 0)
+        goto end;
+    request[length] = '\0';
+
+    /* just the request line matters; anything but a GET of the metrics
+     * gets a 404 */
+    if (strncmp(request, "GET /metrics ", 13) == 0
+        || strncmp(request, "GET / ", 6) == 0) {
+        body = stats_format_prometheus(&body_length);
+        sprintf_s(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %u\r\n"
+                "Connection: close\r\n"
+                "\r\n",
+                (unsigned)body_length);
+    } else {
+        sprintf_s(header, sizeof(header),
+                "HTTP/1.0 404 Not Found\r\n"
+                "Content-Length: 0\r\n"
+                "Connection: close\r\n"
+                "\r\n");
+    }
+
+    if (send(fd, header, (int)strlen(header), 0) > 0 && body) {
+        size_t offset = 0;
+        while (offset < body_length) {
+            length = send(fd, body + offset, (int)(body_length - offset), 0);
+            if (length <= 0)
+                break;
+            offset += length;
+        }
+    }
+
+end:
+    free(body);
+    closesocket(fd);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+control_wait(unsigned milliseconds)
+{
+    fd_set readfds;
+    struct timeval ts;
+    SOCKET nfds = 0;
+
+    if (control_fd == -1 && statistics_fd == -1) {
+        pixie_mssleep(milliseconds);
+        return;
+    }
+
+    FD_ZERO(&readfds);
+    if (control_fd != -1) {
+        FD_SET(control_fd, &readfds);
+        nfds = control_fd;
+    }
+    if (statistics_fd != -1) {
+        FD_SET(statistics_fd, &readfds);
+        if (statistics_fd > nfds)
+            nfds = statistics_fd;
+    }
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_usec = (milliseconds % 1000) * 1000;
+    if (select((int)nfds + 1, &readfds, 0, 0, &ts) <= 0)
+        return;
+
+    if (control_fd != -1 && FD_ISSET(control_fd, &readfds))
+        control_command();
+    if (statistics_fd != -1 && FD_ISSET(statistics_fd, &readfds))
+        control_statistics();
+}
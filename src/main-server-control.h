@@ -0,0 +1,33 @@
+#ifndef MAIN_SERVER_CONTROL_H
+#define MAIN_SERVER_CONTROL_H
+
+/*
+    The control and statistics ports
+
+    A UDP port on the loopback address ("control-port") for changing
+    things while we're running, without reloading the configuration.
+    Each datagram holds commands, one per line, and gets back a datagram
+    saying whether they worked. For now these are the blocklist commands,
+    see util-blocklist.h, such as:
+
+        echo "block 192.0.2.0/24" | nc -u -w1 127.0.0.1 <port>
+
+    And a TCP port on the loopback address ("statistics-port") where
+    an HTTP GET of /metrics returns the statistics in Prometheus text
+    format, see proto-dns-stats.h. Both are handled by the main thread,
+    between checks for configuration changes.
+*/
+
+/**
+ * Listen on these ports, closing the old ones if they're different. 0
+ * closes them.
+ */
+void control_set_config(unsigned control_port, unsigned statistics_port);
+
+/**
+ * Wait up to this long for commands or requests for statistics, and
+ * answer them. Without either port, this just sleeps.
+ */
+void control_wait(unsigned milliseconds);
+
+#endif
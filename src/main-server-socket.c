@@ -118,7 +118,7 @@ sockets_thread(struct Core *core)
         struct DNS_Incoming request[1];
         struct DNS_OutgoingResponse response[1];
         struct Packet pkt;
-        unsigned char buf2[2048];
+        unsigned char buf2[4096];
         
         /*
          * 1. receive 'packet'
@@ -163,7 +163,7 @@ sockets_thread(struct Core *core)
         /*
          * 5. Transmit the 'packet'
          */
-        if (pkt.offset < pkt.max) {
+        if (pkt.offset <= pkt.max) {
             sendto(fd, 
                    (char*)pkt.buf, pkt.offset, 0,
                    (struct sockaddr*)&sin,
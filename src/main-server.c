@@ -10,16 +10,28 @@
 #include "conf-zone.h"
 #include "logger.h"
 #include "main-server-socket.h"
+#include "main-server-control.h"
 #include "main-thread.h"
 #include "pixie.h"
 #include "pixie-nic.h"
 #include "pixie-threads.h"
 #include "pixie-timer.h"
 #include "pixie-sockets.h"
+#include "proto-dns-cookie.h"
+#include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-rrl.h"
+#include "proto-dns-sockfilter.h"
+#include "proto-dns-timing.h"
 #include "rawsock-pfring.h"
+#include "resolver.h"
 #include "string_s.h"
 #include "success-failure.h"
+#include "thread-worker-tcp.h"
 #include "unusedparm.h"
+#include "util-acl.h"
+#include "util-blocklist.h"
 #include "util-ipaddr.h"        /* format IPv6 address */
 #include "util-realloc2.h"
 #include "zonefile-load.h"
@@ -614,6 +626,8 @@ sockitem_open(struct CoreSocketItem *adapt)
 {
     int fd;
     int err;
+    int is_tcp = (adapt->proto == IPPROTO_TCP);
+    const char *proto_name = is_tcp ? "tcp" : "udp";
 
     /*
      * Create a socket descriptor
@@ -622,10 +636,10 @@ sockitem_open(struct CoreSocketItem *adapt)
     case ST_Any:
     case ST_IPv6:
         /* By specifying IPv6, we allow both IPv4 and IPv6 on the same socket */
-        fd = socket(AF_INET6, SOCK_DGRAM, 0);
+        fd = socket(AF_INET6, is_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
         break;
     case ST_IPv4:
-        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        fd = socket(AF_INET, is_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
         break;
     default:
         LOG_ERR(C_NETWORK, "impossible\n");
@@ -726,19 +740,37 @@ sockitem_open(struct CoreSocketItem *adapt)
         return -1;
     }
 
+    /*
+     * For UDP, have the kernel drop junk before it gets to us, see
+     * proto-dns-sockfilter.c
+     */
+    if (!is_tcp && sockfilter_attach(fd) != 0)
+        LOG_DBG(C_NETWORK, 1, "setsockopt(SO_ATTACH_FILTER) %u\n", WSAGetLastError());
+
+    /*
+     * For TCP, the worker threads accept the connections, see
+     * thread-worker-tcp.c
+     */
+    if (is_tcp && listen(fd, 1024) != 0) {
+        LOG_ERR(C_NETWORK, "FAIL: couldn't listen on port %u: %u\n", adapt->port,
+            WSAGetLastError());
+        closesocket(fd);
+        return -1;
+    }
+
 
     /*
      * Now log a success message
      */
     switch (adapt->type) {
     case ST_Any:
-        LOG_INFO(C_NETWORK, "Listening on any udp/%u\n", adapt->port);
+        LOG_INFO(C_NETWORK, "Listening on any %s/%u\n", proto_name, adapt->port);
         break;
     case ST_IPv4:
-        LOG_INFO(C_NETWORK, "Listening on %u.%u.%u.%u udp/%u\n", 
+        LOG_INFO(C_NETWORK, "Listening on %u.%u.%u.%u %s/%u\n", 
             (adapt->ip.v4>>24)&0xFF, (adapt->ip.v4>>15)&0xFF, 
             (adapt->ip.v4>> 8)&0xFF, (adapt->ip.v4>> 0)&0xFF, 
-            adapt->port);
+            proto_name, adapt->port);
         break;
     case ST_IPv6:
         {
@@ -746,8 +778,9 @@ sockitem_open(struct CoreSocketItem *adapt)
             
             format_ipv6_address(text, sizeof(text), adapt->ip.v6);
 
-            LOG_INFO(C_NETWORK, "Listening on [%s] udp/%u\n",
+            LOG_INFO(C_NETWORK, "Listening on [%s] %s/%u\n",
                 text,
+                proto_name,
                 adapt->port);
         }
         break;
@@ -826,6 +859,18 @@ void change_network_adapters(struct Core *core, struct Configuration *cfg_load,
                             adapt_c->port,
                             adapt_c->ifname);
 
+        /* and a TCP listener on the same address, so that clients can
+         * retry truncated responses */
+        if (tcpworker_is_supported() && adapt_c->type != ST_Raw
+            && !core_adapter_lookup(socket_load, adapt_c->type, &adapt_c->ip,
+                                    IPPROTO_TCP, adapt_c->port, adapt_c->ifname)) {
+            core_adapter_add(socket_load,
+                            adapt_c->type,
+                            &adapt_c->ip,
+                            IPPROTO_TCP,
+                            adapt_c->port,
+                            adapt_c->ifname);
+        }
     }
 
     /*
@@ -847,6 +892,10 @@ void change_network_adapters(struct Core *core, struct Configuration *cfg_load,
          * copy the value here */
         if (adapt_r && adapt_r->fd) {
             adapt_l->fd = adapt_r->fd;
+
+            /* but it gets the filter for the new configuration */
+            if (adapt_l->proto != IPPROTO_TCP)
+                sockfilter_attach(adapt_l->fd);
             continue;
         }
         
@@ -1045,6 +1094,67 @@ int server(int argc, char *argv[])
              */
             change_resolver_threads(core, cfg_load);
 
+            /*
+             * The largest UDP response to EDNS0 clients. This is just a
+             * number the worker threads read, so it can change while
+             * they are running.
+             */
+            dns_format_set_max_udp_size(cfg_load->data_plane.max_udp_size);
+            resolver_set_any_policy(cfg_load->data_plane.minimal_any);
+
+            /*
+             * Address-match lists enforced on every query. They're compiled
+             * here, so workers only do a trie lookup per packet.
+             */
+            acl_set_config(cfg_load->data_plane.blackhole, cfg_load->data_plane.allow_query);
+            sockfilter_set_config(cfg_load->data_plane.blackhole);
+
+            /*
+             * Names under attack. Changing these doesn't reload any zones.
+             */
+            qnamefilter_set_config(cfg_load->data_plane.qname_filter,
+                                   cfg_load->data_plane.qname_filter_count);
+
+            /*
+             * New cookie secrets take effect right away, and the old ones
+             * are still accepted for as long as they are listed
+             */
+            cookie_set_config(cfg_load->data_plane.is_answer_cookie,
+                              (const unsigned char *)cfg_load->data_plane.cookie_secrets,
+                              cfg_load->data_plane.cookie_secret_count);
+
+            /*
+             * Response rate limiting. Likewise, each worker's table of
+             * buckets is left alone, and just uses the new limits.
+             */
+            rrl_set_config(&cfg_load->data_plane.rate_limit);
+            if (cfg_load->data_plane.rate_limit.responses_per_second) {
+                LOG_INFO(C_RATE_LIMIT, "rate-limit: %u responses/second, window %u, slip %u%s\n",
+                    cfg_load->data_plane.rate_limit.responses_per_second,
+                    cfg_load->data_plane.rate_limit.window,
+                    cfg_load->data_plane.rate_limit.slip,
+                    cfg_load->data_plane.rate_limit.is_log_only ? " (log only)" : "");
+            }
+
+            /*
+             * Overload shedding. Each core notices on its own whether
+             * it's over the new threshold the next time it looks
+             */
+            overload_set_config(cfg_load->data_plane.overload_threshold);
+
+            /*
+             * Stage timing, which each thread picks up at its next query
+             */
+            timing_set_config(cfg_load->data_plane.stage_timing);
+
+            /*
+             * The blocklist is read again from its file, which replaces
+             * any changes made from the control port since
+             */
+            blocklist_set_config(cfg_load->data_plane.blocklist_file);
+            control_set_config(cfg_load->options.control_port,
+                               cfg_load->options.statistics_port);
+
             /*
              * Change the network adapter configuration. It's at this stage that
              * we'll open/close sockets.
@@ -1117,7 +1227,7 @@ int server(int argc, char *argv[])
         }
 
         for (;;) {
-            pixie_sleep(100);
+            control_wait(100);
         }
     }
 
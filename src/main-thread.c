@@ -3,6 +3,7 @@
 #include "network.h"
 #include "thread.h"
 #include "adapter.h"
+#include "proto-dns-overload.h"
 #include "util-realloc2.h"
 #include <stdlib.h>
 
@@ -34,6 +35,7 @@ void main_thread(void *v)
     struct Adapter *adapter = parms->adapter;
     struct Frame frame[1];
     struct Thread thread[1];
+    unsigned packet_count = 0;
 
     memset(frame, 0, sizeof(frame[0]));
     
@@ -65,6 +67,14 @@ void main_thread(void *v)
         if (err != 0)
             continue;
 
+        /*
+         * How far behind the timestamps we are tells how backed up the
+         * ring is, which is all the overload check needs, so it doesn't
+         * need doing for every packet
+         */
+        if ((packet_count++ & 63) == 0)
+            overload_sample(overload_delay_fill(secs, usecs));
+
         network_receive(
             frame,
             thread,
@@ -7,6 +7,7 @@ extern "C" {
 #include <string.h>
 #include "packet.h"
 #include "proto-dns.h"
+#include "proto-dns-timing.h"
 
 struct Catalog;
 
@@ -36,6 +37,18 @@ struct ICMP_IncomingRequest
     const unsigned char *payload;
 };
 
+struct TCP_IncomingSegment
+{
+    unsigned is_valid:1;
+    unsigned seqno;
+    unsigned ackno;
+    unsigned flags;
+    unsigned window;
+    unsigned mss;
+    unsigned payload_length;
+    const unsigned char *payload;
+};
+
 
 struct Frame
 {
@@ -58,6 +71,8 @@ struct Frame
     struct DNS_Incoming dns[1];
     struct ARP_IncomingRequest arp[1];
     struct ICMP_IncomingRequest icmp[1];
+    struct TCP_IncomingSegment tcp[1];
+    struct StageTimer timer;
 };
 
 enum {
@@ -103,6 +118,10 @@ void proto_icmp_process(struct Frame *frame, const struct ICMP_IncomingRequest *
 
 void proto_udp_parse(struct Frame *frame, const unsigned char px[], unsigned offset, unsigned max);
 
+void proto_tcp_parse(struct Frame *frame, const unsigned char px[], unsigned offset, unsigned max);
+void proto_tcp_process(struct Frame *frame, const struct TCP_IncomingSegment *tcp);
+int proto_tcp_selftest(const struct Catalog *catalog);
+
 void proto_dns_process(const struct DNS_Incoming *dns,
                        const struct Catalog *catalog,
                        struct Packet *pkt);
@@ -13,6 +13,12 @@
 #include <sched.h>
 #include <errno.h>
 #endif
+#if defined(__linux__)
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
 #include <sys/types.h>
@@ -269,3 +275,41 @@ void pixie_mutex_unlock(void *mutex)
 #endif
 }
 
+
+/****************************************************************************
+ * Put the thread to sleep as long as '*addr' still equals 'expected', until
+ * woken by pixie_futex_wake() or the timeout expires. On Linux this is a
+ * real futex. Elsewhere we just sleep a short while, so callers must
+ * always re-check their condition after we return.
+ ****************************************************************************/
+void
+pixie_futex_wait(volatile unsigned *addr, unsigned expected, unsigned timeout_usec)
+{
+#if defined(__linux__)
+    struct timespec ts;
+
+    ts.tv_sec = timeout_usec / 1000000;
+    ts.tv_nsec = (timeout_usec % 1000000) * 1000;
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, &ts, 0, 0);
+#elif defined(WIN32)
+    UNUSEDPARM(timeout_usec);
+    if (*addr == expected)
+        Sleep(1);
+#else
+    if (*addr == expected)
+        usleep(timeout_usec < 100 ? timeout_usec : 100);
+#endif
+}
+
+/****************************************************************************
+ * Wake all threads sleeping in pixie_futex_wait() on this address
+ ****************************************************************************/
+void
+pixie_futex_wake(volatile unsigned *addr)
+{
+#if defined(__linux__)
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+#else
+    UNUSEDPARM(addr);
+#endif
+}
@@ -30,6 +30,29 @@ void pixie_cpu_raise_priority(void);
 void
 pixie_join(size_t thread_handle, size_t *exit_code);
 
+/**
+ * Sleep while '*addr' equals 'expected', until woken or until the timeout
+ * expires. Spurious wakeups are possible, so the caller must re-check
+ * whatever condition it's waiting for.
+ */
+void
+pixie_futex_wait(volatile unsigned *addr, unsigned expected, unsigned timeout_usec);
+
+/**
+ * Wake all threads waiting on this address
+ */
+void
+pixie_futex_wake(volatile unsigned *addr);
+
+/**
+ * Declares a variable with one copy per thread
+ */
+#if defined(_MSC_VER)
+#define PIXIE_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define PIXIE_THREAD_LOCAL __thread
+#endif
+
 
 
 #if defined(_MSC_VER)
@@ -44,6 +67,7 @@ pixie_join(size_t thread_handle, size_t *exit_code);
 #define pixie_locked_CAS32(dst, src, expected) __sync_bool_compare_and_swap((volatile int*)(dst),(int)expected,(int)src)
 #define pixie_locked_CAS64(dst, src, expected) __sync_bool_compare_and_swap((volatile long long int*)(dst),(long long int)expected,(long long int)src)
 
+#define rte_mb() __sync_synchronize()
 #if defined(__arm__)
 #define rte_wmb() __sync_synchronize()
 #define rte_rmb() __sync_synchronize()
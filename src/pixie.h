@@ -103,6 +103,19 @@ unsigned pixie_get_host_name(char *name, unsigned name_size);
     }
 #endif
 
+/**
+ * Hint that we'll soon read this memory, so that the cache miss can
+ * overlap with other work
+ */
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define pixie_prefetch(p) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define pixie_prefetch(p) __builtin_prefetch(p)
+#else
+#define pixie_prefetch(p)
+#endif
+
 void
 pixie_get_memory_size(uint64_t *available, uint64_t *total_physical);
 
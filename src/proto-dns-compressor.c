@@ -4,9 +4,20 @@
 #include "resolver.h"
 #include "packet.h"
 #include "string_s.h"
-#include "util-realloc2.h"
+#include "unusedparm.h"
 #include <string.h>
 
+/* The root name, which is never written to the packet, so never has
+ * a compression code */
+#define ID_ROOT     COMPRESSOR_SLOTS
+
+/* Returned when the table is full, in which case the rest of the name
+ * won't be remembered, and won't be compressed against */
+#define ID_NONE     0xFFFF
+
+/* Don't fill more than this, so that probe sequences stay short */
+#define ID_MAX      (COMPRESSOR_SLOTS/4*3)
+
 
 /******************************************************************************
  * Tests if two labels are the same.
@@ -21,156 +32,158 @@ is_equal(const unsigned char *lhs, const unsigned char *rhs)
 {
     size_t lhs_len = lhs[0];
     size_t rhs_len = rhs[0];
-    
+
     if (lhs_len != rhs_len)
         return 0;
-    
-    return strncasecmp((char*)lhs+1, (char*)rhs+1, lhs_len) == 0;
+
+    return memcasecmp(lhs+1, rhs+1, (int)lhs_len) == 0;
 }
 
 /******************************************************************************
+ * Hash of a suffix, which is the label combined with the index of the
+ * parent suffix. Since the parent is unique for each suffix, this is the
+ * same as hashing the entire suffix, but without going over the bytes
+ * of the parent again. Case-insensitive, like is_equal().
  ******************************************************************************/
 static unsigned short
-compressor_new(struct Compressor *compressor, const unsigned char *label)
+label_hash(unsigned parent, const unsigned char *label)
 {
-    compressor->ids[compressor->count].child = 0;
-    compressor->ids[compressor->count].label = label;
-    compressor->ids[compressor->count].sibling = 0;
-    compressor->ids[compressor->count].compression_code = 0;
-    return (unsigned short)compressor->count++;
-}
+    unsigned hash = 2166136261 ^ (parent * 0x9E3779B1);
+    unsigned i;
 
+    for (i=0; i<=label[0]; i++) {
+        unsigned c = label[i];
+        if ('A' <= c && c <= 'Z')
+            c |= 0x20;
+        hash ^= c;
+        hash *= 16777619;
+    }
+    return (unsigned short)(hash ^ (hash >> 16));
+}
 
 /******************************************************************************
+ * Find the suffix consisting of the label followed by the 'parent' suffix,
+ * optionally adding it if it isn't there.
+ * @return the index of the suffix, or ID_NONE
  ******************************************************************************/
 static unsigned
-compressor_init_label(struct Compressor *compressor, 
-                      unsigned id_index, const unsigned char *label)
+compressor_lookup(struct Compressor *compressor,
+                  unsigned parent, const unsigned char *label, int is_add)
 {
-    struct CompressorId *parent = &compressor->ids[id_index];
-    unsigned child_index;
-
-    /* First born */
-    if (parent->child == 0) {
-        parent->child = compressor_new(compressor, label);
-        return parent->child;
-    }
-
-    /* Existing child */
-    child_index = parent->child;
-    for (;;) {
-        struct CompressorId *child = &compressor->ids[child_index];
-
-        if (is_equal(child->label, label))
-            return child_index;
+    unsigned short hash;
+    unsigned i;
 
-        if (child->sibling == 0) {
-            child->sibling = compressor_new(compressor, label);
-            return child->sibling;
+    if (parent == ID_NONE)
+        return ID_NONE;
+
+    hash = label_hash(parent, label);
+
+    for (i = hash & (COMPRESSOR_SLOTS-1); ; i = (i + 1) & (COMPRESSOR_SLOTS-1)) {
+        struct CompressorId *id = &compressor->ids[i];
+
+        if ((compressor->is_used[i>>3] & (1<<(i&7))) == 0) {
+            if (!is_add || compressor->count >= ID_MAX)
+                return ID_NONE;
+            compressor->is_used[i>>3] |= (unsigned char)(1<<(i&7));
+            compressor->count++;
+            id->label = label;
+            id->parent = (unsigned short)parent;
+            id->compression_code = 0;
+            id->hash = hash;
+            if (parent == ID_ROOT)
+                id->depth = 1;
+            else
+                id->depth = (unsigned char)(compressor->ids[parent].depth + 1);
+            return i;
         }
-        child_index = child->sibling;
+
+        if (id->hash == hash && id->parent == parent && is_equal(id->label, label))
+            return i;
     }
 }
 
-
 /******************************************************************************
  ******************************************************************************/
 static unsigned
-compressor_init_partialname(struct Compressor *compressor, 
-                            struct DomainPointer domain, unsigned id_index)
+compressor_code(const struct Compressor *compressor, unsigned id_index)
 {
-    unsigned char label_offsets[128];
-    unsigned i;
-    unsigned n;
-    const unsigned char *name;
-    unsigned name_length;
-
-    name = domain.name;
-    name_length = domain.length;
-
-    /* go forward in order to go backwards */
-    i = 0;
-    for (n=0; n<name_length; n += name[n] + 1) {
-        label_offsets[i] = (unsigned char)n;
-        i++;
-    }
-    
-    /* traverse the tree trying to match existing items */
-    while (i) {
-        id_index = compressor_init_label(compressor, 
-                                         id_index, 
-                                         &name[label_offsets[i-1]]);
-        i--;
-    }
-    return id_index;
+    if (id_index >= COMPRESSOR_SLOTS)
+        return 0;
+    return compressor->ids[id_index].compression_code;
 }
 
+
 /******************************************************************************
+ * Appends the name, which comes in two parts, the 'name' itself followed by
+ * the 'origin'. Either part can be empty. The name is relative to the
+ * suffix 'id_start', which is normally the root.
  ******************************************************************************/
 static unsigned
-compressor_append_partialname(
-    struct Compressor *compressor, 
-    struct Packet *pkt, 
-    struct DomainPointer domain, 
-    unsigned id_index,
-    unsigned prefix_length)
+compressor_append(struct Compressor *compressor,
+                  struct Packet *pkt,
+                  struct DomainPointer name, struct DomainPointer origin,
+                  unsigned id_start)
 {
-    unsigned char label_offsets[128];
+    const unsigned char *labels[256];
+    unsigned label_offsets[256];
     unsigned i;
     unsigned n;
-    const unsigned char *name;
-    unsigned name_length;
-    unsigned compression_code = compressor->ids[id_index].compression_code;
-    unsigned uncompressed_length = 0;
-
-    name = domain.name;
-    name_length = domain.length;
+    unsigned id_index;
+    unsigned compression_code;
+    unsigned uncompressed_length;
 
-    /* go forward in order to go backwards */
+    /* go forward in order to go backwards. The offsets are where each
+     * label would be if the whole name were written out */
     i = 0;
-    for (n=0; n<name_length; n += name[n] + 1) {
-        label_offsets[i] = (unsigned char)n;
+    for (n=0; n<name.length && i<256; n += name.name[n] + 1) {
+        labels[i] = &name.name[n];
+        label_offsets[i] = n;
         i++;
     }
-    
-    /* traverse the tree trying to match existing items */
-    uncompressed_length = name_length;
+    for (n=0; n<origin.length && i<256; n += origin.name[n] + 1) {
+        labels[i] = &origin.name[n];
+        label_offsets[i] = name.length + n;
+        i++;
+    }
+
+    /* find the longest suffix that's already in the packet */
+    id_index = id_start;
+    compression_code = compressor_code(compressor, id_start);
+    uncompressed_length = name.length + origin.length;
     while (i) {
-        unsigned packet_offset;
-        id_index = compressor_init_label(compressor, 
-                                         id_index, 
-                                         &name[label_offsets[i-1]]);
-        packet_offset = compressor->ids[id_index].compression_code;
+        unsigned child;
 
-        if (packet_offset == 0) {
+        child = compressor_lookup(compressor, id_index, labels[i-1], 0);
+        if (compressor_code(compressor, child) == 0)
             break;
-        }
-        
-        compression_code = packet_offset;
+
+        id_index = child;
+        compression_code = compressor->ids[child].compression_code;
         uncompressed_length = label_offsets[i-1];
         i--;
     }
 
-
-    /* record the remaining offsets */
+    /* remember where the remaining suffixes are going to be. Pointers
+     * only have 14 bits, so suffixes beyond that can't be pointed to */
     while (i) {
-        compressor->ids[id_index].compression_code = (unsigned short)(
-                                        pkt->offset 
-                                        + label_offsets[i-1] 
-                                        + prefix_length 
-                                        - compressor->offset_start);
+        unsigned code = pkt->offset + label_offsets[i-1] - compressor->offset_start;
+
+        id_index = compressor_lookup(compressor, id_index, labels[i-1], 1);
+        if (id_index != ID_NONE && code < 0x4000)
+            compressor->ids[id_index].compression_code = (unsigned short)code;
         i--;
-        if (i == 0)
-            break;
-        id_index = compressor_init_label(compressor, 
-                                         id_index, 
-                                         &name[label_offsets[i-1]]);
     }
 
     /* Write the uncompressed portions of the name, if there are any */
     if (uncompressed_length) {
         if (pkt->offset + uncompressed_length <= pkt->max) {
-            memcpy(&pkt->buf[pkt->offset], name, uncompressed_length);
+            if (uncompressed_length <= name.length)
+                memcpy(&pkt->buf[pkt->offset], name.name, uncompressed_length);
+            else {
+                memcpy(&pkt->buf[pkt->offset], name.name, name.length);
+                memcpy(&pkt->buf[pkt->offset + name.length], origin.name,
+                        uncompressed_length - name.length);
+            }
         }
         pkt->offset += uncompressed_length;
         if (!compression_code) {
@@ -194,86 +207,123 @@ compressor_append_partialname(
 
 /******************************************************************************
  ******************************************************************************/
-static void
-compressor_init_fullname(struct Compressor *compressor, 
-                         struct DomainPointer name, struct DomainPointer origin)
+unsigned
+compressor_append_name(struct Compressor *compressor,
+                       struct Packet *pkt,
+                       struct DomainPointer name, struct DomainPointer origin)
 {
-    unsigned id_index;
-
-    id_index = compressor_init_partialname(compressor, origin, 0);
-    id_index = compressor_init_partialname(compressor, name, id_index);
+    return compressor_append(compressor, pkt, name, origin, ID_ROOT);
 }
 
-
 /******************************************************************************
  ******************************************************************************/
-void
-compressor_append_name(struct Compressor *compressor, 
-                       struct Packet *pkt, 
-                       struct DomainPointer name, struct DomainPointer origin)
+int
+compressor_append_relocated(struct Compressor *compressor,
+                            struct Packet *pkt,
+                            const unsigned char *prefix, unsigned prefix_length,
+                            unsigned owner_id, unsigned suffix_labels)
 {
-    unsigned id_index;
+    struct DomainPointer name;
+    static const struct DomainPointer root = {0,0};
+
+    if (owner_id >= COMPRESSOR_SLOTS || suffix_labels == 0)
+        return 0;
 
-    id_index = compressor_append_partialname(compressor, pkt, 
-                                             origin, 0, name.length);
-    if (name.length)
-        id_index = compressor_append_partialname(compressor, pkt, 
-                                                 name, id_index, 0);
+    /* go up from the owner to the shared suffix */
+    if (compressor->ids[owner_id].depth < suffix_labels)
+        return 0;
+    while (compressor->ids[owner_id].depth > suffix_labels)
+        owner_id = compressor->ids[owner_id].parent;
+    if (compressor->ids[owner_id].compression_code == 0)
+        return 0;
+
+    name.name = prefix;
+    name.length = prefix_length;
+    compressor_append(compressor, pkt, name, root, owner_id);
+    return 1;
 }
 
 
 /******************************************************************************
+ * Start a new packet. The table is only filled in as names are written,
+ * so the only thing to clear is which slots are in use.
  ******************************************************************************/
 void
-compressor_init(struct Compressor *compressor, 
-                const struct DNS_OutgoingResponse *response, 
+compressor_init(struct Compressor *compressor,
+                const struct DNS_OutgoingResponse *response,
                 unsigned offset_start)
 {
-    unsigned i;
-    unsigned rrcount;
-    static const struct DomainPointer root = {0,0};
+    UNUSEDPARM(response);
 
     compressor->offset_start = offset_start;
     compressor->count = 0;
-    compressor_new(compressor, (const unsigned char*)"");
-
-    compressor_init_fullname(compressor, response->query_name, root);
-
-    rrcount = response->ancount + response->nscount + response->arcount;
-    for (i=0; i<rrcount; i++) {
-        compressor_init_fullname(compressor, 
-                                 response->rrsets[i].name, 
-                                 response->rrsets[i].origin);
-    }
+    memset(compressor->is_used, 0, sizeof(compressor->is_used));
 }
 
 
 /******************************************************************************
+ * The expected results here are what the original label-tree compressor
+ * produced, except for names that have both a 'name' and 'origin' part,
+ * which it wrote in the wrong order.
  ******************************************************************************/
 int
-compressor_selftest(const struct DNS_OutgoingResponse *response)
+compressor_selftest(void)
 {
-    unsigned char *buf = REALLOC2(NULL, 65536, 1);
+    static const struct {
+        const char *name;
+        unsigned name_length;
+        const char *origin;
+        unsigned origin_length;
+    } tests[] = {
+        {"\3www\7Example\3com", 16, "", 0},
+        {"\7example\3COM", 12, "", 0},
+        {"\4mail\7example\3com", 17, "", 0},
+        {"", 0, "\7example\3com", 12},
+        {"\3ftp", 4, "\7example\3com", 12},
+        {"\5other\3org", 10, "", 0},
+        {"\1a\1b\5OTHER\3org", 14, "", 0},
+        {"\3www\7example\3com", 16, "", 0},
+        {"\1b\5other", 8, "\3org", 4},
+        {"\3www", 4, "\7example\3com", 12},
+        {0,0,0,0}
+    };
+    static const unsigned char expected[] =
+        "\3www\7Example\3com\0"
+        "\xc0\x10"
+        "\4mail\xc0\x10"
+        "\xc0\x10"
+        "\3ftp\xc0\x10"
+        "\5other\3org\0"
+        "\1a\1b\xc0\x2e"
+        "\xc0\x0c"
+        "\xc0\x3b"
+        "\xc0\x0c";
+    unsigned char buf[256];
     struct Packet pkt;
     struct Compressor compressor[1];
     unsigned i;
-    static const struct DomainPointer root = {0,0};
 
     pkt.buf = buf;
     pkt.max = sizeof(buf);
-    pkt.offset = 16;
-    memset(buf, '*', pkt.offset);
-    
-    compressor_init(compressor, response, pkt.offset);
-    compressor_append_name(compressor, &pkt, response->query_name, root);
+    pkt.offset = 12;
+    memset(buf, 0, pkt.offset);
+
+    compressor_init(compressor, 0, 0);
 
-    for (i=0; i<response->ancount; i++) {
-        const struct DNS_ResponseRRset *rrr = &response->rrsets[i];
+    for (i=0; tests[i].name; i++) {
+        struct DomainPointer name;
+        struct DomainPointer origin;
 
-        compressor_append_name(compressor, &pkt, rrr->name, rrr->origin);
+        name.name = (const unsigned char *)tests[i].name;
+        name.length = tests[i].name_length;
+        origin.name = (const unsigned char *)tests[i].origin;
+        origin.length = tests[i].origin_length;
+        compressor_append_name(compressor, &pkt, name, origin);
     }
 
+    if (pkt.offset - 12 != sizeof(expected) - 1
+        || memcmp(buf + 12, expected, sizeof(expected) - 1) != 0)
+        return 1;
 
     return 0;
 }
-
@@ -5,22 +5,46 @@ struct Packet;
 struct DomainPointer;
 
 /****************************************************************************
+ * Every name suffix ("com", "example.com", "www.example.com") that has been
+ * written to the packet gets an entry in a hash table, keyed by the
+ * entry of its parent suffix plus its first label, so that finding whether
+ * a suffix can be compressed is a single lookup.
  ****************************************************************************/
+#define COMPRESSOR_SLOTS 2048
 struct CompressorId {
     const unsigned char *label;
-    unsigned short sibling;
-    unsigned short child;
+    unsigned short parent;
     unsigned short compression_code;
+    unsigned short hash;
+    unsigned char depth;            /* number of labels in the suffix */
 };
 struct Compressor
 {
     unsigned offset_start;
     unsigned count;
-    struct CompressorId ids[1000];
+    unsigned char is_used[COMPRESSOR_SLOTS/8];
+    struct CompressorId ids[COMPRESSOR_SLOTS];
 };
 
 void compressor_init(struct Compressor *compressor, const struct DNS_OutgoingResponse *response, unsigned offset_start);
-void compressor_append_name(struct Compressor *compressor, struct Packet *pkt, struct DomainPointer name, struct DomainPointer origin);
-int compressor_selftest(const struct DNS_OutgoingResponse *response);
+
+/**
+ * Append the name, made up of 'name' followed by 'origin', compressing it
+ * against the names already in the packet.
+ * @return an identifier for the name, for use with
+ *      compressor_append_relocated()
+ */
+unsigned compressor_append_name(struct Compressor *compressor, struct Packet *pkt, struct DomainPointer name, struct DomainPointer origin);
+
+/**
+ * Append a name that we know at load time shares its last 'suffix_labels'
+ * labels with an owner name that was just appended, so only the 'prefix'
+ * labels need to be looked up. See entry_chain_build_index().
+ * @return 1 on success, or 0 if the owner name can't be pointed to, in
+ *      which case the caller should use compressor_append_name() instead
+ */
+int compressor_append_relocated(struct Compressor *compressor, struct Packet *pkt, const unsigned char *prefix, unsigned prefix_length, unsigned owner_id, unsigned suffix_labels);
+
+int compressor_selftest(void);
 
 #endif
@@ -0,0 +1,369 @@
+#include "proto-dns-cookie.h"
+#include "proto-dns.h"
+#include "proto-dns-formatter.h"
+#include "crypto-siphash.h"
+#include "packet.h"
+#include "pixie-timer.h"
+#include "resolver.h"
+#include "util-realloc2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* How long a server cookie is good for, and how far ahead of our clock
+ * another server in the anycast set can be. After half its life, a valid
+ * cookie gets replaced by a new one.
+ *  RFC 9018 4.3 */
+#define COOKIE_LIFETIME     3600
+#define COOKIE_REFRESH      1800
+#define COOKIE_CLOCK_SKEW   300
+
+struct CookieConfig
+{
+    unsigned is_enabled;
+    unsigned count;
+    unsigned char (*secrets)[16];
+};
+
+static struct CookieConfig * volatile cookie_config;
+static struct CookieConfig *retired;
+
+/* made the first time there's no configured secret, then kept, so that
+ * reloading the configuration doesn't invalidate every client's cookie */
+static unsigned char random_secret[16];
+static unsigned is_random_secret;
+
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+cookie_config_free(struct CookieConfig *config)
+{
+    if (config == NULL)
+        return;
+    free(config->secrets);
+    free(config);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+cookie_random_secret(void)
+{
+    uint64_t x[2];
+    FILE *fp;
+
+    if (is_random_secret)
+        return;
+
+    /* The secret only needs to be unguessable from outside, so if there's
+     * no /dev/urandom, the time and our address will do */
+    memset(random_secret, 0, sizeof(random_secret));
+    fp = fopen("/dev/urandom", "rb");
+    if (fp) {
+        if (fread(random_secret, 1, sizeof(random_secret), fp) != sizeof(random_secret))
+            memset(random_secret, 0, sizeof(random_secret));
+        fclose(fp);
+    }
+    memcpy(x, random_secret, sizeof(x));
+    x[0] ^= pixie_nanotime();
+    x[1] ^= (uint64_t)(size_t)random_secret;
+    memcpy(random_secret, x, sizeof(x));
+    is_random_secret = 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+cookie_set_config(unsigned is_enabled, const unsigned char *secrets, unsigned count)
+{
+    struct CookieConfig *config;
+
+    config = MALLOC2(sizeof(*config));
+    memset(config, 0, sizeof(*config));
+    config->is_enabled = is_enabled;
+
+    if (count == 0) {
+        cookie_random_secret();
+        secrets = random_secret;
+        count = 1;
+    }
+    config->secrets = REALLOC2(0, count, sizeof(config->secrets[0]));
+    memcpy(config->secrets, secrets, count * sizeof(config->secrets[0]));
+    config->count = count;
+
+    cookie_config_free(retired);
+    retired = cookie_config;
+    cookie_config = config;
+}
+
+/****************************************************************************
+ * The hash part of the server cookie, over the client cookie, the first
+ * 8 bytes of the server cookie, and the client's address
+ *  RFC 9018 4.4
+ ****************************************************************************/
+static void
+cookie_hash(unsigned char hash[8],
+            const unsigned char *client_cookie,
+            const unsigned char *server_cookie,
+            const unsigned char *addr, unsigned addr_length,
+            const unsigned char secret[16])
+{
+    unsigned char buf[8 + 8 + 16];
+
+    memcpy(buf + 0, client_cookie, 8);
+    memcpy(buf + 8, server_cookie, 8);
+    memcpy(buf + 16, addr, addr_length);
+    siphash(hash, buf, 16 + addr_length, secret);
+}
+
+/****************************************************************************
+ * Whether the server cookie the client sent back is one of ours, that
+ * hasn't expired
+ * @return 0 if it isn't, otherwise 1 + the index of the secret it's from
+ ****************************************************************************/
+static unsigned
+cookie_is_valid(const struct CookieConfig *config,
+                const unsigned char *cookie, unsigned cookie_length,
+                const unsigned char *addr, unsigned addr_length,
+                unsigned now, unsigned *age)
+{
+    unsigned char hash[8];
+    unsigned timestamp;
+    unsigned i;
+
+    /* version 1, which is the only one, with the reserved bytes zero */
+    if (cookie_length != 24 || cookie[8] != 1
+        || cookie[9] != 0 || cookie[10] != 0 || cookie[11] != 0)
+        return 0;
+
+    /* serial number arithmetic, so that it keeps working in 2106 */
+    timestamp = cookie[12]<<24 | cookie[13]<<16 | cookie[14]<<8 | cookie[15];
+    *age = now - timestamp;
+    if (*age > COOKIE_LIFETIME && timestamp - now > COOKIE_CLOCK_SKEW)
+        return 0;
+
+    for (i=0; i<config->count; i++) {
+        cookie_hash(hash, cookie, cookie + 8, addr, addr_length, config->secrets[i]);
+        if (memcmp(hash, cookie + 16, 8) == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+cookie_validate(const unsigned char *cookie, unsigned cookie_length,
+                const unsigned char *addr, unsigned addr_length,
+                unsigned now)
+{
+    const struct CookieConfig *config = cookie_config;
+    unsigned age;
+
+    if (config == NULL || !config->is_enabled)
+        return 0;
+    return cookie_is_valid(config, cookie, cookie_length,
+                           addr, addr_length, now, &age) != 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+cookie_check(struct DNS_OutgoingResponse *response,
+             const struct DNS_Incoming *request,
+             const unsigned char *addr, unsigned addr_length,
+             unsigned now)
+{
+    const struct CookieConfig *config = cookie_config;
+    unsigned char *cookie = response->cookie;
+    unsigned secret;
+    unsigned age = 0;
+
+    if (request->cookie_length == 0 || config == NULL || !config->is_enabled)
+        return COOKIE_NONE;
+
+    /* the same client cookie goes back, followed by our server cookie */
+    memcpy(cookie, request->cookie, 8);
+    response->cookie_length = 24;
+
+    /*
+     * A valid cookie that's still fresh goes back as it came, which saves
+     * the hashing. One from an old secret gets replaced
+     */
+    secret = cookie_is_valid(config, request->cookie, request->cookie_length,
+                             addr, addr_length, now, &age);
+    if (secret) {
+        response->is_cookie_valid = 1;
+        if (secret == 1 && (age <= COOKIE_REFRESH || age > COOKIE_LIFETIME)) {
+            memcpy(cookie + 8, request->cookie + 8, 16);
+            return COOKIE_VALID;
+        }
+    }
+
+    cookie[8] = 1;                              /* version */
+    cookie[9] = 0;                              /* reserved */
+    cookie[10] = 0;
+    cookie[11] = 0;
+    cookie[12] = (unsigned char)(now>>24);      /* timestamp */
+    cookie[13] = (unsigned char)(now>>16);
+    cookie[14] = (unsigned char)(now>> 8);
+    cookie[15] = (unsigned char)(now>> 0);
+    cookie_hash(cookie + 16, cookie, cookie + 8, addr, addr_length, config->secrets[0]);
+
+    return response->is_cookie_valid ? COOKIE_VALID : COOKIE_CLIENT;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+selftest_hex(unsigned char *buf, const char *hex)
+{
+    unsigned i;
+
+    for (i=0; hex[2*i]; i++) {
+        unsigned x;
+        if (sscanf(hex + 2*i, "%2x", &x) != 1)
+            return 0;
+        buf[i] = (unsigned char)x;
+    }
+    return i;
+}
+
+static int
+selftest_one(const unsigned char *query, unsigned query_length,
+             const unsigned char *addr, unsigned addr_length, unsigned now,
+             int expected, struct DNS_OutgoingResponse *response)
+{
+    struct DNS_Incoming request[1];
+    int result;
+
+    proto_dns_parse(request, query, 0, query_length);
+    if (!request->is_valid || request->is_formerr)
+        return 1;
+    resolver_init(response, request->query_name.name, request->query_name.length,
+                  request->query_type, request->id, request->opcode);
+    result = cookie_check(response, request, addr, addr_length, now);
+    if (result != expected) {
+        fprintf(stderr, "cookie: expected %d, got %d\n", expected, result);
+        return 1;
+    }
+    return 0;
+}
+
+int
+cookie_selftest(void)
+{
+    static const unsigned char header[] =
+        "\x12\x34" "\x00\x00" "\x00\x01" "\x00\x00" "\x00\x00" "\x00\x01"
+        "\x07" "example" "\x03" "com" "\x00" "\x00\x01" "\x00\x01"
+        "\x00" "\x00\x29" "\x10\x00" "\x00\x00\x00\x00" "\x00\x00";
+    unsigned char query[128];
+    unsigned char secrets[2][16];
+    unsigned char ip4[4] = {198, 51, 100, 100};
+    unsigned char ip6[16];
+    unsigned char expected[24];
+    struct DNS_OutgoingResponse response[1];
+    struct DNS_Incoming request[1];
+    struct Packet pkt;
+    unsigned char buf[512];
+    unsigned length = sizeof(header) - 1;
+    int err = 0;
+
+    /*
+     * The example from RFC 9018 A.1, which makes sure that we're the
+     * same as other servers, so that cookies work across an anycast set
+     * that isn't all the same software
+     */
+    selftest_hex(secrets[0], "e5e973e5a6b2a43f48e7dc849e37bfcf");
+    selftest_hex(expected, "2464c4abcf10c957010000005cf79f111f8130c3eee29480");
+    cookie_set_config(1, secrets[0], 1);
+
+    memcpy(query, header, length);
+    query[length - 2] = 0;
+    query[length - 1] = 12;
+    memcpy(query + length, "\x00\x0a\x00\x08", 4);
+    memcpy(query + length + 4, expected, 8);
+    err |= selftest_one(query, length + 12, ip4, 4, 1559731985, COOKIE_CLIENT, response);
+    if (response->cookie_length != 24 || memcmp(response->cookie, expected, 24) != 0) {
+        fprintf(stderr, "cookie: RFC 9018 A.1 failed\n");
+        return 1;
+    }
+
+    /* the cookie comes back in our OPT record */
+    response->is_edns0 = 1;
+    response->rcode = RCODE_REFUSED;
+    pkt.buf = buf;
+    pkt.max = sizeof(buf);
+    pkt.offset = 0;
+    dns_format_response(response, &pkt);
+    if (pkt.offset < 12 + 17 + 39 || buf[11] != 1
+        || memcmp(buf + pkt.offset - 30, "\x00\x1c\x00\x0a\x00\x18", 6) != 0
+        || memcmp(buf + pkt.offset - 24, expected, 24) != 0) {
+        fprintf(stderr, "cookie: formatting failed\n");
+        return 1;
+    }
+
+    /*
+     * A client that sends it back is valid, until it expires, or from
+     * another address
+     */
+    query[length - 1] = 28;
+    query[length + 3] = 24;
+    memcpy(query + length + 4, expected, 24);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 + 10, COOKIE_VALID, response);
+    err |= !response->is_cookie_valid;
+    err |= (memcmp(response->cookie, expected, 24) != 0);
+    err |= !cookie_validate(expected, 24, ip4, 4, 1559731985 + 10);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 - 60, COOKIE_VALID, response);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 + 3600 + 1, COOKIE_CLIENT, response);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 - 301, COOKIE_CLIENT, response);
+    memset(ip6, 0, sizeof(ip6));
+    memcpy(ip6 + 12, ip4, 4);
+    err |= selftest_one(query, length + 28, ip6, 16, 1559731985 + 10, COOKIE_CLIENT, response);
+    err |= response->is_cookie_valid;
+
+    /* all of an IPv6 address counts */
+    memcpy(query + length + 4, response->cookie, 24);
+    err |= selftest_one(query, length + 28, ip6, 16, 1559731985 + 20, COOKIE_VALID, response);
+    ip6[15] ^= 1;
+    err |= selftest_one(query, length + 28, ip6, 16, 1559731985 + 20, COOKIE_CLIENT, response);
+    memcpy(query + length + 4, expected, 24);
+
+    /* after half an hour, it's still valid, but replaced */
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 + 1801, COOKIE_VALID, response);
+    err |= (memcmp(response->cookie, expected, 24) == 0);
+
+    /*
+     * While the secret changes, a cookie from the old one is still valid,
+     * but gets a new one. Once the old one is gone, it isn't
+     */
+    selftest_hex(secrets[1], "e5e973e5a6b2a43f48e7dc849e37bfcf");
+    selftest_hex(secrets[0], "000102030405060708090a0b0c0d0e0f");
+    cookie_set_config(1, secrets[0], 2);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 + 10, COOKIE_VALID, response);
+    err |= (memcmp(response->cookie, expected, 24) == 0);
+    cookie_set_config(1, secrets[0], 1);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 + 10, COOKIE_CLIENT, response);
+
+    /* turned off, cookies are ignored */
+    cookie_set_config(0, secrets[0], 1);
+    err |= selftest_one(query, length + 28, ip4, 4, 1559731985 + 10, COOKIE_NONE, response);
+    err |= (response->cookie_length != 0);
+
+    /* a cookie of the wrong length is a format error, but the question
+     * before it has still been parsed, rather than left as whatever was
+     * there before */
+    query[length - 1] = 13;
+    query[length + 3] = 9;
+    memset(request, 0xA5, sizeof(*request));
+    proto_dns_parse(request, query, 0, length + 13);
+    err |= !request->is_formerr;
+    err |= (request->query_name.name != request->query_name_buffer);
+    err |= (request->query_name.length == 0 || query[12 + request->query_name.length] != 0);
+    err |= (memcmp(request->query_name.name, query + 12, request->query_name.length) != 0);
+
+    cookie_set_config(1, 0, 0);
+    cookie_set_config(1, 0, 0);
+    return err;
+}
@@ -0,0 +1,70 @@
+#ifndef PROTO_DNS_COOKIE_H
+#define PROTO_DNS_COOKIE_H
+struct DNS_Incoming;
+struct DNS_OutgoingResponse;
+
+/*
+    DNS Cookies (RFC 7873)
+
+    A client puts a random 8-byte client cookie in the COOKIE option of
+    its queries, and we answer with it plus a server cookie, which the
+    client sends back from then on. The server cookie is the interoperable
+    one from RFC 9018, a SipHash-2-4 of the client cookie, a timestamp,
+    and the client's address under our secret, so we don't need to keep
+    any state, and a client that spoofs its address can't get one.
+
+    Clients that come back with a valid server cookie have shown that
+    their address is real, so rate limiting leaves them alone.
+
+    Several servers in an anycast set can share the secret. To change
+    it, add the new one to the others first, then make it the first one
+    listed everywhere, then after an hour remove the old one.
+*/
+
+enum {
+    COOKIE_NONE,        /* no COOKIE option, or cookies are turned off */
+    COOKIE_CLIENT,      /* only a client cookie, or a server cookie that
+                         * isn't valid (any more) */
+    COOKIE_VALID,       /* a server cookie we made for this client */
+};
+
+/**
+ * Use these settings from now on.
+ * @param is_enabled
+ *      Whether to answer cookies at all ("answer-cookie").
+ * @param secrets
+ *      'count' 128-bit secrets, one after the other, where the first makes
+ *      new cookies, and all of them are accepted. If there aren't any, a
+ *      random secret made the first time through is used.
+ */
+void cookie_set_config(unsigned is_enabled, const unsigned char *secrets, unsigned count);
+
+/**
+ * Check the cookie in the request, and put a fresh server cookie in the
+ * response. Call this after resolver_init().
+ * @param addr
+ *      The client's IPv4 or IPv6 address, in network order.
+ * @param addr_length
+ *      Either 4 or 16.
+ * @param now
+ *      The time in seconds.
+ * @return one of the COOKIE_xxx values, which is also remembered as
+ *      response->is_cookie_valid
+ */
+int cookie_check(struct DNS_OutgoingResponse *response,
+                 const struct DNS_Incoming *request,
+                 const unsigned char *addr, unsigned addr_length,
+                 unsigned now);
+
+/**
+ * Whether a COOKIE option is a client cookie followed by a server cookie
+ * we made for this client, without parsing or answering the query, for
+ * when we're overloaded.
+ */
+int cookie_validate(const unsigned char *cookie, unsigned cookie_length,
+                    const unsigned char *addr, unsigned addr_length,
+                    unsigned now);
+
+int cookie_selftest(void);
+
+#endif
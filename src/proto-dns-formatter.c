@@ -32,6 +32,16 @@ static const unsigned char version_bind_response[] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0xc0, 0x0c,
 };
 
+static unsigned max_udp_size = DNS_DEFAULT_MAX_UDP_SIZE;
+
+/******************************************************************************
+ ******************************************************************************/
+void
+dns_format_set_max_udp_size(unsigned size)
+{
+    max_udp_size = size;
+}
+
 /******************************************************************************
  * Creates the DNS response packet.
  *
@@ -51,13 +61,16 @@ static const unsigned char version_bind_response[] = {
  * 2. append all the optional records
  * 3. append the edns0 record
  * 4. prepend the DNS header
- * Along the way, we need to check for truncation
+ * Along the way, we need to check for truncation, against the size the
+ * client can receive
  ******************************************************************************/
 void
 dns_format_response(struct DNS_OutgoingResponse *response, 
                     struct Packet *pkt)
 {
     unsigned offset_start = pkt->offset;
+    unsigned max = pkt->max;
+    unsigned limit;
     unsigned i;
     static const struct DomainPointer root = {0,0};
     struct Compressor compressor[1];
@@ -108,6 +121,28 @@ format_error:
         return;
     }
     
+    /*
+     * Limit the size to what the client can receive, which is 512 bytes
+     * unless it's told us otherwise with EDNS0 (RFC 6891 6.2.3), but no
+     * more than we are configured to send. Over TCP, it's whatever fits
+     * in the 16-bit length. With EDNS0, we save room
+     * at the end for our own OPT record.
+     */
+    limit = 512;
+    if (response->is_edns0 && response->edns0_payload_size > limit) {
+        limit = response->edns0_payload_size;
+        if (limit > max_udp_size)
+            limit = max_udp_size;
+        if (limit < 512)
+            limit = 512;
+    }
+    if (response->is_tcp)
+        limit = 65535;
+    if (pkt->max > offset_start + limit)
+        pkt->max = offset_start + limit;
+    if (response->is_edns0)
+        pkt->max -= 11 + (response->cookie_length ? 4 + response->cookie_length : 0);
+
     /*
      * Skip DNS header for now, fill it in at the end. That's because while
      * generating the packet, we might find overflow conditions, meaning
@@ -147,7 +182,7 @@ format_error:
         truncated_offset = pkt->offset;
         
         /* attempt to append the next record-set to the packet */
-        count = rrset_packet_append(rrr->rrset, pkt, compressor, 
+        count = rrset_packet_append(rrr->rrset, rrr->entry, pkt, compressor, 
                                     rrr->name, rrr->origin);
         if (i < response->ancount)
             actual_ancount += count;
@@ -189,7 +224,7 @@ format_error:
         truncated_offset = pkt->offset;
         
         /* attempt to append the next record to the packet */
-        count = rrset_packet_append(rrr->rrset, pkt, compressor, 
+        count = rrset_packet_append(rrr->rrset, rrr->entry, pkt, compressor, 
                                     rrr->name, rrr->origin);
         actual_arcount += count;
 
@@ -204,11 +239,6 @@ format_error:
         }
     }
 
-    /*
-     * If 'edns0', then add the OPT record
-     */
-    /*TODO*/
-
     /*
                                     1  1  1  1  1  1
       0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
@@ -227,6 +257,42 @@ format_error:
     +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
      */
 generate_header:
+    pkt->max = max;
+
+    /*
+     * If 'edns0', then add the OPT record, which we made room for above,
+     * so it's there even when the rest of the response is truncated.
+     *  RFC 6891 6.1.2
+     */
+    if (response->is_edns0) {
+        unsigned char *opt = &pkt->buf[pkt->offset];
+
+        opt[0] = 0;                             /* root name */
+        opt[1] = 0;                             /* TYPE = OPT (41) */
+        opt[2] = 41;
+        opt[3] = (unsigned char)(max_udp_size>>8); /* CLASS = our UDP size */
+        opt[4] = (unsigned char)(max_udp_size>>0);
+        opt[5] = (unsigned char)(response->rcode>>4); /* extended RCODE */
+        opt[6] = 0;                             /* VERSION */
+        opt[7] = 0;                             /* DO bit and Z */
+        opt[8] = 0;
+        opt[9] = 0;                             /* RDLENGTH */
+        opt[10] = 0;
+        pkt->offset += 11;
+        actual_arcount++;
+
+        /* the COOKIE option, RFC 7873 4 */
+        if (response->cookie_length) {
+            opt[10] = (unsigned char)(4 + response->cookie_length);
+            opt[11] = 0;
+            opt[12] = 10;
+            opt[13] = 0;
+            opt[14] = (unsigned char)response->cookie_length;
+            memcpy(opt + 15, response->cookie, response->cookie_length);
+            pkt->offset += 4 + response->cookie_length;
+        }
+    }
+
     pkt->buf[offset_start+0] = (unsigned char)(response->id>>8);
     pkt->buf[offset_start+1] = (unsigned char)(response->id>>0);
     pkt->buf[offset_start+2] = (unsigned char)(
@@ -235,7 +301,7 @@ generate_header:
         (response->aa<<2) |
         (response->tc<<1)
         );
-    pkt->buf[offset_start+3] = (unsigned char)(response->rcode);
+    pkt->buf[offset_start+3] = (unsigned char)(response->rcode & 0xF);
     pkt->buf[offset_start+4] = 0;
     pkt->buf[offset_start+5] = 1;
     pkt->buf[offset_start+6] = (unsigned char)(actual_ancount>>8);
@@ -8,8 +8,15 @@ struct DNS_ResponseRRset
     struct DomainPointer name;
     struct DomainPointer origin;
     const struct DBrrset *rrset;
+    const struct DBEntry *entry;
 };
 
+/* Most responses only have a few RRsets, which are kept inline so that the
+ * response stays in a couple cache lines. Bigger responses move into one
+ * of the thread's overflow pools, see response_copy_rrset_item() */
+#define RESPONSE_INLINE_RRSETS  8
+#define RESPONSE_MAX_RRSETS     4096
+
 struct DNS_OutgoingResponse
 {
     unsigned id;
@@ -17,8 +24,14 @@ struct DNS_OutgoingResponse
     unsigned aa:1;
     unsigned ra:1;
     unsigned tc:1;
+    unsigned is_edns0:1;
+    unsigned is_tcp:1;
+    unsigned is_cookie_valid:1; /* the client sent back our server cookie */
+    unsigned is_retransmit:1;   /* already counted in the statistics */
     unsigned rcode;
+    unsigned edns0_payload_size;
     unsigned opcode;
+    unsigned cookie_length;     /* of the COOKIE option in our OPT record */
 
     unsigned ancount;
     unsigned nscount;
@@ -26,8 +39,15 @@ struct DNS_OutgoingResponse
 
     int query_type;
     struct DomainPointer query_name;
+
+    /* the client cookie, followed by our server cookie, see cookie_check() */
+    unsigned char cookie[24];
     
-    struct DNS_ResponseRRset rrsets[4096];
+    /* points to either 'inline_rrsets' or the overflow pool */
+    struct DNS_ResponseRRset *rrsets;
+    unsigned max_rrsets;
+    unsigned overflow_slot;     /* which pool, its index within a batch */
+    struct DNS_ResponseRRset inline_rrsets[RESPONSE_INLINE_RRSETS];
 };
 
 enum {
@@ -35,6 +55,7 @@ enum {
     RCODE_FORMERR   =   1,
     RCODE_NXDOMAIN  =   3,
     RCODE_REFUSED   =   5,
+    RCODE_BADVERS   =   16, /* extended, in the OPT record */
 };
 
 
@@ -52,4 +73,12 @@ enum {
 void dns_format_response(struct DNS_OutgoingResponse *response, 
                          struct Packet *pkt);
 
+/**
+ * The largest UDP response we'll send to EDNS0 clients, whatever buffer
+ * size they advertise, and which we advertise in our own OPT record.
+ * The default of 1232 avoids IP fragmentation on nearly all paths.
+ */
+#define DNS_DEFAULT_MAX_UDP_SIZE 1232
+void dns_format_set_max_udp_size(unsigned max_udp_size);
+
 #endif
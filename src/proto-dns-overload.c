@@ -0,0 +1,472 @@
+#include "proto-dns-overload.h"
+#include "proto-dns.h"
+#include "proto-dns-cookie.h"
+#include "proto-dns-formatter.h"
+#include "logger.h"
+#include "pixie-threads.h"
+#include "unusedparm.h"
+#include "util-realloc2.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/sock_diag.h>
+#elif !defined(WIN32)
+#include <sys/time.h>
+#endif
+
+/* Prefixes per core. A new prefix takes one of the OVERLOAD_PROBES slots
+ * it hashes to only if one of them is empty or has lost its score */
+#define OVERLOAD_TABLE_SIZE     16384
+#define OVERLOAD_PROBES         4
+
+/* Cores that can have their own table */
+#define OVERLOAD_MAX_TABLES     256
+
+/* A prefix with this score gets in. Since it goes up at most once a
+ * second, that's half a minute of being answered */
+#define OVERLOAD_GOOD_SCORE     30
+#define OVERLOAD_COOKIE_SCORE   4
+#define OVERLOAD_MAX_SCORE      60000
+#define OVERLOAD_HALF_LIFE      600
+
+/* Prefixes that have used TCP in the last day, by the minute */
+#define OVERLOAD_TCP_SIZE       65536
+#define OVERLOAD_TCP_MINUTES    (24*60)
+
+/* How far behind we can get in raw mode before the queue counts as full,
+ * in microseconds */
+#define OVERLOAD_MAX_DELAY      100000
+
+struct OverloadBucket
+{
+    uint64_t key;           /* 0 if unused */
+    unsigned score;
+    unsigned time;          /* when the score last went up */
+    unsigned decay_time;    /* when the score last halved */
+};
+
+struct OverloadTable
+{
+    struct Overload_Counters counters;
+    unsigned is_active;
+    struct OverloadBucket buckets[OVERLOAD_TABLE_SIZE];
+};
+
+static volatile unsigned overload_threshold;
+
+static PIXIE_THREAD_LOCAL struct OverloadTable *overload_table;
+static struct OverloadTable *overload_tables[OVERLOAD_MAX_TABLES];
+static volatile unsigned overload_table_count;
+
+static volatile unsigned short overload_tcp[OVERLOAD_TCP_SIZE];
+
+
+/****************************************************************************
+ ****************************************************************************/
+void
+overload_set_config(unsigned threshold)
+{
+    if (threshold > 100)
+        threshold = 100;
+    overload_threshold = threshold;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct OverloadTable *
+overload_table_get(void)
+{
+    struct OverloadTable *table = overload_table;
+    unsigned index;
+
+    if (table)
+        return table;
+
+    table = MALLOC2(sizeof(*table));
+    memset(table, 0, sizeof(*table));
+
+    index = __sync_fetch_and_add(&overload_table_count, 1);
+    if (index < OVERLOAD_MAX_TABLES)
+        overload_tables[index] = table;
+
+    overload_table = table;
+    return table;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+overload_get_counters(struct Overload_Counters *counters)
+{
+    unsigned count = overload_table_count;
+    unsigned i;
+
+    if (count > OVERLOAD_MAX_TABLES)
+        count = OVERLOAD_MAX_TABLES;
+
+    memset(counters, 0, sizeof(*counters));
+    for (i=0; i<count; i++) {
+        const struct OverloadTable *table = overload_tables[i];
+        if (table == NULL)
+            continue;
+        counters->episodes += table->counters.episodes;
+        counters->admitted += table->counters.admitted;
+        counters->shed += table->counters.shed;
+    }
+}
+
+/****************************************************************************
+ * Going into overload is when the queue gets to the threshold, but coming
+ * out is only once it has drained to half that, so that we don't flip
+ * back and forth with every batch
+ ****************************************************************************/
+void
+overload_sample(unsigned fill)
+{
+    unsigned threshold = overload_threshold;
+    struct OverloadTable *table;
+
+    if (overload_table == NULL && (threshold == 0 || fill < threshold))
+        return;
+    table = overload_table_get();
+
+    if (threshold == 0) {
+        table->is_active = 0;
+    } else if (!table->is_active && fill >= threshold) {
+        table->is_active = 1;
+        table->counters.episodes++;
+        LOG_DBG(C_NETWORK, 1, "overload: queue %u%% full, shedding\n", fill);
+    } else if (table->is_active && fill < threshold / 2) {
+        table->is_active = 0;
+        LOG_DBG(C_NETWORK, 1, "overload: queue %u%% full, done shedding\n", fill);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+overload_is_active(void)
+{
+    const struct OverloadTable *table = overload_table;
+
+    return table && table->is_active;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+unsigned
+overload_socket_fill(int fd)
+{
+#if defined(__linux__) && defined(SO_MEMINFO)
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t sizeof_meminfo = sizeof(meminfo);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &sizeof_meminfo) != 0)
+        return 0;
+    if (meminfo[SK_MEMINFO_RCVBUF] == 0)
+        return 0;
+    if (meminfo[SK_MEMINFO_RMEM_ALLOC] >= meminfo[SK_MEMINFO_RCVBUF])
+        return 100;
+    return (unsigned)(meminfo[SK_MEMINFO_RMEM_ALLOC] * 100ULL / meminfo[SK_MEMINFO_RCVBUF]);
+#else
+    UNUSEDPARM(fd);
+    return 0;
+#endif
+}
+
+/****************************************************************************
+ ****************************************************************************/
+unsigned
+overload_delay_fill(unsigned secs, unsigned usecs)
+{
+#if defined(WIN32)
+    UNUSEDPARM(secs);
+    UNUSEDPARM(usecs);
+    return 0;
+#else
+    struct timeval tv;
+    int64_t delay;
+
+    /* not every adapter gives us timestamps */
+    if (secs == 0)
+        return 0;
+    if (gettimeofday(&tv, 0) != 0)
+        return 0;
+
+    delay = ((int64_t)tv.tv_sec - secs) * 1000000 + ((int64_t)tv.tv_usec - usecs);
+    if (delay <= 0)
+        return 0;
+    if (delay >= OVERLOAD_MAX_DELAY)
+        return 100;
+    return (unsigned)(delay * 100 / OVERLOAD_MAX_DELAY);
+#endif
+}
+
+/****************************************************************************
+ * The /24 or /56 prefix, hashed
+ ****************************************************************************/
+static uint64_t
+overload_key(const unsigned char *addr, unsigned addr_length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned length = (addr_length == 4) ? 3 : 7;
+    unsigned i;
+
+    hash ^= addr_length;
+    hash *= 0x100000001b3ULL;
+    for (i=0; i<length; i++) {
+        hash ^= addr[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash | 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+overload_decay(struct OverloadBucket *bucket, unsigned now)
+{
+    unsigned halvings = (now - bucket->decay_time) / OVERLOAD_HALF_LIFE;
+
+    if (halvings == 0)
+        return;
+    bucket->score = (halvings >= 16) ? 0 : (bucket->score >> halvings);
+    bucket->decay_time += halvings * OVERLOAD_HALF_LIFE;
+}
+
+/****************************************************************************
+ * Find the prefix's bucket, or make one if 'is_create' and there's room
+ ****************************************************************************/
+static struct OverloadBucket *
+overload_bucket(struct OverloadTable *table, uint64_t key, unsigned now, int is_create)
+{
+    struct OverloadBucket *lowest = NULL;
+    unsigned i;
+
+    for (i=0; i<OVERLOAD_PROBES; i++) {
+        struct OverloadBucket *bucket;
+
+        bucket = &table->buckets[((unsigned)(key >> 32) + i) & (OVERLOAD_TABLE_SIZE-1)];
+        if (bucket->key == key) {
+            overload_decay(bucket, now);
+            return bucket;
+        }
+        if (!is_create)
+            continue;
+        if (bucket->key)
+            overload_decay(bucket, now);
+        if (lowest == NULL || bucket->key == 0 || bucket->score < lowest->score)
+            lowest = bucket;
+    }
+
+    /* prefixes that have earned a score keep their place */
+    if (lowest == NULL || (lowest->key && lowest->score > 1))
+        return NULL;
+
+    lowest->key = key;
+    lowest->score = 0;
+    lowest->time = now - 1;
+    lowest->decay_time = now;
+    return lowest;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+overload_credit(const unsigned char *addr, unsigned addr_length,
+                unsigned now, unsigned is_cookie_valid)
+{
+    struct OverloadBucket *bucket;
+
+    if (overload_threshold == 0)
+        return;
+
+    bucket = overload_bucket(overload_table_get(), overload_key(addr, addr_length), now, 1);
+    if (bucket == NULL)
+        return;
+
+    /* once a second, or a flood of answers would earn a place */
+    if (bucket->time == now)
+        return;
+    bucket->score += is_cookie_valid ? OVERLOAD_COOKIE_SCORE : 1;
+    if (bucket->score > OVERLOAD_MAX_SCORE)
+        bucket->score = OVERLOAD_MAX_SCORE;
+    bucket->time = now;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+overload_credit_tcp(const unsigned char *addr, unsigned addr_length,
+                    unsigned now)
+{
+    uint64_t key = overload_key(addr, addr_length);
+
+    overload_tcp[(key >> 32) & (OVERLOAD_TCP_SIZE-1)] = (unsigned short)((now / 60) | 1);
+}
+
+/****************************************************************************
+ * The server cookie, if the query ends with an OPT record holding only a
+ * COOKIE option of a client and server cookie, which is how resolvers
+ * send them
+ ****************************************************************************/
+static const unsigned char *
+overload_peek_cookie(const unsigned char *query, unsigned length)
+{
+    const unsigned char *opt;
+
+    if (length < 12 + 5 + 11 + 4 + 24)
+        return NULL;
+    if (query[10] == 0 && query[11] == 0)
+        return NULL; /* ARCOUNT */
+
+    opt = query + length - (11 + 4 + 24);
+    if (opt[0] != 0 || opt[1] != 0 || opt[2] != 41
+        || opt[9] != 0 || opt[10] != 4 + 24
+        || opt[11] != 0 || opt[12] != 10 || opt[13] != 0 || opt[14] != 24)
+        return NULL;
+    return opt + 15;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+overload_admit(const unsigned char *query, unsigned length,
+               const unsigned char *addr, unsigned addr_length,
+               unsigned now)
+{
+    struct OverloadTable *table = overload_table;
+    const struct OverloadBucket *bucket;
+    const unsigned char *cookie;
+    uint64_t key;
+    unsigned short tcp;
+
+    if (table == NULL || !table->is_active)
+        return 1;
+
+    /* a valid cookie */
+    cookie = overload_peek_cookie(query, length);
+    if (cookie && cookie_validate(cookie, 24, addr, addr_length, now))
+        goto admit;
+
+    /* a prefix that has used TCP */
+    key = overload_key(addr, addr_length);
+    tcp = overload_tcp[(key >> 32) & (OVERLOAD_TCP_SIZE-1)];
+    if (tcp && (unsigned short)((now / 60) - tcp) <= OVERLOAD_TCP_MINUTES)
+        goto admit;
+
+    /* a prefix with a history */
+    bucket = overload_bucket(table, key, now, 0);
+    if (bucket && bucket->score >= OVERLOAD_GOOD_SCORE)
+        goto admit;
+
+    table->counters.shed++;
+    return 0;
+
+admit:
+    table->counters.admitted++;
+    return 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+overload_selftest(void)
+{
+    static const unsigned char header[] =
+        "\x12\x34" "\x00\x00" "\x00\x01" "\x00\x00" "\x00\x00" "\x00\x01"
+        "\x07" "example" "\x03" "com" "\x00" "\x00\x01" "\x00\x01"
+        "\x00" "\x00\x29" "\x10\x00" "\x00\x00\x00\x00" "\x00\x1c"
+        "\x00\x0a\x00\x18";
+    unsigned char query[128];
+    unsigned char secret[16];
+    unsigned char good[4] = {192, 0, 2, 1};
+    unsigned char neighbor[4] = {192, 0, 2, 200};
+    unsigned char stranger[4] = {198, 51, 100, 1};
+    unsigned char flood[4] = {203, 0, 113, 1};
+    unsigned char resolver[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x35};
+    struct DNS_Incoming request[1];
+    struct DNS_OutgoingResponse response[1];
+    struct Overload_Counters before;
+    struct Overload_Counters after;
+    unsigned length = sizeof(header) - 1;
+    unsigned now = 1000000;
+    unsigned i;
+    int err = 0;
+
+    overload_get_counters(&before);
+    overload_set_config(50);
+
+    /* in at the threshold, out at half of it */
+    overload_sample(60);
+    err |= !overload_is_active();
+    overload_sample(30);
+    err |= !overload_is_active();
+    overload_sample(20);
+    err |= overload_is_active();
+    overload_sample(50);
+    err |= !overload_is_active();
+    if (err)
+        return 1;
+
+    memcpy(query, header, length);
+    memset(query + length, 0, 24);
+
+    /* nobody's known yet */
+    err |= overload_admit(query, length + 24, good, 4, now);
+
+    /* being answered for half a minute earns a prefix a place, but many
+     * answers in the same second don't */
+    for (i=0; i<100; i++)
+        overload_credit(good, 4, now, 0);
+    err |= overload_admit(query, length + 24, good, 4, now);
+    for (i=0; i<100; i++)
+        overload_credit(flood, 4, now, 1);
+    err |= overload_admit(query, length + 24, flood, 4, now);
+    for (i=1; i<OVERLOAD_GOOD_SCORE; i++)
+        overload_credit(good, 4, now + i, 0);
+    now += OVERLOAD_GOOD_SCORE;
+    err |= !overload_admit(query, length + 24, good, 4, now);
+    err |= !overload_admit(query, length + 24, neighbor, 4, now);
+    err |= overload_admit(query, length + 24, stranger, 4, now);
+
+    /* ...which it loses when it goes away */
+    err |= overload_admit(query, length + 24, good, 4, now + 2 * OVERLOAD_HALF_LIFE);
+
+    /* a prefix that has used TCP */
+    err |= overload_admit(query, length + 24, resolver, 16, now);
+    overload_credit_tcp(resolver, 16, now);
+    resolver[15] = 0x53;
+    err |= !overload_admit(query, length + 24, resolver, 16, now + 3600);
+    err |= overload_admit(query, length + 24, resolver, 16, now + 2 * 24 * 3600);
+
+    /* a valid cookie, but only from the client it was made for */
+    memset(secret, 0x5a, sizeof(secret));
+    cookie_set_config(1, secret, 1);
+    memset(request, 0, sizeof(request));
+    memcpy(request->cookie, "\1\2\3\4\5\6\7\x08", 8);
+    request->cookie_length = 8;
+    memset(response, 0, sizeof(response));
+    cookie_check(response, request, stranger, 4, now);
+    memcpy(query + length, response->cookie, 24);
+    err |= !overload_admit(query, length + 24, stranger, 4, now);
+    stranger[0]++;
+    err |= overload_admit(query, length + 24, stranger, 4, now);
+    query[length - 1]++;
+    stranger[0]--;
+    err |= overload_admit(query, length + 24, stranger, 4, now);
+    cookie_set_config(1, 0, 0);
+
+    overload_get_counters(&after);
+    err |= (after.episodes - before.episodes != 2);
+    err |= (after.admitted - before.admitted != 4);
+    err |= (after.shed - before.shed != 9);
+
+    overload_set_config(0);
+    overload_sample(0);
+    err |= overload_is_active();
+    return err;
+}
@@ -0,0 +1,104 @@
+#ifndef PROTO_DNS_OVERLOAD_H
+#define PROTO_DNS_OVERLOAD_H
+#include <stdint.h>
+
+/*
+    Overload admission control
+
+    When queries arrive faster than we can answer them, the NIC or the
+    kernel drops whatever doesn't fit in its queue, at random, so the
+    resolvers we normally serve lose out to an attacker in proportion
+    to how much it sends. Instead, each core watches how full its queue
+    is, and past the "overload-threshold" it sheds queries itself, right
+    after receiving them and before parsing, except from:
+
+     - clients sending back a valid DNS cookie, which can't be spoofed
+     - prefixes that have recently made a TCP connection to us, which
+       real resolvers do and spoofed floods can't
+     - prefixes with a long history of queries, kept as a score per
+       /24 or /56 that goes up at most once a second while the prefix
+       is being answered, and halves every 10 minutes
+
+    The score tables are per core, like the rate limiting tables, and
+    a flood from random addresses can't push out prefixes that already
+    have a score. The TCP history is shared, since TCP is handled by
+    other threads, but it's only written when a TCP query is answered.
+
+    The queue is measured as how much of the socket's receive buffer is
+    in use in sockets mode (SO_MEMINFO on Linux), taking the fullest of
+    the sockets a core reads, and as how far behind the packet
+    timestamps we are in raw mode.
+*/
+
+/**
+ * Start shedding once a queue is this full, in percent, and stop again
+ * once it's half that. 0 turns it off.
+ */
+void overload_set_config(unsigned threshold);
+
+/**
+ * Record how full this core's queue is, in percent. A core reading
+ * several sockets should pass the fullest, once per pass over them.
+ */
+void overload_sample(unsigned fill);
+
+/**
+ * How full the socket's receive buffer is, in percent, or 0 if we
+ * can't tell.
+ */
+unsigned overload_socket_fill(int fd);
+
+/**
+ * How full the queue in front of us is, in percent, judged from how long
+ * ago a packet with this timestamp arrived, where 100ms behind is full.
+ */
+unsigned overload_delay_fill(unsigned secs, unsigned usecs);
+
+/**
+ * Whether this core is currently shedding queries.
+ */
+int overload_is_active(void);
+
+/**
+ * Decide whether to go on with a query, when overloaded.
+ * @param query
+ *      The DNS payload, before it's parsed.
+ * @param addr
+ *      The client's IPv4 or IPv6 address, in network order.
+ * @param addr_length
+ *      Either 4 or 16.
+ * @return 1 to process the query, 0 to drop it
+ */
+int overload_admit(const unsigned char *query, unsigned length,
+                   const unsigned char *addr, unsigned addr_length,
+                   unsigned now);
+
+/**
+ * Add to the prefix's score after answering it over UDP, more when it
+ * had a valid cookie. The score goes up at most once a second.
+ */
+void overload_credit(const unsigned char *addr, unsigned addr_length,
+                     unsigned now, unsigned is_cookie_valid);
+
+/**
+ * Remember that the prefix answered over TCP.
+ */
+void overload_credit_tcp(const unsigned char *addr, unsigned addr_length,
+                         unsigned now);
+
+struct Overload_Counters
+{
+    uint64_t episodes;      /* times a core went into overload */
+    uint64_t admitted;      /* queries let through while overloaded */
+    uint64_t shed;          /* queries dropped while overloaded */
+};
+
+/**
+ * The totals across all cores. Cores update their own counters without
+ * locking, so these are only approximately up to date.
+ */
+void overload_get_counters(struct Overload_Counters *counters);
+
+int overload_selftest(void);
+
+#endif
@@ -125,15 +125,72 @@ dns_extract_name(const unsigned char px[], unsigned offset, unsigned max, struct
     }
 }
 
+/****************************************************************************
+ ****************************************************************************/
+unsigned
+dns_rr_skip(const unsigned char px[], unsigned offset, unsigned max)
+{
+    unsigned rdlength;
+
+    offset = dns_name_skip(px, offset, max);
+    offset += 10;
+    if (offset > max)
+        return max + 1;
+    rdlength = px[offset-2]<<8 | px[offset-1];
+    offset += rdlength;
+    if (offset > max)
+        return max + 1;
+    return offset;
+}
+
+/****************************************************************************
+ * Walk the options in the RDATA of the OPT record at 'offset', looking for
+ * the ones we know, which so far is only the COOKIE.
+ *  RFC 6891 6.1.2, RFC 7873 4
+ * @return 0 if an option is malformed, which is a FORMERR
+ ****************************************************************************/
+static int
+dns_parse_edns0_options(struct DNS_Incoming *dns, const unsigned char px[], unsigned offset, unsigned max)
+{
+    unsigned rdlength = px[offset+9]<<8 | px[offset+10];
+    unsigned end;
+
+    offset += 11;
+    end = offset + rdlength;
+    if (end > max)
+        return 1; /* dns_rr_skip() will catch this */
+
+    while (offset + 4 <= end) {
+        unsigned code = px[offset+0]<<8 | px[offset+1];
+        unsigned length = px[offset+2]<<8 | px[offset+3];
+
+        offset += 4;
+        if (offset + length > end)
+            return 0;
+
+        if (code == 10 && dns->cookie_length == 0) {
+            /* a client cookie, plus maybe a server cookie of 8 to 32 bytes
+             *  RFC 7873 5.2.2 */
+            if (length != 8 && (length < 16 || length > 40))
+                return 0;
+            memcpy(dns->cookie, px + offset, length);
+            dns->cookie_length = length;
+        }
+        offset += length;
+    }
+    return offset == end;
+}
+
 /****************************************************************************
  ****************************************************************************/
 void
 proto_dns_parse(struct DNS_Incoming *dns, const unsigned char px[], unsigned offset, unsigned max)
 {
-    static const unsigned MAX_RRs = sizeof(dns->rr_offset)/sizeof(dns->rr_offset[0]);
     unsigned i;
 
     dns->is_valid = 0; /* not valid yet until we've successfully parsed*/
+    dns->is_edns0 = 0;
+    dns->cookie_length = 0;
 
     dns->req = px;
     dns->req_length = max-offset;
@@ -172,11 +229,17 @@ proto_dns_parse(struct DNS_Incoming *dns, const unsigned char px[], unsigned off
     dns->ancount = px[offset+6]<<8 | px[offset+7];
     dns->nscount = px[offset+8]<<8 | px[offset+9];
     dns->arcount = px[offset+10]<<8 | px[offset+11];
-    dns->rr_count = 0; /* so far */
     offset += 12;
     dns->is_valid = 1;
     dns->is_formerr = 1; /* is "formate-error" until we've finished parsing */
 
+    /* the root, until we've got as far as the real question, so that a
+     * FORMERR response never echoes a name we didn't parse */
+    dns->query_name.name = dns->query_name_buffer;
+    dns->query_name.length = 0;
+    dns->query_type = 0;
+    dns->query_class = 0;
+
     /*
                                     1  1  1  1  1  1
       0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
@@ -192,12 +255,10 @@ proto_dns_parse(struct DNS_Incoming *dns, const unsigned char px[], unsigned off
     */
     if (dns->qdcount == 0)
         return;
+    dns->query_offset = offset;
     for (i=0; i<dns->qdcount; i++) {
         unsigned xclass;
         unsigned xtype;
-        if (dns->rr_count >= MAX_RRs)
-            return;
-        dns->rr_offset[dns->rr_count++] = (unsigned short)offset;
         offset = dns_name_skip(px, offset, max);
         offset += 4; /* length of type and class */
         if (offset > max)
@@ -209,6 +270,7 @@ proto_dns_parse(struct DNS_Incoming *dns, const unsigned char px[], unsigned off
         dns->query_type = xtype;
         dns->query_class = xclass;
     }
+    dns_extract_name(px, dns->query_offset, max, &dns->query_name);
 
     /*
                                     1  1  1  1  1  1
@@ -232,49 +294,33 @@ proto_dns_parse(struct DNS_Incoming *dns, const unsigned char px[], unsigned off
     /                                               /
     +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
     */
+    dns->answer_offset = offset;
     for (i=0; i<dns->ancount + dns->nscount; i++) {
-        unsigned rdlength;
-        if (dns->rr_count >= sizeof(dns->rr_offset)/sizeof(dns->rr_offset[0]))
-            return;
-        dns->rr_offset[dns->rr_count++] = (unsigned short)offset;
-        offset = dns_name_skip(px, offset, max);
-        offset += 10;
+        offset = dns_rr_skip(px, offset, max);
         if (offset > max)
             return;
-        rdlength = px[offset-2]<<8 | px[offset-1];
-        offset += rdlength;
-        if (offset > max)
-            break;
     }
+    dns->additional_offset = offset;
     for (i=0; i<dns->arcount; i++) {
-        unsigned rdlength;
-        if (dns->rr_count >= sizeof(dns->rr_offset)/sizeof(dns->rr_offset[0]))
-            return;
-        dns->rr_offset[dns->rr_count++] = (unsigned short)offset;
 
         /* ENDS0 OPT parsing */
         if (offset + 11 <= max && px[offset] == 0 && px[offset+1] == 0 && px[offset+2] == 0x29) {
             dns->edns0.payload_size = px[offset+3]<<8 | px[offset+4];
             if (dns->edns0.payload_size < 512)
-                return;
+                dns->edns0.payload_size = 512; /* rfc 6891 6.2.5 */
             dns->rcode |= px[offset+5]<<4;
             dns->edns0.version = px[offset+6];
+            dns->edns0_offset = offset;
             dns->is_edns0 = 1;
+            if (!dns_parse_edns0_options(dns, px, offset, max))
+                return;
         }
 
-        offset = dns_name_skip(px, offset, max);
-        offset += 10;
-        if (offset > max)
-            return;
-        rdlength = px[offset-2]<<8 | px[offset-1];
-        offset += rdlength;
+        offset = dns_rr_skip(px, offset, max);
         if (offset > max)
             return;
     }
 
-    dns->query_name.name = dns->query_name_buffer;
-    dns_extract_name(px, dns->rr_offset[0], max, &dns->query_name);
-
     dns->is_formerr = 0;
     return;
 }
@@ -0,0 +1,356 @@
+#include "proto-dns-qnamefilter.h"
+#include "configuration.h"
+#include "domainname.h"
+#include "pixie-threads.h"
+#include "smack.h"
+#include "unusedparm.h"
+#include "util-realloc2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Rows of hit counters. Each worker thread counts in its own row, so that
+ * threads don't fight over the same cache-lines. Threads beyond this
+ * many share rows, which only makes the counts less exact */
+#define QNAMEFILTER_ROWS    64
+
+struct QnameFilterRule
+{
+    char *name;
+    unsigned length;            /* in wire format */
+    int action;
+    unsigned is_exact;
+};
+
+struct QnameFilter
+{
+    struct SMACK *smack;
+    struct QnameFilterRule *rules;
+    unsigned count;
+
+    /* QNAMEFILTER_ROWS rows of 'stride' counters, plus the counts from
+     * before the last reload */
+    uint64_t *hits;
+    uint64_t *carried;
+    unsigned stride;
+};
+
+static struct QnameFilter * volatile qname_filter;
+static struct QnameFilter *retired;
+
+static PIXIE_THREAD_LOCAL unsigned qname_row;   /* 1 + the row, 0 if unassigned */
+static volatile unsigned qname_row_count;
+
+
+/****************************************************************************
+ ****************************************************************************/
+unsigned
+qnamefilter_name_to_wire(const char *text, unsigned char *wire, unsigned sizeof_wire)
+{
+    size_t text_length = strlen(text);
+    unsigned length = 0;
+    size_t i = 0;
+
+    /* a trailing dot is optional, and the root by itself isn't allowed */
+    if (text_length && text[text_length-1] == '.')
+        text_length--;
+    if (text_length == 0)
+        return 0;
+
+    while (i < text_length) {
+        size_t j = i;
+
+        while (j < text_length && text[j] != '.')
+            j++;
+        if (j == i || j - i > 63)
+            return 0;
+        if (length + 1 + (j - i) > sizeof_wire || length + 1 + (j - i) > 254)
+            return 0;
+
+        wire[length++] = (unsigned char)(j - i);
+        memcpy(wire + length, text + i, j - i);
+        length += (unsigned)(j - i);
+        i = j + 1;
+    }
+
+    return length;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static uint64_t
+qnamefilter_hits(const struct QnameFilter *filter, unsigned index)
+{
+    uint64_t total = filter->carried[index];
+    unsigned row;
+
+    for (row=0; row<QNAMEFILTER_ROWS; row++)
+        total += filter->hits[row * filter->stride + index];
+    return total;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+qnamefilter_free(struct QnameFilter *filter)
+{
+    unsigned i;
+
+    if (filter == NULL)
+        return;
+    smack_destroy(filter->smack);
+    for (i=0; i<filter->count; i++)
+        free(filter->rules[i].name);
+    free(filter->rules);
+    free(filter->hits);
+    free(filter->carried);
+    free(filter);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct QnameFilter *
+qnamefilter_compile(const struct ConfigurationQnameRule *rules, unsigned count,
+                    const struct QnameFilter *previous)
+{
+    struct QnameFilter *filter;
+    unsigned i;
+
+    if (count == 0)
+        return 0;
+
+    filter = MALLOC2(sizeof(*filter));
+    memset(filter, 0, sizeof(*filter));
+    filter->smack = smack_create("qname-filter", SMACK_CASE_INSENSITIVE);
+    filter->rules = REALLOC2(0, count, sizeof(filter->rules[0]));
+
+    for (i=0; i<count; i++) {
+        struct QnameFilterRule *rule = &filter->rules[filter->count];
+        unsigned char wire[256];
+        unsigned length;
+
+        /* the configuration has already checked these */
+        length = qnamefilter_name_to_wire(rules[i].name, wire, sizeof(wire));
+        if (length == 0)
+            continue;
+
+        rule->name = MALLOC2(strlen(rules[i].name) + 1);
+        memcpy(rule->name, rules[i].name, strlen(rules[i].name) + 1);
+        rule->length = length;
+        rule->action = rules[i].action;
+        rule->is_exact = rules[i].is_exact;
+
+        smack_add_pattern(filter->smack, wire, length, filter->count, 0);
+        filter->count++;
+    }
+    smack_compile(filter->smack);
+
+    /* pad the rows to whole cache-lines */
+    filter->stride = (filter->count + 7) & ~7U;
+    filter->hits = REALLOC2(0, QNAMEFILTER_ROWS * filter->stride + 1, sizeof(filter->hits[0]));
+    memset(filter->hits, 0, (QNAMEFILTER_ROWS * filter->stride + 1) * sizeof(filter->hits[0]));
+    filter->carried = REALLOC2(0, filter->count + 1, sizeof(filter->carried[0]));
+    memset(filter->carried, 0, (filter->count + 1) * sizeof(filter->carried[0]));
+
+    /* keep the counts of rules that are the same as before */
+    for (i=0; previous && i<filter->count && i<previous->count; i++) {
+        const struct QnameFilterRule *rule = &filter->rules[i];
+        const struct QnameFilterRule *old = &previous->rules[i];
+
+        if (rule->action == old->action && rule->is_exact == old->is_exact
+            && strcmp(rule->name, old->name) == 0)
+            filter->carried[i] = qnamefilter_hits(previous, i);
+    }
+
+    return filter;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+qnamefilter_set_config(const struct ConfigurationQnameRule *rules, unsigned count)
+{
+    struct QnameFilter *filter = qnamefilter_compile(rules, count, qname_filter);
+
+    qnamefilter_free(retired);
+    retired = qname_filter;
+    qname_filter = filter;
+}
+
+/****************************************************************************
+ * A pattern can match in the middle of a label, such as "\6abused" inside
+ * the label "x\6abused", so check that it starts where a label does
+ ****************************************************************************/
+static int
+qnamefilter_is_label_start(const struct DomainPointer *name, unsigned offset)
+{
+    unsigned i = 0;
+
+    while (i < offset)
+        i += name->name[i] + 1;
+    return i == offset;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+qnamefilter_check(const struct DomainPointer *name)
+{
+    struct QnameFilter *filter = qname_filter;
+    size_t best = SMACK_NOT_FOUND;
+    unsigned state = 0;
+    unsigned offset = 0;
+    unsigned row;
+
+    if (filter == NULL || name->length == 0)
+        return QNAMEFILTER_PASS;
+
+    /*
+     * Only the matches that end at the end of the name count, since the
+     * rules are for names and the names below them
+     */
+    for (;;) {
+        size_t id = smack_search_next(filter->smack, &state,
+                                      name->name, &offset, name->length);
+        if (id == SMACK_NOT_FOUND)
+            break;
+
+        for ( ; id != SMACK_NOT_FOUND; id = smack_next_match(filter->smack, &state)) {
+            const struct QnameFilterRule *rule = &filter->rules[id];
+
+            if (offset != name->length || id >= best)
+                continue;
+            if (rule->is_exact && rule->length != name->length)
+                continue;
+            if (!qnamefilter_is_label_start(name, offset - rule->length))
+                continue;
+            best = id;
+        }
+
+        if (offset >= name->length)
+            break;
+    }
+
+    if (best == SMACK_NOT_FOUND)
+        return QNAMEFILTER_PASS;
+
+    row = qname_row;
+    if (row == 0) {
+        row = __sync_fetch_and_add(&qname_row_count, 1) % QNAMEFILTER_ROWS + 1;
+        qname_row = row;
+    }
+    filter->hits[(row - 1) * filter->stride + best]++;
+
+    return filter->rules[best].action;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+qnamefilter_get_counters(QNAMEFILTER_COUNTER_CALLBACK callback, void *data)
+{
+    const struct QnameFilter *filter = qname_filter;
+    unsigned i;
+
+    if (filter == NULL)
+        return;
+    for (i=0; i<filter->count; i++) {
+        const struct QnameFilterRule *rule = &filter->rules[i];
+        callback(data, rule->name, rule->is_exact, rule->action,
+                 qnamefilter_hits(filter, i));
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+selftest_one(const char *name, int expected)
+{
+    struct DomainPointer domain;
+    int result;
+
+    domain.name = (const unsigned char *)name;
+    domain.length = (unsigned)strlen(name);
+    result = qnamefilter_check(&domain);
+    if (result != expected) {
+        fprintf(stderr, "qname-filter: %u-byte name: expected %d, got %d\n",
+                domain.length, expected, result);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+selftest_counter(void *data, const char *name, unsigned is_exact, int action,
+                 uint64_t hits)
+{
+    UNUSEDPARM(is_exact);
+    UNUSEDPARM(action);
+    if (strcmp(name, "abused.example.com") == 0)
+        *(uint64_t *)data = hits;
+}
+
+int
+qnamefilter_selftest(void)
+{
+    struct Configuration *cfg;
+    unsigned char wire[256];
+    uint64_t hits = 0;
+    int err = 0;
+
+    if (qnamefilter_name_to_wire("a..b", wire, sizeof(wire)) != 0
+        || qnamefilter_name_to_wire(".", wire, sizeof(wire)) != 0
+        || qnamefilter_name_to_wire("example.com.", wire, sizeof(wire)) != 12
+        || memcmp(wire, "\7example\3com", 12) != 0)
+        return 1;
+
+    cfg = cfg_create();
+    cfg_load_string(cfg,
+        "options {\n"
+        "  qname-filter {\n"
+        "    \"abused.example.com\" drop;\n"
+        "    \"example.com\" refuse;\n"
+        "    \"www.example.org\" exact truncate;\n"
+        "    \"example.net.\" refuse;\n"
+        "  };\n"
+        "};\n");
+    if (cfg->data_plane.qname_filter_count != 4) {
+        cfg_destroy(cfg);
+        return 1;
+    }
+    qnamefilter_set_config(cfg->data_plane.qname_filter, cfg->data_plane.qname_filter_count);
+
+    /* a name and the names below it, in any case */
+    err |= selftest_one("\6abused\7example\3com", QNAMEFILTER_DROP);
+    err |= selftest_one("\3xyz\6abused\7example\3com", QNAMEFILTER_DROP);
+    err |= selftest_one("\3XYZ\6ABUSED\7Example\3COM", QNAMEFILTER_DROP);
+
+    /* the first rule that matches wins, so the rest of example.com is
+     * refused, including a label that hides the bytes of another rule */
+    err |= selftest_one("\7example\3com", QNAMEFILTER_REFUSE);
+    err |= selftest_one("\10x\6abused\7example\3com", QNAMEFILTER_REFUSE);
+    err |= selftest_one("\12badexample\3com", QNAMEFILTER_PASS);
+
+    /* exact names don't include the names below them */
+    err |= selftest_one("\3www\7example\3org", QNAMEFILTER_TRUNCATE);
+    err |= selftest_one("\1a\3www\7example\3org", QNAMEFILTER_PASS);
+    err |= selftest_one("\7example\3org", QNAMEFILTER_PASS);
+
+    err |= selftest_one("\7example\3net", QNAMEFILTER_REFUSE);
+    err |= selftest_one("\3net", QNAMEFILTER_PASS);
+
+    /* counts survive a reload that doesn't change the rule */
+    qnamefilter_get_counters(selftest_counter, &hits);
+    err |= (hits != 3);
+    qnamefilter_set_config(cfg->data_plane.qname_filter, cfg->data_plane.qname_filter_count);
+    err |= selftest_one("\6abused\7example\3com", QNAMEFILTER_DROP);
+    qnamefilter_get_counters(selftest_counter, &hits);
+    err |= (hits != 4);
+
+    qnamefilter_set_config(0, 0);
+    qnamefilter_set_config(0, 0);
+    err |= selftest_one("\6abused\7example\3com", QNAMEFILTER_PASS);
+
+    cfg_destroy(cfg);
+    return err;
+}
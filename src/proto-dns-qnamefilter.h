@@ -0,0 +1,74 @@
+#ifndef PROTO_DNS_QNAMEFILTER_H
+#define PROTO_DNS_QNAMEFILTER_H
+#include <stdint.h>
+struct DomainPointer;
+struct ConfigurationQnameRule;
+
+/*
+    Query-name filter
+
+    During an attack, the queries are often for the same few names, or for
+    random labels under the same few names. The "qname-filter" block in
+    "options" lists such names, and what to do with queries for them:
+
+        qname-filter {
+            "abused.example.com" drop;
+            "victim.example.net" refuse;
+            "www.example.org" exact truncate;
+        };
+
+    A name matches itself and every name below it, unless it's "exact".
+    When several match, the first one listed wins.
+
+    All the names are compiled into a single Aho-Corasick state machine
+    (see smack1.c), which is run over the query name in wire format right
+    after it's parsed, so checking costs the same however many names
+    there are. The filter is replaced whenever the configuration is
+    reloaded, without touching the zones.
+*/
+enum {
+    QNAMEFILTER_PASS,       /* no name matched, resolve it normally */
+    QNAMEFILTER_DROP,       /* don't answer at all */
+    QNAMEFILTER_REFUSE,     /* answer with REFUSED */
+    QNAMEFILTER_TRUNCATE,   /* answer with an empty truncated response,
+                             * so the client retries over TCP. Over TCP
+                             * the query is resolved normally */
+};
+
+/**
+ * Convert a name in text form to wire format, without the root label.
+ * @return the length, or 0 if the name isn't valid
+ */
+unsigned qnamefilter_name_to_wire(const char *text, unsigned char *wire, unsigned sizeof_wire);
+
+/**
+ * Compile the rules and start using them. The previous filter is kept
+ * until the next call, so workers that are in the middle of using it
+ * can finish. The hit counters of rules that haven't changed position
+ * carry over.
+ */
+void qnamefilter_set_config(const struct ConfigurationQnameRule *rules, unsigned count);
+
+/**
+ * Decide what to do with a query, counting the hit against the rule
+ * that matched.
+ * @param name
+ *      The query name, in wire format without the root label, as
+ *      extracted by proto_dns_parse().
+ * @return one of the QNAMEFILTER_xxx values
+ */
+int qnamefilter_check(const struct DomainPointer *name);
+
+/**
+ * Get the number of times each rule matched. Workers count without
+ * locking, each in its own row, so these are only approximately up to
+ * date.
+ */
+typedef void (*QNAMEFILTER_COUNTER_CALLBACK)(void *data, const char *name,
+                                             unsigned is_exact, int action,
+                                             uint64_t hits);
+void qnamefilter_get_counters(QNAMEFILTER_COUNTER_CALLBACK callback, void *data);
+
+int qnamefilter_selftest(void);
+
+#endif
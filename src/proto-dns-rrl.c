@@ -0,0 +1,502 @@
+#include "proto-dns-rrl.h"
+#include "proto-dns-formatter.h"
+#include "configuration.h"
+#include "resolver.h"
+#include "logger.h"
+#include "pixie-atomic.h"
+#include "pixie-threads.h"
+#include "util-realloc2.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Buckets per core. Once full, new buckets replace the least recently
+ * used of the RRL_PROBES slots they hash to */
+#define RRL_TABLE_SIZE      16384
+#define RRL_PROBES          4
+
+/* Cores that can have their own table */
+#define RRL_MAX_TABLES      256
+
+enum {
+    RRL_CLASS_RESPONSE,
+    RRL_CLASS_REFERRAL,
+    RRL_CLASS_NODATA,
+    RRL_CLASS_NXDOMAIN,
+    RRL_CLASS_ERROR,
+};
+static const char *rrl_class_names[] = {
+    "responses", "referrals", "nodata", "nxdomains", "errors"
+};
+
+struct RRL_Bucket
+{
+    uint64_t key;           /* 0 if unused */
+    int balance;            /* tokens, negative once over the limit */
+    unsigned time;          /* when tokens were last added */
+    unsigned short slip_count;
+    unsigned short is_limited;
+};
+
+struct RRL_Table
+{
+    struct RRL_Counters counters;
+    struct RRL_Bucket buckets[RRL_TABLE_SIZE];
+};
+
+static struct ConfigurationRateLimit rrl_config;
+static unsigned rrl_rates[5];
+static volatile unsigned rrl_is_enabled;
+
+static PIXIE_THREAD_LOCAL struct RRL_Table *rrl_table;
+static struct RRL_Table *rrl_tables[RRL_MAX_TABLES];
+static volatile unsigned rrl_table_count;
+
+
+/****************************************************************************
+ ****************************************************************************/
+void
+rrl_set_config(const struct ConfigurationRateLimit *config)
+{
+    rrl_config = *config;
+    rrl_rates[RRL_CLASS_RESPONSE] = config->responses_per_second;
+    rrl_rates[RRL_CLASS_REFERRAL] = config->referrals_per_second;
+    rrl_rates[RRL_CLASS_NODATA] = config->nodata_per_second;
+    rrl_rates[RRL_CLASS_NXDOMAIN] = config->nxdomains_per_second;
+    rrl_rates[RRL_CLASS_ERROR] = config->errors_per_second;
+    if (rrl_config.window == 0)
+        rrl_config.window = 1;
+
+    rrl_is_enabled = config->responses_per_second
+                    || config->referrals_per_second
+                    || config->nodata_per_second
+                    || config->nxdomains_per_second
+                    || config->errors_per_second;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct RRL_Table *
+rrl_table_get(void)
+{
+    struct RRL_Table *table = rrl_table;
+    unsigned index;
+
+    if (table)
+        return table;
+
+    table = MALLOC2(sizeof(*table));
+    memset(table, 0, sizeof(*table));
+
+    index = __sync_fetch_and_add(&rrl_table_count, 1);
+    if (index < RRL_MAX_TABLES)
+        rrl_tables[index] = table;
+
+    rrl_table = table;
+    return table;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+rrl_get_counters(struct RRL_Counters *counters)
+{
+    unsigned count = rrl_table_count;
+    unsigned i;
+
+    if (count > RRL_MAX_TABLES)
+        count = RRL_MAX_TABLES;
+
+    memset(counters, 0, sizeof(*counters));
+    for (i=0; i<count; i++) {
+        const struct RRL_Table *table = rrl_tables[i];
+        if (table == NULL)
+            continue;
+        counters->responses += table->counters.responses;
+        counters->dropped += table->counters.dropped;
+        counters->slipped += table->counters.slipped;
+        counters->log_only += table->counters.log_only;
+    }
+}
+
+/****************************************************************************
+ * Which class the response belongs to, and the name it's counted against
+ ****************************************************************************/
+static unsigned
+rrl_classify(const struct DNS_OutgoingResponse *response,
+             struct DomainPointer *name, struct DomainPointer *origin)
+{
+    const struct DNS_ResponseRRset *authority = NULL;
+
+    if (response->nscount)
+        authority = &response->rrsets[response->ancount];
+
+    *name = response->query_name;
+    origin->name = 0;
+    origin->length = 0;
+
+    if (response->rcode == RCODE_NXDOMAIN) {
+        if (authority) {
+            *name = authority->name;
+            *origin = authority->origin;
+        }
+        return RRL_CLASS_NXDOMAIN;
+    }
+    if (response->rcode != RCODE_OK) {
+        name->length = 0;
+        return RRL_CLASS_ERROR;
+    }
+    if (response->ancount)
+        return RRL_CLASS_RESPONSE;
+    if (!response->aa && authority) {
+        *name = authority->name;
+        *origin = authority->origin;
+        return RRL_CLASS_REFERRAL;
+    }
+    return RRL_CLASS_NODATA;
+}
+
+/****************************************************************************
+ * FNV-1a, ignoring case in the names
+ ****************************************************************************/
+static uint64_t
+rrl_hash(uint64_t hash, const unsigned char *buf, unsigned length, int is_name)
+{
+    unsigned i;
+
+    for (i=0; i<length; i++) {
+        unsigned c = buf[i];
+        if (is_name && 'A' <= c && c <= 'Z')
+            c |= 0x20;
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/****************************************************************************
+ * The key for the bucket: the class, the client's prefix, and the name,
+ * plus the type for positive answers and NODATA
+ ****************************************************************************/
+static uint64_t
+rrl_key(const struct DNS_OutgoingResponse *response, unsigned rrl_class,
+        const unsigned char *addr, unsigned addr_length,
+        struct DomainPointer name, struct DomainPointer origin)
+{
+    unsigned char prefix[17];
+    unsigned prefix_length;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned i;
+
+    if (addr_length == 4)
+        prefix_length = rrl_config.ipv4_prefix_length;
+    else
+        prefix_length = rrl_config.ipv6_prefix_length;
+    if (prefix_length > addr_length * 8)
+        prefix_length = addr_length * 8;
+
+    memset(prefix, 0, sizeof(prefix));
+    prefix[0] = (unsigned char)(rrl_class << 5 | addr_length);
+    for (i=0; i<prefix_length/8; i++)
+        prefix[1+i] = addr[i];
+    if (prefix_length % 8)
+        prefix[1+i] = (unsigned char)(addr[i] & (0xFF00 >> (prefix_length % 8)));
+    hash = rrl_hash(hash, prefix, 1 + addr_length, 0);
+
+    if (rrl_class == RRL_CLASS_RESPONSE || rrl_class == RRL_CLASS_NODATA) {
+        unsigned char type[2];
+        type[0] = (unsigned char)(response->query_type >> 8);
+        type[1] = (unsigned char)(response->query_type >> 0);
+        hash = rrl_hash(hash, type, 2, 0);
+    }
+    hash = rrl_hash(hash, name.name, name.length, 1);
+    hash = rrl_hash(hash, origin.name, origin.length, 1);
+
+    return hash | 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct RRL_Bucket *
+rrl_bucket(struct RRL_Table *table, uint64_t key, unsigned rate, unsigned now)
+{
+    struct RRL_Bucket *empty = NULL;
+    struct RRL_Bucket *oldest = NULL;
+    unsigned i;
+
+    for (i=0; i<RRL_PROBES; i++) {
+        struct RRL_Bucket *bucket;
+
+        bucket = &table->buckets[((unsigned)(key >> 32) + i) & (RRL_TABLE_SIZE-1)];
+        if (bucket->key == key)
+            return bucket;
+        if (bucket->key == 0) {
+            if (empty == NULL)
+                empty = bucket;
+        } else if (oldest == NULL || bucket->time < oldest->time)
+            oldest = bucket;
+    }
+    if (empty)
+        oldest = empty;
+
+    oldest->key = key;
+    oldest->balance = (int)rate;
+    oldest->time = now;
+    oldest->slip_count = 0;
+    oldest->is_limited = 0;
+    return oldest;
+}
+
+/****************************************************************************
+ * Log when a client starts and stops being limited. This is a debug
+ * message, since during an attack there may be one for every prefix
+ * being spoofed.
+ ****************************************************************************/
+static void
+rrl_log(const struct DNS_OutgoingResponse *response, unsigned rrl_class,
+        const unsigned char *addr, unsigned addr_length,
+        struct DomainPointer name, struct DomainPointer origin,
+        int is_start)
+{
+    char client[64];
+    char domain[256];
+    unsigned char prefix[16];
+    unsigned prefix_length;
+    unsigned offset = 0;
+    unsigned i;
+
+    if (addr_length == 4)
+        prefix_length = rrl_config.ipv4_prefix_length;
+    else
+        prefix_length = rrl_config.ipv6_prefix_length;
+    for (i=0; i<addr_length; i++) {
+        if (i*8 + 8 <= prefix_length)
+            prefix[i] = addr[i];
+        else if (i*8 < prefix_length)
+            prefix[i] = (unsigned char)(addr[i] & (0xFF00 >> (prefix_length % 8)));
+        else
+            prefix[i] = 0;
+    }
+
+    if (addr_length == 4) {
+        sprintf(client, "%u.%u.%u.%u/%u",
+                prefix[0], prefix[1], prefix[2], prefix[3], prefix_length);
+    } else {
+        for (i=0; i<16; i += 2)
+            offset += sprintf(client + offset, "%s%x", i ? ":" : "",
+                              prefix[i]<<8 | prefix[i+1]);
+        sprintf(client + offset, "/%u", prefix_length);
+    }
+
+    /* labels to dotted text, good enough for the log */
+    offset = 0;
+    for (i=0; i<2; i++) {
+        struct DomainPointer part = i ? origin : name;
+        unsigned j;
+
+        for (j=0; j<part.length && part.name[j]; j += part.name[j] + 1) {
+            unsigned len = part.name[j];
+            if (j + 1 + len > part.length || offset + len + 2 >= sizeof(domain))
+                break;
+            memcpy(domain + offset, part.name + j + 1, len);
+            offset += len;
+            domain[offset++] = '.';
+        }
+    }
+    if (offset == 0)
+        domain[offset++] = '.';
+    domain[offset] = '\0';
+
+    if (rrl_class == RRL_CLASS_ERROR)
+        LOG_DBG(C_RATE_LIMIT, 1, "%s%s %s to %s\n",
+            rrl_config.is_log_only ? "would " : "",
+            is_start ? "limit" : "stop limiting",
+            rrl_class_names[rrl_class], client);
+    else
+        LOG_DBG(C_RATE_LIMIT, 1, "%s%s %s to %s for %s (%u)\n",
+            rrl_config.is_log_only ? "would " : "",
+            is_start ? "limit" : "stop limiting",
+            rrl_class_names[rrl_class], client, domain,
+            response->query_type);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+rrl_check(struct DNS_OutgoingResponse *response,
+          const unsigned char *addr, unsigned addr_length,
+          unsigned now)
+{
+    struct RRL_Table *table;
+    struct RRL_Bucket *bucket;
+    struct DomainPointer name;
+    struct DomainPointer origin;
+    unsigned rrl_class;
+    unsigned rate;
+    unsigned elapsed;
+    uint64_t key;
+
+    if (!rrl_is_enabled)
+        return RRL_SEND;
+
+    /* a valid DNS cookie means the address isn't spoofed, so there's
+     * nobody for us to amplify against */
+    if (response->is_cookie_valid)
+        return RRL_SEND;
+
+    table = rrl_table_get();
+    table->counters.responses++;
+
+    rrl_class = rrl_classify(response, &name, &origin);
+    rate = rrl_rates[rrl_class];
+    if (rate == 0)
+        return RRL_SEND;
+
+    key = rrl_key(response, rrl_class, addr, addr_length, name, origin);
+    bucket = rrl_bucket(table, key, rate, now);
+
+    /*
+     * Add the tokens for the time since we last did, up to one second's
+     * worth, and take one for this response. While over the limit, the
+     * balance can go down to a window's worth, so the client has to stay
+     * quiet for that long before it gets answers again.
+     */
+    elapsed = now - bucket->time;
+    if (elapsed) {
+        if (elapsed > rrl_config.window + 1)
+            elapsed = rrl_config.window + 1;
+        bucket->balance += (int)(elapsed * rate);
+        if (bucket->balance > (int)rate)
+            bucket->balance = (int)rate;
+        bucket->time = now;
+    }
+    if (bucket->balance > -(int)(rrl_config.window * rate))
+        bucket->balance--;
+
+    if (bucket->balance >= 0) {
+        if (bucket->is_limited) {
+            bucket->is_limited = 0;
+            rrl_log(response, rrl_class, addr, addr_length, name, origin, 0);
+        }
+        return RRL_SEND;
+    }
+
+    if (!bucket->is_limited) {
+        bucket->is_limited = 1;
+        rrl_log(response, rrl_class, addr, addr_length, name, origin, 1);
+    }
+
+    if (rrl_config.is_log_only) {
+        table->counters.log_only++;
+        return RRL_SEND;
+    }
+
+    /*
+     * Let every Nth one through as an empty truncated response, so that a
+     * real client whose address is being spoofed can still get an answer
+     * over TCP
+     */
+    if (rrl_config.slip && ++bucket->slip_count >= rrl_config.slip) {
+        bucket->slip_count = 0;
+        table->counters.slipped++;
+        response->tc = 1;
+        response->ancount = 0;
+        response->nscount = 0;
+        response->arcount = 0;
+        return RRL_SLIP;
+    }
+
+    table->counters.dropped++;
+    return RRL_DROP;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+rrl_selftest(void)
+{
+    struct ConfigurationRateLimit config;
+    struct DNS_OutgoingResponse response[1];
+    struct RRL_Counters before;
+    struct RRL_Counters after;
+    static const unsigned char client1[4] = {10, 1, 2, 3};
+    static const unsigned char client2[4] = {10, 1, 2, 200};
+    static const unsigned char client3[4] = {10, 1, 3, 3};
+    static const unsigned char client6[16] = {0x20,0x01,0x0d,0xb8, 0,0,0,0x11, 0,0,0,0, 0,0,0,1};
+    int results[10];
+    int result = 1;
+    unsigned i;
+
+    memset(&config, 0, sizeof(config));
+    config.responses_per_second = 5;
+    config.errors_per_second = 5;
+    config.window = 2;
+    config.slip = 2;
+    config.ipv4_prefix_length = 24;
+    config.ipv6_prefix_length = 56;
+    rrl_set_config(&config);
+    rrl_get_counters(&before);
+
+    resolver_init(response, (const unsigned char *)"\3rrl\7example\3com", 17, 1, 1, 0);
+    response->ancount = 1;
+
+    /* the first 5 go through, then they alternate between dropped and
+     * truncated */
+    for (i=0; i<10; i++) {
+        results[i] = rrl_check(response, client1, 4, 1000);
+        if (results[i] == RRL_SLIP) {
+            if (response->tc != 1 || response->ancount != 0)
+                goto end;
+            response->tc = 0;
+            response->ancount = 1;
+        }
+    }
+    for (i=0; i<5; i++) {
+        if (results[i] != RRL_SEND)
+            goto end;
+    }
+    if (results[5] != RRL_DROP || results[6] != RRL_SLIP || results[7] != RRL_DROP)
+        goto end;
+
+    /* others in the same /24 share the limit, but not those outside it,
+     * or for a different type */
+    if (rrl_check(response, client2, 4, 1000) == RRL_SEND)
+        goto end;
+    response->tc = 0;
+    response->ancount = 1;
+    if (rrl_check(response, client3, 4, 1000) != RRL_SEND)
+        goto end;
+    if (rrl_check(response, client6, 16, 1000) != RRL_SEND)
+        goto end;
+    response->query_type = 28;
+    if (rrl_check(response, client1, 4, 1000) != RRL_SEND)
+        goto end;
+    response->query_type = 1;
+
+    /* after being limited, the client has to wait out the window */
+    if (rrl_check(response, client1, 4, 1001) == RRL_SEND)
+        goto end;
+    response->tc = 0;
+    response->ancount = 1;
+    if (rrl_check(response, client1, 4, 1004) != RRL_SEND)
+        goto end;
+
+    /* errors are limited by client alone, whatever the name */
+    response->rcode = RCODE_REFUSED;
+    response->ancount = 0;
+    for (i=0; i<6; i++) {
+        response->query_name.length = 17 - (i % 2) * 4;
+        results[i] = rrl_check(response, client3, 4, 2000);
+    }
+    if (results[4] != RRL_SEND || results[5] == RRL_SEND)
+        goto end;
+
+    rrl_get_counters(&after);
+    if (after.dropped == before.dropped || after.slipped == before.slipped)
+        goto end;
+
+    result = 0;
+end:
+    memset(&config, 0, sizeof(config));
+    rrl_set_config(&config);
+    return result;
+}
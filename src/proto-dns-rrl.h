@@ -0,0 +1,68 @@
+#ifndef PROTO_DNS_RRL_H
+#define PROTO_DNS_RRL_H
+#include <stdint.h>
+struct DNS_OutgoingResponse;
+struct ConfigurationRateLimit;
+
+/*
+    Response Rate Limiting, like BIND's
+
+    Identical responses to the same client prefix are counted against a
+    token bucket, so that an attacker spoofing a victim's address can't
+    use us to flood the victim. "Identical" means the same class of
+    response for the same name: the query name and type for answers and
+    NODATA, the zone or delegation for NXDOMAIN and referrals (so that
+    random names under a zone count as one), and nothing at all for
+    errors.
+
+    Each core has its own table of buckets, so there's no locking or
+    sharing of cache lines between cores. A client's queries normally all
+    arrive on the same core, but if they don't, it gets a little more
+    than its share.
+*/
+
+enum {
+    RRL_SEND,   /* send the response as normal */
+    RRL_DROP,   /* don't send anything */
+    RRL_SLIP,   /* the response has been changed to an empty truncated one */
+};
+
+/**
+ * Use these limits from now on. Rates of 0 mean that class isn't limited,
+ * and if they're all 0, rrl_check() does nothing.
+ */
+void rrl_set_config(const struct ConfigurationRateLimit *config);
+
+/**
+ * Count the response against the client's limit. Only call this for
+ * UDP, since TCP clients can't be spoofed, and for the same reason
+ * clients with a valid DNS cookie aren't limited.
+ * @param addr
+ *      The client's IPv4 or IPv6 address, in network order.
+ * @param addr_length
+ *      Either 4 or 16.
+ * @param now
+ *      The time in seconds.
+ * @return one of RRL_SEND, RRL_DROP, or RRL_SLIP
+ */
+int rrl_check(struct DNS_OutgoingResponse *response,
+              const unsigned char *addr, unsigned addr_length,
+              unsigned now);
+
+struct RRL_Counters
+{
+    uint64_t responses;     /* responses checked */
+    uint64_t dropped;
+    uint64_t slipped;
+    uint64_t log_only;      /* would have been dropped or slipped */
+};
+
+/**
+ * The totals across all cores. Cores update their own counters without
+ * locking, so these are only approximately up to date.
+ */
+void rrl_get_counters(struct RRL_Counters *counters);
+
+int rrl_selftest(void);
+
+#endif
@@ -0,0 +1,402 @@
+#include "proto-dns-sockfilter.h"
+#include "configuration.h"
+#include "logger.h"
+#include "unusedparm.h"
+#include "util-acl.h"
+#include "util-realloc2.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/filter.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* On a UDP socket the program sees the packet from the UDP header, and
+ * the IP header at SKF_NET_OFF */
+#define UDP_HEADER_LENGTH   8
+
+/* A 12 byte header, plus a question for the root: a 1 byte name, the
+ * type and the class */
+#define DNS_MIN_QUERY       (12 + 1 + 4)
+
+/* The values a program returns: how much of the packet to keep */
+#define BPF_DROP            0
+#define BPF_ACCEPT          0xFFFFFFFF
+
+struct SockFilter
+{
+    struct sock_filter *code;
+    unsigned count;
+    unsigned max;
+};
+
+/* The blackhole list's rules, in order */
+struct SockFilterRules
+{
+    struct {
+        unsigned char addr[16];
+        unsigned version;
+        unsigned prefix_length;
+        int value;
+    } *list;
+    unsigned count;
+};
+
+static struct SockFilter *current;
+
+/****************************************************************************
+ ****************************************************************************/
+static unsigned
+bpf_emit(struct SockFilter *filter, unsigned short code,
+         unsigned jt, unsigned jf, unsigned k)
+{
+    struct sock_filter *insn;
+
+    if (filter->count >= filter->max) {
+        filter->max = filter->max * 2 + 64;
+        filter->code = REALLOC2(filter->code, filter->max, sizeof(filter->code[0]));
+    }
+    insn = &filter->code[filter->count];
+    insn->code = code;
+    insn->jt = (unsigned char)jt;
+    insn->jf = (unsigned char)jf;
+    insn->k = k;
+    return filter->count++;
+}
+
+/****************************************************************************
+ * Load 32-bits of the source address, and compare the first 'bits' of it
+ ****************************************************************************/
+static unsigned
+bpf_emit_compare(struct SockFilter *filter, unsigned offset,
+                 const unsigned char *addr, unsigned bits, unsigned jf)
+{
+    unsigned mask = 0xFFFFFFFF << (32 - bits);
+    unsigned value = addr[0]<<24 | addr[1]<<16 | addr[2]<<8 | addr[3];
+
+    bpf_emit(filter, BPF_LD|BPF_W|BPF_ABS, 0, 0, SKF_NET_OFF + offset);
+    if (bits < 32)
+        bpf_emit(filter, BPF_ALU|BPF_AND|BPF_K, 0, 0, mask);
+    return bpf_emit(filter, BPF_JMP|BPF_JEQ|BPF_K, 0, jf, value & mask);
+}
+
+/****************************************************************************
+ * The rules for one IP version, in order, each one returning as soon as
+ * it matches, finishing with accepting whatever nothing matched
+ ****************************************************************************/
+static void
+bpf_emit_rules(struct SockFilter *filter, const struct SockFilterRules *rules,
+               unsigned version)
+{
+    unsigned i;
+
+    for (i=0; i<rules->count; i++) {
+        const unsigned char *addr = rules->list[i].addr;
+        unsigned prefix_length = rules->list[i].prefix_length;
+        unsigned verdict = (rules->list[i].value == ACL_ALLOW) ? BPF_DROP : BPF_ACCEPT;
+        unsigned words = (prefix_length + 31) / 32;
+        unsigned start = filter->count;
+        unsigned length;
+        unsigned w;
+
+        if (rules->list[i].version != 0 && rules->list[i].version != version)
+            continue;
+
+        /* matches every address, so the rules after it don't matter */
+        if (rules->list[i].version == 0 || prefix_length == 0) {
+            bpf_emit(filter, BPF_RET|BPF_K, 0, 0, verdict);
+            return;
+        }
+
+        /* each word is a load, maybe a mask, and a compare that skips to
+         * the next rule, then the rule's answer */
+        length = 1;
+        for (w=0; w<words; w++)
+            length += (prefix_length - w*32 >= 32) ? 2 : 3;
+
+        for (w=0; w<words; w++) {
+            unsigned bits = prefix_length - w*32;
+            unsigned index;
+
+            if (bits > 32)
+                bits = 32;
+            index = bpf_emit_compare(filter,
+                                     (version == 4) ? 12 : 8 + w*4,
+                                     addr + w*4, bits, 0);
+            filter->code[index].jf = (unsigned char)(start + length - index - 1);
+        }
+        bpf_emit(filter, BPF_RET|BPF_K, 0, 0, verdict);
+    }
+    bpf_emit(filter, BPF_RET|BPF_K, 0, 0, BPF_ACCEPT);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+sockfilter_add_rule(void *data, unsigned version,
+                    const unsigned char *addr, unsigned prefix_length, int value)
+{
+    struct SockFilterRules *rules = (struct SockFilterRules *)data;
+
+    rules->list = REALLOC2(rules->list, rules->count + 1, sizeof(rules->list[0]));
+    memset(&rules->list[rules->count], 0, sizeof(rules->list[0]));
+    if (version)
+        memcpy(rules->list[rules->count].addr, addr, (version == 4) ? 4 : 16);
+    rules->list[rules->count].version = version;
+    rules->list[rules->count].prefix_length = prefix_length;
+    rules->list[rules->count].value = value;
+    rules->count++;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct SockFilter *
+sockfilter_compile(const struct Cfg_AddrMatchList *blackhole)
+{
+    struct SockFilter *filter;
+    struct SockFilterRules rules = {0, 0};
+    unsigned header_count;
+
+    filter = MALLOC2(sizeof(*filter));
+    memset(filter, 0, sizeof(*filter));
+
+    /*
+     * Header sanity
+     */
+    bpf_emit(filter, BPF_LD|BPF_W|BPF_LEN, 0, 0, 0);
+    bpf_emit(filter, BPF_JMP|BPF_JGE|BPF_K, 1, 0, UDP_HEADER_LENGTH + DNS_MIN_QUERY);
+    bpf_emit(filter, BPF_RET|BPF_K, 0, 0, BPF_DROP);
+
+    /* QR must be 0 */
+    bpf_emit(filter, BPF_LD|BPF_B|BPF_ABS, 0, 0, UDP_HEADER_LENGTH + 2);
+    bpf_emit(filter, BPF_JMP|BPF_JSET|BPF_K, 0, 1, 0x80);
+    bpf_emit(filter, BPF_RET|BPF_K, 0, 0, BPF_DROP);
+
+    /* opcodes 0-2 and 4-6 are assigned, 3 and 7-15 aren't */
+    bpf_emit(filter, BPF_ALU|BPF_AND|BPF_K, 0, 0, 0x78);
+    bpf_emit(filter, BPF_JMP|BPF_JEQ|BPF_K, 0, 1, 3<<3);
+    bpf_emit(filter, BPF_RET|BPF_K, 0, 0, BPF_DROP);
+    bpf_emit(filter, BPF_JMP|BPF_JGE|BPF_K, 0, 1, 7<<3);
+    bpf_emit(filter, BPF_RET|BPF_K, 0, 0, BPF_DROP);
+    header_count = filter->count;
+
+    /*
+     * The blackhole list, first the IPv4 rules, then the IPv6 rules. An
+     * IPv6 socket gets IPv4 packets with an IPv4 header, so we check
+     * the version in the IP header rather than the socket's.
+     */
+    if (blackhole)
+        acl_foreach_rule(blackhole, sockfilter_add_rule, &rules);
+    if (rules.count) {
+        unsigned jump;
+
+        bpf_emit(filter, BPF_LD|BPF_B|BPF_ABS, 0, 0, SKF_NET_OFF + 0);
+        bpf_emit(filter, BPF_ALU|BPF_RSH|BPF_K, 0, 0, 4);
+        bpf_emit(filter, BPF_JMP|BPF_JEQ|BPF_K, 0, 1, 6);
+        jump = bpf_emit(filter, BPF_JMP|BPF_JA, 0, 0, 0);
+        bpf_emit_rules(filter, &rules, 4);
+        filter->code[jump].k = filter->count - jump - 1;
+        bpf_emit_rules(filter, &rules, 6);
+
+        if (filter->count > BPF_MAXINSNS) {
+            LOG_ERR(C_NETWORK, "blackhole: too big for a socket filter, only checking in user-space\n");
+            filter->count = header_count;
+        }
+    }
+    if (filter->count == header_count)
+        bpf_emit(filter, BPF_RET|BPF_K, 0, 0, BPF_ACCEPT);
+
+    free(rules.list);
+    return filter;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+sockfilter_free(struct SockFilter *filter)
+{
+    if (filter == NULL)
+        return;
+    free(filter->code);
+    free(filter);
+}
+
+/****************************************************************************
+ * The kernel copies the program when it's attached, so the old one can
+ * be freed right away.
+ ****************************************************************************/
+void
+sockfilter_set_config(const struct Cfg_AddrMatchList *blackhole)
+{
+    sockfilter_free(current);
+    current = sockfilter_compile(blackhole);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+sockfilter_attach(int fd)
+{
+    struct sock_fprog prog;
+
+    if (current == NULL)
+        sockfilter_set_config(0);
+
+    prog.len = (unsigned short)current->count;
+    prog.filter = current->code;
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/****************************************************************************
+ * Send the packet, followed by an acceptable query, and see whether the
+ * first one to arrive is ours
+ ****************************************************************************/
+static int
+selftest_passes(int server, int client,
+                const struct sockaddr *to, socklen_t sizeof_to,
+                const unsigned char *px, unsigned length)
+{
+    static const unsigned char sentinel[] =
+        "\xff\xff\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+        "\x03www\x07" "example\x03" "com\x00\x00\x01\x00\x01";
+    unsigned char buf[512];
+    struct timeval tv;
+    fd_set readset;
+    ssize_t count;
+
+    sendto(client, (const char *)px, length, 0, to, sizeof_to);
+    sendto(client, (const char *)sentinel, sizeof(sentinel) - 1, 0, to, sizeof_to);
+
+    FD_ZERO(&readset);
+    FD_SET(server, &readset);
+    tv.tv_sec = 0;
+    tv.tv_usec = 100000;
+    if (select(server + 1, &readset, 0, 0, &tv) <= 0)
+        return 0;
+    count = recv(server, (char *)buf, sizeof(buf), 0);
+
+    /* empty the queue for the next test */
+    while (recv(server, (char *)buf + 2, sizeof(buf) - 2, MSG_DONTWAIT) > 0)
+        ;
+
+    return count >= 2 && buf[0] == px[0] && buf[1] == px[1];
+}
+
+/****************************************************************************
+ * Opens a socket on the loopback address, and returns the number of
+ * packets that got through that shouldn't have, and vice versa. The
+ * "nested" list negates a list that denies loopback, which mustn't turn
+ * into blackholing it.
+ ****************************************************************************/
+static int
+selftest_family(int family, const struct Configuration *cfg,
+                const char *blackhole_self, const char *blackhole_other)
+{
+    unsigned char query[] =
+        "\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+        "\x03www\x07" "example\x03" "com\x00\x00\x01\x00\x01";
+    unsigned length = sizeof(query) - 1;
+    struct sockaddr_storage sa;
+    socklen_t sizeof_sa;
+    int server;
+    int client;
+    int err = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&sa;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(0x7f000001);
+        sizeof_sa = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&sa;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_loopback;
+        sizeof_sa = sizeof(*sin6);
+    }
+
+    /* If there's no loopback for this family, there's nothing to test */
+    server = socket(family, SOCK_DGRAM, 0);
+    client = socket(family, SOCK_DGRAM, 0);
+    if (server < 0 || client < 0
+        || bind(server, (struct sockaddr *)&sa, sizeof_sa) != 0
+        || getsockname(server, (struct sockaddr *)&sa, &sizeof_sa) != 0) {
+        if (server >= 0)
+            close(server);
+        if (client >= 0)
+            close(client);
+        return 0;
+    }
+
+    sockfilter_set_config(0);
+    if (sockfilter_attach(server) != 0) {
+        close(server);
+        close(client);
+        return 0;
+    }
+
+    /* the header checks */
+    err |= !selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    query[2] = 0x81;    /* a response */
+    err |= selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    query[2] = 0x19;    /* opcode 3 */
+    err |= selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    query[2] = 0x79;    /* opcode 15 */
+    err |= selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    query[2] = 0x21;    /* NOTIFY */
+    err |= !selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    query[2] = 0x01;
+    err |= selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, 12);
+
+    /* the blackhole list */
+    sockfilter_set_config(cfg_addrlist_lookup(cfg, blackhole_self));
+    sockfilter_attach(server);
+    err |= selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    sockfilter_set_config(cfg_addrlist_lookup(cfg, blackhole_other));
+    sockfilter_attach(server);
+    err |= !selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+    sockfilter_set_config(cfg_addrlist_lookup(cfg, "nested"));
+    sockfilter_attach(server);
+    err |= !selftest_passes(server, client, (struct sockaddr *)&sa, sizeof_sa, query, length);
+
+    close(server);
+    close(client);
+    return err;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+sockfilter_selftest(void)
+{
+    struct Configuration *cfg;
+    int err = 0;
+
+    cfg = cfg_create();
+    cfg_load_string(cfg,
+        "acl \"local4\" { 10/8; 127.0.0.0/8; };\n"
+        "acl \"not-local4\" { !127.0.0.1; 127/8; ::1; };\n"
+        "acl \"local6\" { !fe80::/10; !::2; \"local4\"; 2001:db8::/32; ::/127; };\n"
+        "acl \"not-local6\" { 127.0.0.1; !::1; any; };\n"
+        "acl \"except-loopback\" { !127.0.0.1; !::1; 127/8; ::/127; };\n"
+        "acl \"nested\" { !\"except-loopback\"; };\n");
+
+    err |= selftest_family(AF_INET, cfg, "local4", "not-local4");
+    err |= selftest_family(AF_INET6, cfg, "local6", "not-local6");
+
+    sockfilter_set_config(0);
+    cfg_destroy(cfg);
+    return err;
+}
+
+#else
+
+void sockfilter_set_config(const struct Cfg_AddrMatchList *blackhole) {UNUSEDPARM(blackhole);}
+int sockfilter_attach(int fd) {UNUSEDPARM(fd); return -1;}
+int sockfilter_selftest(void) {return 0;}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PROTO_DNS_SOCKFILTER_H
+#define PROTO_DNS_SOCKFILTER_H
+struct Cfg_AddrMatchList;
+
+/**
+ * Early drop for sockets mode. Every packet that reaches one of our UDP
+ * sockets costs a system call and a copy before proto_dns_parse() gets
+ * to look at it, even when it's junk. So we compile a classic BPF
+ * program and attach it to the sockets with SO_ATTACH_FILTER, so that
+ * the kernel drops these before they're queued:
+ *
+ *  - payloads too short to hold a header and the shortest question
+ *  - responses (QR=1), which are never queries to us
+ *  - opcodes that haven't been assigned
+ *  - queries from addresses the "blackhole" list matches
+ *
+ * The worker threads still check everything, since this is only done
+ * on Linux, and a blackhole list too big for a BPF program is left out.
+ */
+
+/**
+ * Compile the program for this configuration. Sockets that are already
+ * open keep the previous program until sockfilter_attach() is called on
+ * them again.
+ */
+void sockfilter_set_config(const struct Cfg_AddrMatchList *blackhole);
+
+/**
+ * Attach the current program to a UDP socket, replacing any program it
+ * already has.
+ * @return 0 on success, or -1 on failure (or if this isn't supported)
+ */
+int sockfilter_attach(int fd);
+
+int sockfilter_selftest(void);
+
+#endif
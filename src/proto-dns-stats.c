@@ -0,0 +1,569 @@
+#include "proto-dns-stats.h"
+#include "db-zone.h"
+#include "domainname.h"
+#include "pixie-threads.h"
+#include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-rrl.h"
+#include "proto-dns-timing.h"
+#include "string_s.h"
+#include "util-realloc2.h"
+#include "zonefile-parse.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Threads beyond this many aren't counted */
+#define STATS_MAX_THREADS   256
+
+/* Query types above this are counted together */
+#define STATS_TYPES         256
+
+/* Extended rcodes go up to BADVERS and a bit beyond */
+#define STATS_RCODES        32
+
+/* Zones each thread keeps separate counts for, where queries for zones
+ * beyond that are counted together */
+#define STATS_ZONE_SLOTS    1024
+
+#define STATS_CACHE_LINE    64
+
+struct StatsZone
+{
+    uint64_t hash;      /* see zone_hash() */
+    uint64_t hits;
+    char *name;         /* NULL if the slot is unused */
+};
+
+struct Stats
+{
+    uint64_t queries[2][STATS_TYPES + 1];
+    uint64_t rcodes[STATS_RCODES];
+    uint64_t truncated;
+    uint64_t dropped[STATS_DROP_MAX];
+    uint64_t zone_other;
+    struct StatsZone zones[STATS_ZONE_SLOTS];
+};
+
+static const char *stats_drop_names[STATS_DROP_MAX] = {
+    "blocklist", "overload", "blackhole", "qname-filter", "rate-limit", "malformed"
+};
+
+static PIXIE_THREAD_LOCAL struct Stats *stats_local;
+static struct Stats *stats_threads[STATS_MAX_THREADS];
+static volatile unsigned stats_thread_count;
+
+
+/****************************************************************************
+ * This thread's counters, which start on a cache line of their own and
+ * take up whole cache lines, so no other thread writes anywhere near them
+ ****************************************************************************/
+static struct Stats *
+stats_get(void)
+{
+    struct Stats *stats = stats_local;
+    unsigned char *p;
+    unsigned index;
+
+    if (stats)
+        return stats;
+
+    p = MALLOC2(sizeof(*stats) + 2 * STATS_CACHE_LINE);
+    p += STATS_CACHE_LINE - ((size_t)p & (STATS_CACHE_LINE - 1));
+    stats = (struct Stats *)p;
+    memset(stats, 0, sizeof(*stats));
+
+    index = __sync_fetch_and_add(&stats_thread_count, 1);
+    if (index < STATS_MAX_THREADS)
+        stats_threads[index] = stats;
+
+    stats_local = stats;
+    return stats;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+stats_query(unsigned transport, unsigned query_type)
+{
+    if (query_type > STATS_TYPES)
+        query_type = STATS_TYPES;
+    stats_get()->queries[transport != STATS_UDP][query_type]++;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+stats_response(const struct DNS_OutgoingResponse *response)
+{
+    struct Stats *stats = stats_get();
+
+    if (response->rcode < STATS_RCODES)
+        stats->rcodes[response->rcode]++;
+    if (response->tc)
+        stats->truncated++;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+stats_drop(unsigned reason)
+{
+    stats_get()->dropped[reason]++;
+}
+
+/****************************************************************************
+ * The zone name as text, the first time a thread sees the zone
+ ****************************************************************************/
+static char *
+stats_zone_name(const struct DomainPointer *origin)
+{
+    char *name = MALLOC2(origin->length * 4 + 2);
+    unsigned length = 0;
+    unsigned i = 0;
+
+    while (i < origin->length && origin->name[i]) {
+        unsigned label_length = origin->name[i++];
+        unsigned j;
+
+        for (j=0; j<label_length && i < origin->length; j++) {
+            unsigned c = origin->name[i++];
+
+            /* keep it safe to put inside quotes */
+            if (c == '"' || c == '\\')
+                name[length++] = '\\';
+            if (c < 0x21 || c > 0x7e)
+                c = '?';
+            name[length++] = (char)c;
+        }
+        name[length++] = '.';
+    }
+    if (length == 0)
+        name[length++] = '.';
+    name[length] = '\0';
+    return name;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+stats_zone(const struct DBZone *zone)
+{
+    struct Stats *stats = stats_get();
+    uint64_t hash = zone_hash(zone);
+    unsigned i;
+
+    /* a short linear probe, so a busy table doesn't cost much */
+    for (i=0; i<8; i++) {
+        struct StatsZone *slot = &stats->zones[(hash + i) & (STATS_ZONE_SLOTS - 1)];
+
+        if (slot->hash == hash && slot->name) {
+            slot->hits++;
+            return;
+        }
+        if (slot->name == NULL) {
+            struct DomainPointer origin;
+
+            zone_name(zone, &origin);
+            slot->hash = hash;
+            slot->hits = 1;
+            slot->name = stats_zone_name(&origin);
+            return;
+        }
+    }
+    stats->zone_other++;
+}
+
+
+/****************************************************************************
+ * Text that grows as it's printed to
+ ****************************************************************************/
+struct StatsText
+{
+    char *buf;
+    size_t length;
+    size_t max;
+};
+
+static void
+stats_printf(struct StatsText *text, const char *fmt, ...)
+{
+    for (;;) {
+        va_list marker;
+        int n;
+
+        if (text->max - text->length >= 256) {
+            va_start(marker, fmt);
+            n = vsprintf_s(text->buf + text->length, text->max - text->length, fmt, marker);
+            va_end(marker);
+            if (n >= 0 && (size_t)n < text->max - text->length) {
+                text->length += n;
+                return;
+            }
+        }
+        text->max = text->max * 2 + 4096;
+        text->buf = REALLOC2(text->buf, text->max, 1);
+    }
+}
+
+static void
+stats_header_type(struct StatsText *text, const char *name, const char *help,
+                  const char *type)
+{
+    stats_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+stats_header(struct StatsText *text, const char *name, const char *help)
+{
+    stats_header_type(text, name, help, "counter");
+}
+
+/****************************************************************************
+ * Percentiles of the time spent in each stage, from the queries that
+ * "stage-timing" sampled
+ ****************************************************************************/
+static void
+stats_format_timing(struct StatsText *text)
+{
+    struct Timing_Summary summaries[TIMING_MAX];
+    unsigned i;
+
+    for (i=0; i<TIMING_MAX; i++)
+        timing_get_summary(i, &summaries[i]);
+
+    stats_header_type(text, "robdns_stage_seconds", "Time spent in each stage of answering sampled queries.", "summary");
+    for (i=0; i<TIMING_MAX; i++) {
+        const struct Timing_Summary *summary = &summaries[i];
+        const char *name = timing_stage_name(i);
+
+        if (summary->count == 0)
+            continue;
+        stats_printf(text, "robdns_stage_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n", name, summary->p50);
+        stats_printf(text, "robdns_stage_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n", name, summary->p99);
+        stats_printf(text, "robdns_stage_seconds{stage=\"%s\",quantile=\"0.999\"} %.9f\n", name, summary->p999);
+        stats_printf(text, "robdns_stage_seconds_sum{stage=\"%s\"} %.9f\n", name, summary->seconds);
+        stats_printf(text, "robdns_stage_seconds_count{stage=\"%s\"} %llu\n", name, (unsigned long long)summary->count);
+    }
+
+    stats_header(text, "robdns_stage_cycles_total", "Timestamp counter ticks spent in each stage of answering sampled queries.");
+    for (i=0; i<TIMING_MAX; i++) {
+        if (summaries[i].count == 0)
+            continue;
+        stats_printf(text, "robdns_stage_cycles_total{stage=\"%s\"} %llu\n",
+                     timing_stage_name(i), (unsigned long long)summaries[i].cycles);
+    }
+}
+
+/****************************************************************************
+ * Per-zone counts, added up across threads by name
+ ****************************************************************************/
+static void
+stats_format_zones(struct StatsText *text, unsigned count)
+{
+    struct StatsZone *merged;
+    unsigned merged_max = STATS_ZONE_SLOTS * 2 * (count ? count : 1);
+    uint64_t other = 0;
+    unsigned i;
+    unsigned j;
+
+    merged = REALLOC2(0, merged_max, sizeof(*merged));
+    memset(merged, 0, merged_max * sizeof(*merged));
+
+    for (i=0; i<count; i++) {
+        const struct Stats *stats = stats_threads[i];
+
+        if (stats == NULL)
+            continue;
+        other += stats->zone_other;
+        for (j=0; j<STATS_ZONE_SLOTS; j++) {
+            const struct StatsZone *slot = &stats->zones[j];
+            const char *name = slot->name;
+            unsigned k;
+
+            if (name == NULL)
+                continue;
+            for (k = (unsigned)(slot->hash % merged_max); ; k = (k + 1) % merged_max) {
+                if (merged[k].name == NULL) {
+                    merged[k].name = (char *)name;
+                    merged[k].hash = slot->hash;
+                    merged[k].hits = slot->hits;
+                    break;
+                }
+                if (merged[k].hash == slot->hash) {
+                    merged[k].hits += slot->hits;
+                    break;
+                }
+            }
+        }
+    }
+
+    stats_header(text, "robdns_zone_queries_total", "Queries for names in each zone.");
+    for (i=0; i<merged_max; i++) {
+        if (merged[i].name)
+            stats_printf(text, "robdns_zone_queries_total{zone=\"%s\"} %llu\n",
+                         merged[i].name, (unsigned long long)merged[i].hits);
+    }
+    if (other)
+        stats_printf(text, "robdns_zone_queries_total{zone=\"(other)\"} %llu\n",
+                     (unsigned long long)other);
+    free(merged);
+}
+
+/****************************************************************************
+ * A label value from the configuration, with the backslashes, quotes and
+ * newlines escaped the way the text format wants
+ ****************************************************************************/
+static char *
+stats_label_escape(const char *value)
+{
+    size_t value_length = strlen(value);
+    char *escaped = MALLOC2(value_length * 2 + 1);
+    size_t length = 0;
+    size_t i;
+
+    for (i=0; i<value_length; i++) {
+        char c = value[i];
+
+        if (c == '\\' || c == '"' || c == '\n')
+            escaped[length++] = '\\';
+        escaped[length++] = (c == '\n') ? 'n' : c;
+    }
+    escaped[length] = '\0';
+    return escaped;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+stats_format_qname(void *data, const char *name, unsigned is_exact, int action,
+                   uint64_t hits)
+{
+    static const char *action_names[] = {"pass", "drop", "refuse", "truncate"};
+    struct StatsText *text = (struct StatsText *)data;
+    char *escaped = stats_label_escape(name);
+
+    stats_printf(text, "robdns_qname_filter_hits_total{name=\"%s\",exact=\"%s\",action=\"%s\"} %llu\n",
+                 escaped, is_exact ? "yes" : "no",
+                 (action >= 0 && action < 4) ? action_names[action] : "unknown",
+                 (unsigned long long)hits);
+    free(escaped);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+char *
+stats_format_prometheus(size_t *length)
+{
+    static const char *transport_names[2] = {"udp", "tcp"};
+    static const char *rcode_names[STATS_RCODES] = {
+        "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+        "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE", "DSOTYPENI",
+        0, 0, 0, 0, "BADVERS",
+    };
+    struct StatsText text = {0, 0, 0};
+    struct Stats *total;
+    struct RRL_Counters rrl;
+    struct Overload_Counters overload;
+    unsigned count = stats_thread_count;
+    unsigned i;
+    unsigned j;
+
+    if (count > STATS_MAX_THREADS)
+        count = STATS_MAX_THREADS;
+
+    /* add up the threads, except for the zones */
+    total = MALLOC2(sizeof(*total));
+    memset(total, 0, sizeof(*total));
+    for (i=0; i<count; i++) {
+        const struct Stats *stats = stats_threads[i];
+
+        if (stats == NULL)
+            continue;
+        for (j=0; j<STATS_TYPES + 1; j++) {
+            total->queries[0][j] += stats->queries[0][j];
+            total->queries[1][j] += stats->queries[1][j];
+        }
+        for (j=0; j<STATS_RCODES; j++)
+            total->rcodes[j] += stats->rcodes[j];
+        total->truncated += stats->truncated;
+        for (j=0; j<STATS_DROP_MAX; j++)
+            total->dropped[j] += stats->dropped[j];
+    }
+
+    stats_header(&text, "robdns_queries_total", "Queries received, by transport and query type.");
+    for (i=0; i<2; i++) {
+        for (j=0; j<STATS_TYPES + 1; j++) {
+            const char *name;
+
+            if (total->queries[i][j] == 0)
+                continue;
+            name = (j < STATS_TYPES) ? name_of_type(j) : "other";
+            stats_printf(&text, "robdns_queries_total{transport=\"%s\",qtype=\"%s\"} %llu\n",
+                         transport_names[i], name, (unsigned long long)total->queries[i][j]);
+        }
+    }
+
+    stats_header(&text, "robdns_responses_total", "Responses sent, by rcode.");
+    for (j=0; j<STATS_RCODES; j++) {
+        if (total->rcodes[j] == 0)
+            continue;
+        if (rcode_names[j])
+            stats_printf(&text, "robdns_responses_total{rcode=\"%s\"} %llu\n",
+                         rcode_names[j], (unsigned long long)total->rcodes[j]);
+        else
+            stats_printf(&text, "robdns_responses_total{rcode=\"RCODE%u\"} %llu\n",
+                         j, (unsigned long long)total->rcodes[j]);
+    }
+
+    stats_header(&text, "robdns_truncated_total", "Responses sent with the TC bit set.");
+    stats_printf(&text, "robdns_truncated_total %llu\n", (unsigned long long)total->truncated);
+
+    stats_header(&text, "robdns_dropped_total", "Packets not answered, by reason.");
+    for (j=0; j<STATS_DROP_MAX; j++)
+        stats_printf(&text, "robdns_dropped_total{reason=\"%s\"} %llu\n",
+                     stats_drop_names[j], (unsigned long long)total->dropped[j]);
+    free(total);
+
+    stats_format_zones(&text, count);
+
+    rrl_get_counters(&rrl);
+    stats_header(&text, "robdns_rrl_responses_total", "Responses checked by rate limiting.");
+    stats_printf(&text, "robdns_rrl_responses_total %llu\n", (unsigned long long)rrl.responses);
+    stats_header(&text, "robdns_rrl_limited_total", "Responses rate limiting acted on, by what it did.");
+    stats_printf(&text, "robdns_rrl_limited_total{action=\"drop\"} %llu\n", (unsigned long long)rrl.dropped);
+    stats_printf(&text, "robdns_rrl_limited_total{action=\"slip\"} %llu\n", (unsigned long long)rrl.slipped);
+    stats_printf(&text, "robdns_rrl_limited_total{action=\"log-only\"} %llu\n", (unsigned long long)rrl.log_only);
+
+    stats_header(&text, "robdns_qname_filter_hits_total", "Queries matching each qname-filter rule.");
+    qnamefilter_get_counters(stats_format_qname, &text);
+
+    overload_get_counters(&overload);
+    stats_header(&text, "robdns_overload_episodes_total", "Times a core started shedding queries.");
+    stats_printf(&text, "robdns_overload_episodes_total %llu\n", (unsigned long long)overload.episodes);
+    stats_header(&text, "robdns_overload_queries_total", "Queries checked while overloaded, by outcome.");
+    stats_printf(&text, "robdns_overload_queries_total{outcome=\"admitted\"} %llu\n", (unsigned long long)overload.admitted);
+    stats_printf(&text, "robdns_overload_queries_total{outcome=\"shed\"} %llu\n", (unsigned long long)overload.shed);
+
+    stats_format_timing(&text);
+
+    *length = text.length;
+    return text.buf;
+}
+
+/****************************************************************************
+ * The value on the line that starts with this, or 0 if there isn't one
+ ****************************************************************************/
+static unsigned long long
+selftest_value(const char *text, const char *prefix)
+{
+    size_t prefix_length = strlen(prefix);
+    const char *p = text;
+
+    while (p && *p) {
+        if (strncmp(p, prefix, prefix_length) == 0 && p[prefix_length] == ' ')
+            return strtoull(p + prefix_length + 1, 0, 10);
+        p = strchr(p, '\n');
+        if (p)
+            p++;
+    }
+    return 0;
+}
+
+struct StatsSelftest
+{
+    const char *prefix;
+    unsigned long long expected;
+};
+
+int
+stats_selftest(void)
+{
+    static const struct StatsSelftest tests[] = {
+        {"robdns_queries_total{transport=\"udp\",qtype=\"A\"}", 3},
+        {"robdns_queries_total{transport=\"tcp\",qtype=\"A\"}", 1},
+        {"robdns_queries_total{transport=\"udp\",qtype=\"other\"}", 2},
+        {"robdns_responses_total{rcode=\"REFUSED\"}", 1},
+        {"robdns_responses_total{rcode=\"BADVERS\"}", 1},
+        {"robdns_truncated_total", 1},
+        {"robdns_dropped_total{reason=\"blocklist\"}", 2},
+        {"robdns_dropped_total{reason=\"malformed\"}", 1},
+        {0, 0}
+    };
+    unsigned long long before[sizeof(tests)/sizeof(tests[0])];
+    struct DNS_OutgoingResponse response[1];
+    struct DomainPointer origin;
+    char *text;
+    char *name;
+    size_t length;
+    unsigned i;
+
+    text = stats_format_prometheus(&length);
+    if (text == NULL || strlen(text) != length)
+        return 1;
+    for (i=0; tests[i].prefix; i++)
+        before[i] = selftest_value(text, tests[i].prefix);
+    free(text);
+
+    stats_query(STATS_UDP, 1);
+    stats_query(STATS_UDP, 1);
+    stats_query(STATS_UDP, 1);
+    stats_query(STATS_TCP, 1);
+    stats_query(STATS_UDP, 32769);
+    stats_query(STATS_UDP, 65535);
+    memset(response, 0, sizeof(response[0]));
+    response->rcode = RCODE_REFUSED;
+    stats_response(response);
+    response->rcode = RCODE_BADVERS;
+    response->tc = 1;
+    stats_response(response);
+    stats_drop(STATS_DROP_BLOCKLIST);
+    stats_drop(STATS_DROP_BLOCKLIST);
+    stats_drop(STATS_DROP_MALFORMED);
+
+    text = stats_format_prometheus(&length);
+    for (i=0; tests[i].prefix; i++) {
+        unsigned long long value = selftest_value(text, tests[i].prefix);
+
+        if (value - before[i] != tests[i].expected) {
+            fprintf(stderr, "stats: %s %llu, expected %llu more than %llu\n",
+                    tests[i].prefix, value, tests[i].expected, before[i]);
+            free(text);
+            return 1;
+        }
+    }
+    if (strstr(text, "# TYPE robdns_dropped_total counter\n") == NULL) {
+        free(text);
+        return 1;
+    }
+    free(text);
+
+    /* zone names are made safe to put in quotes */
+    origin.name = (const unsigned char *)"\7exa\"ple\3com";
+    origin.length = 13;
+    name = stats_zone_name(&origin);
+    if (strcmp(name, "exa\\\"ple.com.") != 0) {
+        free(name);
+        return 1;
+    }
+    free(name);
+
+    /* and so are the names of qname-filter rules, which come straight
+     * from the configuration */
+    {
+        struct StatsText qname = {0, 0, 0};
+        int is_escaped;
+
+        stats_format_qname(&qname, "a\\b\"c\nd", 1, 1, 7);
+        is_escaped = qname.buf != NULL
+            && strcmp(qname.buf, "robdns_qname_filter_hits_total"
+                      "{name=\"a\\\\b\\\"c\\nd\",exact=\"yes\",action=\"drop\"} 7\n") == 0;
+        free(qname.buf);
+        if (!is_escaped)
+            return 1;
+    }
+
+    return 0;
+}
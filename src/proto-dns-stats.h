@@ -0,0 +1,73 @@
+#ifndef PROTO_DNS_STATS_H
+#define PROTO_DNS_STATS_H
+#include <stddef.h>
+#include <stdint.h>
+struct DBZone;
+struct DNS_OutgoingResponse;
+
+/*
+    Query statistics
+
+    Counts of queries by transport and type, responses by rcode, truncated
+    responses, packets dropped and why, and queries per zone. Each thread
+    counts into its own block of counters, allocated on its own cache
+    lines the first time it counts anything, so counting is a plain
+    increment that no other core ever writes to. Reading adds up all the
+    blocks, without locking, so the totals are only approximately up to
+    date.
+
+    stats_format_prometheus() turns these, along with the counters kept
+    by rate limiting, the query-name filter, and overload shedding, into
+    the Prometheus text format for the statistics port.
+*/
+
+enum {
+    STATS_UDP,
+    STATS_TCP,
+};
+
+enum {
+    STATS_DROP_BLOCKLIST,   /* "blocklist-file" or the control port */
+    STATS_DROP_OVERLOAD,    /* shed while overloaded */
+    STATS_DROP_BLACKHOLE,   /* "blackhole" */
+    STATS_DROP_QNAME,       /* "qname-filter" with "drop" */
+    STATS_DROP_RATE_LIMIT,  /* response rate limiting */
+    STATS_DROP_MALFORMED,   /* not a query we could parse */
+    STATS_DROP_MAX
+};
+
+/**
+ * Count a query we've parsed.
+ * @param transport
+ *      STATS_UDP or STATS_TCP
+ */
+void stats_query(unsigned transport, unsigned query_type);
+
+/**
+ * Count a response we're sending, by its rcode and whether it's truncated.
+ */
+void stats_response(const struct DNS_OutgoingResponse *response);
+
+/**
+ * Count a packet we're not answering.
+ * @param reason
+ *      One of the STATS_DROP_xxx values.
+ */
+void stats_drop(unsigned reason);
+
+/**
+ * Count a query for a name in this zone.
+ */
+void stats_zone(const struct DBZone *zone);
+
+/**
+ * The statistics in Prometheus text format.
+ * @param length
+ *      Set to the length of the text.
+ * @return the text, to be freed by the caller
+ */
+char *stats_format_prometheus(size_t *length);
+
+int stats_selftest(void);
+
+#endif
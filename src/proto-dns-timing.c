@@ -0,0 +1,399 @@
+#include "proto-dns-timing.h"
+#include "pixie.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include "util-realloc2.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Threads beyond this many aren't timed */
+#define TIMING_MAX_THREADS  256
+
+/* Each power of two is split into this many buckets, so a bucket is at
+ * most 1/16th of the values in it */
+#define TIMING_SUB_BITS     4
+#define TIMING_SUB          (1 << TIMING_SUB_BITS)
+#define TIMING_BUCKETS      ((64 - TIMING_SUB_BITS + 1) * TIMING_SUB)
+
+#define TIMING_CACHE_LINE   64
+
+/* The timestamp counter where there is one, otherwise nanoseconds */
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define timing_now() ((uint64_t)__rdtsc())
+#else
+#define timing_now() pixie_nanotime()
+#endif
+
+struct TimingStage
+{
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t buckets[TIMING_BUCKETS];
+};
+
+struct Timing
+{
+    unsigned countdown;
+    struct TimingStage stages[TIMING_MAX];
+};
+
+static const char *timing_stage_names[TIMING_MAX] = {
+    "parse", "resolve", "format", "xmit"
+};
+
+static volatile unsigned timing_rate;
+static double timing_ticks_per_second;
+
+static PIXIE_THREAD_LOCAL struct Timing *timing_local;
+static struct Timing *timing_threads[TIMING_MAX_THREADS];
+static volatile unsigned timing_thread_count;
+
+
+/****************************************************************************
+ * This thread's histograms, on cache lines of their own like the counters
+ * in proto-dns-stats.c
+ ****************************************************************************/
+static struct Timing *
+timing_get(void)
+{
+    struct Timing *timing = timing_local;
+    unsigned char *p;
+    unsigned index;
+
+    if (timing)
+        return timing;
+
+    p = MALLOC2(sizeof(*timing) + 2 * TIMING_CACHE_LINE);
+    p += TIMING_CACHE_LINE - ((size_t)p & (TIMING_CACHE_LINE - 1));
+    timing = (struct Timing *)p;
+    memset(timing, 0, sizeof(*timing));
+
+    index = __sync_fetch_and_add(&timing_thread_count, 1);
+    if (index < TIMING_MAX_THREADS)
+        timing_threads[index] = timing;
+
+    timing_local = timing;
+    return timing;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+timing_set_config(unsigned sample_rate)
+{
+    timing_rate = sample_rate;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+const char *
+timing_stage_name(unsigned stage)
+{
+    if (stage >= TIMING_MAX)
+        return "unknown";
+    return timing_stage_names[stage];
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+timing_sample(struct StageTimer *timer)
+{
+    unsigned rate = timing_rate;
+    struct Timing *timing;
+
+    timer->is_sampled = 0;
+    if (rate == 0)
+        return;
+
+    timing = timing_get();
+    if (timing->countdown > 1) {
+        timing->countdown--;
+        return;
+    }
+    timing->countdown = rate;
+    timer->is_sampled = 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+timing_start(struct StageTimer *timer)
+{
+    timer->start = timing_now();
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static unsigned
+timing_log2(uint64_t n)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(n);
+#else
+    unsigned e = 0;
+    while (n >>= 1)
+        e++;
+    return e;
+#endif
+}
+
+/****************************************************************************
+ * Values under 16 get a bucket each, above that each power of two gets
+ * 16 buckets, from the 4 bits after the leading one
+ ****************************************************************************/
+static unsigned
+timing_bucket(uint64_t ticks)
+{
+    unsigned e;
+
+    if (ticks < TIMING_SUB)
+        return (unsigned)ticks;
+    e = timing_log2(ticks);
+    return (e - TIMING_SUB_BITS + 1) * TIMING_SUB
+            + (unsigned)((ticks >> (e - TIMING_SUB_BITS)) & (TIMING_SUB - 1));
+}
+
+/****************************************************************************
+ * The smallest value in the bucket, and how many values it holds
+ ****************************************************************************/
+static uint64_t
+timing_bucket_low(unsigned index, uint64_t *width)
+{
+    unsigned e;
+
+    if (index < TIMING_SUB) {
+        *width = 1;
+        return index;
+    }
+    e = index / TIMING_SUB + TIMING_SUB_BITS - 1;
+    *width = 1ULL << (e - TIMING_SUB_BITS);
+    return (uint64_t)(TIMING_SUB + index % TIMING_SUB) << (e - TIMING_SUB_BITS);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+timing_add(struct TimingStage *stage, uint64_t ticks, unsigned count)
+{
+    stage->count += count;
+    stage->cycles += ticks;
+    stage->buckets[timing_bucket(ticks / count)] += count;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+timing_stop(struct StageTimer *timer, unsigned stage, unsigned count)
+{
+    uint64_t ticks = timing_now() - timer->start;
+
+    if (count == 0)
+        return;
+
+    /* moving to a core whose counter is behind can't make it negative */
+    if ((int64_t)ticks < 0)
+        ticks = 0;
+    timing_add(&timing_get()->stages[stage], ticks, count);
+}
+
+/****************************************************************************
+ * The middle of the bucket that holds this fraction of the values
+ ****************************************************************************/
+static uint64_t
+timing_percentile(const struct TimingStage *stage, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * (double)stage->count + 0.999999);
+    uint64_t seen = 0;
+    unsigned i;
+
+    if (rank == 0)
+        rank = 1;
+    for (i=0; i<TIMING_BUCKETS; i++) {
+        seen += stage->buckets[i];
+        if (seen >= rank) {
+            uint64_t width;
+            uint64_t low = timing_bucket_low(i, &width);
+            return low + width / 2;
+        }
+    }
+    return 0;
+}
+
+/****************************************************************************
+ * How fast the timestamp counter runs, measured against the clock
+ ****************************************************************************/
+static double
+timing_calibrate(void)
+{
+    uint64_t ticks;
+    uint64_t nanoseconds;
+
+    if (timing_ticks_per_second == 0.0) {
+        ticks = timing_now();
+        nanoseconds = pixie_nanotime();
+        pixie_mssleep(10);
+        ticks = timing_now() - ticks;
+        nanoseconds = pixie_nanotime() - nanoseconds;
+        if (nanoseconds == 0)
+            return 1000000000.0;
+        timing_ticks_per_second = (double)ticks * 1000000000.0 / (double)nanoseconds;
+    }
+    return timing_ticks_per_second;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+timing_get_summary(unsigned stage, struct Timing_Summary *summary)
+{
+    struct TimingStage *total;
+    unsigned count = timing_thread_count;
+    double hz;
+    unsigned i;
+    unsigned j;
+
+    memset(summary, 0, sizeof(*summary));
+    if (stage >= TIMING_MAX)
+        return;
+    if (count > TIMING_MAX_THREADS)
+        count = TIMING_MAX_THREADS;
+
+    total = MALLOC2(sizeof(*total));
+    memset(total, 0, sizeof(*total));
+    for (i=0; i<count; i++) {
+        const struct Timing *timing = timing_threads[i];
+
+        if (timing == NULL)
+            continue;
+        total->count += timing->stages[stage].count;
+        total->cycles += timing->stages[stage].cycles;
+        for (j=0; j<TIMING_BUCKETS; j++)
+            total->buckets[j] += timing->stages[stage].buckets[j];
+    }
+
+    summary->count = total->count;
+    summary->cycles = total->cycles;
+    if (total->count) {
+        hz = timing_calibrate();
+        summary->seconds = (double)total->cycles / hz;
+        summary->p50 = (double)timing_percentile(total, 0.50) / hz;
+        summary->p99 = (double)timing_percentile(total, 0.99) / hz;
+        summary->p999 = (double)timing_percentile(total, 0.999) / hz;
+    }
+    free(total);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+selftest_near(uint64_t value, uint64_t expected)
+{
+    uint64_t error = (value > expected) ? value - expected : expected - value;
+    return error <= expected / TIMING_SUB + 1;
+}
+
+int
+timing_selftest(void)
+{
+    static const uint64_t values[] = {
+        0, 1, 15, 16, 17, 31, 32, 33, 100, 1000, 4095, 4096, 123456789,
+        0x7FFFFFFFFFFFFFFFULL, 0x8000000000000000ULL, 0xFFFFFFFFFFFFFFFFULL,
+    };
+    struct TimingStage *stage;
+    struct Timing_Summary before;
+    struct Timing_Summary after;
+    struct StageTimer timer;
+    unsigned sampled;
+    unsigned i;
+
+    /* every value lands in a bucket that holds it, and the buckets are
+     * in order */
+    for (i=0; i<sizeof(values)/sizeof(values[0]); i++) {
+        unsigned index = timing_bucket(values[i]);
+        uint64_t width;
+        uint64_t low;
+
+        if (index >= TIMING_BUCKETS) {
+            fprintf(stderr, "timing: %llu in bucket %u\n", (unsigned long long)values[i], index);
+            return 1;
+        }
+        low = timing_bucket_low(index, &width);
+        if (values[i] < low || values[i] - low >= width) {
+            fprintf(stderr, "timing: %llu not in bucket %u\n", (unsigned long long)values[i], index);
+            return 1;
+        }
+    }
+    for (i=1; i<100000; i++) {
+        if (timing_bucket(i) < timing_bucket(i - 1)) {
+            fprintf(stderr, "timing: bucket for %u out of order\n", i);
+            return 1;
+        }
+    }
+
+    /* percentiles of 1..1000 are where they should be, within a bucket */
+    stage = MALLOC2(sizeof(*stage));
+    memset(stage, 0, sizeof(*stage));
+    for (i=1; i<=1000; i++)
+        timing_add(stage, i, 1);
+    if (!selftest_near(timing_percentile(stage, 0.50), 500)
+        || !selftest_near(timing_percentile(stage, 0.99), 990)
+        || !selftest_near(timing_percentile(stage, 0.999), 999)) {
+        fprintf(stderr, "timing: percentiles %llu %llu %llu\n",
+                (unsigned long long)timing_percentile(stage, 0.50),
+                (unsigned long long)timing_percentile(stage, 0.99),
+                (unsigned long long)timing_percentile(stage, 0.999));
+        free(stage);
+        return 1;
+    }
+
+    /* a batch counts as that many queries */
+    memset(stage, 0, sizeof(*stage));
+    timing_add(stage, 8000, 8);
+    if (stage->count != 8 || stage->buckets[timing_bucket(1000)] != 8) {
+        fprintf(stderr, "timing: batch recorded wrong\n");
+        free(stage);
+        return 1;
+    }
+    free(stage);
+
+    /* off means nothing is sampled */
+    timing_set_config(0);
+    timing_sample(&timer);
+    if (timer.is_sampled) {
+        fprintf(stderr, "timing: sampled while off\n");
+        return 1;
+    }
+
+    /* one in four, once we've got to the start of a round */
+    timing_set_config(4);
+    for (i=0; i<4; i++) {
+        timing_sample(&timer);
+        if (timer.is_sampled)
+            break;
+    }
+    for (sampled=0, i=0; i<12; i++) {
+        timing_sample(&timer);
+        sampled += timer.is_sampled;
+    }
+    if (sampled != 3) {
+        fprintf(stderr, "timing: sampled %u of 12, expected 3\n", sampled);
+        timing_set_config(0);
+        return 1;
+    }
+
+    /* and what's sampled shows up in the summary */
+    timing_get_summary(TIMING_FORMAT, &before);
+    timer.is_sampled = 1;
+    TIMING_START(&timer);
+    timing_stop(&timer, TIMING_FORMAT, 2);
+    timing_get_summary(TIMING_FORMAT, &after);
+    timing_set_config(0);
+    if (after.count != before.count + 2 || after.p999 < after.p50) {
+        fprintf(stderr, "timing: summary count %llu, expected %llu\n",
+                (unsigned long long)after.count, (unsigned long long)before.count + 2);
+        return 1;
+    }
+
+    return 0;
+}
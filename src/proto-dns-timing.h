@@ -0,0 +1,92 @@
+#ifndef PROTO_DNS_TIMING_H
+#define PROTO_DNS_TIMING_H
+#include <stdint.h>
+
+/*
+    Stage timing
+
+    Where the time goes in answering a query: parsing it, resolving it,
+    formatting the response, and transmitting it. Each stage is timed
+    with the CPU's timestamp counter into a histogram kept by each
+    thread, where buckets are powers of two split 16 ways (like an HDR
+    histogram), so any duration is recorded to within about 6% with
+    under a thousand buckets. Reading adds up all the threads'
+    histograms to get the percentiles for the statistics port.
+
+    Timing every query would cost more than some stages take, so only
+    one query in "stage-timing" is timed, chosen by counting down. Where
+    queries are received and resolved in batches, it's one batch in that
+    many instead. For queries that aren't timed, each stage costs a test
+    of a flag that's already in a register. One in 100 keeps the total cost well under 1%.
+
+    Usage:
+        struct StageTimer timer;
+
+        timing_sample(&timer);
+        TIMING_START(&timer);
+        proto_dns_parse(...);
+        TIMING_STOP(&timer, TIMING_PARSE);
+*/
+
+enum {
+    TIMING_PARSE,       /* proto_dns_parse() */
+    TIMING_RESOLVE,     /* resolver_algorithm() */
+    TIMING_FORMAT,      /* dns_format_response() */
+    TIMING_XMIT,        /* sendto() or frame_xmit_response() */
+    TIMING_MAX
+};
+
+struct StageTimer
+{
+    uint64_t start;
+    unsigned is_sampled;
+};
+
+struct Timing_Summary
+{
+    uint64_t count;     /* times the stage was timed */
+    uint64_t cycles;    /* total timestamp counter ticks */
+    double seconds;     /* the same, converted to seconds */
+    double p50;         /* percentiles, in seconds */
+    double p99;
+    double p999;
+};
+
+/**
+ * Time one query in this many, or none if 0.
+ */
+void timing_set_config(unsigned sample_rate);
+
+/**
+ * Decide whether to time the stages of this query, or batch of queries.
+ */
+void timing_sample(struct StageTimer *timer);
+
+void timing_start(struct StageTimer *timer);
+
+/**
+ * Record the time since timing_start() against this stage.
+ * @param count
+ *      How many queries that time was spent on, for a batch, where each
+ *      is recorded as taking its share of the time.
+ */
+void timing_stop(struct StageTimer *timer, unsigned stage, unsigned count);
+
+#define TIMING_START(timer) \
+    do { if ((timer)->is_sampled) timing_start(timer); } while (0)
+#define TIMING_STOP(timer, stage) \
+    do { if ((timer)->is_sampled) timing_stop(timer, stage, 1); } while (0)
+
+/**
+ * The name of the stage, such as "parse"
+ */
+const char *timing_stage_name(unsigned stage);
+
+/**
+ * Add up all the threads' histograms for the stage.
+ */
+void timing_get_summary(unsigned stage, struct Timing_Summary *summary);
+
+int timing_selftest(void);
+
+#endif
@@ -25,6 +25,12 @@ struct DNS_Incoming
         unsigned version;
         unsigned z;
     } edns0;
+
+    /* The COOKIE option from the OPT record (RFC 7873), which is the
+     * 8-byte client cookie, and any 8 to 32 byte server cookie after it.
+     * The length is 0 if there wasn't one */
+    unsigned cookie_length;
+    unsigned char cookie[40];
     const unsigned char *req;
     unsigned req_length;
     
@@ -34,12 +40,24 @@ struct DNS_Incoming
     unsigned query_class;
     unsigned char query_name_buffer[256];
 
-    unsigned rr_count;
-    unsigned short rr_offset[1024];
+    /* Where the sections start. Individual records aren't remembered,
+     * since queries rarely have anything besides the question and an
+     * OPT record. Code that needs them, such as for TSIG, walks the
+     * section with dns_rr_skip() */
+    unsigned query_offset;
+    unsigned answer_offset;
+    unsigned additional_offset;
     unsigned edns0_offset;
 };
 
 void proto_dns_parse(struct DNS_Incoming *dns, const unsigned char px[], unsigned offset, unsigned max);
 
+/**
+ * Skip a resource record in the answer, authority, or additional section.
+ * @return the offset of the next record, or a value greater than 'max'
+ *      if the record is corrupt
+ */
+unsigned dns_rr_skip(const unsigned char px[], unsigned offset, unsigned max);
+
 
 #endif
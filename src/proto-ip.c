@@ -1,6 +1,8 @@
 #include "network.h"
 #include "thread.h"
 #include "adapter.h"
+#include "proto-dns-stats.h"
+#include "util-blocklist.h"
 #include <string.h>
 
 #define VERIFY_REMAINING(n) if (offset+(n) > max) return;
@@ -59,6 +61,19 @@ proto_ip_parse(struct Frame *frame, const unsigned char px[], unsigned offset, u
 	frame->ip_ver = 4;
 	frame->ip_src = px[offset+12]<<24 | px[offset+13]<<16 | px[offset+14]<<8 | px[offset+15]; 
 	frame->ip_dst = px[offset+16]<<24 | px[offset+17]<<16 | px[offset+18]<<8 | px[offset+19]; 
+
+	/* Blocked networks get nothing, not even parsed */
+	if (blocklist_is_blocked(px + offset + 12, 4)) {
+		stats_drop(STATS_DROP_BLOCKLIST);
+		return;
+	}
+
+	/* Ignore Ethernet padding after the end of the datagram, which
+	 * TCP would otherwise treat as data */
+	if (ip.total_length < ip.header_length)
+		return;
+	if (offset + ip.total_length < max)
+		max = offset + ip.total_length;
 	offset += 20;
 
 	/* Process IP options */
@@ -72,6 +87,7 @@ proto_ip_parse(struct Frame *frame, const unsigned char px[], unsigned offset, u
 		proto_icmp_parse(frame, px, offset, max);
 		break;
 	case 6: /* TCP */
+		proto_tcp_parse(frame, px, offset, max);
 		break;
 	case 17: /* UDP */
         proto_udp_parse(frame, px, offset, max); 
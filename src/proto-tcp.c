@@ -0,0 +1,887 @@
+/*
+    Minimal TCP for DNS
+
+    This isn't a general TCP stack. It handles just the exchange that DNS
+    clients do when retrying a truncated query: connect, send one query,
+    read the response, close. Only that, and only in that order:
+
+    1. SYN: we reply with a SYN-ACK whose sequence number is a "SYN cookie",
+       a keyed hash of the connection, so that we keep no state. A flood
+       of SYNs costs us a hash and a transmit per packet, and nothing else.
+    2. The ACK completing the handshake carries the cookie back to us. If
+       it doesn't carry any data, we ignore it, still without state.
+    3. The query, normally in a single segment, though we'll put up with
+       the 2-byte length being sent separately. Only now do we create an
+       entry in the per-core connection table, remembering the query.
+    4. The response, in one segment or two (we limit it to two MSS worth,
+       truncating larger responses), the last with a FIN.
+    5. The client's FIN, which we ACK and forget the connection.
+
+    Nothing is retransmitted on a timer. If the response is lost, the
+    client either retransmits its query or sends duplicate ACKs, and we
+    answer again from the query we remembered. If the connection table
+    entry has been reused by then, the client times out and retries, as
+    it would with any other lost DNS packet.
+*/
+#include "network.h"
+#include "adapter.h"
+#include "thread.h"
+#include "proto-dns-cookie.h"
+#include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-stats.h"
+#include "resolver.h"
+#include "crypto-siphash.h"
+#include "pixie-threads.h"
+#include "pixie-timer.h"
+#include "util-acl.h"
+#include "util-realloc2.h"
+#include "unusedparm.h"
+#include <stdio.h>
+#include <string.h>
+
+#define VERIFY_REMAINING(n) if (offset+(n) > max) return;
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+/* Entries per core. This is direct-mapped, a new connection replacing
+ * whatever was in its slot before */
+#define TCP_TABLE_SIZE      256
+
+/* The largest query we'll accept, not counting the 2-byte length. Queries
+ * are normally under 100 bytes, but leave room for EDNS0 options and
+ * TSIG */
+#define TCP_QUERY_MAX       512
+
+/* Forget connections after this many seconds */
+#define TCP_TABLE_TIMEOUT   10
+
+/* Cookies are good for between one and two of these periods, in seconds */
+#define TCP_COOKIE_PERIOD   64
+
+/* The MSS values we can encode in the low 2 bits of a cookie */
+static const unsigned mss_table[4] = {536, 1220, 1440, 1460};
+
+/* The response is at most two segments of the largest MSS */
+#define TCP_RESPONSE_MAX    (2 * 1460)
+
+struct TcpEntry
+{
+    unsigned ip_them;
+    unsigned ip_me;
+    unsigned short port_them;
+    unsigned short port_me;
+    unsigned seqno_them;        /* first byte of the query */
+    unsigned seqno_me;          /* first byte of the response */
+    unsigned acked;             /* last ACK we saw */
+    unsigned time;
+    unsigned short mss;
+    unsigned short length;      /* bytes of query received so far */
+    unsigned short response_length;
+    unsigned char is_used;
+    unsigned char is_answered;
+    unsigned char query[2 + TCP_QUERY_MAX];
+};
+
+struct TcpTable
+{
+    uint64_t key[2];
+    struct TcpEntry entries[TCP_TABLE_SIZE];
+};
+
+/* Each core has its own table, and its own cookie key. With receive-side
+ * scaling, all the packets of a connection arrive on the same core */
+static PIXIE_THREAD_LOCAL struct TcpTable *tcp_table;
+
+
+/****************************************************************************
+ ****************************************************************************/
+static struct TcpTable *
+tcp_table_get(void)
+{
+    struct TcpTable *table = tcp_table;
+    unsigned char seed[16];
+    FILE *fp;
+
+    if (table)
+        return table;
+
+    table = MALLOC2(sizeof(*table));
+    memset(table, 0, sizeof(*table));
+
+    /* The key only needs to be unguessable from outside, so if there's
+     * no /dev/urandom, the time and our address will do */
+    memset(seed, 0, sizeof(seed));
+    fp = fopen("/dev/urandom", "rb");
+    if (fp) {
+        if (fread(seed, 1, sizeof(seed), fp) != sizeof(seed))
+            memset(seed, 0, sizeof(seed));
+        fclose(fp);
+    }
+    memcpy(&table->key[0], seed, 8);
+    memcpy(&table->key[1], seed + 8, 8);
+    table->key[0] ^= pixie_nanotime();
+    table->key[1] ^= (uint64_t)(size_t)table;
+
+    tcp_table = table;
+    return table;
+}
+
+/****************************************************************************
+ * The cookie is a hash of the connection and the time period, with the
+ * index of the MSS in the low two bits, since the MSS from the SYN is
+ * the only thing we need to remember from it.
+ ****************************************************************************/
+static unsigned
+tcp_cookie(const struct TcpTable *table, const struct Frame *frame,
+           unsigned seqno_them, unsigned period)
+{
+    unsigned char buf[20];
+    uint64_t hash;
+
+    buf[ 0] = (unsigned char)(frame->ip_src>>24);
+    buf[ 1] = (unsigned char)(frame->ip_src>>16);
+    buf[ 2] = (unsigned char)(frame->ip_src>> 8);
+    buf[ 3] = (unsigned char)(frame->ip_src>> 0);
+    buf[ 4] = (unsigned char)(frame->ip_dst>>24);
+    buf[ 5] = (unsigned char)(frame->ip_dst>>16);
+    buf[ 6] = (unsigned char)(frame->ip_dst>> 8);
+    buf[ 7] = (unsigned char)(frame->ip_dst>> 0);
+    buf[ 8] = (unsigned char)(frame->port_src>>8);
+    buf[ 9] = (unsigned char)(frame->port_src>>0);
+    buf[10] = (unsigned char)(frame->port_dst>>8);
+    buf[11] = (unsigned char)(frame->port_dst>>0);
+    buf[12] = (unsigned char)(seqno_them>>24);
+    buf[13] = (unsigned char)(seqno_them>>16);
+    buf[14] = (unsigned char)(seqno_them>> 8);
+    buf[15] = (unsigned char)(seqno_them>> 0);
+    buf[16] = (unsigned char)(period>>24);
+    buf[17] = (unsigned char)(period>>16);
+    buf[18] = (unsigned char)(period>> 8);
+    buf[19] = (unsigned char)(period>> 0);
+
+    hash = siphash_x(buf, sizeof(buf), table->key[0], table->key[1]);
+    return (unsigned)(hash ^ (hash >> 32)) & ~3U;
+}
+
+/****************************************************************************
+ * @return the MSS encoded in the cookie, or 0 if the cookie isn't one
+ *      of ours from this period or the previous one
+ ****************************************************************************/
+static unsigned
+tcp_cookie_check(const struct TcpTable *table, const struct Frame *frame,
+                 unsigned seqno_them, unsigned cookie)
+{
+    unsigned period = frame->time_secs / TCP_COOKIE_PERIOD;
+
+    if (tcp_cookie(table, frame, seqno_them, period) == (cookie & ~3U))
+        return mss_table[cookie & 3];
+    if (period && tcp_cookie(table, frame, seqno_them, period - 1) == (cookie & ~3U))
+        return mss_table[cookie & 3];
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct TcpEntry *
+tcp_entry_slot(struct TcpTable *table, const struct Frame *frame)
+{
+    unsigned hash;
+
+    hash = frame->ip_src * 0x9E3779B1;
+    hash ^= (frame->port_src << 16 | frame->port_dst) * 0x85EBCA6B;
+    hash ^= frame->ip_dst;
+    hash ^= hash >> 15;
+    return &table->entries[hash & (TCP_TABLE_SIZE-1)];
+}
+
+/****************************************************************************
+ * Find the connection the segment belongs to, if we have one
+ ****************************************************************************/
+static struct TcpEntry *
+tcp_entry_lookup(struct TcpTable *table, const struct Frame *frame)
+{
+    struct TcpEntry *entry = tcp_entry_slot(table, frame);
+
+    if (!entry->is_used)
+        return NULL;
+    if (entry->ip_them != frame->ip_src || entry->ip_me != frame->ip_dst)
+        return NULL;
+    if (entry->port_them != frame->port_src || entry->port_me != frame->port_dst)
+        return NULL;
+    if (frame->time_secs - entry->time > TCP_TABLE_TIMEOUT) {
+        entry->is_used = 0;
+        return NULL;
+    }
+    return entry;
+}
+
+/****************************************************************************
+ * Send a segment. The SYN-ACK is the only one with an option, the MSS.
+ ****************************************************************************/
+static void
+tcp_send(struct Frame *frame, unsigned seqno, unsigned ackno, unsigned flags,
+         unsigned mss, const unsigned char *data, unsigned length)
+{
+    struct Packet pkt;
+    unsigned char *px;
+    unsigned offset;
+    unsigned header_length = (flags & TCP_SYN) ? 24 : 20;
+
+    pkt = frame_create_response(frame, NET_TCP);
+    if (pkt.offset < pkt.fixup.transport + 20
+        || pkt.fixup.transport + header_length + length > pkt.max) {
+        pkt.max = 0;
+        frame_xmit_response(frame, &pkt);
+        return;
+    }
+    px = pkt.buf;
+    offset = pkt.fixup.transport;
+
+    px[offset+ 4] = (unsigned char)(seqno>>24);
+    px[offset+ 5] = (unsigned char)(seqno>>16);
+    px[offset+ 6] = (unsigned char)(seqno>> 8);
+    px[offset+ 7] = (unsigned char)(seqno>> 0);
+    px[offset+ 8] = (unsigned char)(ackno>>24);
+    px[offset+ 9] = (unsigned char)(ackno>>16);
+    px[offset+10] = (unsigned char)(ackno>> 8);
+    px[offset+11] = (unsigned char)(ackno>> 0);
+    px[offset+12] = (unsigned char)((header_length/4)<<4);
+    px[offset+13] = (unsigned char)flags;
+    px[offset+14] = (unsigned char)((2 + TCP_QUERY_MAX)>>8);
+    px[offset+15] = (unsigned char)((2 + TCP_QUERY_MAX)>>0);
+    px[offset+16] = 0;
+    px[offset+17] = 0;
+    px[offset+18] = 0;
+    px[offset+19] = 0;
+    if (flags & TCP_SYN) {
+        px[offset+20] = 2;
+        px[offset+21] = 4;
+        px[offset+22] = (unsigned char)(mss>>8);
+        px[offset+23] = (unsigned char)(mss>>0);
+    }
+    offset += header_length;
+
+    if (length)
+        memcpy(px + offset, data, length);
+    pkt.offset = offset + length;
+
+    frame_xmit_response(frame, &pkt);
+}
+
+/****************************************************************************
+ * Reply to a SYN, choosing the largest MSS we can encode that's no larger
+ * than the client's
+ ****************************************************************************/
+static void
+tcp_syn(struct TcpTable *table, struct Frame *frame,
+        const struct TCP_IncomingSegment *tcp)
+{
+    unsigned cookie;
+    unsigned i;
+
+    for (i=3; i>0 && mss_table[i] > tcp->mss; i--)
+        ;
+
+    cookie = tcp_cookie(table, frame, tcp->seqno,
+                        frame->time_secs / TCP_COOKIE_PERIOD) | i;
+
+    tcp_send(frame, cookie, tcp->seqno + 1, TCP_SYN|TCP_ACK, mss_table[i], 0, 0);
+}
+
+/****************************************************************************
+ * Check the client against the blackhole and allow-query lists. Nothing
+ * is remembered, so the answer is looked up again for every segment.
+ ****************************************************************************/
+static int
+tcp_acl(const struct Frame *frame)
+{
+    unsigned char ip_src[4];
+
+    ip_src[0] = (unsigned char)(frame->ip_src>>24);
+    ip_src[1] = (unsigned char)(frame->ip_src>>16);
+    ip_src[2] = (unsigned char)(frame->ip_src>> 8);
+    ip_src[3] = (unsigned char)(frame->ip_src>> 0);
+    return acl_check_query(ip_src, 4);
+}
+
+/****************************************************************************
+ * Format the response to the query in the entry, with its 2-byte length
+ * @return the length, or 0 if the query can't be answered
+ ****************************************************************************/
+static unsigned
+tcp_format(struct Frame *frame, const struct TcpEntry *entry,
+           unsigned char *buf, unsigned max)
+{
+    struct DNS_Incoming request[1];
+    struct DNS_OutgoingResponse response[1];
+    struct Packet pkt;
+    unsigned char ip_src[4];
+    int action;
+
+    /* a lost segment means formatting the response again, which only
+     * counts the first time */
+    proto_dns_parse(request, entry->query, 2, entry->length);
+    if (!request->is_valid) {
+        if (!entry->is_answered)
+            stats_drop(STATS_DROP_MALFORMED);
+        return 0;
+    }
+    if (!entry->is_answered)
+        stats_query(STATS_TCP, request->query_type);
+
+    /* over TCP, a truncated answer would only be retried, so those are
+     * resolved normally. A malformed query is answered FORMERR, whatever
+     * its name */
+    if (request->is_formerr)
+        action = QNAMEFILTER_PASS;
+    else
+        action = qnamefilter_check(&request->query_name);
+    if (action == QNAMEFILTER_DROP) {
+        if (!entry->is_answered)
+            stats_drop(STATS_DROP_QNAME);
+        return 0;
+    }
+
+    resolver_init(response,
+                  request->query_name.name,
+                  request->query_name.length,
+                  request->query_type,
+                  request->id,
+                  request->opcode);
+    response->is_tcp = 1;
+    response->is_retransmit = entry->is_answered;
+    ip_src[0] = (unsigned char)(frame->ip_src>>24);
+    ip_src[1] = (unsigned char)(frame->ip_src>>16);
+    ip_src[2] = (unsigned char)(frame->ip_src>> 8);
+    ip_src[3] = (unsigned char)(frame->ip_src>> 0);
+    if (request->cookie_length)
+        cookie_check(response, request, ip_src, 4, frame->time_secs);
+
+    if (tcp_acl(frame) == ACL_QUERY_REFUSE || action == QNAMEFILTER_REFUSE) {
+        resolver_edns(response, request);
+        response->rcode = RCODE_REFUSED;
+    } else if (request->is_formerr) {
+        resolver_edns(response, request);
+        response->rcode = RCODE_FORMERR;
+    } else {
+        resolver_algorithm(frame->thread->catalog_run, response, request);
+
+        /* the handshake proves the address is real, so let this prefix
+         * in over UDP when we're overloaded */
+        overload_credit_tcp(ip_src, 4, frame->time_secs);
+    }
+
+    pkt.buf = buf;
+    pkt.max = max;
+    pkt.offset = 2;
+    dns_format_response(response, &pkt);
+    if (pkt.offset <= 2 || pkt.offset > pkt.max)
+        return 0;
+    if (!entry->is_answered)
+        stats_response(response);
+
+    buf[0] = (unsigned char)((pkt.offset - 2)>>8);
+    buf[1] = (unsigned char)((pkt.offset - 2)>>0);
+    return pkt.offset;
+}
+
+/****************************************************************************
+ * Send the response starting from the byte the client has acknowledged,
+ * followed by our FIN. The response is formatted again each time, rather
+ * than keeping it around, since that's only needed when a segment gets
+ * lost.
+ ****************************************************************************/
+static void
+tcp_respond(struct Frame *frame, struct TcpEntry *entry, unsigned ackno)
+{
+    unsigned char buf[TCP_RESPONSE_MAX];
+    unsigned length;
+    unsigned offset;
+    unsigned seqno_them = entry->seqno_them + entry->length;
+
+    length = tcp_format(frame, entry, buf, 2 * entry->mss);
+    if (length == 0 || (entry->is_answered && length != entry->response_length)) {
+        tcp_send(frame, entry->seqno_me + (entry->is_answered ? entry->response_length : 0),
+                 seqno_them, TCP_RST|TCP_ACK, 0, 0, 0);
+        entry->is_used = 0;
+        return;
+    }
+    entry->is_answered = 1;
+    entry->response_length = (unsigned short)length;
+
+    offset = ackno - entry->seqno_me;
+    if (offset > length)
+        return;
+
+    do {
+        unsigned segment = length - offset;
+        unsigned flags = TCP_ACK;
+
+        if (segment > entry->mss)
+            segment = entry->mss;
+        else
+            flags |= TCP_PSH | TCP_FIN;
+
+        tcp_send(frame, entry->seqno_me + offset, seqno_them, flags, 0,
+                 buf + offset, segment);
+        offset += segment;
+    } while (offset < length);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+proto_tcp_process(struct Frame *frame, const struct TCP_IncomingSegment *tcp)
+{
+    struct TcpTable *table = tcp_table_get();
+    struct TcpEntry *entry;
+
+    if (!tcp->is_valid || frame->port_dst != 53)
+        return;
+
+    /* blackholed clients don't even get a SYN-ACK */
+    if (tcp_acl(frame) == ACL_QUERY_DROP)
+        return;
+
+    entry = tcp_entry_lookup(table, frame);
+
+    if (tcp->flags & TCP_RST) {
+        if (entry)
+            entry->is_used = 0;
+        return;
+    }
+
+    if ((tcp->flags & (TCP_SYN|TCP_ACK)) == TCP_SYN) {
+        tcp_syn(table, frame, tcp);
+        return;
+    }
+
+    if ((tcp->flags & TCP_ACK) == 0 || (tcp->flags & TCP_SYN))
+        return;
+
+    /*
+     * The first segment with data creates the entry, if it carries
+     * one of our cookies
+     */
+    if (entry == NULL) {
+        unsigned mss;
+
+        if (tcp->payload_length == 0)
+            return;
+        mss = tcp_cookie_check(table, frame, tcp->seqno - 1, tcp->ackno - 1);
+        if (mss == 0)
+            return;
+
+        entry = tcp_entry_slot(table, frame);
+        entry->ip_them = frame->ip_src;
+        entry->ip_me = frame->ip_dst;
+        entry->port_them = (unsigned short)frame->port_src;
+        entry->port_me = (unsigned short)frame->port_dst;
+        entry->seqno_them = tcp->seqno;
+        entry->seqno_me = tcp->ackno;
+        entry->acked = tcp->ackno;
+        entry->time = frame->time_secs;
+        entry->mss = (unsigned short)mss;
+        entry->length = 0;
+        entry->response_length = 0;
+        entry->is_answered = 0;
+        entry->is_used = 1;
+    }
+
+    /*
+     * More of the query, or the query again because the response
+     * got lost
+     */
+    if (tcp->payload_length) {
+        unsigned query_length;
+
+        if (entry->is_answered) {
+            if (tcp->seqno == entry->seqno_them)
+                tcp_respond(frame, entry, tcp->ackno);
+            return;
+        }
+
+        if (tcp->seqno != entry->seqno_them + entry->length) {
+            /* out of order, so tell them what we're missing */
+            tcp_send(frame, entry->seqno_me, entry->seqno_them + entry->length,
+                     TCP_ACK, 0, 0, 0);
+            return;
+        }
+        if (entry->length + tcp->payload_length > sizeof(entry->query)) {
+            tcp_send(frame, entry->seqno_me, 0, TCP_RST, 0, 0, 0);
+            entry->is_used = 0;
+            return;
+        }
+        memcpy(entry->query + entry->length, tcp->payload, tcp->payload_length);
+        entry->length = (unsigned short)(entry->length + tcp->payload_length);
+
+        if (entry->length < 2)
+            query_length = 0;
+        else
+            query_length = entry->query[0]<<8 | entry->query[1];
+        if (entry->length < 2 || entry->length < 2 + query_length) {
+            tcp_send(frame, entry->seqno_me, entry->seqno_them + entry->length,
+                     TCP_ACK, 0, 0, 0);
+            return;
+        }
+        if (entry->length > 2 + query_length) {
+            /* a second query on the same connection */
+            tcp_send(frame, entry->seqno_me, 0, TCP_RST, 0, 0, 0);
+            entry->is_used = 0;
+            return;
+        }
+
+        tcp_respond(frame, entry, entry->seqno_me);
+        return;
+    }
+
+    /*
+     * Their FIN, after they've read the response
+     */
+    if (tcp->flags & TCP_FIN) {
+        if (entry->is_answered && tcp->ackno == entry->seqno_me + entry->response_length + 1)
+            tcp_send(frame, tcp->ackno, tcp->seqno + 1, TCP_ACK, 0, 0, 0);
+        else
+            tcp_send(frame, tcp->ackno, 0, TCP_RST, 0, 0, 0);
+        entry->is_used = 0;
+        return;
+    }
+
+    /*
+     * A duplicate ACK means they're missing part of the response
+     */
+    if (entry->is_answered && tcp->ackno == entry->acked
+        && tcp->ackno - entry->seqno_me <= entry->response_length)
+        tcp_respond(frame, entry, tcp->ackno);
+    entry->acked = tcp->ackno;
+}
+
+/****************************************************************************
+ * 'parse' incoming TCP segments. Which port it's for is checked when
+ * processing, since only DNS gets answered.
+ ****************************************************************************/
+void
+proto_tcp_parse(struct Frame *frame, const unsigned char px[], unsigned offset, unsigned max)
+{
+    struct TCP_IncomingSegment *tcp = frame->tcp;
+    unsigned header_length;
+    unsigned checksum;
+    unsigned i;
+
+    frame->net_protocol = NET_TCP;
+    tcp->is_valid = 0;
+
+    VERIFY_REMAINING(20);
+    frame->port_src = px[offset+0]<<8 | px[offset+1];
+    frame->port_dst = px[offset+2]<<8 | px[offset+3];
+
+    tcp->seqno = px[offset+4]<<24 | px[offset+5]<<16 | px[offset+6]<<8 | px[offset+7];
+    tcp->ackno = px[offset+8]<<24 | px[offset+9]<<16 | px[offset+10]<<8 | px[offset+11];
+    header_length = (px[offset+12]>>4) * 4;
+    tcp->flags = px[offset+13] & 0x3F;
+    tcp->window = px[offset+14]<<8 | px[offset+15];
+    if (header_length < 20)
+        return;
+    VERIFY_REMAINING(header_length);
+
+    /*
+     * 'checksum' field, over the pseudo-header and the segment
+     */
+    checksum = (frame->ip_src>>16)&0xFFFF;
+    checksum += (frame->ip_src>> 0)&0xFFFF;
+    checksum += (frame->ip_dst>>16)&0xFFFF;
+    checksum += (frame->ip_dst>> 0)&0xFFFF;
+    checksum += max - offset;
+    checksum += 6;
+    for (i=offset; i+1<max; i += 2)
+        checksum += px[i]<<8 | px[i+1];
+    if (i < max)
+        checksum += px[i]<<8;
+    checksum = (checksum&0xFFFF) + (checksum>>16);
+    checksum = (checksum&0xFFFF) + (checksum>>16);
+    if (checksum != 0xFFFF)
+        return;
+
+    /*
+     * The only option we care about is the MSS in the SYN
+     */
+    tcp->mss = 536;
+    for (i=offset+20; i<offset+header_length; ) {
+        unsigned kind = px[i];
+        unsigned length;
+
+        if (kind == 0)
+            break;
+        if (kind == 1) {
+            i++;
+            continue;
+        }
+        if (i + 2 > offset + header_length)
+            break;
+        length = px[i+1];
+        if (length < 2 || i + length > offset + header_length)
+            break;
+        if (kind == 2 && length == 4)
+            tcp->mss = px[i+2]<<8 | px[i+3];
+        i += length;
+    }
+
+    tcp->payload = px + offset + header_length;
+    tcp->payload_length = max - offset - header_length;
+    tcp->is_valid = 1;
+}
+
+
+/****************************************************************************
+ * The selftest plays the client: the packets it transmits go straight to
+ * network_receive(), and the server's are kept for checking.
+ ****************************************************************************/
+#define TCP_SELFTEST_MAX 4
+struct TcpSelftest
+{
+    struct Adapter *client;
+    struct Adapter *server;
+    struct Thread thread[1];
+    unsigned char buf[2048];
+    unsigned count;
+    struct TcpSelftestSegment {
+        unsigned seqno;
+        unsigned ackno;
+        unsigned flags;
+        unsigned mss;
+        unsigned length;
+        unsigned char payload[1460];
+    } sent[TCP_SELFTEST_MAX];
+};
+
+extern int adapter_create_ipv4(struct Packet *pkt, int protocol,
+    const unsigned char *mac_src, const unsigned char *mac_dst,
+    unsigned ip_src, unsigned ip_dst, unsigned port_src, unsigned port_dst,
+    unsigned ip_id);
+
+static struct Packet
+tcp_selftest_alloc(struct Adapter *adapter, struct Thread *thread)
+{
+    struct TcpSelftest *t = (struct TcpSelftest *)adapter->userdata;
+    struct Packet pkt;
+
+    UNUSEDPARM(thread);
+
+    pkt.buf = t->buf;
+    pkt.max = sizeof(t->buf);
+    pkt.offset = 0;
+    pkt.fixup.network = 0;
+    pkt.fixup.transport = 0;
+    return pkt;
+}
+
+static void
+tcp_selftest_to_server(struct Adapter *adapter, struct Thread *thread, struct Packet *pkt)
+{
+    struct TcpSelftest *t = (struct TcpSelftest *)adapter->userdata;
+    struct Frame frame[1];
+
+    UNUSEDPARM(thread);
+
+    network_receive(frame, t->thread, t->server, 0, 0, pkt->buf, pkt->max);
+}
+
+static void
+tcp_selftest_to_client(struct Adapter *adapter, struct Thread *thread, struct Packet *pkt)
+{
+    struct TcpSelftest *t = (struct TcpSelftest *)adapter->userdata;
+    struct TcpSelftestSegment *sent;
+    struct Frame frame[1];
+
+    UNUSEDPARM(thread);
+
+    memset(frame, 0, sizeof(frame[0]));
+    proto_ethernet_parse(frame, pkt->buf, 0, pkt->max);
+    if (t->count >= TCP_SELFTEST_MAX)
+        return;
+    sent = &t->sent[t->count++];
+
+    if (!frame->tcp->is_valid || frame->tcp->payload_length > sizeof(sent->payload)) {
+        sent->flags = 0xFF;
+        return;
+    }
+    sent->seqno = frame->tcp->seqno;
+    sent->ackno = frame->tcp->ackno;
+    sent->flags = frame->tcp->flags;
+    sent->mss = frame->tcp->mss;
+    sent->length = frame->tcp->payload_length;
+    memcpy(sent->payload, frame->tcp->payload, sent->length);
+}
+
+static void
+tcp_selftest_send(struct TcpSelftest *t, unsigned port, unsigned seqno,
+                  unsigned ackno, unsigned flags, unsigned mss,
+                  const void *data, unsigned length)
+{
+    struct Packet pkt;
+    unsigned offset;
+
+    t->count = 0;
+    pkt = tcp_selftest_alloc(t->client, 0);
+    adapter_create_ipv4(&pkt, NET_TCP,
+        t->client->mac->address, t->server->mac->address,
+        0x0a000001, 0xC0A00002, port, 53, 0);
+    offset = pkt.fixup.transport;
+    pkt.buf[offset+ 4] = (unsigned char)(seqno>>24);
+    pkt.buf[offset+ 5] = (unsigned char)(seqno>>16);
+    pkt.buf[offset+ 6] = (unsigned char)(seqno>> 8);
+    pkt.buf[offset+ 7] = (unsigned char)(seqno>> 0);
+    pkt.buf[offset+ 8] = (unsigned char)(ackno>>24);
+    pkt.buf[offset+ 9] = (unsigned char)(ackno>>16);
+    pkt.buf[offset+10] = (unsigned char)(ackno>> 8);
+    pkt.buf[offset+11] = (unsigned char)(ackno>> 0);
+    pkt.buf[offset+12] = mss ? 0x60 : 0x50;
+    pkt.buf[offset+13] = (unsigned char)flags;
+    pkt.buf[offset+14] = 0xFF;
+    pkt.buf[offset+15] = 0xFF;
+    memset(pkt.buf + offset + 16, 0, 4);
+    offset += 20;
+    if (mss) {
+        pkt.buf[offset++] = 2;
+        pkt.buf[offset++] = 4;
+        pkt.buf[offset++] = (unsigned char)(mss>>8);
+        pkt.buf[offset++] = (unsigned char)(mss>>0);
+    }
+    memcpy(pkt.buf + offset, data, length);
+    pkt.offset = offset + length;
+
+    adapter_xmit(t->client, t->thread, &pkt);
+}
+
+/****************************************************************************
+ * One connection: handshake, query split in two, response, close.
+ * @return the number of response segments, or 0 on failure
+ ****************************************************************************/
+static unsigned
+tcp_selftest_query(struct TcpSelftest *t, unsigned port, unsigned mss,
+                   const unsigned char *query, unsigned query_length,
+                   unsigned id, unsigned *response_length)
+{
+    unsigned seqno = 1000 + port;
+    unsigned isn;
+    unsigned received = 0;
+    unsigned count;
+    unsigned i;
+
+    tcp_selftest_send(t, port, seqno, 0, TCP_SYN, mss, 0, 0);
+    if (t->count != 1 || t->sent[0].flags != (TCP_SYN|TCP_ACK)
+        || t->sent[0].ackno != seqno + 1 || t->sent[0].mss != mss)
+        return 0;
+    isn = t->sent[0].seqno;
+    seqno++;
+
+    /* the handshake ACK creates no state, and gets no reply */
+    tcp_selftest_send(t, port, seqno, isn + 1, TCP_ACK, 0, 0, 0);
+    if (t->count != 0)
+        return 0;
+
+    /* the length by itself is just acknowledged */
+    tcp_selftest_send(t, port, seqno, isn + 1, TCP_ACK, 0, query, 2);
+    if (t->count != 1 || t->sent[0].flags != TCP_ACK || t->sent[0].ackno != seqno + 2)
+        return 0;
+
+    tcp_selftest_send(t, port, seqno + 2, isn + 1, TCP_ACK|TCP_PSH, 0,
+                      query + 2, query_length - 2);
+    count = t->count;
+    if (count == 0)
+        return 0;
+    for (i=0; i<count; i++) {
+        unsigned expected = TCP_ACK;
+        if (i + 1 == count)
+            expected |= TCP_PSH|TCP_FIN;
+        if (t->sent[i].flags != expected || t->sent[i].ackno != seqno + query_length)
+            return 0;
+        if (t->sent[i].seqno != isn + 1 + received || t->sent[i].length > mss)
+            return 0;
+        received += t->sent[i].length;
+    }
+    if (t->sent[0].length < 2 + 12
+        || (t->sent[0].payload[0]<<8 | t->sent[0].payload[1]) != received - 2
+        || (t->sent[0].payload[2]<<8 | t->sent[0].payload[3]) != id
+        || (t->sent[0].payload[5] & 0xF) != 0)
+        return 0;
+
+    /* a duplicate ACK for the first byte gets it all again */
+    tcp_selftest_send(t, port, seqno + query_length, isn + 1, TCP_ACK, 0, 0, 0);
+    if (t->count != count || t->sent[0].seqno != isn + 1)
+        return 0;
+
+    /* their FIN gets ACKed, and then the connection is forgotten */
+    tcp_selftest_send(t, port, seqno + query_length, isn + 1 + received + 1,
+                      TCP_ACK|TCP_FIN, 0, 0, 0);
+    if (t->count != 1 || t->sent[0].flags != TCP_ACK
+        || t->sent[0].ackno != seqno + query_length + 1)
+        return 0;
+    tcp_selftest_send(t, port, seqno + query_length, isn + 1, TCP_ACK, 0, 0, 0);
+    if (t->count != 0)
+        return 0;
+
+    *response_length = received - 2;
+    return count;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+proto_tcp_selftest(const struct Catalog *catalog)
+{
+    static const unsigned char hydrogen[] =
+        "\x00\x26"
+        "\x00\x01\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+        "\x08hydrogen\x07" "example\x03" "com\x00" "\x00\x01\x00\x01";
+    static const unsigned char chlorine[] =
+        "\x00\x26"
+        "\x00\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+        "\x08" "chlorine\x07" "example\x03" "com\x00" "\x00\x10\x00\x01";
+    struct TcpSelftest *t;
+    unsigned response_length;
+    unsigned isn;
+    int result = 1;
+
+    t = MALLOC2(sizeof(*t));
+    memset(t, 0, sizeof(*t));
+    t->thread->catalog_run = (struct Catalog *)catalog;
+    t->client = adapter_create(tcp_selftest_alloc, tcp_selftest_to_server, t);
+    t->server = adapter_create(tcp_selftest_alloc, tcp_selftest_to_client, t);
+    adapter_add_ipv4(t->server, 0xC0A00002, 0xFFFFffff);
+
+    /* a small response, in one segment */
+    if (tcp_selftest_query(t, 1025, 1460, hydrogen, sizeof(hydrogen)-1, 1, &response_length) != 1)
+        goto end;
+
+    /* a larger one, in two small segments */
+    if (tcp_selftest_query(t, 1026, 536, chlorine, sizeof(chlorine)-1, 2, &response_length) != 2)
+        goto end;
+    if (response_length + 2 <= 536)
+        goto end;
+
+    /* an ACK with data but a bad cookie is dropped */
+    tcp_selftest_send(t, 1027, 5000, 0, TCP_SYN, 1460, 0, 0);
+    if (t->count != 1)
+        goto end;
+    isn = t->sent[0].seqno;
+    tcp_selftest_send(t, 1027, 5001, isn + 2, TCP_ACK, 0, hydrogen, sizeof(hydrogen)-1);
+    if (t->count != 0)
+        goto end;
+    tcp_selftest_send(t, 1028, 5001, isn + 1, TCP_ACK, 0, hydrogen, sizeof(hydrogen)-1);
+    if (t->count != 0)
+        goto end;
+
+    result = 0;
+end:
+    adapter_destroy(t->client);
+    adapter_destroy(t->server);
+    free(t);
+    return result;
+}
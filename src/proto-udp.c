@@ -1,4 +1,6 @@
 #include "network.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-stats.h"
 
 #define VERIFY_REMAINING(n) if (offset+(n) > max) return;
 
@@ -24,11 +26,28 @@ proto_udp_parse(struct Frame *frame, const unsigned char px[], unsigned offset,
     udp_length = px[offset+4]<<8 | px[offset+5];
     if (udp_length < 8) {
         return;
-    } else if (udp_length > max) {
+    } else if (udp_length > max - offset) {
         return;
     }
     max = offset + udp_length; /* shrink remaining length to fit UDP length */
 
+    /*
+     * When we're overloaded, shed queries from clients we don't know
+     * before doing any more work on them
+     */
+    if (frame->port_dst == 53 && overload_is_active()) {
+        unsigned char ip_src[4];
+
+        ip_src[0] = (unsigned char)(frame->ip_src>>24);
+        ip_src[1] = (unsigned char)(frame->ip_src>>16);
+        ip_src[2] = (unsigned char)(frame->ip_src>> 8);
+        ip_src[3] = (unsigned char)(frame->ip_src>> 0);
+        if (!overload_admit(px + offset + 8, udp_length - 8, ip_src, 4, frame->time_secs)) {
+            stats_drop(STATS_DROP_OVERLOAD);
+            return;
+        }
+    }
+
     /*
      * 'checksum' field.
      * TODO: skip this step when the underlying adapter offloads
@@ -62,7 +81,9 @@ proto_udp_parse(struct Frame *frame, const unsigned char px[], unsigned offset,
      */
     switch (frame->port_dst) {
     case 53:
+        TIMING_START(&frame->timer);
         proto_dns_parse(frame->dns, px, offset, max);
+        TIMING_STOP(&frame->timer, TIMING_PARSE);
         if (frame->dns->is_valid)
             frame->net_protocol = NET_DNS;
     }
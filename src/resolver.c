@@ -5,9 +5,51 @@
 #include "proto-dns-compressor.h"
 #include "proto-dns-formatter.h"
 #include "proto-dns.h"
+#include "proto-dns-stats.h"
+#include "pixie-threads.h"
 #include "string_s.h"
+#include "util-realloc2.h"
 #include <stddef.h>
 
+/****************************************************************************
+ * The overflow pools for responses with more RRsets than fit inline. A
+ * batch of responses is resolved before any of them are formatted, so
+ * each response in a batch gets its own pool, by its 'overflow_slot'. A
+ * response resolved on its own uses the first. They're allocated the
+ * first time a thread needs them, and kept for the life of the thread.
+ ****************************************************************************/
+static PIXIE_THREAD_LOCAL struct DNS_ResponseRRset **overflow_pools;
+static PIXIE_THREAD_LOCAL unsigned overflow_pool_count;
+
+static int
+response_grow(struct DNS_OutgoingResponse *response)
+{
+    unsigned slot = response->overflow_slot;
+    struct DNS_ResponseRRset *pool;
+
+    if (response->rrsets != response->inline_rrsets)
+        return 0;
+
+    if (slot >= overflow_pool_count) {
+        unsigned count = slot + 1;
+
+        overflow_pools = REALLOC2(overflow_pools, count, sizeof(overflow_pools[0]));
+        memset(overflow_pools + overflow_pool_count, 0,
+               (count - overflow_pool_count) * sizeof(overflow_pools[0]));
+        overflow_pool_count = count;
+    }
+    pool = overflow_pools[slot];
+    if (pool == NULL) {
+        pool = MALLOC2(RESPONSE_MAX_RRSETS * sizeof(pool[0]));
+        overflow_pools[slot] = pool;
+    }
+
+    memcpy(pool, response->inline_rrsets, sizeof(response->inline_rrsets));
+    response->rrsets = pool;
+    response->max_rrsets = RESPONSE_MAX_RRSETS;
+    return 1;
+}
+
 /****************************************************************************
  * Register an RRset in the appropriate answer/authority/additional section.
  * We don't copy the RRset to the packet right now, but instead, remember
@@ -16,18 +58,19 @@
 void
 response_copy_rrset_item(
         const struct DBrrset *rrset, 
+        const struct DBEntry *entry,
         struct DNS_OutgoingResponse *response, 
         int section,
         struct DomainPointer name, 
         struct DomainPointer origin)
 {
-    struct DNS_ResponseRRset *rrr = &response->rrsets[0];
-    static const size_t MAX_RRs = sizeof(response->rrsets)/sizeof(response->rrsets[0]);
+    struct DNS_ResponseRRset *rrr;
+    unsigned count = response->ancount + response->nscount + response->arcount;
 
     /* TRUNCATION CHECK: 
      * while we aren't building a packet yet, we may run out of room
      * in our list, so report this as a truncation error as well */
-    if (response->ancount + response->nscount + response->arcount >= MAX_RRs) {
+    if (count >= response->max_rrsets && !response_grow(response)) {
         /* additional records can be dropped without setting
          * truncation TC bit */
         if (section == SECTION_ADDITIONAL) {
@@ -44,21 +87,25 @@ response_copy_rrset_item(
     switch (section) {
     case SECTION_ANSWER:
         rrr = &response->rrsets[response->ancount];
-        memmove(rrr+1, rrr, response->nscount * sizeof(*rrr));
+        memmove(rrr+1, rrr, (response->nscount + response->arcount) * sizeof(*rrr));
         response->ancount++;
         break;
     case SECTION_AUTHORITATIVE:
         rrr = &response->rrsets[response->ancount + response->nscount];
+        memmove(rrr+1, rrr, response->arcount * sizeof(*rrr));
         response->nscount++;
         break;
     case SECTION_ADDITIONAL:
+        rrr = &response->rrsets[response->ancount + response->nscount + response->arcount];
         response->arcount++;
-        rrr = &response->rrsets[MAX_RRs - response->arcount];
         break;
+    default:
+        return;
     }
 
     /* fill in pointers */
     rrr->rrset = rrset;
+    rrr->entry = entry;
     rrr->name = name;
     rrr->origin = origin;
 }
@@ -83,7 +130,7 @@ response_copy_rrsets(
     /* copy call matching RRsets (e.g. if type=ANY, then we'll copy all
      * RRsets) */
     for (rrset=rrset_first(entry, type); rrset; rrset = rrset_next(entry, type, rrset)) {
-        response_copy_rrset_item(rrset, response, section, name, origin);
+        response_copy_rrset_item(rrset, entry, response, section, name, origin);
     }
 }
 
@@ -95,18 +142,81 @@ static void
 response_add_glue(
         const struct DBrrset *rrset, 
         struct DNS_OutgoingResponse *response, 
-        const struct DBZone *zone,
         const struct DBEntry *entry)
 {
-    //const struct DBEntry *glue;
-    //struct DomainPointer name = {0,0};
-    //static const struct DomainPointer origin = {0,0};
-
-    /*glue = rrset_get_glue(zone, entry, rrset, &name);
-    if (glue) {
+    const struct DBEntry *glue;
+    struct DomainPointer name = {0,0};
+    static const struct DomainPointer origin = {0,0};
+    unsigned index = 0;
+
+    /* The glue was looked up when the zone was loaded, see
+     * catalog_build_index() */
+    while ((glue = rrset_get_glue(entry, rrset, &index, &name)) != NULL) {
         response_copy_rrsets(glue, TYPE_A, response, SECTION_ADDITIONAL, name, origin);
         response_copy_rrsets(glue, TYPE_AAAA, response, SECTION_ADDITIONAL, name, origin);
-    }*/
+    }
+}
+
+/****************************************************************************
+ * ANY queries, see resolver_set_any_policy(). Like the maximum UDP size,
+ * this is just a number the worker threads read, so it can be changed
+ * while they are running.
+ ****************************************************************************/
+static int any_policy = RESOLVER_ANY_FULL;
+
+void
+resolver_set_any_policy(int policy)
+{
+    any_policy = policy;
+}
+
+/* RFC 8482 4.2: HINFO with CPU "RFC8482" and an empty OS, in the same
+ * format as the RRsets in the database */
+static const unsigned char any_hinfo_rrset[] = {
+    0, 19,                  /* total length */
+    0, TYPE_HINFO,
+    0, 0, 0x0e, 0x10,       /* TTL = 3600 */
+    0, 9,                   /* RDLENGTH */
+    7, 'R', 'F', 'C', '8', '4', '8', '2',
+    0,
+};
+
+/****************************************************************************
+ * Answer an ANY query over UDP without copying every RRset, so that the
+ * formatter and compressor never see the huge response.
+ * @return the number of RRsets added to the answer, or 1 if the response
+ *      has been truncated
+ ****************************************************************************/
+static unsigned
+response_minimal_any(
+        struct DNS_OutgoingResponse *response,
+        const struct DBEntry *entry,
+        struct DomainPointer query_name)
+{
+    static const struct DomainPointer root = {0,0};
+    const struct DBrrset *rrset;
+
+    switch (any_policy) {
+    case RESOLVER_ANY_TRUNCATE:
+        response->tc = 1;
+        return 1;
+    case RESOLVER_ANY_HINFO:
+        response_copy_rrset_item((const struct DBrrset *)any_hinfo_rrset, 0,
+                                 response, SECTION_ANSWER, query_name, root);
+        return 1;
+    default:
+        /* The first RRset that isn't the signatures */
+        for (rrset=rrset_first(entry, TYPE_ANY); rrset; rrset = rrset_next(entry, TYPE_ANY, rrset)) {
+            if (rrset_type(rrset) != TYPE_RRSIG)
+                break;
+        }
+        if (rrset == NULL)
+            return 0;
+
+        response_copy_rrset_item(rrset, entry, response, SECTION_ANSWER, query_name, root);
+        response_add_glue(rrset, response, entry);
+        return 1;
+    }
 }
 
 /****************************************************************************
@@ -123,6 +233,9 @@ resolver_init(
         unsigned opcode)
 {
     memset(response, 0, offsetof(struct DNS_OutgoingResponse, query_type));
+    response->rrsets = response->inline_rrsets;
+    response->max_rrsets = RESPONSE_INLINE_RRSETS;
+    response->overflow_slot = 0;
     response->query_name.name = query_name;
     response->query_name.length = query_name_length;
     response->query_type = query_type;
@@ -132,40 +245,48 @@ resolver_init(
 }
 
 /****************************************************************************
- ****************************************************************************
- ** THIS IS WHERE IT ALL HAPPENS !!!!
- **
- **     This is the central/core function of the entire DNS server. It's at
- **     this point that we take an incoming-request (mostly containing
- **     a QNAME/QTYPE) and from it generate an outgoing-response prototype.
- **
- **     Note the bunch of quirkiness. For example, the input is not the
- **     the DNS request packet itself, but a parsed version of the request.
- **     Likewise, we don't generate the response packet in this function,
- **     but only a "prototype" for the reponse packet.
- **
- ****************************************************************************
  ****************************************************************************/
 void
-resolver_algorithm(
-        const struct Catalog *catalog,
+resolver_edns(struct DNS_OutgoingResponse *response,
+              const struct DNS_Incoming *request)
+{
+    if (request->is_edns0) {
+        response->is_edns0 = 1;
+        response->edns0_payload_size = request->edns0.payload_size;
+    }
+}
+
+/****************************************************************************
+ * The first steps of the algorithm, the special cases that we handle
+ * before looking in the catalog.
+ * @return 1 if the response is complete, 0 if we need to look up the name
+ ****************************************************************************/
+static int
+resolver_special(
         struct DNS_OutgoingResponse *response,
         const struct DNS_Incoming *request)
 {
-    struct DBZone *zone;
-    const struct DBEntry *entry;
-    struct DB_XDomain query_name_x[1];
-    struct DomainPointer root = {0,0};
-    struct DomainPointer query_name = response->query_name;
-    int query_type = request->query_type;
-
-    
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      * handle format errors
      * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*/
     if (request->is_formerr) {
         response->rcode = RCODE_FORMERR;
-        return;
+        return 1;
+    }
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * EDNS0
+     *  RFC 6891 6.1.1, 6.1.3
+     * Remember how big a response the client can take, so the formatter
+     * can truncate to that, and echo an OPT record back. We only know
+     * version 0.
+     * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*/
+    if (request->is_edns0) {
+        resolver_edns(response, request);
+        if (request->edns0.version != 0) {
+            response->rcode = RCODE_BADVERS;
+            return 1;
+        }
     }
 
     
@@ -178,15 +299,12 @@ resolver_algorithm(
         && memcasecmp(request->query_name.name, 
                        "\x07" "version" "\x04" "bind" "\x00", 13) == 0) {
             response->is_version_bind = 1;
-            return;
+            return 1;
     } else {
         response->is_version_bind = 0;
     }
 
 
-    xdomain_reverse2(query_name_x, query_name.name, query_name.length);
-
-
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      * clear recursion flag
      *  RFC 1034 4.3.2. 1.
@@ -195,19 +313,32 @@ resolver_algorithm(
      * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*/
     response->ra = 0;
 
+    return 0;
+}
+
+/****************************************************************************
+ * The rest of the algorithm, once we've found the zone (if any) that
+ * the name belongs to.
+ ****************************************************************************/
+static void
+resolver_zone(
+        struct DBZone *zone,
+        struct DNS_OutgoingResponse *response,
+        const struct DNS_Incoming *request,
+        const struct DB_XDomain *query_name_x)
+{
+    const struct DBEntry *entry;
+    struct DomainPointer root = {0,0};
+    struct DomainPointer query_name = response->query_name;
+    int query_type = request->query_type;
 
-    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-     * find zone
-     *  RFC 1034 4.3.2. 2.
-     * Do a "longest suffix" match to find longest name that matches
-     * the query name.
-     * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*/
-  	zone = catalog_lookup_zone(catalog, query_name_x);
     if (zone == NULL) {
         response->aa = 0;
         response->rcode = RCODE_REFUSED;
         return;
     }
+    if (!response->is_retransmit)
+        stats_zone(zone);
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      * delegation/referral/cut
@@ -232,9 +363,9 @@ resolver_algorithm(
         /* copy all name-server records (and glue) into response */
         for (rrset=rrset_first(entry, TYPE_NS); rrset; rrset = rrset_next(entry, TYPE_NS, rrset)) {
 
-            response_copy_rrset_item(rrset, response, SECTION_AUTHORITATIVE, name, origin);
+            response_copy_rrset_item(rrset, entry, response, SECTION_AUTHORITATIVE, name, origin);
 
-            response_add_glue(rrset, response, zone, entry);
+            response_add_glue(rrset, response, entry);
         }
         return;
     }
@@ -243,17 +374,31 @@ resolver_algorithm(
      * exact match
      *  RFC 1034 4.3.2. 3. b.
      * Now try for an exact match, which takes precedence over wildcards.
+     * Most names that aren't in the zone are ruled out by the zone's
+     * filter without searching the hash table, which is what matters
+     * during random-subdomain floods. The delegation walk above and the
+     * wildcard walk below test each name they try against the same
+     * filter, so a flood of random names rarely touches the hash table.
      * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*/
-    entry = zone_lookup_exact(zone, query_name_x);
+    if (zone_name_may_exist(zone, query_name_x))
+        entry = zone_lookup_exact(zone, query_name_x);
+    else
+        entry = NULL;
     if (entry != NULL) {
         const struct DBrrset *rrset;
         unsigned count = 0;
 
+        if (query_type == TYPE_ANY && any_policy != RESOLVER_ANY_FULL && !response->is_tcp) {
+            if (response_minimal_any(response, entry, query_name))
+                return;
+            goto soa;
+        }
+
         for (rrset=rrset_first(entry, query_type); rrset; rrset = rrset_next(entry, query_type, rrset)) {
 
-            response_copy_rrset_item(rrset, response, SECTION_ANSWER, query_name, root);
+            response_copy_rrset_item(rrset, entry, response, SECTION_ANSWER, query_name, root);
 
-            response_add_glue(rrset, response, zone, entry);
+            response_add_glue(rrset, response, entry);
 
             count++;
         }
@@ -276,11 +421,17 @@ resolver_algorithm(
         const struct DBrrset *rrset;
         unsigned count = 0;
 
+        if (query_type == TYPE_ANY && any_policy != RESOLVER_ANY_FULL && !response->is_tcp) {
+            if (response_minimal_any(response, entry, query_name))
+                return;
+            goto soa;
+        }
+
         for (rrset=rrset_first(entry, query_type); rrset; rrset = rrset_next(entry, query_type, rrset)) {
 
-            response_copy_rrset_item(rrset, response, SECTION_ANSWER, query_name, root);
+            response_copy_rrset_item(rrset, entry, response, SECTION_ANSWER, query_name, root);
 
-            response_add_glue(rrset, response, zone, entry);
+            response_add_glue(rrset, response, entry);
 
             count++;
         }
@@ -306,9 +457,9 @@ soa:
         
         zone_name_from_record(zone, 0, &name, &origin);
 
-        rrset = zone_get_soa_rr(zone);
+        rrset = zone_get_soa_rr(zone, &entry);
 
-        response_copy_rrset_item(rrset, response, SECTION_AUTHORITATIVE, name, origin);
+        response_copy_rrset_item(rrset, entry, response, SECTION_AUTHORITATIVE, name, origin);
 
         /* We don't add NS glue because we are really just returning the 
          * TTL and nothing else */
@@ -316,3 +467,118 @@ soa:
     }
 }
 
+/****************************************************************************
+ ****************************************************************************
+ ** THIS IS WHERE IT ALL HAPPENS !!!!
+ **
+ **     This is the central/core function of the entire DNS server. It's at
+ **     this point that we take an incoming-request (mostly containing
+ **     a QNAME/QTYPE) and from it generate an outgoing-response prototype.
+ **
+ **     Note the bunch of quirkiness. For example, the input is not the
+ **     the DNS request packet itself, but a parsed version of the request.
+ **     Likewise, we don't generate the response packet in this function,
+ **     but only a "prototype" for the reponse packet.
+ **
+ ****************************************************************************
+ ****************************************************************************/
+void
+resolver_algorithm(
+        const struct Catalog *catalog,
+        struct DNS_OutgoingResponse *response,
+        const struct DNS_Incoming *request)
+{
+    struct DBZone *zone;
+    struct DB_XDomain query_name_x[1];
+
+    if (resolver_special(response, request))
+        return;
+
+    xdomain_reverse2(query_name_x, response->query_name.name, response->query_name.length);
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * find zone
+     *  RFC 1034 4.3.2. 2.
+     * Do a "longest suffix" match to find longest name that matches
+     * the query name.
+     * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -*/
+    zone = catalog_lookup_zone(catalog, query_name_x);
+
+    resolver_zone(zone, response, request, query_name_x);
+}
+
+/****************************************************************************
+ * The same as resolver_algorithm(), but for a batch of requests, such as
+ * from a single recvmmsg(). For large zones, nearly every lookup is a
+ * cache miss, and one request at a time, each miss is waited on in turn.
+ * Instead, we run each step across the whole batch, prefetching what the
+ * next step will need, so that the misses for all the requests overlap.
+ ****************************************************************************/
+static void
+resolver_batch(
+        const struct Catalog *catalog,
+        struct DNS_OutgoingResponse *responses,
+        const struct DNS_Incoming *requests,
+        unsigned count)
+{
+    struct DB_XDomain names[RESOLVER_BATCH_MAX];
+    struct DBZone *zones[RESOLVER_BATCH_MAX];
+    unsigned char is_done[RESOLVER_BATCH_MAX];
+    unsigned i;
+
+    /* 1. hash all the names, prefetching the catalog buckets */
+    for (i=0; i<count; i++) {
+        is_done[i] = (unsigned char)resolver_special(&responses[i], &requests[i]);
+        if (is_done[i])
+            continue;
+        xdomain_reverse2(&names[i], responses[i].query_name.name, responses[i].query_name.length);
+        catalog_prefetch_zone(catalog, &names[i]);
+    }
+
+    /* 2. find the zones, prefetching the zone's bucket for the name */
+    for (i=0; i<count; i++) {
+        if (is_done[i])
+            continue;
+        zones[i] = catalog_lookup_zone(catalog, &names[i]);
+        if (zones[i])
+            zone_prefetch_bucket(zones[i], &names[i]);
+    }
+
+    /* 3. prefetch the first entry in each bucket */
+    for (i=0; i<count; i++) {
+        if (is_done[i] || zones[i] == NULL)
+            continue;
+        zone_prefetch_entry(zones[i], &names[i]);
+    }
+
+    /* 4. match the entries and build the responses */
+    for (i=0; i<count; i++) {
+        if (is_done[i])
+            continue;
+        resolver_zone(zones[i], &responses[i], &requests[i], &names[i]);
+    }
+}
+
+void
+resolver_algorithm_batch(
+        const struct Catalog *catalog,
+        struct DNS_OutgoingResponse *responses,
+        const struct DNS_Incoming *requests,
+        unsigned count)
+{
+    unsigned i;
+
+    /* none of these are formatted until they're all resolved, so any
+     * that overflow need pools of their own */
+    for (i=0; i<count; i++)
+        responses[i].overflow_slot = i;
+
+    /* larger batches are done in pieces */
+    for (i=0; i<count; i += RESOLVER_BATCH_MAX) {
+        unsigned n = count - i;
+
+        if (n > RESOLVER_BATCH_MAX)
+            n = RESOLVER_BATCH_MAX;
+        resolver_batch(catalog, responses + i, requests + i, n);
+    }
+}
@@ -20,6 +20,42 @@ void resolver_algorithm(const struct Catalog *catalog,
                         struct DNS_OutgoingResponse *response, 
                         const struct DNS_Incoming *request);
 
+/**
+ * The same as calling 'resolver_algorithm' on each request in turn, but
+ * interleaving the lookups so that their cache misses overlap. Each
+ * response must have been initialized with 'resolver_init' first. Big
+ * responses each get their own overflow pool, so they can all be
+ * formatted afterwards, until the next batch on this thread.
+ */
+#define RESOLVER_BATCH_MAX 16
+void resolver_algorithm_batch(const struct Catalog *catalog,
+                        struct DNS_OutgoingResponse *responses,
+                        const struct DNS_Incoming *requests,
+                        unsigned count);
+
+/**
+ * How to answer ANY queries over UDP, see RFC 8482. Answering with every
+ * RRset on the name costs the most CPU of any query, and makes the
+ * biggest responses for amplification attacks. Queries over TCP always
+ * get the full answer.
+ */
+enum {
+    RESOLVER_ANY_FULL,      /* every RRset, the traditional answer */
+    RESOLVER_ANY_SINGLE,    /* just one of the RRsets */
+    RESOLVER_ANY_HINFO,     /* a synthesized HINFO "RFC8482" */
+    RESOLVER_ANY_TRUNCATE,  /* empty with TC set, so the client uses TCP */
+};
+void resolver_set_any_policy(int policy);
+
+/**
+ * Echo the request's EDNS0 in the response, so that it gets an OPT record
+ * (with our cookie, if there is one) and the client's UDP size. The
+ * resolver does this itself, so it's only needed for responses that
+ * don't go through it, like refusals.
+ */
+void resolver_edns(struct DNS_OutgoingResponse *response,
+                   const struct DNS_Incoming *request);
+
 /**
  * Call this before calling 'resolver_algorithm' to initialize the
  * response structure
@@ -158,6 +158,153 @@ rte_ring_create(unsigned count, unsigned flags)
     return r;
 }
 
+/* The maximum number of spins before sleeping, and how long to sleep
+ * before re-checking on our own (in case a wakeup was missed) */
+#define RING_SPIN_MAX       4096
+#define RING_SLEEP_USEC     10000
+
+/* wake up sleepers */
+void
+rte_ring_notify(struct rte_ring *r)
+{
+    /* Make sure our change to the ring is visible before reading the
+     * number of sleepers, pairing with the increment in ring_wait() */
+    rte_mb();
+
+    if (r->park.sleepers) {
+        pixie_locked_add_u32(&r->park.seq, 1);
+        pixie_futex_wake(&r->park.seq);
+    }
+}
+
+/* enqueue and wake up sleepers */
+int
+rte_ring_enqueue_notify(struct rte_ring *r, void *obj)
+{
+    int err;
+    unsigned count;
+
+    err = rte_ring_enqueue(r, obj);
+
+    count = rte_ring_count(r);
+    if (r->park.max_count < count)
+        r->park.max_count = count;
+
+    rte_ring_notify(r);
+    return err;
+}
+
+/* thread-safe add, for the stall statistics */
+static void
+ring_locked_add_u64(volatile uint64_t *dst, uint64_t value)
+{
+    for (;;) {
+        uint64_t old = *dst;
+        if (pixie_locked_CAS64(dst, old + value, old))
+            break;
+    }
+}
+
+/* spin-then-sleep until the 'is_ready' condition is true */
+static int
+ring_wait(struct rte_ring *r,
+          int (*is_ready)(struct rte_ring *r, void *arg), void *arg,
+          volatile unsigned *is_running)
+{
+    for (;;) {
+        unsigned i;
+        uint32_t seq;
+        uint64_t start;
+
+        /* Spin for a while */
+        for (i=0; i<=r->park.spin_limit; i++) {
+            if (is_ready(r, arg)) {
+                if (i && r->park.spin_limit < RING_SPIN_MAX)
+                    r->park.spin_limit = r->park.spin_limit * 2 + 1;
+                return 0;
+            }
+            if (is_running && !*is_running)
+                return -ENOENT;
+            rte_pause();
+        }
+
+        /* Spinning didn't help, so do less of it next time */
+        r->park.spin_limit /= 2;
+
+        /* Announce that we are going to sleep, then check one last time,
+         * so that we can't miss a wakeup that happens in between */
+        seq = r->park.seq;
+        pixie_locked_add_u32(&r->park.sleepers, 1);
+        if (is_ready(r, arg)) {
+            pixie_locked_add_u32(&r->park.sleepers, -1);
+            return 0;
+        }
+        if (is_running && !*is_running) {
+            pixie_locked_add_u32(&r->park.sleepers, -1);
+            return -ENOENT;
+        }
+
+        start = pixie_nanotime();
+        pixie_futex_wait(&r->park.seq, seq, RING_SLEEP_USEC);
+        pixie_locked_add_u32(&r->park.sleepers, -1);
+
+        ring_locked_add_u64(&r->park.stalls, 1);
+        ring_locked_add_u64(&r->park.stall_nsecs, pixie_nanotime() - start);
+    }
+}
+
+static int
+ring_try_dequeue(struct rte_ring *r, void *arg)
+{
+    return rte_ring_dequeue(r, (void**)arg) == 0;
+}
+
+/* dequeue, sleeping if nothing is available */
+int
+rte_ring_dequeue_wait(struct rte_ring *r, void **obj_p,
+                      volatile unsigned *is_running)
+{
+    int err;
+
+    err = ring_wait(r, ring_try_dequeue, obj_p, is_running);
+
+    /* wake anybody waiting on the ring to drain */
+    if (err == 0)
+        rte_ring_notify(r);
+    return err;
+}
+
+static int
+ring_is_count(struct rte_ring *r, void *arg)
+{
+    return rte_ring_count(r) == *(unsigned*)arg;
+}
+
+/* wait until the ring has the given number of entries */
+void
+rte_ring_wait_count(struct rte_ring *r, unsigned count)
+{
+    ring_wait(r, ring_is_count, &count, 0);
+}
+
+/* get statistics */
+void
+rte_ring_get_waitstats(const struct rte_ring *r,
+                       struct rte_ring_waitstats *stats)
+{
+    stats->stalls = r->park.stalls;
+    stats->stall_nsecs = r->park.stall_nsecs;
+    stats->count = rte_ring_count(r);
+    stats->max_count = r->park.max_count;
+}
+
+/* free the ring */
+void
+rte_ring_free(struct rte_ring *r)
+{
+    free(r);
+}
+
 /*
  * change the high water mark. If *count* is 0, water marking is
  * disabled
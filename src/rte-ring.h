@@ -90,6 +90,7 @@
 #define rte_wmb() _WriteBarrier()
 #define rte_pause() _mm_pause()
 #define rte_rmb() _ReadBarrier()
+#define rte_mb() _mm_mfence()
 #ifndef EDQUOT
 #define EDQUOT EOVERFLOW
 #endif
@@ -187,6 +188,16 @@ struct rte_ring {
         volatile uint32_t tail;  /**< Consumer tail. */
     } cons __rte_cache_aligned;
 
+    /** Sleeping support, see rte_ring_dequeue_wait() */
+    struct park {
+        volatile uint32_t seq;       /**< Bumped to wake sleepers. */
+        volatile uint32_t sleepers;  /**< Threads sleeping on seq. */
+        uint32_t spin_limit;         /**< Adaptive spins before sleeping. */
+        uint32_t max_count;          /**< High-water mark of entries. */
+        volatile uint64_t stalls;    /**< Number of times a thread slept. */
+        volatile uint64_t stall_nsecs; /**< Total time spent sleeping. */
+    } park __rte_cache_aligned;
+
 
 #ifdef RTE_LIBRTE_RING_DEBUG
     struct rte_ring_debug_stats stats[RTE_MAX_LCORE];
@@ -252,6 +263,74 @@ struct rte_ring {
  */
 struct rte_ring *rte_ring_create(unsigned count, unsigned flags);
 
+/**
+ * De-allocate all memory used by the ring.
+ *
+ * @param r
+ *   Ring to free. The ring must no longer be in use by any thread.
+ */
+void rte_ring_free(struct rte_ring *r);
+
+/**
+ * Statistics about how often threads had to sleep waiting on a ring,
+ * and how full the ring got.
+ */
+struct rte_ring_waitstats {
+    uint64_t stalls;        /**< Number of times a thread went to sleep. */
+    uint64_t stall_nsecs;   /**< Total nanoseconds threads spent asleep. */
+    unsigned count;         /**< Current number of entries. */
+    unsigned max_count;     /**< Highest number of entries seen. */
+};
+
+/**
+ * Enqueue one object, then wake any threads sleeping on the ring.
+ *
+ * This is for rings where the other side uses rte_ring_dequeue_wait()
+ * or rte_ring_wait_count() instead of polling.
+ *
+ * @return
+ *   Same as rte_ring_enqueue().
+ */
+int rte_ring_enqueue_notify(struct rte_ring *r, void *obj);
+
+/**
+ * Dequeue one object, waiting for one to arrive if the ring is empty.
+ *
+ * The thread first spins a while, since in a busy pipeline the next
+ * object usually arrives within microseconds. If nothing shows up, it
+ * sleeps (on a futex, on Linux) until another thread calls
+ * rte_ring_enqueue_notify() or rte_ring_notify(). The amount of spinning
+ * adapts: it grows when spinning pays off and shrinks when the thread
+ * ends up sleeping anyway.
+ *
+ * @param is_running
+ *   Optional. If this becomes zero while the ring is empty, give up.
+ *   Whoever clears it should then call rte_ring_notify().
+ * @return
+ *   - 0: Success; object dequeued.
+ *   - -ENOENT: The ring is empty and *is_running is zero.
+ */
+int rte_ring_dequeue_wait(struct rte_ring *r, void **obj_p,
+                          volatile unsigned *is_running);
+
+/**
+ * Wait until the ring contains exactly the given number of entries.
+ * Used to wait for all objects to be returned to a free-list.
+ */
+void rte_ring_wait_count(struct rte_ring *r, unsigned count);
+
+/**
+ * Wake all threads sleeping on the ring, so that they re-check
+ * whatever they were waiting for.
+ */
+void rte_ring_notify(struct rte_ring *r);
+
+/**
+ * Get the sleep/occupancy statistics for the ring.
+ */
+void rte_ring_get_waitstats(const struct rte_ring *r,
+                            struct rte_ring_waitstats *stats);
+
 /**
  * Change the high water mark.
  *
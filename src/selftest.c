@@ -22,7 +22,22 @@
 #include "zonefile-load.h"
 #include "string_s.h"
 #include "rte-ring.h"
+#include "zonefile-stream.h"
 #include "util-realloc2.h"
+#include "proto-dns-compressor.h"
+#include "proto-dns-cookie.h"
+#include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-rrl.h"
+#include "proto-dns-sockfilter.h"
+#include "proto-dns-stats.h"
+#include "proto-dns-timing.h"
+#include "resolver.h"
+#include "thread-worker-tcp.h"
+#include "util-acl.h"
+#include "util-blocklist.h"
+#include "util-ranges.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -370,6 +385,39 @@ selftest_verify_one_item(
         }
         break;
 
+    case TYPE_NS:
+    case TYPE_CNAME:
+    case TYPE_PTR:
+    case TYPE_MX:
+        {
+            unsigned char buf[1024];
+            unsigned buf_length = 0;
+            unsigned rdata_offset = (unsigned)(b_rdata - px);
+            unsigned rdata_max = rdata_offset + b_rdlength;
+            struct DomainPointer d;
+
+            /* MX has a preference before the name */
+            if (b_type == TYPE_MX) {
+                memcpy(buf, b_rdata, 2);
+                buf_length = 2;
+                rdata_offset += 2;
+            }
+
+            /* the name must fill the rest of the RDATA exactly, which
+             * checks that RDLENGTH was fixed up after compression */
+            if (dns_name_skip(px, rdata_offset, rdata_max) != rdata_max)
+                return 0;
+            d.name = buf + buf_length;
+            dns_extract_name(px, rdata_offset, rdata_max, &d);
+            buf_length += d.length;
+            buf[buf_length++] = 0;
+
+            if (a->rdlength != buf_length)
+                return 0;
+            return memcasecmp(a->rdata, buf, buf_length) == 0;
+        }
+        break;
+
     default:
         if (a->rdlength != b_rdlength)
             return 0;
@@ -591,6 +639,358 @@ append_name(struct Packet *pkt, const char *name)
     }
 }
 
+/****************************************************************************
+ * Builds a query packet, without any network headers, optionally with
+ * an EDNS0 OPT record with the given payload size and version.
+ ****************************************************************************/
+static unsigned
+selftest_make_query(unsigned char *buf, unsigned sizeof_buf, 
+                    const char *name, int type,
+                    unsigned edns0_payload_size, unsigned edns0_version)
+{
+    struct Packet pkt;
+
+    pkt.buf = buf;
+    pkt.max = sizeof_buf;
+    memcpy(pkt.buf, "\x12\x34\0\0\0\1\0\0\0\0\0\0", 12);
+    pkt.offset = 12;
+    append_name(&pkt, name);
+    memcpy(pkt.buf + pkt.offset, "\0\0\0\0\1", 5);
+    pkt.buf[pkt.offset+1] = (unsigned char)(type>>8);
+    pkt.buf[pkt.offset+2] = (unsigned char)(type>>0);
+    pkt.offset += 5;
+
+    if (edns0_payload_size) {
+        pkt.buf[11] = 1; /* ARCOUNT */
+        memcpy(pkt.buf + pkt.offset, "\0\0\x29\0\0\0\0\0\0\0\0", 11);
+        pkt.buf[pkt.offset+3] = (unsigned char)(edns0_payload_size>>8);
+        pkt.buf[pkt.offset+4] = (unsigned char)(edns0_payload_size>>0);
+        pkt.buf[pkt.offset+6] = (unsigned char)edns0_version;
+        pkt.offset += 11;
+    }
+
+    return pkt.offset;
+}
+
+/****************************************************************************
+ * Resolve and format a query for a name with a big TXT RRset, checking
+ * the response is truncated to what the client said it can receive, and
+ * that EDNS0 clients get an OPT record back.
+ ****************************************************************************/
+static int
+selftest_edns_one(const struct Catalog *catalog,
+                  unsigned edns0_payload_size, unsigned edns0_version,
+                  unsigned expected_max, unsigned expected_tc, 
+                  unsigned expected_rcode)
+{
+    unsigned char query[300];
+    unsigned char buf[4096];
+    struct DNS_Incoming request[1];
+    struct DNS_OutgoingResponse response[1];
+    struct Packet pkt;
+    unsigned length;
+    unsigned arcount;
+    unsigned rcode;
+
+    length = selftest_make_query(query, sizeof(query), "chlorine.example.com", 
+                                 TYPE_TXT, edns0_payload_size, edns0_version);
+    proto_dns_parse(request, query, 0, length);
+    if (!request->is_valid || request->is_formerr)
+        return 1;
+
+    resolver_init(response, request->query_name.name, request->query_name.length,
+                  request->query_type, request->id, request->opcode);
+    resolver_algorithm(catalog, response, request);
+
+    pkt.buf = buf;
+    pkt.max = sizeof(buf);
+    pkt.offset = 0;
+    dns_format_response(response, &pkt);
+
+    if (pkt.offset > expected_max || pkt.offset < 12)
+        return 1;
+    if (((buf[2]>>1)&1) != expected_tc)
+        return 1;
+    rcode = buf[3] & 0xF;
+
+    arcount = buf[10]<<8 | buf[11];
+    if (edns0_payload_size == 0) {
+        if (arcount != 0 || rcode != expected_rcode)
+            return 1;
+        return 0;
+    }
+
+    /* the OPT record is at the end, and advertises our size */
+    if (arcount < 1 || pkt.offset < 12 + 11)
+        return 1;
+    if (memcmp(buf + pkt.offset - 11, "\0\0\x29", 3) != 0)
+        return 1;
+    if ((unsigned)(buf[pkt.offset-8]<<8 | buf[pkt.offset-7]) != DNS_DEFAULT_MAX_UDP_SIZE)
+        return 1;
+    rcode |= buf[pkt.offset-6]<<4;
+    if (rcode != expected_rcode)
+        return 1;
+
+    return 0;
+}
+
+static int
+selftest_edns(const struct Catalog *catalog)
+{
+    /* plain DNS gets at most 512 bytes */
+    if (selftest_edns_one(catalog, 0, 0, 512, 1, RCODE_OK))
+        return 1;
+
+    /* EDNS0 gets the whole thing, but no more than we are configured for */
+    if (selftest_edns_one(catalog, 4096, 0, DNS_DEFAULT_MAX_UDP_SIZE, 0, RCODE_OK))
+        return 1;
+
+    /* but no more than the client asked for, and OPT is there even when
+     * truncated */
+    if (selftest_edns_one(catalog, 600, 0, 600, 1, RCODE_OK))
+        return 1;
+
+    /* only version 0 is supported */
+    if (selftest_edns_one(catalog, 4096, 1, 512, 0, RCODE_BADVERS))
+        return 1;
+
+    /* refusals don't go through the resolver, but still get an OPT */
+    {
+        unsigned char query[300];
+        unsigned char buf[512];
+        struct DNS_Incoming request[1];
+        struct DNS_OutgoingResponse response[1];
+        struct Packet pkt;
+        unsigned length;
+
+        length = selftest_make_query(query, sizeof(query), "chlorine.example.com",
+                                     TYPE_TXT, 1232, 0);
+        proto_dns_parse(request, query, 0, length);
+        resolver_init(response, request->query_name.name, request->query_name.length,
+                      request->query_type, request->id, request->opcode);
+        resolver_edns(response, request);
+        response->rcode = RCODE_REFUSED;
+        pkt.buf = buf;
+        pkt.max = sizeof(buf);
+        pkt.offset = 0;
+        dns_format_response(response, &pkt);
+        if (pkt.offset < 12 + 11 || (buf[3] & 0xF) != RCODE_REFUSED
+            || (buf[10]<<8 | buf[11]) != 1
+            || memcmp(buf + pkt.offset - 11, "\0\0\x29", 3) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/****************************************************************************
+ * Resolve a batch of queries both one at a time and as a batch, and make
+ * sure that both produce the same responses.
+ ****************************************************************************/
+static int
+selftest_batch(const struct Catalog *catalog)
+{
+    static const char *names[] = {
+        "hydrogen.example.com", "helium.example.com", "sulfur.example.com",
+        "aluminium.example.com", "random123.example.com", "example.com",
+        "silicon.example.com", "www.example.net", 0};
+    static const int types[] = {
+        TYPE_A, TYPE_ANY, TYPE_ANY, 
+        TYPE_MX, TYPE_A, TYPE_SOA, 
+        TYPE_CNAME, TYPE_A};
+    unsigned char bufs[8][300];
+    struct DNS_Incoming requests[8];
+    struct DNS_OutgoingResponse singles[8];
+    struct DNS_OutgoingResponse batch[8];
+    unsigned count;
+    unsigned i;
+    unsigned j;
+
+    for (count=0; names[count]; count++) {
+        unsigned length;
+
+        length = selftest_make_query(bufs[count], sizeof(bufs[count]),
+                                     names[count], types[count], 0, 0);
+        proto_dns_parse(&requests[count], bufs[count], 0, length);
+        if (!requests[count].is_valid)
+            return 1;
+    }
+
+    for (i=0; i<count; i++) {
+        const struct DNS_Incoming *request = &requests[i];
+
+        resolver_init(&singles[i], request->query_name.name, request->query_name.length,
+                      request->query_type, request->id, request->opcode);
+        resolver_init(&batch[i], request->query_name.name, request->query_name.length,
+                      request->query_type, request->id, request->opcode);
+        resolver_algorithm(catalog, &singles[i], request);
+    }
+    resolver_algorithm_batch(catalog, batch, requests, count);
+
+    for (i=0; i<count; i++) {
+        const struct DNS_OutgoingResponse *lhs = &singles[i];
+        const struct DNS_OutgoingResponse *rhs = &batch[i];
+
+        if (lhs->rcode != rhs->rcode || lhs->aa != rhs->aa
+            || lhs->ancount != rhs->ancount
+            || lhs->nscount != rhs->nscount
+            || lhs->arcount != rhs->arcount)
+            return 1;
+        for (j=0; j<lhs->ancount + lhs->nscount + lhs->arcount; j++) {
+            if (lhs->rrsets[j].rrset != rhs->rrsets[j].rrset)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+/****************************************************************************
+ * Format a response into a packet, for comparing
+ ****************************************************************************/
+static unsigned
+selftest_format(struct DNS_OutgoingResponse *response,
+                unsigned char *buf, unsigned sizeof_buf)
+{
+    struct Packet pkt;
+
+    memset(buf, 0, sizeof_buf);
+    pkt.buf = buf;
+    pkt.max = sizeof_buf;
+    pkt.offset = 0;
+    dns_format_response(response, &pkt);
+    return pkt.offset;
+}
+
+/****************************************************************************
+ * Two responses in the same batch that both outgrow their inline RRsets
+ * mustn't share overflow storage. Each is formatted after the whole batch
+ * is resolved, and must match what it gets when resolved on its own.
+ ****************************************************************************/
+static int
+selftest_batch_overflow(const struct Catalog *catalog)
+{
+    static const char *names[] = {"sulfur.example.com", "argon.example.com"};
+    unsigned char queries[2][300];
+    unsigned char expected[2][4096];
+    unsigned char got[2][4096];
+    unsigned expected_length[2];
+    struct DNS_Incoming requests[2];
+    struct DNS_OutgoingResponse responses[2];
+    unsigned i;
+
+    for (i=0; i<2; i++) {
+        unsigned length;
+
+        length = selftest_make_query(queries[i], sizeof(queries[i]), names[i], TYPE_ANY, 4096, 0);
+        proto_dns_parse(&requests[i], queries[i], 0, length);
+        if (!requests[i].is_valid)
+            return 1;
+    }
+
+    /* one at a time, formatting each before resolving the next */
+    for (i=0; i<2; i++) {
+        const struct DNS_Incoming *request = &requests[i];
+
+        resolver_init(&responses[i], request->query_name.name, request->query_name.length,
+                      request->query_type, request->id, request->opcode);
+        resolver_algorithm(catalog, &responses[i], request);
+        if (responses[i].ancount + responses[i].nscount + responses[i].arcount <= RESPONSE_INLINE_RRSETS)
+            return 1;
+        expected_length[i] = selftest_format(&responses[i], expected[i], sizeof(expected[i]));
+    }
+
+    /* then both in one batch */
+    for (i=0; i<2; i++) {
+        const struct DNS_Incoming *request = &requests[i];
+
+        resolver_init(&responses[i], request->query_name.name, request->query_name.length,
+                      request->query_type, request->id, request->opcode);
+    }
+    resolver_algorithm_batch(catalog, responses, requests, 2);
+    for (i=0; i<2; i++) {
+        if (selftest_format(&responses[i], got[i], sizeof(got[i])) != expected_length[i]
+            || memcmp(got[i], expected[i], expected_length[i]) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/****************************************************************************
+ * Resolve an ANY query under one of the RFC 8482 policies, over UDP or
+ * TCP, and format the response
+ ****************************************************************************/
+static void
+selftest_any_one(const struct Catalog *catalog, int policy, unsigned is_tcp,
+                 struct DNS_OutgoingResponse *response,
+                 unsigned char *packet, unsigned sizeof_packet)
+{
+    unsigned char query[300];
+    struct DNS_Incoming request[1];
+    struct Packet pkt;
+    unsigned length;
+
+    length = selftest_make_query(query, sizeof(query), "sulfur.example.com", TYPE_ANY, 0, 0);
+    proto_dns_parse(request, query, 0, length);
+
+    resolver_set_any_policy(policy);
+    resolver_init(response, request->query_name.name, request->query_name.length,
+                  request->query_type, request->id, request->opcode);
+    response->is_tcp = is_tcp;
+    resolver_algorithm(catalog, response, request);
+    resolver_set_any_policy(RESOLVER_ANY_FULL);
+
+    memset(packet, 0, sizeof_packet);
+    pkt.buf = packet;
+    pkt.max = sizeof_packet;
+    pkt.offset = 0;
+    dns_format_response(response, &pkt);
+}
+
+static int
+selftest_minimal_any(const struct Catalog *catalog)
+{
+    struct DNS_OutgoingResponse response[1];
+    unsigned char packet[4096];
+    unsigned i;
+    int found;
+
+    /* The name has many RRsets, so the full answer has them all */
+    selftest_any_one(catalog, RESOLVER_ANY_FULL, 0, response, packet, sizeof(packet));
+    if (response->ancount < 4 || response->tc)
+        return 1;
+
+    /* Only one of them */
+    selftest_any_one(catalog, RESOLVER_ANY_SINGLE, 0, response, packet, sizeof(packet));
+    if (response->ancount != 1 || response->tc)
+        return 1;
+
+    /* A made up HINFO, which has to survive formatting */
+    selftest_any_one(catalog, RESOLVER_ANY_HINFO, 0, response, packet, sizeof(packet));
+    if (response->ancount != 1 || response->tc)
+        return 1;
+    found = 0;
+    for (i=0; i + 18 <= sizeof(packet); i++) {
+        if (memcmp(packet + i, "\0\x0d\0\x01\0\0\x0e\x10\0\x09\x07RFC8482", 18) == 0)
+            found = 1;
+    }
+    if (!found)
+        return 1;
+
+    /* Nothing, but try again over TCP */
+    selftest_any_one(catalog, RESOLVER_ANY_TRUNCATE, 0, response, packet, sizeof(packet));
+    if (response->ancount != 0 || !response->tc || (packet[2] & 0x02) == 0)
+        return 1;
+
+    /* Which gets everything */
+    selftest_any_one(catalog, RESOLVER_ANY_TRUNCATE, 1, response, packet, sizeof(packet));
+    if (response->ancount < 4 || response->tc)
+        return 1;
+
+    return 0;
+}
+
 /****************************************************************************
  * Send a DNS request to ourselves, then parse the response and make sure
  * it contains at least the information we requested.
@@ -726,6 +1126,114 @@ selftest(int argc, char *argv[])
         return Failure;
     }
 
+    /*
+     * Compressed zonefile streaming
+     */
+    if (zonestream_selftest() != 0) {
+        fprintf(stderr, "zonefile-stream: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * DNS name compression
+     */
+    if (compressor_selftest() != 0) {
+        fprintf(stderr, "compressor: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Response rate limiting
+     */
+    if (rrl_selftest() != 0) {
+        fprintf(stderr, "rrl: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Packed entry layout
+     */
+    if (entry_selftest() != 0) {
+        fprintf(stderr, "entry: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Zone negative-lookup filter
+     */
+    if (zone_selftest() != 0) {
+        fprintf(stderr, "zone: filter selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Compiled address-match lists
+     */
+    if (acl_selftest() != 0) {
+        fprintf(stderr, "acl: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Address ranges, and the blocklist made of them
+     */
+    if (ranges_selftest() != 0) {
+        fprintf(stderr, "ranges: selftest failed\n");
+        return Failure;
+    }
+    if (blocklist_selftest() != 0) {
+        fprintf(stderr, "blocklist: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Kernel socket filter
+     */
+    if (sockfilter_selftest() != 0) {
+        fprintf(stderr, "sockfilter: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Query-name filter
+     */
+    if (qnamefilter_selftest() != 0) {
+        fprintf(stderr, "qname-filter: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * DNS cookies
+     */
+    if (cookie_selftest() != 0) {
+        fprintf(stderr, "cookie: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Overload admission control
+     */
+    if (overload_selftest() != 0) {
+        fprintf(stderr, "overload: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Per-thread query statistics
+     */
+    if (stats_selftest() != 0) {
+        fprintf(stderr, "stats: selftest failed\n");
+        return Failure;
+    }
+
+    /*
+     * Stage timing histograms
+     */
+    if (timing_selftest() != 0) {
+        fprintf(stderr, "timing: selftest failed\n");
+        return Failure;
+    }
+
 
     selftest->total_code = Success;
 
@@ -982,6 +1490,133 @@ selftest(int argc, char *argv[])
         "magnesium.example.com", 22, "\x02\x01" "\x12\x34\x56\x78\x9a\xbc\xde\xf6\x78\x90\x12\x34\x56\x78\x9a\xbc\xde\xf6\x78\x90", TYPE_SSHFP,
         NULL);
 
+    /*
+     * Glue: the address of the mailserver should be in the additional
+     * section. The glue is linked when the catalog is indexed after
+     * loading, so we have to flush and index it before querying.
+     */
+    LOAD("aluminium   MX 10 mx.aluminium\n", parser);
+    LOAD("mx.aluminium A 10.13.0.1\n", parser);
+    if (zonefile_flush(selftest->parser) == Failure)
+        return Failure;
+    catalog_build_index(db_load);
+    QUERY("aluminium", TYPE_MX, selftest,
+        "mx.aluminium.example.com", 4, "\x0a\x0d\x00\x01", TYPE_A,
+        NULL);
+
+    /*
+     * Indexing also built the directory of RRset types, so these find
+     * the RRsets through that instead of walking the entry
+     */
+    QUERY("helium", TYPE_AAAA, selftest,
+        "helium.example.com", 16, "\x20\2\0\0\0\0\0\0\0\0\0\0\0\0\0\1", TYPE_AAAA,
+        NULL);
+    QUERY("helium", TYPE_TXT, selftest,
+        "helium.example.com", 13, "\x0c" "hello, world", TYPE_TXT,
+        NULL);
+
+    /*
+     * Names within RDATA are compressed against the owner. Indexing worked
+     * out how many labels each shares with the owner (or zone), so only
+     * the first labels need compressing.
+     */
+    QUERY("aluminium", TYPE_MX, selftest,
+        "aluminium.example.com", 28, "\x00\x0a" "\x02" "mx" "\x09" "aluminium" "\x07" "example" "\x03" "com" "\x00", TYPE_MX,
+        NULL);
+    QUERY("example.com.", TYPE_SOA, selftest,
+        "example.com.", 0x3c, 
+                "\x02" "ns" "\x07" "example" "\x03" "com" "\x00"
+                "\x0a" "hostmaster" "\x07" "example" "\x03" "com" "\x00"
+                "\x77\x64\x96\x60"
+                "\x00\x02\xa3\x00"
+                "\x00\x00\x03\x84"
+                "\x00\x12\x75\x00"
+                "\x00\x00\x0e\x10",
+        TYPE_SOA,
+        NULL);
+    LOAD("silicon CNAME hydrogen\n", parser);
+    LOAD("phosphorus CNAME www.example.net.\n", parser);
+    QUERY("silicon", TYPE_CNAME, selftest,
+        "silicon.example.com", 22, "\x08" "hydrogen" "\x07" "example" "\x03" "com" "\x00", TYPE_CNAME,
+        NULL);
+    if (zonefile_flush(selftest->parser) == Failure)
+        return Failure;
+    catalog_build_index(db_load);
+    QUERY("silicon", TYPE_CNAME, selftest,
+        "silicon.example.com", 22, "\x08" "hydrogen" "\x07" "example" "\x03" "com" "\x00", TYPE_CNAME,
+        NULL);
+    QUERY("phosphorus", TYPE_CNAME, selftest,
+        "phosphorus.example.com", 17, "\x03" "www" "\x07" "example" "\x03" "net" "\x00", TYPE_CNAME,
+        NULL);
+
+    /*
+     * More RRsets than fit inline in a response, so that it has to move
+     * to the overflow pool part way through.
+     */
+    LOAD("sulfur A 16.0.0.1\n", parser);
+    LOAD("sulfur AAAA 2016::1\n", parser);
+    LOAD("sulfur TXT \"sixteen\"\n", parser);
+    LOAD("sulfur HINFO \"x86\" \"Linux\"\n", parser);
+    LOAD("sulfur SSHFP 2 1 123456789abcdef67890123456789abcdef67890\n", parser);
+    LOAD("sulfur LOC 42 21 54 N 71 06 18 W -24m 30m\n", parser);
+    LOAD("sulfur PTR hydrogen\n", parser);
+    LOAD("sulfur MX 10 hydrogen\n", parser);
+    LOAD("argon A 18.0.0.1\n", parser);
+    LOAD("argon AAAA 2018::1\n", parser);
+    LOAD("argon TXT \"eighteen\"\n", parser);
+    LOAD("argon HINFO \"arm\" \"Linux\"\n", parser);
+    LOAD("argon SSHFP 2 1 23456789abcdef67890123456789abcdef678901\n", parser);
+    LOAD("argon LOC 42 21 54 N 71 06 18 W -18m 30m\n", parser);
+    LOAD("argon PTR helium\n", parser);
+    LOAD("argon MX 10 helium\n", parser);
+    if (zonefile_flush(selftest->parser) == Failure)
+        return Failure;
+    catalog_build_index(db_load);
+    QUERY("sulfur", TYPE_ANY, selftest,
+        "sulfur.example.com", 4, "\x10\0\0\1", TYPE_A,
+        "sulfur.example.com", 8, "\x07" "sixteen", TYPE_TXT,
+        "sulfur.example.com", 16, "\x20\x16\0\0\0\0\0\0\0\0\0\0\0\0\0\1", TYPE_AAAA,
+        "hydrogen.example.com", 4, "\1\0\0\1", TYPE_A,
+        NULL);
+
+
+    LOAD("chlorine TXT \"17 ..............................................................\"\n"
+         "chlorine TXT \"17 .............................................................1\"\n"
+         "chlorine TXT \"17 .............................................................2\"\n"
+         "chlorine TXT \"17 .............................................................3\"\n"
+         "chlorine TXT \"17 .............................................................4\"\n"
+         "chlorine TXT \"17 .............................................................5\"\n"
+         "chlorine TXT \"17 .............................................................6\"\n"
+         "chlorine TXT \"17 .............................................................7\"\n"
+         "chlorine TXT \"17 .............................................................8\"\n"
+         "chlorine TXT \"17 .............................................................9\"\n",
+         parser);
+    if (zonefile_flush(selftest->parser) == Failure)
+        return Failure;
+    if (selftest_edns(db_load) != 0) {
+        fprintf(stderr, "edns0: selftest failed\n");
+        selftest->total_code = Failure;
+    }
+    if (tcpworker_selftest(db_load) != 0) {
+        fprintf(stderr, "tcp: selftest failed\n");
+        selftest->total_code = Failure;
+    }
+    if (proto_tcp_selftest(db_load) != 0) {
+        fprintf(stderr, "tcp: stack selftest failed\n");
+        selftest->total_code = Failure;
+    }
+    if (selftest_batch(db_load) != 0) {
+        fprintf(stderr, "resolver: batch selftest failed\n");
+        selftest->total_code = Failure;
+    }
+    if (selftest_batch_overflow(db_load) != 0) {
+        fprintf(stderr, "resolver: batch overflow selftest failed\n");
+        selftest->total_code = Failure;
+    }
+    if (selftest_minimal_any(db_load) != 0) {
+        fprintf(stderr, "resolver: minimal ANY selftest failed\n");
+        selftest->total_code = Failure;
+    }
 
     /* we are now done parsing the zonefile, so free the parser */
     parse_results = zonefile_end(parser);
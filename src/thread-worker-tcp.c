@@ -0,0 +1,771 @@
+#define _GNU_SOURCE
+#include "thread-worker-tcp.h"
+#include "main-conf.h"
+#include "logger.h"
+#include "pixie-atomic.h"
+#include "pixie-sockets.h"
+#include "proto-dns.h"
+#include "proto-dns-cookie.h"
+#include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-stats.h"
+#include "proto-dns-timing.h"
+#include "resolver.h"
+#include "packet.h"
+#include "string_s.h"
+#include "unusedparm.h"
+#include "util-acl.h"
+#include "util-blocklist.h"
+#include "util-realloc2.h"
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Connections from the same prefix are counted in one of these slots. Two
+ * prefixes that share a slot share the limit, which errs on the side of
+ * refusing connections */
+#define TCP_PREFIX_SLOTS        4096
+static volatile unsigned prefix_counts[TCP_PREFIX_SLOTS];
+
+/* How many free buffers each thread keeps around */
+#define TCP_POOL_MAX            64
+
+/* epoll data for a listener, rather than a connection index */
+#define TCP_LISTENER_FLAG       0x100000000ULL
+
+struct TcpConnection
+{
+    int fd;
+    unsigned prefix_slot;
+    unsigned is_refused:1;
+    time_t last_active;
+
+    /* the client's address, for DNS cookies */
+    unsigned char addr[16];
+    unsigned addr_length;
+
+    /* The bytes received so far, 2 byte length prefixed queries, in
+     * a buffer from the pool. It's only held while there are bytes in
+     * it, so idle connections don't have one */
+    unsigned char *buf;
+    unsigned length;
+
+    /* Response bytes the socket wouldn't take yet. While there are any,
+     * we stop reading queries */
+    unsigned char *pending;
+    unsigned pending_offset;
+    unsigned pending_length;
+};
+
+struct TcpWorker
+{
+    int epfd;
+
+    /* the set of listeners we've registered, only used to tell when
+     * it changes, since the old set is freed afterwards */
+    const struct CoreSocketSet *sockets;
+    int listeners[16];
+    unsigned listener_count;
+
+    struct TcpConnection conns[TCP_MAX_CONNECTIONS];
+    unsigned free_list[TCP_MAX_CONNECTIONS];
+    unsigned free_count;
+
+    unsigned char *pool[TCP_POOL_MAX];
+    unsigned pool_count;
+
+    time_t last_sweep;
+
+    /* where responses are formatted: the 2 byte length, followed by
+     * the largest possible DNS message */
+    unsigned char out[2 + 65535];
+};
+
+
+/****************************************************************************
+ * Find the counter for the client's /24 (IPv4) or /56 (IPv6)
+ ****************************************************************************/
+static unsigned
+tcp_prefix_slot(const struct sockaddr_storage *sa)
+{
+    unsigned hash = 0;
+
+    if (sa->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        hash = ntohl(sin->sin_addr.s_addr) >> 8;
+    } else if (sa->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        const unsigned char *a = sin6->sin6_addr.s6_addr;
+        unsigned i;
+
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+            hash = a[12]<<16 | a[13]<<8 | a[14];
+        else {
+            hash = 0x80000000;
+            for (i=0; i<7; i++)
+                hash = hash * 31 + a[i];
+        }
+    }
+
+    hash ^= hash >> 13;
+    hash *= 0x9E3779B1;
+    return (hash >> 16) & (TCP_PREFIX_SLOTS-1);
+}
+
+/****************************************************************************
+ * Check the client against the blocklist, and the blackhole and
+ * allow-query lists
+ ****************************************************************************/
+static int
+tcp_acl(const struct sockaddr_storage *sa)
+{
+    const unsigned char *addr;
+    unsigned addr_length;
+
+    if (sa->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        addr = (const unsigned char *)&sin->sin_addr;
+        addr_length = 4;
+    } else if (sa->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        addr = sin6->sin6_addr.s6_addr;
+        addr_length = 16;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            addr += 12;
+            addr_length = 4;
+        }
+    } else
+        return ACL_QUERY_ACCEPT;
+
+    if (blocklist_is_blocked(addr, addr_length))
+        return ACL_QUERY_DROP;
+    return acl_check_query(addr, addr_length);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static unsigned char *
+tcp_buffer_get(struct TcpWorker *tcp)
+{
+    if (tcp->pool_count)
+        return tcp->pool[--tcp->pool_count];
+    return MALLOC2(2 + TCP_MAX_QUERY);
+}
+
+static void
+tcp_buffer_put(struct TcpWorker *tcp, unsigned char *buf)
+{
+    if (tcp->pool_count < TCP_POOL_MAX)
+        tcp->pool[tcp->pool_count++] = buf;
+    else
+        free(buf);
+}
+
+/****************************************************************************
+ * Give the buffer back once every query in it has been answered
+ ****************************************************************************/
+static void
+tcp_buffer_release(struct TcpWorker *tcp, struct TcpConnection *conn)
+{
+    if (conn->buf && conn->length == 0) {
+        tcp_buffer_put(tcp, conn->buf);
+        conn->buf = 0;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+tcp_close(struct TcpWorker *tcp, struct TcpConnection *conn)
+{
+    close(conn->fd);
+    __sync_fetch_and_sub(&prefix_counts[conn->prefix_slot], 1);
+
+    if (conn->buf)
+        tcp_buffer_put(tcp, conn->buf);
+    if (conn->pending)
+        free(conn->pending);
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+    tcp->free_list[tcp->free_count++] = (unsigned)(conn - tcp->conns);
+}
+
+/****************************************************************************
+ * Start handling a connection that's been accepted. The prefix count has
+ * already been incremented.
+ ****************************************************************************/
+static int
+tcp_add(struct TcpWorker *tcp, int fd, const struct sockaddr_storage *sa,
+        unsigned prefix_slot, unsigned is_refused)
+{
+    struct TcpConnection *conn;
+    struct epoll_event ev;
+    unsigned index;
+
+    if (tcp->free_count == 0)
+        return -1;
+    index = tcp->free_list[--tcp->free_count];
+    conn = &tcp->conns[index];
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->prefix_slot = prefix_slot;
+    conn->is_refused = is_refused;
+    conn->last_active = time(0);
+    if (sa->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        memcpy(conn->addr, &sin->sin_addr, 4);
+        conn->addr_length = 4;
+    } else if (sa->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            memcpy(conn->addr, sin6->sin6_addr.s6_addr + 12, 4);
+            conn->addr_length = 4;
+        } else {
+            memcpy(conn->addr, sin6->sin6_addr.s6_addr, 16);
+            conn->addr_length = 16;
+        }
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = index;
+    if (epoll_ctl(tcp->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        conn->fd = -1;
+        tcp->free_list[tcp->free_count++] = index;
+        return -1;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+tcp_accept(struct TcpWorker *tcp, int listener)
+{
+    for (;;) {
+        struct sockaddr_storage sa;
+        socklen_t sizeof_sa = sizeof(sa);
+        unsigned slot;
+        int verdict;
+        int fd;
+
+        fd = accept4(listener, (struct sockaddr *)&sa, &sizeof_sa, SOCK_NONBLOCK);
+        if (fd < 0)
+            return; /* EAGAIN, or another thread got it */
+
+        /* the kernel has already completed the handshake, so the best we
+         * can do for blocked or blackholed clients is hang up right away */
+        verdict = tcp_acl(&sa);
+        if (verdict == ACL_QUERY_DROP) {
+            close(fd);
+            continue;
+        }
+
+        /* enforce the limits: per prefix across all threads, and per
+         * thread for our table */
+        slot = tcp_prefix_slot(&sa);
+        if (__sync_fetch_and_add(&prefix_counts[slot], 1) >= TCP_MAX_PER_PREFIX) {
+            __sync_fetch_and_sub(&prefix_counts[slot], 1);
+            LOG_DBG(C_NETWORK, 2, "tcp: too many connections from prefix\n");
+            close(fd);
+            continue;
+        }
+        if (tcp_add(tcp, fd, &sa, slot, verdict == ACL_QUERY_REFUSE) != 0) {
+            __sync_fetch_and_sub(&prefix_counts[slot], 1);
+            close(fd);
+            continue;
+        }
+    }
+}
+
+/****************************************************************************
+ * Switch between waiting for the socket to be readable (normal) and
+ * waiting for it to be writable (when we have a pending response)
+ ****************************************************************************/
+static void
+tcp_wait_for(struct TcpWorker *tcp, struct TcpConnection *conn, unsigned events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = (unsigned)(conn - tcp->conns);
+    epoll_ctl(tcp->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/****************************************************************************
+ * Send a response, keeping whatever the socket won't take for later.
+ * @return 0 on success, or -1 if the connection is broken
+ ****************************************************************************/
+static int
+tcp_send(struct TcpWorker *tcp, struct TcpConnection *conn,
+         const unsigned char *buf, unsigned length)
+{
+    ssize_t x;
+
+    x = send(conn->fd, buf, length, MSG_NOSIGNAL);
+    if (x < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        x = 0;
+    }
+    if ((unsigned)x == length)
+        return 0;
+
+    conn->pending = MALLOC2(length - x);
+    memcpy(conn->pending, buf + x, length - x);
+    conn->pending_offset = 0;
+    conn->pending_length = length - (unsigned)x;
+    tcp_wait_for(tcp, conn, EPOLLOUT);
+    return 0;
+}
+
+/****************************************************************************
+ * Send what's left of a pending response
+ ****************************************************************************/
+static int
+tcp_send_pending(struct TcpWorker *tcp, struct TcpConnection *conn)
+{
+    ssize_t x;
+
+    x = send(conn->fd, conn->pending + conn->pending_offset,
+             conn->pending_length - conn->pending_offset, MSG_NOSIGNAL);
+    if (x < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    conn->pending_offset += (unsigned)x;
+    if (conn->pending_offset < conn->pending_length)
+        return 0;
+
+    free(conn->pending);
+    conn->pending = 0;
+    conn->pending_offset = 0;
+    conn->pending_length = 0;
+    tcp_wait_for(tcp, conn, EPOLLIN);
+    return 0;
+}
+
+/****************************************************************************
+ * Answer one query, using the same parse/resolve/format steps as UDP,
+ * except that the response isn't limited to a UDP size.
+ ****************************************************************************/
+static int
+tcp_answer(struct TcpWorker *tcp, struct TcpConnection *conn,
+           const struct Catalog *catalog,
+           const unsigned char *query, unsigned query_length)
+{
+    struct DNS_Incoming request[1];
+    struct DNS_OutgoingResponse response[1];
+    struct Packet pkt;
+    struct StageTimer timer;
+    int action;
+    int x;
+
+    timing_sample(&timer);
+    TIMING_START(&timer);
+    proto_dns_parse(request, query, 0, query_length);
+    TIMING_STOP(&timer, TIMING_PARSE);
+    if (!request->is_valid) {
+        stats_drop(STATS_DROP_MALFORMED);
+        return 0;
+    }
+    stats_query(STATS_TCP, request->query_type);
+
+    /* over TCP, a truncated answer would only be retried, so those are
+     * resolved normally. A malformed query is answered FORMERR, whatever
+     * its name */
+    if (request->is_formerr)
+        action = QNAMEFILTER_PASS;
+    else
+        action = qnamefilter_check(&request->query_name);
+    if (action == QNAMEFILTER_DROP) {
+        stats_drop(STATS_DROP_QNAME);
+        return 0;
+    }
+
+    resolver_init(response,
+                  request->query_name.name,
+                  request->query_name.length,
+                  request->query_type,
+                  request->id,
+                  request->opcode);
+    response->is_tcp = 1;
+    if (request->cookie_length && conn->addr_length)
+        cookie_check(response, request, conn->addr, conn->addr_length, (unsigned)time(0));
+
+    if (conn->is_refused || action == QNAMEFILTER_REFUSE) {
+        resolver_edns(response, request);
+        response->rcode = RCODE_REFUSED;
+    } else if (request->is_formerr) {
+        resolver_edns(response, request);
+        response->rcode = RCODE_FORMERR;
+    } else {
+        TIMING_START(&timer);
+        resolver_algorithm(catalog, response, request);
+        TIMING_STOP(&timer, TIMING_RESOLVE);
+
+        /* the handshake proves the address is real, so let this prefix
+         * in over UDP when we're overloaded */
+        if (conn->addr_length)
+            overload_credit_tcp(conn->addr, conn->addr_length, (unsigned)time(0));
+    }
+
+    pkt.buf = tcp->out;
+    pkt.max = sizeof(tcp->out);
+    pkt.offset = 2;
+    TIMING_START(&timer);
+    dns_format_response(response, &pkt);
+    TIMING_STOP(&timer, TIMING_FORMAT);
+    if (pkt.offset <= 2 || pkt.offset > pkt.max)
+        return 0;
+    stats_response(response);
+
+    tcp->out[0] = (unsigned char)((pkt.offset - 2)>>8);
+    tcp->out[1] = (unsigned char)((pkt.offset - 2)>>0);
+    TIMING_START(&timer);
+    x = tcp_send(tcp, conn, tcp->out, pkt.offset);
+    TIMING_STOP(&timer, TIMING_XMIT);
+    return x;
+}
+
+/****************************************************************************
+ * Answer all the complete queries in the buffer, in the order they
+ * arrived, leaving any partial query for the next read. RFC 7766 lets us
+ * reply out of order, but every answer here comes from memory without
+ * waiting on anything, so a later query can never be ready before an
+ * earlier one. The only thing that holds replies up is a full socket, and
+ * that holds them all up whatever order they're in.
+ ****************************************************************************/
+static int
+tcp_process(struct TcpWorker *tcp, struct TcpConnection *conn,
+            const struct Catalog *catalog)
+{
+    unsigned offset = 0;
+
+    while (conn->pending == NULL && offset + 2 <= conn->length) {
+        unsigned length = conn->buf[offset]<<8 | conn->buf[offset+1];
+
+        if (length > TCP_MAX_QUERY || length < 12)
+            return -1;
+        if (offset + 2 + length > conn->length)
+            break;
+
+        if (tcp_answer(tcp, conn, catalog, conn->buf + offset + 2, length) != 0)
+            return -1;
+        offset += 2 + length;
+    }
+
+    if (offset) {
+        memmove(conn->buf, conn->buf + offset, conn->length - offset);
+        conn->length -= offset;
+    }
+    tcp_buffer_release(tcp, conn);
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+tcp_read(struct TcpWorker *tcp, struct TcpConnection *conn,
+         const struct Catalog *catalog)
+{
+    while (conn->pending == NULL) {
+        ssize_t x;
+
+        if (conn->buf == NULL)
+            conn->buf = tcp_buffer_get(tcp);
+
+        x = recv(conn->fd, conn->buf + conn->length,
+                 2 + TCP_MAX_QUERY - conn->length, 0);
+        if (x == 0)
+            return -1; /* closed by the client */
+        if (x < 0) {
+            tcp_buffer_release(tcp, conn);
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        conn->length += (unsigned)x;
+        if (tcp_process(tcp, conn, catalog) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+tcp_sweep(struct TcpWorker *tcp, time_t now)
+{
+    unsigned i;
+
+    for (i=0; i<TCP_MAX_CONNECTIONS; i++) {
+        struct TcpConnection *conn = &tcp->conns[i];
+
+        if (conn->fd < 0)
+            continue;
+        if (now - conn->last_active > TCP_IDLE_TIMEOUT)
+            tcp_close(tcp, conn);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+tcpworker_run(struct TcpWorker *tcp, const struct Catalog *catalog)
+{
+    struct epoll_event events[64];
+    time_t now = time(0);
+    int count;
+    int i;
+
+    count = epoll_wait(tcp->epfd, events, 64, 0);
+
+    for (i=0; i<count; i++) {
+        struct TcpConnection *conn;
+        int err = 0;
+
+        if (events[i].data.u64 & TCP_LISTENER_FLAG) {
+            tcp_accept(tcp, (int)(events[i].data.u64 & 0xFFFFFFFF));
+            continue;
+        }
+
+        conn = &tcp->conns[events[i].data.u64];
+        if (conn->fd < 0)
+            continue;
+        conn->last_active = now;
+
+        if (events[i].events & (EPOLLERR|EPOLLHUP))
+            err = -1;
+        if (!err && conn->pending)
+            err = tcp_send_pending(tcp, conn);
+        if (!err && conn->pending == NULL) {
+            /* queries that arrived while we were waiting to send */
+            err = tcp_process(tcp, conn, catalog);
+            if (!err)
+                err = tcp_read(tcp, conn, catalog);
+        }
+        if (err)
+            tcp_close(tcp, conn);
+    }
+
+    if (now != tcp->last_sweep) {
+        tcp->last_sweep = now;
+        tcp_sweep(tcp, now);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+tcpworker_set_listeners(struct TcpWorker *tcp, const struct CoreSocketSet *sockets)
+{
+    unsigned i;
+
+    if (sockets == tcp->sockets)
+        return;
+    tcp->sockets = sockets;
+
+    for (i=0; i<tcp->listener_count; i++)
+        epoll_ctl(tcp->epfd, EPOLL_CTL_DEL, tcp->listeners[i], 0);
+    tcp->listener_count = 0;
+
+    for (i=0; sockets && i<sockets->count; i++) {
+        const struct CoreSocketItem *item = &sockets->list[i];
+        struct epoll_event ev;
+        int fd = item->fd;
+
+        if (item->proto != IPPROTO_TCP || fd <= 0)
+            continue;
+        if (tcp->listener_count >= sizeof(tcp->listeners)/sizeof(tcp->listeners[0]))
+            break;
+
+        /* all threads accept from the same listener, so it mustn't block
+         * when another thread gets there first */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+        ev.data.u64 = TCP_LISTENER_FLAG | (unsigned)fd;
+        if (epoll_ctl(tcp->epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+            tcp->listeners[tcp->listener_count++] = fd;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+tcpworker_is_supported(void)
+{
+    return 1;
+}
+
+int
+tcpworker_fd(const struct TcpWorker *tcp)
+{
+    return tcp->epfd;
+}
+
+struct TcpWorker *
+tcpworker_create(void)
+{
+    struct TcpWorker *tcp;
+    unsigned i;
+
+    tcp = MALLOC2(sizeof(*tcp));
+    memset(tcp, 0, sizeof(*tcp));
+
+    tcp->epfd = epoll_create1(0);
+    if (tcp->epfd < 0) {
+        LOG_ERR(C_NETWORK, "epoll_create1(): %s\n", strerror(errno));
+        free(tcp);
+        return NULL;
+    }
+
+    for (i=0; i<TCP_MAX_CONNECTIONS; i++) {
+        tcp->conns[i].fd = -1;
+        tcp->free_list[i] = TCP_MAX_CONNECTIONS - 1 - i;
+    }
+    tcp->free_count = TCP_MAX_CONNECTIONS;
+
+    return tcp;
+}
+
+void
+tcpworker_destroy(struct TcpWorker *tcp)
+{
+    unsigned i;
+
+    if (tcp == NULL)
+        return;
+
+    for (i=0; i<TCP_MAX_CONNECTIONS; i++) {
+        if (tcp->conns[i].fd >= 0)
+            tcp_close(tcp, &tcp->conns[i]);
+    }
+    for (i=0; i<tcp->pool_count; i++)
+        free(tcp->pool[i]);
+    close(tcp->epfd);
+    free(tcp);
+}
+
+/****************************************************************************
+ * Send three pipelined queries, the first split across writes, down one
+ * end of a socket pair, and check they all get answered in order. The
+ * third has a COOKIE of the wrong length, so it gets a bare FORMERR that
+ * doesn't echo the name. The connection only holds a buffer while part of
+ * a query is waiting in it.
+ ****************************************************************************/
+int
+tcpworker_selftest(const struct Catalog *catalog)
+{
+    static const unsigned char queries[] =
+        "\x00\x26"
+        "\x00\x01\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+        "\x08hydrogen\x07" "example\x03" "com\x00" "\x00\x01\x00\x01"
+        "\x00\x24"
+        "\x00\x02\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+        "\x06helium\x07" "example\x03" "com\x00" "\x00\x01\x00\x01"
+        "\x00\x3e"
+        "\x00\x03\x00\x00\x00\x01\x00\x00\x00\x00\x00\x01"
+        "\x08hydrogen\x07" "example\x03" "com\x00" "\x00\x01\x00\x01"
+        "\x00\x00\x29\x10\x00\x00\x00\x00\x00\x00\x0d"
+        "\x00\x0a\x00\x09" "\x01\x02\x03\x04\x05\x06\x07\x08\x09";
+    static const unsigned rcodes[] = {0, 0, 0, 1};
+    struct TcpWorker *tcp;
+    struct TcpConnection *conn;
+    struct sockaddr_storage sa;
+    unsigned char buf[1024];
+    unsigned length = 0;
+    unsigned offset;
+    unsigned id;
+    int fds[2];
+    int i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return 1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+
+    tcp = tcpworker_create();
+    if (tcp == NULL)
+        return 1;
+    __sync_fetch_and_add(&prefix_counts[0], 1);
+    memset(&sa, 0, sizeof(sa));
+    if (tcp_add(tcp, fds[0], &sa, 0, 0) != 0)
+        return 1;
+    for (i=0; i<TCP_MAX_CONNECTIONS && tcp->conns[i].fd != fds[0]; i++)
+        ;
+    conn = &tcp->conns[i];
+    if (i == TCP_MAX_CONNECTIONS || conn->buf != NULL)
+        return 1;
+
+    if (write(fds[1], queries, 10) != 10)
+        return 1;
+    tcpworker_run(tcp, catalog);
+    if (conn->buf == NULL || conn->length != 10)
+        return 1;
+    if (write(fds[1], queries + 10, sizeof(queries) - 1 - 10) != (ssize_t)sizeof(queries) - 1 - 10)
+        return 1;
+
+    for (i=0; i<100 && length < sizeof(buf); i++) {
+        ssize_t x;
+
+        tcpworker_run(tcp, catalog);
+        x = recv(fds[1], buf + length, sizeof(buf) - length, MSG_DONTWAIT);
+        if (x > 0)
+            length += (unsigned)x;
+        else if (length)
+            break;
+    }
+
+    /* three responses, with the IDs of the queries, in order */
+    offset = 0;
+    for (id=1; id<=3; id++) {
+        unsigned response_length;
+
+        if (offset + 2 + 12 > length)
+            break;
+        response_length = buf[offset]<<8 | buf[offset+1];
+        if ((unsigned)(buf[offset+2]<<8 | buf[offset+3]) != id)
+            break;
+        if ((buf[offset+4] & 0x80) == 0 || (buf[offset+5] & 0xF) != rcodes[id])
+            break;
+        if (rcodes[id] && response_length != 12)
+            break;
+        offset += 2 + response_length;
+    }
+    if (conn->buf != NULL || tcp->pool_count != 1)
+        id = 0;
+
+    tcpworker_destroy(tcp);
+    close(fds[1]);
+
+    if (id != 4 || offset != length)
+        return 1;
+    return 0;
+}
+
+#else
+
+/****************************************************************************
+ * No epoll, so no TCP
+ ****************************************************************************/
+int tcpworker_is_supported(void) {return 0;}
+struct TcpWorker *tcpworker_create(void) {return 0;}
+void tcpworker_destroy(struct TcpWorker *tcp) {UNUSEDPARM(tcp);}
+int tcpworker_fd(const struct TcpWorker *tcp) {UNUSEDPARM(tcp); return -1;}
+void tcpworker_set_listeners(struct TcpWorker *tcp, const struct CoreSocketSet *sockets) {UNUSEDPARM(tcp); UNUSEDPARM(sockets);}
+void tcpworker_run(struct TcpWorker *tcp, const struct Catalog *catalog) {UNUSEDPARM(tcp); UNUSEDPARM(catalog);}
+int tcpworker_selftest(const struct Catalog *catalog) {UNUSEDPARM(catalog); return 0;}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef THREAD_WORKER_TCP_H
+#define THREAD_WORKER_TCP_H
+struct Catalog;
+struct CoreSocketSet;
+
+/**
+ * DNS over TCP for sockets mode. Each worker thread has one of these,
+ * which accepts connections on the TCP listeners and answers the queries
+ * on them, alongside the UDP sockets the thread already handles.
+ *
+ * Queries on a connection may be pipelined (RFC 7766 6.2.1.1), and each
+ * is answered as soon as it's been read. Connections are closed after
+ * being idle for a while, and the number of connections from the same
+ * source prefix is limited, so that clients can't use up our memory by
+ * opening lots of connections.
+ *
+ * This is built on epoll(), so elsewhere tcpworker_create() returns NULL
+ * and we don't listen on TCP.
+ */
+struct TcpWorker;
+
+/* Connections per worker thread */
+#define TCP_MAX_CONNECTIONS     1024
+
+/* Connections from the same /24 (IPv4) or /56 (IPv6), across all threads */
+#define TCP_MAX_PER_PREFIX      16
+
+/* Seconds a connection may be idle, RFC 7766 6.2.3 */
+#define TCP_IDLE_TIMEOUT        10
+
+/* The largest query we'll read, not counting the 2 byte length */
+#define TCP_MAX_QUERY           4096
+
+
+int tcpworker_is_supported(void);
+
+struct TcpWorker *tcpworker_create(void);
+void tcpworker_destroy(struct TcpWorker *tcp);
+
+/**
+ * A file descriptor that becomes readable when there is something to do,
+ * so that it can be added to the worker's select() set
+ */
+int tcpworker_fd(const struct TcpWorker *tcp);
+
+/**
+ * Start accepting connections on the TCP sockets in the set, and stop
+ * accepting on the previous set. Call this whenever the set changes,
+ * before the old set is closed.
+ */
+void tcpworker_set_listeners(struct TcpWorker *tcp, const struct CoreSocketSet *sockets);
+
+/**
+ * Handle whatever is ready, without waiting: accept new connections,
+ * answer queries, send pending responses, and close idle connections.
+ */
+void tcpworker_run(struct TcpWorker *tcp, const struct Catalog *catalog);
+
+int tcpworker_selftest(const struct Catalog *catalog);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "main-conf.h"
 #include "configuration.h"
 #include "logger.h"
@@ -7,9 +8,345 @@
 #include "string_s.h"
 #include "proto-dns.h"
 #include "proto-dns-compressor.h"
+#include "proto-dns-cookie.h"
 #include "proto-dns-formatter.h"
+#include "proto-dns-overload.h"
+#include "proto-dns-qnamefilter.h"
+#include "proto-dns-rrl.h"
+#include "proto-dns-stats.h"
+#include "proto-dns-timing.h"
 #include "resolver.h"
+#include "thread-worker-tcp.h"
+#include "util-acl.h"
+#include "util-blocklist.h"
 #include "util-realloc2.h"
+#include <time.h>
+
+/****************************************************************************
+ * The client's address, as the 4 or 16 bytes that the ACLs, rate limiting,
+ * and cookies work with. IPv4 clients on dual-stack sockets are treated
+ * as IPv4.
+ * @return the address, or NULL if it's neither IPv4 nor IPv6
+ ****************************************************************************/
+static const unsigned char *
+thread_worker_addr(const struct sockaddr_storage *sa, unsigned *length)
+{
+    if (sa->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        *length = 4;
+        return (const unsigned char *)&sin->sin_addr;
+    } else if (sa->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        const unsigned char *addr = (const unsigned char *)&sin6->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            *length = 4;
+            return addr + 12;
+        }
+        *length = 16;
+        return addr;
+    }
+    return NULL;
+}
+
+/****************************************************************************
+ * Check the response against the rate limits for the client's address.
+ ****************************************************************************/
+static int
+thread_worker_rrl(struct DNS_OutgoingResponse *response,
+                  const struct sockaddr_storage *sa, unsigned now)
+{
+    unsigned length;
+    const unsigned char *addr = thread_worker_addr(sa, &length);
+
+    if (addr == NULL)
+        return RRL_SEND;
+    return rrl_check(response, addr, length, now);
+}
+
+/****************************************************************************
+ * Whether the client is in a blocked network
+ ****************************************************************************/
+static int
+thread_worker_blocked(const struct sockaddr_storage *sa)
+{
+    unsigned length;
+    const unsigned char *addr = thread_worker_addr(sa, &length);
+
+    if (addr == NULL)
+        return 0;
+    return blocklist_is_blocked(addr, length);
+}
+
+/****************************************************************************
+ * Check the client's address against the blackhole and allow-query lists
+ ****************************************************************************/
+static int
+thread_worker_acl(const struct sockaddr_storage *sa)
+{
+    unsigned length;
+    const unsigned char *addr = thread_worker_addr(sa, &length);
+
+    if (addr == NULL)
+        return ACL_QUERY_ACCEPT;
+    return acl_check_query(addr, length);
+}
+
+/****************************************************************************
+ * Check the client's DNS cookie, if it sent one, and add ours
+ ****************************************************************************/
+static void
+thread_worker_cookie(struct DNS_OutgoingResponse *response,
+                     const struct DNS_Incoming *request,
+                     const struct sockaddr_storage *sa, unsigned now)
+{
+    unsigned length;
+    const unsigned char *addr;
+
+    if (request->cookie_length == 0)
+        return;
+    addr = thread_worker_addr(sa, &length);
+    if (addr)
+        cookie_check(response, request, addr, length, now);
+}
+
+/****************************************************************************
+ * When overloaded, whether to go on with a query from this client
+ ****************************************************************************/
+static int
+thread_worker_admit(const unsigned char *query, unsigned length,
+                    const struct sockaddr_storage *sa, unsigned now)
+{
+    unsigned addr_length;
+    const unsigned char *addr = thread_worker_addr(sa, &addr_length);
+
+    if (addr == NULL)
+        return 1;
+    return overload_admit(query, length, addr, addr_length, now);
+}
+
+/****************************************************************************
+ * Format the response and send it, unless rate limiting says not to
+ ****************************************************************************/
+static void
+thread_worker_send(int fd, struct DNS_OutgoingResponse *response,
+                   const struct sockaddr_storage *sa, socklen_t sizeof_sa,
+                   unsigned now, struct StageTimer *timer)
+{
+    unsigned char buf[4096];
+    struct Packet pkt;
+    const unsigned char *addr;
+    unsigned addr_length;
+
+    /*
+     * Don't let spoofed requests turn us into an amplifier
+     */
+    if (thread_worker_rrl(response, sa, now) == RRL_DROP) {
+        stats_drop(STATS_DROP_RATE_LIMIT);
+        return;
+    }
+
+    /*
+     * Clients we answer build up a history, which gets them in when
+     * we're overloaded
+     */
+    addr = thread_worker_addr(sa, &addr_length);
+    if (addr && response->rcode != RCODE_REFUSED)
+        overload_credit(addr, addr_length, now, response->is_cookie_valid);
+
+    /*
+     * format the 'response' into a 'packet'
+     */
+    pkt.buf = buf;
+    pkt.max = sizeof(buf);
+    pkt.offset = 0;
+    TIMING_START(timer);
+    dns_format_response(response, &pkt);
+    TIMING_STOP(timer, TIMING_FORMAT);
+
+    /*
+     * Transmit the 'packet'
+     */
+    if (pkt.offset <= pkt.max) {
+        stats_response(response);
+        TIMING_START(timer);
+        sendto(fd, 
+               (char*)pkt.buf, pkt.offset, 0,
+               (const struct sockaddr*)sa,
+               sizeof_sa);
+        TIMING_STOP(timer, TIMING_XMIT);
+    }
+}
+
+/****************************************************************************
+ * Receive packets from the socket, resolve them, and send back the
+ * responses. Where we have recvmmsg(), we get up to a batch of packets
+ * at a time and resolve them together, otherwise it's one packet at
+ * a time.
+ * @return how full the socket's queue is, in percent, where anything
+ *      short of a full batch means we've caught up, see overload_sample()
+ ****************************************************************************/
+static unsigned
+thread_worker_receive(struct Core *core, int fd)
+{
+    unsigned char bufs[RESOLVER_BATCH_MAX][2048];
+    unsigned lengths[RESOLVER_BATCH_MAX];
+    struct sockaddr_storage sins[RESOLVER_BATCH_MAX];
+    socklen_t sizeof_sins[RESOLVER_BATCH_MAX];
+    struct DNS_Incoming requests[RESOLVER_BATCH_MAX];
+    struct DNS_OutgoingResponse responses[RESOLVER_BATCH_MAX];
+    unsigned index[RESOLVER_BATCH_MAX];
+    struct StageTimer timer;
+    unsigned count = 0;
+    unsigned valid_count = 0;
+    unsigned fill = 0;
+    unsigned now;
+    unsigned i;
+
+    /*
+     * 1. receive 'packets'
+     */
+#if defined(__linux__)
+    {
+        struct mmsghdr msgs[RESOLVER_BATCH_MAX];
+        struct iovec iovs[RESOLVER_BATCH_MAX];
+        int x;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (i=0; i<RESOLVER_BATCH_MAX; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_name = &sins[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sins[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        x = recvmmsg(fd, msgs, RESOLVER_BATCH_MAX, MSG_DONTWAIT, 0);
+        if (x <= 0)
+            return 0;
+        count = (unsigned)x;
+        for (i=0; i<count; i++) {
+            lengths[i] = msgs[i].msg_len;
+            sizeof_sins[i] = msgs[i].msg_hdr.msg_namelen;
+        }
+    }
+#else
+    {
+        int bytes_received;
+
+        sizeof_sins[0] = sizeof(sins[0]);
+        bytes_received = recvfrom(fd, 
+                                  (char*)bufs[0], sizeof(bufs[0]),
+                                  0, 
+                                  (struct sockaddr*)&sins[0], &sizeof_sins[0]);
+        if (bytes_received <= 0)
+            return 0;
+        lengths[0] = bytes_received;
+        count = 1;
+    }
+#endif
+    now = (unsigned)time(0);
+    timing_sample(&timer);
+
+    /*
+     * A full batch means there may be more waiting, so see how far behind
+     * we are. Anything less means we've caught up
+     */
+    if (count == RESOLVER_BATCH_MAX)
+        fill = overload_socket_fill(fd);
+
+    /*
+     * 2. parse 'packets' into 'requests', and start the 'responses'.
+     * Blocked networks are dropped first, then under overload clients we
+     * don't know are shed, and blackholed clients are dropped, all before
+     * parsing. Queries we refuse or truncate don't need resolving, so
+     * they're answered right away.
+     */
+    for (i=0; i<count; i++) {
+        struct DNS_Incoming *request = &requests[valid_count];
+        struct DNS_OutgoingResponse *response = &responses[valid_count];
+        int verdict;
+        int action;
+
+        if (lengths[i] == 0)
+            continue;
+        if (thread_worker_blocked(&sins[i])) {
+            stats_drop(STATS_DROP_BLOCKLIST);
+            continue;
+        }
+        if (overload_is_active() && !thread_worker_admit(bufs[i], lengths[i], &sins[i], now)) {
+            stats_drop(STATS_DROP_OVERLOAD);
+            continue;
+        }
+        verdict = thread_worker_acl(&sins[i]);
+        if (verdict == ACL_QUERY_DROP) {
+            stats_drop(STATS_DROP_BLACKHOLE);
+            continue;
+        }
+
+        TIMING_START(&timer);
+        proto_dns_parse(request, bufs[i], 0, lengths[i]);
+        TIMING_STOP(&timer, TIMING_PARSE);
+        if (!request->is_valid) {
+            stats_drop(STATS_DROP_MALFORMED);
+            continue;
+        }
+        stats_query(STATS_UDP, request->query_type);
+
+        /* a malformed query is answered FORMERR, whatever its name */
+        if (request->is_formerr)
+            action = QNAMEFILTER_PASS;
+        else
+            action = qnamefilter_check(&request->query_name);
+        if (action == QNAMEFILTER_DROP) {
+            stats_drop(STATS_DROP_QNAME);
+            continue;
+        }
+
+        resolver_init(response, 
+                      request->query_name.name, 
+                      request->query_name.length, 
+                      request->query_type,
+                      request->id,
+                      request->opcode);
+        thread_worker_cookie(response, request, &sins[i], now);
+
+        if (verdict == ACL_QUERY_REFUSE || action == QNAMEFILTER_REFUSE) {
+            resolver_edns(response, request);
+            response->rcode = RCODE_REFUSED;
+            thread_worker_send(fd, response, &sins[i], sizeof_sins[i], now, &timer);
+            continue;
+        }
+        if (action == QNAMEFILTER_TRUNCATE) {
+            resolver_edns(response, request);
+            response->tc = 1;
+            thread_worker_send(fd, response, &sins[i], sizeof_sins[i], now, &timer);
+            continue;
+        }
+        if (request->is_formerr) {
+            resolver_edns(response, request);
+            response->rcode = RCODE_FORMERR;
+            thread_worker_send(fd, response, &sins[i], sizeof_sins[i], now, &timer);
+            continue;
+        }
+        index[valid_count++] = i;
+    }
+
+    /*
+     * 3. resolve 'requests' into 'responses'
+     */
+    TIMING_START(&timer);
+    resolver_algorithm_batch(core->db_run, responses, requests, valid_count);
+    if (timer.is_sampled)
+        timing_stop(&timer, TIMING_RESOLVE, valid_count);
+
+    /*
+     * 4. format and transmit the 'responses'
+     */
+    for (i=0; i<valid_count; i++)
+        thread_worker_send(fd, &responses[i], &sins[index[i]], sizeof_sins[index[i]], now, &timer);
+
+    return fill;
+}
 
 /****************************************************************************
  ****************************************************************************/
@@ -19,17 +356,22 @@ thread_worker(void *p)
     struct CoreWorkerThread *t = (struct CoreWorkerThread *)p;
     struct Core *core = t->core;
 
+    t->tcp = tcpworker_create();
+
     while (!t->should_end) {
         unsigned i;
         struct CoreSocketSet *sockets;
         fd_set readfds;
         int nfds = 0;
         int x;
+        unsigned fill;
         struct timeval ts;
 
         /* [SYNCHRONIZATION POINT] 
         * mark the fact we are using the new socket-set */
         sockets = (struct CoreSocketSet *)core->socket_run;
+        if (t->tcp)
+            tcpworker_set_listeners(t->tcp, sockets);
         t->loop_count++;
 
         /* During startup, the sockets argument may be NULL for a time.
@@ -46,14 +388,21 @@ thread_worker(void *p)
          */
         FD_ZERO(&readfds);
         for (i=0; i<sockets->count; i++) {
+            if (sockets->list[i].proto == IPPROTO_TCP)
+                continue; /* accepted through 't->tcp' */
             FD_SET(sockets->list[i].fd, &readfds);
             if (nfds < sockets->list[i].fd)
                 nfds = sockets->list[i].fd;
         }
+        if (t->tcp) {
+            FD_SET(tcpworker_fd(t->tcp), &readfds);
+            if (nfds < tcpworker_fd(t->tcp))
+                nfds = tcpworker_fd(t->tcp);
+        }
         ts.tv_sec = 0;
         ts.tv_usec = 1000; /* one millisecond */
 
-        x = select(nfds, &readfds, 0, 0, &ts);
+        x = select(nfds + 1, &readfds, 0, 0, &ts);
         if (x < 0) {
             LOG_ERR(C_NETWORK, "select() returned error %u\n", WSAGetLastError());
             pixie_mssleep(1000);
@@ -61,78 +410,42 @@ thread_worker(void *p)
              * until the system is manually reconfigured */
             continue;
         }
-        if (x == 0)
-            continue; /* nothing found */
+        if (x == 0) {
+            /* nothing found, but TCP connections may have gone idle */
+            if (t->tcp)
+                tcpworker_run(t->tcp, core->db_run);
+            continue;
+        }
 
         /*
-         * Process any packets that have arrived
+         * Process any packets that have arrived. The overload state is
+         * this thread's, so it follows the fullest of our sockets, rather
+         * than whichever one we happened to read last
          */
+        fill = 0;
         for (i=0; i<sockets->count; i++) {
-            struct sockaddr_storage sin;
-            socklen_t sizeof_sin = sizeof(sin);
-            unsigned char buf[2048];
-            unsigned char buf2[2048];
-            int bytes_received;
-            struct DNS_Incoming request[1];
-            struct DNS_OutgoingResponse response[1];
-            struct Packet pkt;
-            int fd;
-
-            fd = sockets->list[i].fd;
-            if (!FD_ISSET(fd, &readfds))
-                continue;
-        
-            /*
-             * 1. receive 'packet'
-             */
-            bytes_received = recvfrom(fd, 
-                                      (char*)buf, sizeof(buf),
-                                      0, 
-                                      (struct sockaddr*)&sin, &sizeof_sin);
-            if (bytes_received == 0)
-                continue;
+            int fd = sockets->list[i].fd;
 
-        
-            /*
-             * 2. parse 'packet' into a 'request'
-             */
-            proto_dns_parse(request, buf, 0, bytes_received);
-            if (!request->is_valid)
+            if (sockets->list[i].proto == IPPROTO_TCP)
                 continue;
-
-
-            /*
-             * 3. resolve 'request' into a 'repsonse'
-             */
-            resolver_init(response, 
-                          request->query_name.name, 
-                          request->query_name.length, 
-                          request->query_type,
-                          request->id,
-                          request->opcode);
-            
-            resolver_algorithm(core->db_run, response, request);
-            
-
-            /*
-             * 4. format the 'response' into a 'packet'
-             */
-            pkt.buf = buf2;
-            pkt.max = sizeof(buf2);
-            pkt.offset = 0;
-            dns_format_response(response, &pkt);
-            
-            /*
-             * 5. Transmit the 'packet'
-             */
-            if (pkt.offset < pkt.max) {
-                sendto(fd, 
-                       (char*)pkt.buf, pkt.offset, 0,
-                       (struct sockaddr*)&sin,
-                       sizeof_sin);
+            if (FD_ISSET(fd, &readfds)) {
+                unsigned socket_fill = thread_worker_receive(core, fd);
+                if (fill < socket_fill)
+                    fill = socket_fill;
             }
         }
+        if (fill || overload_is_active())
+            overload_sample(fill);
+
+        /*
+         * Process TCP connections and queries
+         */
+        if (t->tcp && FD_ISSET(tcpworker_fd(t->tcp), &readfds))
+            tcpworker_run(t->tcp, core->db_run);
     }
+
+    tcpworker_destroy(t->tcp);
+    t->tcp = NULL;
 }
 
 /****************************************************************************
@@ -0,0 +1,587 @@
+#include "util-acl.h"
+#include "configuration.h"
+#include "util-realloc2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A slot in the trie holds either the index of the next level's node, or
+ * (with this bit set) the answer */
+#define ACL_LEAF            0x80000000
+
+/* Lists can refer to lists that refer to lists... */
+#define ACL_MAX_NESTING     16
+
+struct ACL
+{
+    uint32_t root4;
+    uint32_t root6;
+
+    uint32_t (*nodes)[256];
+    unsigned node_count;
+    unsigned node_max;
+};
+
+/* An element of the list, after following the references to other lists */
+struct ACL_Rule
+{
+    unsigned char addr[16];
+    unsigned char version;          /* 4 or 6, or 0 for both */
+    unsigned char prefix_length;
+    unsigned char value;            /* ACL_ALLOW or ACL_DENY */
+};
+
+struct ACL_Rules
+{
+    struct ACL_Rule *list;
+    unsigned count;
+};
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+acl_rule_add(struct ACL_Rules *rules, unsigned version,
+             const unsigned char *addr, unsigned prefix_length, unsigned value)
+{
+    struct ACL_Rule *rule;
+
+    rules->list = REALLOC2(rules->list, rules->count + 1, sizeof(rules->list[0]));
+    rule = &rules->list[rules->count++];
+    memset(rule, 0, sizeof(*rule));
+
+    rule->version = (unsigned char)version;
+    if (version == 4) {
+        memcpy(rule->addr, addr, 4);
+        rule->prefix_length = (unsigned char)(prefix_length > 32 ? 32 : prefix_length);
+    } else if (version == 6) {
+        memcpy(rule->addr, addr, 16);
+        rule->prefix_length = (unsigned char)(prefix_length > 128 ? 128 : prefix_length);
+    }
+    rule->value = (unsigned char)value;
+}
+
+/****************************************************************************
+ * Add the rule, minus any of the holes that overlap it. Two prefixes are
+ * either disjoint or one holds the other, so the rule either survives
+ * whole, disappears, or is split in half until the halves are one or
+ * the other.
+ ****************************************************************************/
+static void
+acl_rule_add_except(struct ACL_Rules *rules, const struct ACL_Rule *rule,
+                    unsigned value, const struct ACL_Rules *holes, unsigned first)
+{
+    unsigned i;
+
+    for (i=first; i<holes->count; i++) {
+        const struct ACL_Rule *hole = &holes->list[i];
+        struct ACL_Rule half;
+        unsigned common;
+        unsigned j;
+
+        if (hole->version == 0)
+            return;
+        if (rule->version == 0) {
+            /* "any" is all of IPv4 and all of IPv6 */
+            memset(&half, 0, sizeof(half));
+            half.version = 4;
+            acl_rule_add_except(rules, &half, value, holes, i);
+            half.version = 6;
+            acl_rule_add_except(rules, &half, value, holes, i);
+            return;
+        }
+        if (hole->version != rule->version)
+            continue;
+
+        common = (hole->prefix_length < rule->prefix_length) ? hole->prefix_length : rule->prefix_length;
+        for (j=0; j<common; j++) {
+            unsigned mask = 0x80 >> (j%8);
+            if ((hole->addr[j/8] & mask) != (rule->addr[j/8] & mask))
+                break;
+        }
+        if (j < common)
+            continue;
+        if (hole->prefix_length <= rule->prefix_length)
+            return;
+
+        half = *rule;
+        half.prefix_length++;
+        half.addr[rule->prefix_length/8] &= ~(0x80 >> (rule->prefix_length%8));
+        acl_rule_add_except(rules, &half, value, holes, i);
+        half.addr[rule->prefix_length/8] |= (0x80 >> (rule->prefix_length%8));
+        acl_rule_add_except(rules, &half, value, holes, i);
+        return;
+    }
+    acl_rule_add(rules, rule->version, rule->addr, rule->prefix_length, value);
+}
+
+/****************************************************************************
+ * Flatten the list into rules, in order, giving the same first match. A
+ * reference to another list is replaced by that list's rules. Like BIND,
+ * a negated reference can only deny or not match: an address the other
+ * list allows is denied, and one it denies skips the rest of that list
+ * and carries on with our next element. So the denied parts become holes
+ * cut out of the other list's later rules.
+ ****************************************************************************/
+static void
+acl_flatten(struct ACL_Rules *rules, const struct Cfg_AddrMatchList *list,
+            unsigned depth)
+{
+    size_t i;
+
+    if (list == NULL || depth > ACL_MAX_NESTING)
+        return;
+
+    for (i=0; i<list->elements_count; i++) {
+        const struct Cfg_AddrMatchElement *element = &list->elements[i];
+        unsigned value = element->is_not ? ACL_DENY : ACL_ALLOW;
+
+        switch (element->version) {
+        case 1: /* another list */
+            if (!element->is_not)
+                acl_flatten(rules, element->ip.other, depth + 1);
+            else {
+                struct ACL_Rules other = {0, 0};
+                struct ACL_Rules holes = {0, 0};
+                unsigned j;
+
+                acl_flatten(&other, element->ip.other, depth + 1);
+                for (j=0; j<other.count; j++) {
+                    const struct ACL_Rule *rule = &other.list[j];
+
+                    if (rule->value == ACL_ALLOW)
+                        acl_rule_add_except(rules, rule, ACL_DENY, &holes, 0);
+                    else
+                        acl_rule_add(&holes, rule->version, rule->addr, rule->prefix_length, ACL_DENY);
+                }
+                free(other.list);
+                free(holes.list);
+            }
+            break;
+        case 2: /* "any" */
+            acl_rule_add(rules, 0, 0, 0, value);
+            break;
+        case 3: /* "none" */
+            break;
+        case 4:
+            {
+                unsigned char addr[4];
+                addr[0] = (unsigned char)(element->ip.v4>>24);
+                addr[1] = (unsigned char)(element->ip.v4>>16);
+                addr[2] = (unsigned char)(element->ip.v4>> 8);
+                addr[3] = (unsigned char)(element->ip.v4>> 0);
+                acl_rule_add(rules, 4, addr, element->cidr, value);
+            }
+            break;
+        case 6:
+            acl_rule_add(rules, 6, element->ip.v6, element->cidr, value);
+            break;
+        }
+    }
+}
+
+/****************************************************************************
+ * Create a node with every slot holding the given answer
+ ****************************************************************************/
+static uint32_t
+acl_node_create(struct ACL *acl, uint32_t leaf)
+{
+    unsigned i;
+
+    if (acl->node_count >= acl->node_max) {
+        acl->node_max = acl->node_max ? acl->node_max * 2 : 16;
+        acl->nodes = REALLOC2(acl->nodes, acl->node_max, sizeof(acl->nodes[0]));
+    }
+    for (i=0; i<256; i++)
+        acl->nodes[acl->node_count][i] = leaf;
+
+    return acl->node_count++;
+}
+
+/****************************************************************************
+ * The node a slot points to, replacing an answer with a node full of that
+ * answer if necessary
+ ****************************************************************************/
+static uint32_t
+acl_node_child(struct ACL *acl, uint32_t node, unsigned index)
+{
+    uint32_t slot = acl->nodes[node][index];
+
+    if (slot & ACL_LEAF) {
+        slot = acl_node_create(acl, slot);
+        acl->nodes[node][index] = slot;
+    }
+    return slot;
+}
+
+/****************************************************************************
+ * Make every address under the prefix give this answer, whatever was
+ * there before
+ ****************************************************************************/
+static void
+acl_paint(struct ACL *acl, uint32_t *root,
+          const unsigned char *addr, unsigned prefix_length, unsigned value)
+{
+    uint32_t node;
+    unsigned depth;
+    unsigned bits;
+    unsigned first;
+    unsigned i;
+
+    if (prefix_length == 0) {
+        *root = ACL_LEAF | value;
+        return;
+    }
+
+    if (*root & ACL_LEAF)
+        *root = acl_node_create(acl, *root);
+    node = *root;
+
+    for (depth=0; prefix_length > depth*8 + 8; depth++)
+        node = acl_node_child(acl, node, addr[depth]);
+
+    /* the last 1 to 8 bits of the prefix cover a run of slots */
+    bits = prefix_length - depth*8;
+    first = addr[depth] & (0xFF << (8 - bits)) & 0xFF;
+    for (i=0; i < (1U << (8 - bits)); i++)
+        acl->nodes[node][first + i] = ACL_LEAF | value;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+struct ACL *
+acl_compile(const struct Cfg_AddrMatchList *list)
+{
+    struct ACL_Rules rules = {0, 0};
+    struct ACL *acl;
+    unsigned i;
+
+    acl = MALLOC2(sizeof(*acl));
+    memset(acl, 0, sizeof(*acl));
+    acl->root4 = ACL_LEAF | ACL_NOMATCH;
+    acl->root6 = ACL_LEAF | ACL_NOMATCH;
+
+    acl_flatten(&rules, list, 0);
+
+    /* last to first, so that the first match is what's left */
+    for (i=rules.count; i>0; i--) {
+        const struct ACL_Rule *rule = &rules.list[i-1];
+
+        if (rule->version != 6)
+            acl_paint(acl, &acl->root4, rule->addr, rule->version ? rule->prefix_length : 0, rule->value);
+        if (rule->version != 4)
+            acl_paint(acl, &acl->root6, rule->addr, rule->version ? rule->prefix_length : 0, rule->value);
+    }
+
+    free(rules.list);
+    return acl;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+acl_foreach_rule(const struct Cfg_AddrMatchList *list,
+                 ACL_RULE_CALLBACK callback, void *data)
+{
+    struct ACL_Rules rules = {0, 0};
+    unsigned i;
+
+    acl_flatten(&rules, list, 0);
+    for (i=0; i<rules.count; i++) {
+        const struct ACL_Rule *rule = &rules.list[i];
+        callback(data, rule->version, rule->addr, rule->prefix_length, rule->value);
+    }
+    free(rules.list);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+acl_free(struct ACL *acl)
+{
+    if (acl == NULL)
+        return;
+    free(acl->nodes);
+    free(acl);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+acl_match(const struct ACL *acl, const unsigned char *addr, unsigned addr_length)
+{
+    uint32_t slot = (addr_length == 4) ? acl->root4 : acl->root6;
+    unsigned i = 0;
+
+    /* nodes only exist for bytes within the address, so this always
+     * ends at a leaf in time */
+    while ((slot & ACL_LEAF) == 0)
+        slot = acl->nodes[slot][addr[i++]];
+
+    return slot & ~ACL_LEAF;
+}
+
+/****************************************************************************
+ * The lists being enforced. Workers read these pointers without locking,
+ * so the replaced lists are freed one reconfiguration later.
+ ****************************************************************************/
+static struct ACL * volatile query_blackhole;
+static struct ACL * volatile query_allow;
+static struct ACL *retired[2];
+
+void
+acl_set_config(const struct Cfg_AddrMatchList *blackhole,
+               const struct Cfg_AddrMatchList *allow_query)
+{
+    struct ACL *new_blackhole = blackhole ? acl_compile(blackhole) : 0;
+    struct ACL *new_allow = allow_query ? acl_compile(allow_query) : 0;
+
+    acl_free(retired[0]);
+    acl_free(retired[1]);
+    retired[0] = query_blackhole;
+    retired[1] = query_allow;
+
+    query_blackhole = new_blackhole;
+    query_allow = new_allow;
+}
+
+int
+acl_check_query(const unsigned char *addr, unsigned addr_length)
+{
+    const struct ACL *blackhole = query_blackhole;
+    const struct ACL *allow = query_allow;
+
+    if (blackhole && acl_match(blackhole, addr, addr_length) == ACL_ALLOW)
+        return ACL_QUERY_DROP;
+    if (allow && acl_match(allow, addr, addr_length) != ACL_ALLOW)
+        return ACL_QUERY_REFUSE;
+    return ACL_QUERY_ACCEPT;
+}
+
+/****************************************************************************
+ * The straightforward first-match walk of the list, to check the trie
+ * against. A negated reference to a list that denies doesn't match.
+ ****************************************************************************/
+static int
+selftest_linear(const struct Cfg_AddrMatchList *list,
+                const unsigned char *addr, unsigned addr_length)
+{
+    size_t i;
+
+    for (i=0; i<list->elements_count; i++) {
+        const struct Cfg_AddrMatchElement *element = &list->elements[i];
+        unsigned char prefix[16];
+        unsigned prefix_length;
+        unsigned is_allow;
+        unsigned j;
+
+        switch (element->version) {
+        case 1:
+            switch (selftest_linear(element->ip.other, addr, addr_length)) {
+            case ACL_NOMATCH:
+                continue;
+            case ACL_ALLOW:
+                is_allow = 1;
+                break;
+            default:
+                if (element->is_not)
+                    continue;
+                is_allow = 0;
+                break;
+            }
+            break;
+        case 2:
+            is_allow = 1;
+            break;
+        case 4:
+        case 6:
+            if (addr_length != (element->version == 4 ? 4U : 16U))
+                continue;
+            if (element->version == 4) {
+                prefix[0] = (unsigned char)(element->ip.v4>>24);
+                prefix[1] = (unsigned char)(element->ip.v4>>16);
+                prefix[2] = (unsigned char)(element->ip.v4>> 8);
+                prefix[3] = (unsigned char)(element->ip.v4>> 0);
+            } else
+                memcpy(prefix, element->ip.v6, 16);
+            prefix_length = element->cidr;
+            if (prefix_length > addr_length * 8)
+                prefix_length = addr_length * 8;
+            for (j=0; j<prefix_length; j++) {
+                unsigned mask = 0x80 >> (j%8);
+                if ((prefix[j/8] & mask) != (addr[j/8] & mask))
+                    break;
+            }
+            if (j < prefix_length)
+                continue;
+            is_allow = 1;
+            break;
+        default:
+            continue;
+        }
+
+        if (element->is_not)
+            is_allow = !is_allow;
+        return is_allow ? ACL_ALLOW : ACL_DENY;
+    }
+    return ACL_NOMATCH;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+selftest_one(struct Configuration *cfg, const char *name,
+             const char *address, unsigned addr_length, int expected)
+{
+    const struct Cfg_AddrMatchList *list = cfg_addrlist_lookup(cfg, name);
+    unsigned char addr[16];
+    struct ACL *acl;
+    int result;
+
+    if (list == NULL)
+        return 1;
+    if (addr_length == 4)
+        sscanf(address, "%hhu.%hhu.%hhu.%hhu", &addr[0], &addr[1], &addr[2], &addr[3]);
+    else
+        memcpy(addr, address, 16);
+
+    acl = acl_compile(list);
+    result = acl_match(acl, addr, addr_length);
+    acl_free(acl);
+
+    if (result != expected || selftest_linear(list, addr, addr_length) != expected) {
+        fprintf(stderr, "acl: %s %u.%u.%u.%u: expected %d, got %d\n",
+                name, addr[0], addr[1], addr[2], addr[3], expected, result);
+        return 1;
+    }
+    return 0;
+}
+
+int
+acl_selftest(void)
+{
+    struct Configuration *cfg;
+    struct ACL *acl;
+    char text[4096];
+    unsigned seed = 1;
+    unsigned i;
+    int err = 0;
+
+    cfg = cfg_create();
+    cfg_load_string(cfg,
+        "acl \"except7\" { !192.168.2.7; 192.168.2.0/24; };\n"
+        "acl \"even7\" { 192.168.2.3/24; !192.168.2.7; };\n"
+        "acl \"good-guys\" { !192.168.2.5/28; 192.168.2.0/24; 2001:db8:0:1::/64; };\n"
+        "acl \"nested\" { !\"except7\"; 10.0.0.0/8; };\n"
+        "acl \"nested-any\" { !\"except7\"; any; };\n"
+        "acl \"twice\" { !\"nested\"; };\n"
+        "acl \"everyone\" { any; };\n"
+        "acl \"nobody\" { none; };\n");
+
+    /* first match, not longest or last */
+    err |= selftest_one(cfg, "except7", "192.168.2.7", 4, ACL_DENY);
+    err |= selftest_one(cfg, "except7", "192.168.2.8", 4, ACL_ALLOW);
+    err |= selftest_one(cfg, "except7", "10.0.0.1", 4, ACL_NOMATCH);
+    err |= selftest_one(cfg, "even7", "192.168.2.7", 4, ACL_ALLOW);
+
+    err |= selftest_one(cfg, "good-guys", "192.168.2.1", 4, ACL_DENY);
+    err |= selftest_one(cfg, "good-guys", "192.168.2.20", 4, ACL_ALLOW);
+    err |= selftest_one(cfg, "good-guys",
+        "\x20\x01\x0d\xb8\0\0\0\x01\0\0\0\0\0\0\0\x05", 16, ACL_ALLOW);
+    err |= selftest_one(cfg, "good-guys",
+        "\x20\x01\x0d\xb8\0\0\0\x02\0\0\0\0\0\0\0\x05", 16, ACL_NOMATCH);
+
+    /* a negated reference denies what the list it refers to allows, but
+     * what that list denies doesn't match, it isn't allowed */
+    err |= selftest_one(cfg, "nested", "192.168.2.7", 4, ACL_NOMATCH);
+    err |= selftest_one(cfg, "nested", "192.168.2.8", 4, ACL_DENY);
+    err |= selftest_one(cfg, "nested", "10.1.2.3", 4, ACL_ALLOW);
+    err |= selftest_one(cfg, "nested-any", "192.168.2.7", 4, ACL_ALLOW);
+    err |= selftest_one(cfg, "nested-any", "192.168.2.8", 4, ACL_DENY);
+    err |= selftest_one(cfg, "twice", "192.168.2.7", 4, ACL_NOMATCH);
+    err |= selftest_one(cfg, "twice", "192.168.2.8", 4, ACL_NOMATCH);
+    err |= selftest_one(cfg, "twice", "10.1.2.3", 4, ACL_DENY);
+
+    err |= selftest_one(cfg, "everyone", "1.2.3.4", 4, ACL_ALLOW);
+    err |= selftest_one(cfg, "everyone", "\xfe\x80\0\0\0\0\0\0\0\0\0\0\0\0\0\1", 16, ACL_ALLOW);
+    err |= selftest_one(cfg, "nobody", "1.2.3.4", 4, ACL_NOMATCH);
+
+    /*
+     * Random overlapping prefixes, checking random addresses near them
+     * against the linear walk, both directly and through a negated
+     * reference
+     */
+    {
+        static const char *names[] = {"random", "random-long", "not-random"};
+        size_t length = 0;
+        const struct Cfg_AddrMatchList *list;
+        unsigned n;
+
+        length += sprintf(text + length, "acl \"random\" {");
+        for (i=0; i<100; i++) {
+            seed = seed * 1103515245 + 12345;
+            length += sprintf(text + length, " %s10.%u.%u.0/%u;",
+                              (seed & 0x100) ? "!" : "",
+                              (seed >> 8) & 3, (seed >> 16) & 0xFF, 8 + (seed >> 24) % 17);
+        }
+        sprintf(text + length, " };");
+        cfg_load_string(cfg, text);
+
+        /* longer prefixes, so that the denials aren't all hidden behind
+         * an early /8 */
+        length = 0;
+        length += sprintf(text + length, "acl \"random-long\" {");
+        for (i=0; i<100; i++) {
+            seed = seed * 1103515245 + 12345;
+            length += sprintf(text + length, " %s10.%u.%u.0/%u;",
+                              (seed & 0x100) ? "!" : "",
+                              (seed >> 8) & 3, (seed >> 16) & 0xFF, 14 + (seed >> 24) % 11);
+        }
+        sprintf(text + length, " };\n"
+                "acl \"not-random\" { !\"random-long\"; 10.1.0.0/16; };\n");
+        cfg_load_string(cfg, text);
+
+        list = cfg_addrlist_lookup(cfg, "random");
+        if (list == NULL || list->elements_count != 100)
+            err = 1;
+        for (n=0; n<3; n++) {
+            list = cfg_addrlist_lookup(cfg, names[n]);
+            if (list == NULL) {
+                err = 1;
+                break;
+            }
+            acl = acl_compile(list);
+            for (i=0; i<100000; i++) {
+                unsigned char addr[4];
+
+                seed = seed * 1103515245 + 12345;
+                addr[0] = 10;
+                addr[1] = (unsigned char)((seed >> 8) & 3);
+                addr[2] = (unsigned char)(seed >> 16);
+                addr[3] = (unsigned char)(seed >> 24);
+                if (acl_match(acl, addr, 4) != selftest_linear(list, addr, 4)) {
+                    fprintf(stderr, "acl: %s %u.%u.%u.%u differs from a linear walk\n",
+                            names[n], addr[0], addr[1], addr[2], addr[3]);
+                    err = 1;
+                    break;
+                }
+            }
+            acl_free(acl);
+        }
+    }
+
+    /* the lists the data plane enforces */
+    acl_set_config(cfg_addrlist_lookup(cfg, "except7"), cfg_addrlist_lookup(cfg, "good-guys"));
+    if (acl_check_query((const unsigned char *)"\xc0\xa8\x02\x08", 4) != ACL_QUERY_DROP
+        || acl_check_query((const unsigned char *)"\xc0\xa8\x02\x07", 4) != ACL_QUERY_REFUSE
+        || acl_check_query((const unsigned char *)"\x0a\0\0\1", 4) != ACL_QUERY_REFUSE)
+        err = 1;
+    acl_set_config(0, cfg_addrlist_lookup(cfg, "everyone"));
+    if (acl_check_query((const unsigned char *)"\xc0\xa8\x02\x08", 4) != ACL_QUERY_ACCEPT)
+        err = 1;
+    acl_set_config(0, 0);
+    acl_set_config(0, 0);
+
+    cfg_destroy(cfg);
+    return err;
+}
@@ -0,0 +1,90 @@
+#ifndef UTIL_ACL_H
+#define UTIL_ACL_H
+struct Cfg_AddrMatchList;
+
+/*
+    Compiled address-match lists
+
+    The configuration keeps an address-match list the way it was written:
+    an ordered list of elements, some negated, some referring to other
+    lists, where the first element that matches decides. Checking that
+    for every packet means walking the whole list.
+
+    So before the data plane uses a list, we compile it into a multibit
+    trie, one byte of the address per level, where every slot either
+    points to the next level or holds the answer. Elements are painted
+    into the trie from last to first, each one overwriting whatever the
+    later ones put under its prefix, so the trie gives the same answer
+    as the first match. A lookup is at most 4 memory accesses for IPv4,
+    and usually only a few more for IPv6.
+*/
+struct ACL;
+
+enum {
+    ACL_NOMATCH,    /* no element matched, which normally means "deny" */
+    ACL_ALLOW,      /* the first matching element isn't negated */
+    ACL_DENY,       /* the first matching element is negated */
+};
+
+/**
+ * Compile an address-match list. Named lists it refers to are compiled
+ * into it too, so the result doesn't depend on the configuration.
+ * Elements with ports or keys match on the address alone.
+ */
+struct ACL *acl_compile(const struct Cfg_AddrMatchList *list);
+void acl_free(struct ACL *acl);
+
+/**
+ * @param addr
+ *      The IPv4 or IPv6 address, in network order. IPv4-mapped IPv6
+ *      addresses should be passed as IPv4.
+ * @param addr_length
+ *      Either 4 or 16.
+ * @return one of ACL_NOMATCH, ACL_ALLOW, or ACL_DENY
+ */
+int acl_match(const struct ACL *acl, const unsigned char *addr, unsigned addr_length);
+
+/**
+ * Walk the elements of a list in order, after references to other lists
+ * have been replaced by their elements, for code that compiles the list
+ * into something else.
+ * @param version
+ *      4 or 6, or 0 for an element that matches every address
+ * @param value
+ *      ACL_ALLOW or ACL_DENY, what the element answers when it matches
+ */
+typedef void (*ACL_RULE_CALLBACK)(void *data, unsigned version,
+                                  const unsigned char *addr, unsigned prefix_length,
+                                  int value);
+void acl_foreach_rule(const struct Cfg_AddrMatchList *list,
+                      ACL_RULE_CALLBACK callback, void *data);
+
+/*
+    The lists the data plane enforces, from the "blackhole" and
+    "allow-query" options.
+*/
+enum {
+    ACL_QUERY_ACCEPT,   /* answer normally */
+    ACL_QUERY_REFUSE,   /* answer with REFUSED */
+    ACL_QUERY_DROP,     /* don't answer at all */
+};
+
+/**
+ * Compile the lists and start using them. Either can be NULL, meaning
+ * nobody is blackholed, or everybody may query. The previous lists are
+ * kept until the next call, so workers that are in the middle of using
+ * them can finish.
+ */
+void acl_set_config(const struct Cfg_AddrMatchList *blackhole,
+                    const struct Cfg_AddrMatchList *allow_query);
+
+/**
+ * Decide what to do with a query from this address, see acl_match()
+ * for the parameters.
+ * @return one of ACL_QUERY_ACCEPT, ACL_QUERY_REFUSE, or ACL_QUERY_DROP
+ */
+int acl_check_query(const unsigned char *addr, unsigned addr_length);
+
+int acl_selftest(void);
+
+#endif
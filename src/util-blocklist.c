@@ -0,0 +1,414 @@
+#include "util-blocklist.h"
+#include "logger.h"
+#include "string_s.h"
+#include "util-ipaddr.h"
+#include "util-ranges.h"
+#include "util-realloc2.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* How long a replaced list is kept. A lookup takes well under a
+ * microsecond, so this is only for a worker that gets descheduled in the
+ * middle of one */
+#define BLOCKLIST_GRACE_SECONDS 2
+
+struct Blocklist
+{
+    struct RangeList v4;
+    struct RangeListV6 v6;
+
+    /* once it's been replaced, the next older list waiting to be freed */
+    struct Blocklist *next;
+    time_t retired_time;
+};
+
+/****************************************************************************
+ * The list being enforced, which workers read without locking, and the
+ * lists it replaced, newest first
+ ****************************************************************************/
+static struct Blocklist * volatile blocklist_current;
+static struct Blocklist *blocklist_retired;
+static char *blocklist_filename;
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+blocklist_free(struct Blocklist *list)
+{
+    if (list == NULL)
+        return;
+    rangelist_remove_all(&list->v4);
+    rangelist_remove_all_v6(&list->v6);
+    free(list);
+}
+
+/****************************************************************************
+ * A copy of the list to make changes to, while workers go on reading
+ * the original
+ ****************************************************************************/
+static struct Blocklist *
+blocklist_copy(const struct Blocklist *src)
+{
+    struct Blocklist *list = MALLOC2(sizeof(*list));
+
+    memset(list, 0, sizeof(*list));
+    if (src) {
+        rangelist_copy(&list->v4, &src->v4);
+        rangelist_copy_v6(&list->v6, &src->v6);
+    }
+    return list;
+}
+
+/****************************************************************************
+ * Start enforcing the list, and free the replaced lists that have been
+ * out of use long enough
+ ****************************************************************************/
+static void
+blocklist_publish(struct Blocklist *list)
+{
+    struct Blocklist *old = blocklist_current;
+    struct Blocklist **r;
+    time_t now = time(0);
+
+    /* workers skip the lookup entirely when there's no list */
+    if (list->v4.count == 0 && list->v6.count == 0) {
+        blocklist_free(list);
+        list = NULL;
+    }
+    blocklist_current = list;
+
+    if (old) {
+        old->retired_time = now;
+        old->next = blocklist_retired;
+        blocklist_retired = old;
+    }
+
+    for (r = &blocklist_retired; *r; r = &(*r)->next) {
+        if (now - (*r)->retired_time >= BLOCKLIST_GRACE_SECONDS) {
+            struct Blocklist *expired = *r;
+            *r = NULL;
+            while (expired) {
+                struct Blocklist *next = expired->next;
+                blocklist_free(expired);
+                expired = next;
+            }
+            break;
+        }
+    }
+}
+
+/****************************************************************************
+ * Add or remove a prefix written like "192.0.2.0/24" or "2001:db8::/32".
+ * Any bits past the prefix length are ignored.
+ ****************************************************************************/
+static int
+blocklist_change(struct Blocklist *list, const char *text, unsigned length,
+                 int is_remove)
+{
+    struct ParsedIpAddress ip;
+    unsigned offset = 0;
+
+    if (length == 0 || !parse_ip_address(text, &offset, length, &ip) || offset != length)
+        return -1;
+
+    if (ip.version == 4) {
+        unsigned addr = ip.address[0]<<24 | ip.address[1]<<16 | ip.address[2]<<8 | ip.address[3];
+        unsigned mask;
+
+        if (ip.prefix_length > 32)
+            return -1;
+        mask = ip.prefix_length ? 0xFFFFFFFF << (32 - ip.prefix_length) : 0;
+        if (is_remove)
+            rangelist_remove_range(&list->v4, addr & mask, addr | ~mask);
+        else
+            rangelist_add_range(&list->v4, addr & mask, addr | ~mask);
+    } else if (ip.version == 6) {
+        uint64_t begin[2];
+        uint64_t end[2];
+        unsigned i;
+
+        if (ip.prefix_length > 128)
+            return -1;
+        for (i=0; i<2; i++) {
+            unsigned bits = ip.prefix_length > i*64 ? ip.prefix_length - i*64 : 0;
+            uint64_t mask;
+            unsigned j;
+
+            if (bits > 64)
+                bits = 64;
+            mask = bits ? ~(uint64_t)0 << (64 - bits) : 0;
+            begin[i] = 0;
+            for (j=0; j<8; j++)
+                begin[i] = begin[i]<<8 | ip.address[i*8 + j];
+            end[i] = begin[i] | ~mask;
+            begin[i] &= mask;
+        }
+        if (is_remove)
+            rangelist_remove_range_v6(&list->v6, begin, end);
+        else
+            rangelist_add_range_v6(&list->v6, begin, end);
+    } else
+        return -1;
+
+    return 0;
+}
+
+/****************************************************************************
+ * The next line of text, without the whitespace around it or any comment
+ ****************************************************************************/
+static size_t
+blocklist_next_line(const char *text, size_t length, size_t *offset,
+                    const char **line, unsigned *line_length)
+{
+    size_t start = *offset;
+    size_t end;
+
+    while (*offset < length && text[*offset] != '\n')
+        (*offset)++;
+    end = *offset;
+    if (*offset < length)
+        (*offset)++;
+
+    while (start < end && isspace(text[start]&0xFF))
+        start++;
+    *line = text + start;
+    for (*line_length = 0; start + *line_length < end; (*line_length)++) {
+        if ((*line)[*line_length] == '#')
+            break;
+    }
+    while (*line_length && isspace((*line)[*line_length - 1]&0xFF))
+        (*line_length)--;
+    return *line_length;
+}
+
+/****************************************************************************
+ * Add the prefixes in the file to the list. Bad lines are skipped.
+ ****************************************************************************/
+static int
+blocklist_load(struct Blocklist *list, const char *filename)
+{
+    FILE *fp;
+    char buf[512];
+    unsigned line_number = 0;
+
+    fp = fopen(filename, "rt");
+    if (fp == NULL) {
+        LOG_ERR(C_CONFIG, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        const char *line;
+        unsigned line_length;
+        size_t offset = 0;
+
+        line_number++;
+        if (blocklist_next_line(buf, strlen(buf), &offset, &line, &line_length) == 0)
+            continue;
+        if (blocklist_change(list, line, line_length, 0) != 0)
+            LOG_ERR(C_CONFIG, "%s:%u: bad prefix\n", filename, line_number);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+blocklist_set_config(const char *filename)
+{
+    struct Blocklist *list = blocklist_copy(NULL);
+
+    free(blocklist_filename);
+    blocklist_filename = filename ? strdup(filename) : NULL;
+
+    if (filename) {
+        blocklist_load(list, filename);
+        LOG_INFO(C_CONFIG, "blocklist: %u IPv4 and %u IPv6 ranges from %s\n",
+                 list->v4.count, list->v6.count, filename);
+    }
+    blocklist_publish(list);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+blocklist_update(const char *commands, size_t length,
+                 char *reply, size_t sizeof_reply)
+{
+    struct Blocklist *list = blocklist_copy(blocklist_current);
+    size_t offset = 0;
+    unsigned line_number = 0;
+
+    while (offset < length) {
+        const char *line;
+        unsigned line_length;
+        unsigned verb_length;
+        unsigned arg;
+        int err = 0;
+
+        line_number++;
+        if (blocklist_next_line(commands, length, &offset, &line, &line_length) == 0)
+            continue;
+
+        for (verb_length = 0; verb_length < line_length; verb_length++) {
+            if (isspace(line[verb_length]&0xFF))
+                break;
+        }
+        for (arg = verb_length; arg < line_length; arg++) {
+            if (!isspace(line[arg]&0xFF))
+                break;
+        }
+
+#define VERB(name) (verb_length == sizeof(name)-1 && memcmp(line, name, verb_length) == 0)
+        if (VERB("block"))
+            err = blocklist_change(list, line + arg, line_length - arg, 0);
+        else if (VERB("unblock"))
+            err = blocklist_change(list, line + arg, line_length - arg, 1);
+        else if (VERB("flush") && arg == line_length) {
+            rangelist_remove_all(&list->v4);
+            rangelist_remove_all_v6(&list->v6);
+        } else if (VERB("reload") && arg == line_length && blocklist_filename) {
+            rangelist_remove_all(&list->v4);
+            rangelist_remove_all_v6(&list->v6);
+            err = blocklist_load(list, blocklist_filename);
+        } else
+            err = -1;
+#undef VERB
+
+        if (err) {
+            sprintf_s(reply, sizeof_reply, "error: line %u: %.*s\n",
+                      line_number, line_length > 64 ? 64 : line_length, line);
+            blocklist_free(list);
+            return -1;
+        }
+    }
+
+    sprintf_s(reply, sizeof_reply, "ok: %u IPv4 and %u IPv6 ranges\n",
+              list->v4.count, list->v6.count);
+    blocklist_publish(list);
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+blocklist_is_blocked(const unsigned char *addr, unsigned addr_length)
+{
+    const struct Blocklist *list = blocklist_current;
+
+    if (list == NULL)
+        return 0;
+
+    if (addr_length == 4) {
+        unsigned ip = addr[0]<<24 | addr[1]<<16 | addr[2]<<8 | addr[3];
+        return rangelist_is_contains(&list->v4, ip);
+    } else {
+        uint64_t ip[2];
+        unsigned i;
+
+        ip[0] = ip[1] = 0;
+        for (i=0; i<16; i++)
+            ip[i/8] = ip[i/8]<<8 | addr[i];
+        return rangelist_is_contains_v6(&list->v6, ip);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+selftest_update(const char *commands, int expected)
+{
+    char reply[256];
+    int result = blocklist_update(commands, strlen(commands), reply, sizeof(reply));
+
+    if (result != expected) {
+        fprintf(stderr, "blocklist: \"%s\" got: %s", commands, reply);
+        return 1;
+    }
+    if (strncmp(reply, expected ? "error" : "ok", expected ? 5 : 2) != 0)
+        return 1;
+    return 0;
+}
+
+/****************************************************************************
+ * Free the list and every list it replaced, grace period or not, since
+ * there are no workers reading them during the selftest
+ ****************************************************************************/
+static void
+blocklist_selftest_end(void)
+{
+    struct Blocklist *list = blocklist_current;
+
+    blocklist_current = NULL;
+    blocklist_free(list);
+    while (blocklist_retired) {
+        list = blocklist_retired;
+        blocklist_retired = list->next;
+        blocklist_free(list);
+    }
+}
+
+int
+blocklist_selftest(void)
+{
+    static const unsigned char ip6[16] = {0x20,0x01,0x0d,0xb8,0,0,0,0, 0,0,0,0,0,0,0,1};
+    static const unsigned char ip6_next[16] = {0x20,0x01,0x0d,0xb9,0,0,0,0, 0,0,0,0,0,0,0,1};
+
+    if (blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\x01", 4))
+        goto fail;
+
+    /* host bits past the prefix are ignored, and comments and blank
+     * lines are skipped */
+    if (selftest_update("block 192.0.2.77/24\n"
+                        "\n"
+                        "  # a comment\n"
+                        "block 198.51.100.7   # just this one\r\n"
+                        "block 2001:db8::5/32", 0))
+        goto fail;
+    if (!blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\x01", 4)
+        || !blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\xff", 4)
+        || blocklist_is_blocked((const unsigned char *)"\xc0\x00\x03\x00", 4)
+        || !blocklist_is_blocked((const unsigned char *)"\xc6\x33\x64\x07", 4)
+        || blocklist_is_blocked((const unsigned char *)"\xc6\x33\x64\x08", 4)
+        || !blocklist_is_blocked(ip6, 16)
+        || blocklist_is_blocked(ip6_next, 16))
+        goto fail;
+
+    /* a bad line means none of the changes are made */
+    if (selftest_update("unblock 192.0.2.0/25\nblock 10.0.0.0/33", -1)
+        || selftest_update("block", -1)
+        || selftest_update("block 10.0.0.1 junk", -1)
+        || selftest_update("flush everything", -1)
+        || selftest_update("blockade 10.0.0.1", -1))
+        goto fail;
+    if (!blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\x01", 4))
+        goto fail;
+
+    /* unblocking part of a prefix leaves the rest */
+    if (selftest_update("unblock 192.0.2.0/25\nunblock 2001:db8::/128", 0))
+        goto fail;
+    if (blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\x7f", 4)
+        || !blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\x80", 4)
+        || !blocklist_is_blocked(ip6, 16))
+        goto fail;
+
+    if (selftest_update("flush", 0))
+        goto fail;
+    if (blocklist_current != NULL
+        || blocklist_is_blocked((const unsigned char *)"\xc0\x00\x02\x80", 4)
+        || blocklist_is_blocked(ip6, 16))
+        goto fail;
+
+    blocklist_selftest_end();
+    return 0;
+fail:
+    blocklist_selftest_end();
+    return 1;
+}
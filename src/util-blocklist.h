@@ -0,0 +1,54 @@
+#ifndef UTIL_BLOCKLIST_H
+#define UTIL_BLOCKLIST_H
+#include <stddef.h>
+
+/*
+    Blocklist of source prefixes
+
+    Packets from these IPv4 and IPv6 prefixes are dropped as soon as
+    their source address is known, before anything else is parsed.
+    Unlike "blackhole", which only changes with the configuration, the
+    list comes from its own file ("blocklist-file"), one prefix per
+    line, and can be changed while we're running from the control port,
+    so an abusive network can be blocked right away. Changes made that
+    way last until the file is loaded again.
+
+    Workers never lock or wait for it. A change is made to a copy of the
+    list, which then replaces the one they're reading, and replaced lists
+    are only freed once no worker can still be in the middle of a lookup.
+    Changes are only made from the main thread.
+*/
+
+/**
+ * Load the blocklist from this file, replacing whatever is there, and
+ * remember the name for the "reload" command. NULL empties it.
+ */
+void blocklist_set_config(const char *filename);
+
+/**
+ * Apply commands from the control port, one per line:
+ *      block <prefix>
+ *      unblock <prefix>
+ *      flush
+ *      reload
+ * They're applied together, or not at all if any of them is bad.
+ * @param reply
+ *      Where to put the text to send back, starting with "ok" or "error".
+ * @return 0 if the changes were made, -1 if not
+ */
+int blocklist_update(const char *commands, size_t length,
+                     char *reply, size_t sizeof_reply);
+
+/**
+ * @param addr
+ *      The IPv4 or IPv6 address, in network order. IPv4-mapped IPv6
+ *      addresses should be passed as IPv4.
+ * @param addr_length
+ *      Either 4 or 16.
+ * @return 1 if the address is in a blocked prefix, 0 otherwise
+ */
+int blocklist_is_blocked(const unsigned char *addr, unsigned addr_length);
+
+int blocklist_selftest(void);
+
+#endif
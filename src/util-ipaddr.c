@@ -315,7 +315,7 @@ parse_ipv4_address(const char *px, unsigned *offset, size_t length, struct Parse
         
         i++;
 
-        if (i>=length || !isdigit(px[i]*0xFF))
+        if (i>=length || !isdigit(px[i]&0xFF))
             return RETURN_ERR(false);
 
         n = px[i] - '0';
@@ -400,6 +400,8 @@ parse_ipv6_address(const char *px, unsigned *offset, size_t length, struct Parse
 				break;
 			if (px[i] == ':')
 				break; /* early exit due to leading nuls */
+			if (px[i] == '/')
+				break; /* the CIDR field after an elision, like "::/64" */
 			if (!isxdigit(px[i]&0xFF)) {
                 return RETURN_ERR(false);
 				break; /* error */
@@ -477,7 +479,7 @@ parse_ipv6_address(const char *px, unsigned *offset, size_t length, struct Parse
         n = px[i] - '0';
         i++;
 
-        if (i<length && isdigit(px[i]&0xFF)) {
+        while (i<length && isdigit(px[i]&0xFF) && n < 100) {
             n = n * 10 + px[i] - '0';
             i++;
         }
@@ -21,11 +21,19 @@
 int
 rangelist_is_contains(const struct RangeList *task, unsigned number)
 {
-    unsigned i;
-    for (i=0; i<task->count; i++) {
-        struct Range *range = &task->list[i];
-
-        if (range->begin <= number && number <= range->end)
+    unsigned lo = 0;
+    unsigned hi = task->count;
+
+    /* the ranges are sorted and don't overlap */
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo)/2;
+        const struct Range *range = &task->list[mid];
+
+        if (number < range->begin)
+            hi = mid;
+        else if (number > range->end)
+            lo = mid + 1;
+        else
             return 1;
     }
     return 0;
@@ -218,6 +226,218 @@ rangelist_remove_range2(struct RangeList *task, struct Range range)
     rangelist_remove_range(task, range.begin, range.end);
 }
 
+/***************************************************************************
+ ***************************************************************************/
+void
+rangelist_copy(struct RangeList *dst, const struct RangeList *src)
+{
+    dst->count = src->count;
+    dst->max = src->count + 1;
+    dst->list = malloc(dst->max * sizeof(dst->list[0]));
+    if (dst->list == NULL)
+        exit(1); /* out of memory */
+    if (src->count)
+        memcpy(dst->list, src->list, src->count * sizeof(dst->list[0]));
+}
+
+
+/***************************************************************************
+ * IPv6 addresses are two 64-bit halves, high half first, so that they
+ * compare the same way as the addresses do.
+ ***************************************************************************/
+static int
+u128_compare(const uint64_t lhs[2], const uint64_t rhs[2])
+{
+    if (lhs[0] != rhs[0])
+        return lhs[0] < rhs[0] ? -1 : 1;
+    if (lhs[1] != rhs[1])
+        return lhs[1] < rhs[1] ? -1 : 1;
+    return 0;
+}
+static int
+u128_is_max(const uint64_t x[2])
+{
+    return x[0] == ~(uint64_t)0 && x[1] == ~(uint64_t)0;
+}
+static void
+u128_add1(uint64_t result[2], const uint64_t x[2])
+{
+    result[0] = x[0] + (x[1] == ~(uint64_t)0);
+    result[1] = x[1] + 1;
+}
+static void
+u128_sub1(uint64_t result[2], const uint64_t x[2])
+{
+    result[0] = x[0] - (x[1] == 0);
+    result[1] = x[1] - 1;
+}
+
+/***************************************************************************
+ * Whether the range ends before 'begin', without even touching it, in
+ * which case it doesn't get combined with a range starting there.
+ ***************************************************************************/
+static int
+range6_is_before(const struct RangeV6 *range, const uint64_t begin[2])
+{
+    uint64_t next[2];
+
+    if (u128_is_max(range->end))
+        return 0;
+    u128_add1(next, range->end);
+    return u128_compare(next, begin) < 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+static void
+rangelist_grow_v6(struct RangeListV6 *task, unsigned count)
+{
+    size_t new_max;
+    struct RangeV6 *new_list;
+
+    if (task->count + count <= task->max)
+        return;
+
+    new_max = (size_t)task->max * 2 + count;
+    if (new_max >= SIZE_MAX/sizeof(*new_list) || new_max > 0xFFFFFFFF)
+        exit(1); /* integer overflow */
+    new_list = malloc(sizeof(*new_list) * new_max);
+    if (new_list == NULL)
+        exit(1); /* out of memory */
+
+    if (task->count)
+        memcpy(new_list, task->list, task->count * sizeof(*new_list));
+    free(task->list);
+    task->list = new_list;
+    task->max = (unsigned)new_max;
+}
+
+/***************************************************************************
+ * Add the IPv6 range, combining it with any ranges it overlaps or
+ * touches, so the list stays sorted with no overlaps.
+ ***************************************************************************/
+void
+rangelist_add_range_v6(struct RangeListV6 *task, const uint64_t begin[2], const uint64_t end[2])
+{
+    struct RangeV6 range;
+    unsigned i;
+    unsigned j;
+
+    range.begin[0] = begin[0];
+    range.begin[1] = begin[1];
+    range.end[0] = end[0];
+    range.end[1] = end[1];
+
+    rangelist_grow_v6(task, 1);
+
+    /* skip the ranges that are wholly before this one */
+    for (i = 0; i < task->count; i++) {
+        if (!range6_is_before(&task->list[i], range.begin))
+            break;
+    }
+
+    /* absorb the ranges it overlaps or touches */
+    for (j = i; j < task->count; j++) {
+        if (range6_is_before(&range, task->list[j].begin))
+            break;
+        if (u128_compare(task->list[j].begin, range.begin) < 0)
+            memcpy(range.begin, task->list[j].begin, sizeof(range.begin));
+        if (u128_compare(task->list[j].end, range.end) > 0)
+            memcpy(range.end, task->list[j].end, sizeof(range.end));
+    }
+
+    /* replace them with the combined range */
+    if (j == i)
+        memmove(&task->list[i+1], &task->list[i], (task->count - i) * sizeof(task->list[0]));
+    else if (j > i + 1)
+        memmove(&task->list[i+1], &task->list[j], (task->count - j) * sizeof(task->list[0]));
+    task->list[i] = range;
+    task->count = task->count + 1 - (j - i);
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+rangelist_remove_range_v6(struct RangeListV6 *task, const uint64_t begin[2], const uint64_t end[2])
+{
+    unsigned i;
+
+    for (i = 0; i < task->count; i++) {
+        struct RangeV6 *range = &task->list[i];
+        int is_lower = u128_compare(range->begin, begin) < 0;
+        int is_upper = u128_compare(range->end, end) > 0;
+
+        if (u128_compare(range->end, begin) < 0)
+            continue;
+        if (u128_compare(range->begin, end) > 0)
+            break;
+
+        if (is_lower && is_upper) {
+            /* bisected, so it becomes two */
+            rangelist_grow_v6(task, 1);
+            range = &task->list[i];
+            memmove(range + 1, range, (task->count - i) * sizeof(*range));
+            task->count++;
+            u128_sub1(range[0].end, begin);
+            u128_add1(range[1].begin, end);
+            break;
+        } else if (is_lower) {
+            u128_sub1(range->end, begin);
+        } else if (is_upper) {
+            u128_add1(range->begin, end);
+            break;
+        } else {
+            /* wholly covered */
+            memmove(range, range + 1, (task->count - i - 1) * sizeof(*range));
+            task->count--;
+            i--;
+        }
+    }
+}
+
+/***************************************************************************
+ ***************************************************************************/
+int
+rangelist_is_contains_v6(const struct RangeListV6 *task, const uint64_t number[2])
+{
+    unsigned lo = 0;
+    unsigned hi = task->count;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo)/2;
+        const struct RangeV6 *range = &task->list[mid];
+
+        if (u128_compare(number, range->begin) < 0)
+            hi = mid;
+        else if (u128_compare(number, range->end) > 0)
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+rangelist_remove_all_v6(struct RangeListV6 *list)
+{
+    free(list->list);
+    memset(list, 0, sizeof(*list));
+}
+
+/***************************************************************************
+ ***************************************************************************/
+void
+rangelist_copy_v6(struct RangeListV6 *dst, const struct RangeListV6 *src)
+{
+    memset(dst, 0, sizeof(*dst));
+    rangelist_grow_v6(dst, src->count + 1);
+    dst->count = src->count;
+    if (src->count)
+        memcpy(dst->list, src->list, src->count * sizeof(dst->list[0]));
+}
+
 
 /***************************************************************************
  * Parse an IPv4 address from a line of text, moving the offset forward
@@ -595,6 +815,95 @@ regress_pick2()
 
 
 
+/***************************************************************************
+ ***************************************************************************/
+static int
+regress_v6(void)
+{
+    struct RangeListV6 list[1];
+    struct RangeListV6 copy[1];
+    static const uint64_t max = ~(uint64_t)0;
+    uint64_t a[2], b[2];
+
+    memset(list, 0, sizeof(list[0]));
+
+    /* 2001:db8::/32 and 2001:db9::/32 touch, so they become one */
+#define SET(x, hi, lo) (x[0] = (hi), x[1] = (lo))
+    SET(a, 0x20010db800000000ULL, 0);
+    SET(b, 0x20010db8ffffffffULL, max);
+    rangelist_add_range_v6(list, a, b);
+    SET(a, 0x20010db900000000ULL, 0);
+    SET(b, 0x20010db9ffffffffULL, max);
+    rangelist_add_range_v6(list, a, b);
+    REGRESS(list->count == 1);
+    REGRESS(list->list[0].begin[0] == 0x20010db800000000ULL);
+    REGRESS(list->list[0].end[0] == 0x20010db9ffffffffULL);
+
+    /* ranges before, after, and in between stay separate, in order */
+    SET(a, 0x20010dc000000000ULL, 0);
+    SET(b, 0x20010dc000000000ULL, max);
+    rangelist_add_range_v6(list, a, b);
+    SET(a, 0, 1);
+    rangelist_add_range_v6(list, a, a);
+    SET(a, 0x20010dbb00000000ULL, 0);
+    SET(b, 0x20010dbbffffffffULL, max);
+    rangelist_add_range_v6(list, a, b);
+    REGRESS(list->count == 4);
+    REGRESS(list->list[0].begin[1] == 1);
+    REGRESS(list->list[2].begin[0] == 0x20010dbb00000000ULL);
+
+    /* one range covering the middle two absorbs them */
+    SET(a, 0x20010db800000000ULL, 5);
+    SET(b, 0x20010dbc00000000ULL, 0);
+    rangelist_add_range_v6(list, a, b);
+    REGRESS(list->count == 3);
+    REGRESS(list->list[1].begin[0] == 0x20010db800000000ULL && list->list[1].begin[1] == 0);
+    REGRESS(list->list[1].end[0] == 0x20010dbc00000000ULL && list->list[1].end[1] == 0);
+
+    /* the edges of the address space */
+    SET(a, max, max);
+    rangelist_add_range_v6(list, a, a);
+    REGRESS(rangelist_is_contains_v6(list, a));
+    SET(a, max, max - 1);
+    REGRESS(!rangelist_is_contains_v6(list, a));
+    SET(a, 0, 0);
+    REGRESS(!rangelist_is_contains_v6(list, a));
+
+    /* removing from the middle splits a range, and the copy doesn't change */
+    rangelist_copy_v6(copy, list);
+    SET(a, 0x20010db900000000ULL, 0);
+    SET(b, 0x20010db9ffffffffULL, max);
+    rangelist_remove_range_v6(list, a, b);
+    REGRESS(list->count == 5);
+    REGRESS(!rangelist_is_contains_v6(list, a));
+    REGRESS(!rangelist_is_contains_v6(list, b));
+    REGRESS(rangelist_is_contains_v6(copy, a));
+    SET(a, 0x20010db8ffffffffULL, max);
+    REGRESS(rangelist_is_contains_v6(list, a));
+    SET(a, 0x20010dba00000000ULL, 0);
+    REGRESS(rangelist_is_contains_v6(list, a));
+
+    /* removing across ranges trims one and drops another */
+    SET(a, 0x20010db880000000ULL, 0);
+    SET(b, 0x20010dbc00000000ULL, 0);
+    rangelist_remove_range_v6(list, a, b);
+    REGRESS(list->count == 4);
+    REGRESS(list->list[1].end[0] == 0x20010db87fffffffULL && list->list[1].end[1] == max);
+    REGRESS(list->list[2].begin[0] == 0x20010dc000000000ULL && list->list[2].begin[1] == 0);
+
+    /* and trimming from the bottom */
+    SET(a, 0x20010dbf00000000ULL, 0);
+    SET(b, 0x20010dc000000000ULL, 5);
+    rangelist_remove_range_v6(list, a, b);
+    REGRESS(list->count == 4);
+    REGRESS(list->list[2].begin[0] == 0x20010dc000000000ULL && list->list[2].begin[1] == 6);
+
+    rangelist_remove_all_v6(list);
+    rangelist_remove_all_v6(copy);
+#undef SET
+    return 0;
+}
+
 /***************************************************************************
  * Called during "make regress" to run a regression test over this module.
  ***************************************************************************/
@@ -713,6 +1022,21 @@ ranges_selftest(void)
         return 1;
     }
 
+    /* the binary search */
+    REGRESS(rangelist_is_contains(task, 0x0a000001));
+    REGRESS(rangelist_is_contains(task, 0x0a09ffff));
+    REGRESS(!rangelist_is_contains(task, 0x0a0a0000));
+    REGRESS(!rangelist_is_contains(task, 0x0a0b8000));
+    REGRESS(!rangelist_is_contains(task, 0x0a0cffff));
+    REGRESS(rangelist_is_contains(task, 0x0a0d0000));
+    REGRESS(!rangelist_is_contains(task, 0x0a140000));
+    REGRESS(rangelist_is_contains(task, 0x0a150000));
+    REGRESS(!rangelist_is_contains(task, 0x0a000000));
+    REGRESS(!rangelist_is_contains(task, 0x0affffff));
+    rangelist_remove_all(task);
+
+    REGRESS(regress_v6() == 0);
+
 
     return 0;
 }
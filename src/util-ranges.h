@@ -14,7 +14,7 @@ struct Range
 };
 struct RangeV6
 {
-    uint64_t begin[2];
+    uint64_t begin[2];  /* [0] is the high half */
     uint64_t end[2];
 };
 
@@ -27,7 +27,7 @@ struct RangeList
 
 struct RangeListV6
 {
-    struct Range6 *list;
+    struct RangeV6 *list;
     unsigned count;
     unsigned max;
 };
@@ -46,7 +46,7 @@ struct RangeListV6
 void
 rangelist_add_range(struct RangeList *task, unsigned begin, unsigned end);
 void
-rangelist_add_range_v6(struct RangeList *task, uint64_t begin[2], uint64_t end[2]);
+rangelist_add_range_v6(struct RangeListV6 *task, const uint64_t begin[2], const uint64_t end[2]);
 
 /**
  * Removes the given range from the target list. The input range doesn't
@@ -61,7 +61,7 @@ rangelist_add_range_v6(struct RangeList *task, uint64_t begin[2], uint64_t end[2
 void
 rangelist_remove_range(struct RangeList *task, unsigned begin, unsigned end);
 void
-rangelist_remove_range_v6(struct RangeList *task, uint64_t begin[2], uint64_t end[2]);
+rangelist_remove_range_v6(struct RangeListV6 *task, const uint64_t begin[2], const uint64_t end[2]);
 
 /**
  * Same as 'rangelist_remove_range()', except the input is a range
@@ -72,7 +72,8 @@ rangelist_remove_range2(struct RangeList *task, struct Range range);
 
 /**
  * Returns 'true' is the indicated port or IP address is in one of the task
- * ranges.
+ * ranges. The ranges are kept sorted and merged, so this is a binary
+ * search, quick enough to do for every packet.
  * @param task
  *      A list of ranges of either IPv4 addresses or port numbers.
  * @param number
@@ -83,7 +84,7 @@ rangelist_remove_range2(struct RangeList *task, struct Range range);
 int
 rangelist_is_contains(const struct RangeList *task, unsigned number);
 int
-rangelist_is_contains_v6(const struct RangeList *task, uint64_t number[2]);
+rangelist_is_contains_v6(const struct RangeListV6 *task, const uint64_t number[2]);
 
 
 /**
@@ -159,7 +160,16 @@ IPV6ADDR rangelist_pick_v6(const struct RangeListV6 *targets, uint64_t i);
 void
 rangelist_remove_all(struct RangeList *list);
 void
-rangelist_remove_all_v6(struct RangeList *list);
+rangelist_remove_all_v6(struct RangeListV6 *list);
+
+/**
+ * Make 'dst' a copy of 'src', for changing a list that other threads
+ * might be reading.
+ */
+void
+rangelist_copy(struct RangeList *dst, const struct RangeList *src);
+void
+rangelist_copy_v6(struct RangeListV6 *dst, const struct RangeListV6 *src);
 
 
 
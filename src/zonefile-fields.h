@@ -100,8 +100,12 @@ struct ZoneFileParser
     struct rte_ring *insertion_queue;
     struct rte_ring *free_queue;
     unsigned additional_threads;
-    volatile unsigned running_threads;
     volatile unsigned is_running;
+    struct InsertionThread inserters[MAX_INSERTION_THREADS];
+
+    /* Statistics for records this thread inserts itself, when running
+     * without additional insertion threads */
+    struct EntryStatistics stats;
 };
 struct Bytes;
 
@@ -1,65 +1,221 @@
 #include "zonefile-insertion.h"
 #include "zonefile-fields.h"
+#include "db-xdomain.h"
 #include "rte-ring.h"
 #include "pixie-timer.h"
 #include "pixie-threads.h"
+#include "logger.h"
+#include "string_s.h"
 #include <string.h>
 
 /****************************************************************************
+ * A single resource-record pulled back out of a parsed block.
  ****************************************************************************/
-static void
-insert_block_into_catalog(struct ParsedBlock *block, 
-                          RESOURCE_RECORD_CALLBACK callback, 
-                          void *userdata, 
-                          uint64_t filesize)
+struct BlockRecord
 {
-    unsigned i;
-    unsigned max = block->offset;
+    struct DomainPointer domain;
+    const unsigned char *rdata;
+    unsigned type;
+    unsigned ttl;
+    unsigned rdlength;
+    unsigned line_number;
+    unsigned hash;          /* see block_hash_owners() */
+};
 
-    for (i=0; i<max; ) {
-        const unsigned char *buf = block->buf;
-        struct DomainPointer domain;
-        const unsigned char *rdata;
-        unsigned type;
-        unsigned ttl;
-        unsigned rdlength;
-        unsigned line_number =0;
+/****************************************************************************
+ * Decode the next record from the block.
+ * @return 1 if a record was decoded, 0 at the end of the block
+ ****************************************************************************/
+static int
+block_next_record(const struct ParsedBlock *block, unsigned *offset, struct BlockRecord *rec)
+{
+    const unsigned char *buf = block->buf;
+    unsigned i = *offset;
 
+    if (i >= block->offset)
+        return 0;
 
+    rec->domain.length = buf[i];
+    rec->domain.name = &buf[i+1];
 
-        domain.length = buf[i];
-        domain.name = &buf[i+1];
+    i += rec->domain.length + 1;
 
-        i += domain.length + 1;
+    /* not aligned, since the name before them can be any length */
+    memcpy(&rec->line_number, &buf[i], 4);
+    memcpy(&rec->hash, &buf[i+4], 4);
 
-        line_number = *(unsigned*)(&buf[i]);
+    i += 8;
 
-        i += 4;
+    rec->type = buf[i+0]<<8 | buf[i+1];
+    rec->ttl = buf[i+2]<<24 | buf[i+3]<<16 | buf[i+4]<<8 | buf[i+5];
+    rec->rdlength = buf[i+6]<<8 | buf[i+7];
+    i += 8;
 
-        type = buf[i+0]<<8 | buf[i+1];
-        ttl = buf[i+2]<<24 | buf[i+3]<<16 | buf[i+4]<<8 | buf[i+5];
-        rdlength = buf[i+6]<<8 | buf[i+7];
-        i += 8;
+    rec->rdata = &buf[i];
+    i += rec->rdlength;
 
-        rdata = &buf[i];
-        i += rdlength;
+    *offset = i;
+    return 1;
+}
 
+/****************************************************************************
+ ****************************************************************************/
+static void
+block_record_insert(const struct ParsedBlock *block,
+                    const struct BlockRecord *rec,
+                    RESOURCE_RECORD_CALLBACK callback,
+                    void *userdata,
+                    uint64_t filesize)
+{
+    callback(
+        rec->domain,
+        block->origin,
+        rec->type,
+        rec->ttl,
+        rec->rdlength,
+        rec->rdata,
+        filesize,
+        userdata,
+        block->filename,
+        rec->line_number);
+}
 
-        callback(
-            domain,
-            block->origin,
-            type,
-            ttl,
-            rdlength,
-            rdata,
-            filesize,
-            userdata,
-            block->filename,
-            line_number);
+/****************************************************************************
+ * Which insertion thread owns this record. A record lands in the hash
+ * bucket (hash & entry_mask) of its zone. Since both the bucket count and
+ * the thread count are powers of two, and there are never fewer buckets
+ * than threads, taking the low bits of the same hash means that each
+ * thread touches a disjoint set of buckets.
+ ****************************************************************************/
+static unsigned
+block_record_partition(const struct BlockRecord *rec, unsigned mask)
+{
+    return rec->hash & mask;
+}
+
+/****************************************************************************
+ * Fill in the owner-name hash of every record in the block, once, before
+ * it's handed to the insertion threads. Otherwise each of them would hash
+ * every record in the block just to find the few that are its own.
+ ****************************************************************************/
+static void
+block_hash_owners(struct ParsedBlock *block)
+{
+    unsigned i = 0;
+    unsigned start;
+    struct BlockRecord rec;
+
+    for (start = i; block_next_record(block, &i, &rec); start = i) {
+        struct DB_XDomain xdomain[1];
+        unsigned hash;
+
+        xdomain_reverse3(xdomain, &rec.domain, &block->origin);
+        hash = (unsigned)xdomain->hash;
+        memcpy(&block->buf[start + 1 + rec.domain.length + 4], &hash, 4);
     }
+}
 
+/****************************************************************************
+ * Reset a block so that it can be used again by the parser
+ ****************************************************************************/
+static void
+block_reset(struct ParsedBlock *block)
+{
     block->offset = 0;
     block->offset_start = 0;
+    block->soa_count = 0;
+}
+
+/****************************************************************************
+ * Wait until every insertion thread has inserted its share of the SOA
+ * records in the block. Threads normally arrive within microseconds of
+ * each other, so spin briefly before sleeping.
+ ****************************************************************************/
+static void
+block_soa_barrier(struct ParsedBlock *block)
+{
+    unsigned remaining;
+    unsigned i;
+
+    for (;;) {
+        remaining = block->soa_remaining;
+        if (pixie_locked_CAS32(&block->soa_remaining, remaining - 1, remaining))
+            break;
+    }
+    if (remaining == 1) {
+        pixie_futex_wake(&block->soa_remaining);
+        return;
+    }
+
+    for (i=0; (remaining = block->soa_remaining) != 0; i++) {
+        if (i < 1000)
+            rte_pause();
+        else
+            pixie_futex_wait(&block->soa_remaining, remaining, 1000);
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+insert_block_into_catalog(struct ParsedBlock *block,
+                          RESOURCE_RECORD_CALLBACK callback,
+                          void *userdata,
+                          uint64_t filesize)
+{
+    unsigned i = 0;
+    struct BlockRecord rec;
+
+    while (block_next_record(block, &i, &rec))
+        block_record_insert(block, &rec, callback, userdata, filesize);
+
+    block_reset(block);
+}
+
+/****************************************************************************
+ * Insert only those records in a block that belong to this thread's
+ * partition. Every insertion thread sees every block.
+ ****************************************************************************/
+static void
+insert_block_partition(struct ParsedBlock *block,
+                       struct InsertionThread *me,
+                       unsigned mask)
+{
+    struct ZoneFileParser *parser = me->parser;
+    unsigned i;
+    struct BlockRecord rec;
+
+    /*
+     * Pass 1: SOA records create zones, so every thread must wait until
+     * the SOAs in this block have been inserted before inserting other
+     * records, otherwise it'll fail to find the zone (or worse, put the
+     * record into the parent zone). Nobody blocks during this pass, so
+     * there is no chance of deadlock.
+     */
+    if (block->soa_count) {
+        i = 0;
+        while (block_next_record(block, &i, &rec)) {
+            if (rec.type != TYPE_SOA)
+                continue;
+            if (block_record_partition(&rec, mask) != me->index)
+                continue;
+            block_record_insert(block, &rec, parser->callback, parser->callbackdata, block->filesize);
+        }
+
+        block_soa_barrier(block);
+    }
+
+    /*
+     * Pass 2: all the other records in our partition
+     */
+    i = 0;
+    while (block_next_record(block, &i, &rec)) {
+        if (rec.type == TYPE_SOA && block->soa_count)
+            continue;
+        if (block_record_partition(&rec, mask) != me->index)
+            continue;
+        block_record_insert(block, &rec, parser->callback, parser->callbackdata, block->filesize);
+    }
 }
 
 
@@ -71,15 +227,18 @@ block_rr_finish(struct ParsedBlock *block)
 {
     unsigned i = block->offset_start;
     unsigned rdlength;
-    
-    /* skip domain name */
+
+    /* skip domain name, line number, and owner hash */
     i += block->buf[i] + 1;
-    i += 4;
-    
+    i += 8;
+
     rdlength = block->offset - i - 8;
     block->buf[i+6] = (unsigned char)(rdlength>>8);
     block->buf[i+7] = (unsigned char)(rdlength>>0);
     block->offset_start = block->offset;
+
+    if ((block->buf[i+0]<<8 | block->buf[i+1]) == TYPE_SOA)
+        block->soa_count++;
 }
 
 void
@@ -88,6 +247,28 @@ block_rr_start(struct ParsedBlock *block)
     (void)block;
 }
 
+/******************************************************************************
+ * Hand a finished block to the insertion threads. Each thread gets a
+ * reference to the block, and the last one to finish with it returns it
+ * to the free queue.
+ ******************************************************************************/
+static void
+block_dispatch(struct ZoneFileParser *parser, struct ParsedBlock *block)
+{
+    unsigned i;
+
+    if (parser->additional_threads == 0) {
+        rte_ring_enqueue(parser->insertion_queue, block);
+        return;
+    }
+
+    block_hash_owners(block);
+    block->refcount = parser->additional_threads;
+    block->soa_remaining = parser->additional_threads;
+    for (i=0; i<parser->additional_threads; i++)
+        rte_ring_enqueue_notify(parser->inserters[i].queue, block);
+}
+
 /******************************************************************************
  * BLOCKS: By grouping multiple RRs together in a "block", we can have
  * multiple threads updating the zone database without having to interact
@@ -102,7 +283,6 @@ block_next_to_parse(struct ZoneFileParser *parser)
     unsigned char domain_buffer[256];
 	uint64_t ttl;
     struct ParsedBlock *block = parser->block;
-    int err;
 
 
     if (block->offset == 0)
@@ -116,33 +296,23 @@ block_next_to_parse(struct ZoneFileParser *parser)
     memcpy(origin_buffer, block->origin_buffer, 256);
     origin.name = origin_buffer;
     origin.length = block->origin.length;
-    
+
     memcpy(domain_buffer, block->domain.name, 256);
     domain.name = domain_buffer;
     domain.length = block->domain.length;
-    
+
     ttl = block->ttl;
 
     /*
      * Insert this block into the processing queue
      */
-    rte_ring_enqueue(parser->insertion_queue, block);
+    block_dispatch(parser, block);
 
     /*
-     * Get a new block from the free queue
+     * Get a new block from the free queue. If the insertion threads are
+     * behind, this sleeps until one of them returns a block.
      */
-    for (err=1; err; ) {
-        err = rte_ring_dequeue(parser->free_queue, (void**)&block);
-        if (err != 0) {
-            static int is_warning_printed = 0;
-            if (!is_warning_printed) {
-                fprintf(stderr, "insertion slow, parser waiting\n");
-                is_warning_printed = 1;
-            }
-            fflush(stdout);
-            pixie_usleep(100);
-        }
-    }
+    rte_ring_dequeue_wait(parser->free_queue, (void**)&block, 0);
     parser->block = block;
 
     /*
@@ -151,13 +321,13 @@ block_next_to_parse(struct ZoneFileParser *parser)
     memcpy(block->origin_buffer, origin_buffer, 256);
     block->origin.name = block->origin_buffer;
     block->origin.length = origin.length;
-    
+
     memcpy(block->domain_buffer, domain_buffer, 256);
     block->domain.name = block->domain_buffer;
     block->domain.length = domain.length;
-    
+
     block->ttl = ttl;
-    
+
     memcpy(block->filename, parser->src.filename, sizeof(block->filename));
     block->filesize = parser->filesize;
 
@@ -169,23 +339,12 @@ block_next_to_parse(struct ZoneFileParser *parser)
      * do the job.
      */
     if (parser->additional_threads == 0) {
-        for (err=1; err; ) {
-            err = rte_ring_dequeue(parser->insertion_queue, (void**)&block);
-            if (err != 0) {
-                static int is_warning_printed = 0;
-                if (!is_warning_printed) {
-                    fprintf(stderr, "de-insertion slow, parser waiting\n");
-                    is_warning_printed = 1;
-                }
-                fflush(stdout);
-                pixie_usleep(100);
-            }
-        }
-        insert_block_into_catalog(block, 
-                                  parser->callback, 
-                                  parser->callbackdata, 
+        rte_ring_dequeue_wait(parser->insertion_queue, (void**)&block, 0);
+        insert_block_into_catalog(block,
+                                  parser->callback,
+                                  parser->callbackdata,
                                   parser->filesize);
-        
+
         rte_ring_enqueue(parser->free_queue, block);
     }
 
@@ -194,49 +353,74 @@ block_next_to_parse(struct ZoneFileParser *parser)
 
 
 
+/****************************************************************************
+ * Drop this thread's reference to the block.
+ * @return 1 if this was the last reference, 0 otherwise
+ ****************************************************************************/
+static int
+block_release(struct ParsedBlock *block)
+{
+    for (;;) {
+        unsigned refcount = block->refcount;
+        if (pixie_locked_CAS32(&block->refcount, refcount - 1, refcount))
+            return refcount == 1;
+    }
+}
+
 /****************************************************************************
  ****************************************************************************/
 static void
 insertion_thread(void *v)
 {
-    struct ZoneFileParser *parser = (struct ZoneFileParser *)v;
+    struct InsertionThread *me = (struct InsertionThread *)v;
+    struct ZoneFileParser *parser = me->parser;
+    unsigned mask = parser->additional_threads - 1;
 
-    pixie_locked_add_u32(&parser->running_threads, 1);
+    entry_stats_bind(&me->stats);
 
-    /* 
-     * just sit in a loop grabbing work units as they arrive 
+    /*
+     * just sit in a loop grabbing work units as they arrive
      */
-    while (parser->is_running) {
+    for (;;) {
         struct ParsedBlock *block = 0;
         int err;
 
-        for (err=1; err && parser->is_running; ) {
-            err = rte_ring_dequeue(parser->insertion_queue, (void**)&block);
-            if (err != 0) {
-                static int is_warning_printed = 0;
-                if (!is_warning_printed) {
-                    fprintf(stderr, "de-insertion slow, parser waiting\n");
-                    is_warning_printed = 1;
-                }
-                fflush(stdout);
-                pixie_usleep(100);
-            }
-        }
-        insert_block_into_catalog(block, parser->callback, parser->callbackdata, block->filesize);
-        //printf("." "INSERTION-THREAD: inserted block\n");
-        rte_ring_enqueue(parser->free_queue, block);
+        /* Sleeps when there is no work, and only exits once our queue
+         * has been drained */
+        err = rte_ring_dequeue_wait(me->queue, (void**)&block, &parser->is_running);
+        if (err != 0)
+            break;
 
+        insert_block_partition(block, me, mask);
+
+        /* The last thread to finish with the block recycles it */
+        if (block_release(block)) {
+            block_reset(block);
+            rte_ring_enqueue_notify(parser->free_queue, block);
+        }
     }
 
-    pixie_locked_add_u32(&parser->running_threads, -1);
+    entry_stats_bind(0);
+}
+
+/****************************************************************************
+ * Round down to a power of two, so that the partition can be selected with
+ * a simple mask of the hash
+ ****************************************************************************/
+static unsigned
+pow2_floor(unsigned x)
+{
+    unsigned result = 1;
 
-    printf("parser->running threads = %u\n", parser->running_threads);
+    while (result * 2 <= x)
+        result *= 2;
+    return result;
 }
 
 /****************************************************************************
  ****************************************************************************/
 struct ParsedBlock *
-block_init(struct ZoneFileParser *parser, 
+block_init(struct ZoneFileParser *parser,
             struct DomainPointer origin,
             uint64_t ttl)
 {
@@ -262,13 +446,29 @@ block_init(struct ZoneFileParser *parser,
     if (parser->src.filename) {
         memcpy(parser->block->filename, parser->src.filename, sizeof(parser->block->filename));
     }
+    parser->block->filesize = parser->filesize;
+
+    /* Records that this thread inserts itself */
+    memset(&parser->stats, 0, sizeof(parser->stats));
+    entry_stats_bind(&parser->stats);
 
     /*
-     * Start the insertion threads
+     * Start the insertion threads. There must be a power-of-two number
+     * of them so that records can be partitioned by hash.
      */
+    if (parser->additional_threads > MAX_INSERTION_THREADS)
+        parser->additional_threads = MAX_INSERTION_THREADS;
+    if (parser->additional_threads)
+        parser->additional_threads = pow2_floor(parser->additional_threads);
     parser->is_running = 1;
     for (i=0; i<parser->additional_threads; i++) {
-        pixie_begin_thread(insertion_thread, 0, parser);
+        struct InsertionThread *inserter = &parser->inserters[i];
+
+        inserter->parser = parser;
+        inserter->index = i;
+        inserter->queue = rte_ring_create(128, RING_F_SP_ENQ | RING_F_SC_DEQ);
+        memset(&inserter->stats, 0, sizeof(inserter->stats));
+        inserter->handle = pixie_begin_thread(insertion_thread, 0, inserter);
     }
 
     return parser->block;
@@ -279,10 +479,40 @@ block_init(struct ZoneFileParser *parser,
 void
 block_end(struct ZoneFileParser *parser)
 {
+    unsigned i;
+    struct rte_ring_waitstats stats;
+
+    /* Wake up any idle insertion threads so they notice we are done */
     parser->is_running = 0;
-    while (parser->running_threads) {
-        pixie_usleep(1000);
+    for (i=0; i<parser->additional_threads; i++)
+        rte_ring_notify(parser->inserters[i].queue);
+
+    /*
+     * Wait for the threads to exit, then merge their statistics into
+     * the process-wide totals
+     */
+    for (i=0; i<parser->additional_threads; i++) {
+        struct InsertionThread *inserter = &parser->inserters[i];
+
+        pixie_join(inserter->handle, 0);
+        entry_stats_merge(&inserter->stats);
+
+        rte_ring_get_waitstats(inserter->queue, &stats);
+        LOG_DBG(C_ZONEFILE, 1, "insertion-thread[%u]: %" PRIu64 " stalls, %" PRIu64 " usecs idle, max %u blocks queued\n",
+            i, stats.stalls, stats.stall_nsecs/1000, stats.max_count);
+        rte_ring_free(inserter->queue);
     }
+
+    entry_stats_bind(0);
+    entry_stats_merge(&parser->stats);
+
+    /* Stalls on the free queue are the parser waiting on the inserters */
+    rte_ring_get_waitstats(parser->free_queue, &stats);
+    LOG_DBG(C_ZONEFILE, 1, "parser: %" PRIu64 " stalls, %" PRIu64 " usecs waiting for insertion\n",
+        stats.stalls, stats.stall_nsecs/1000);
+
+    rte_ring_free(parser->insertion_queue);
+    rte_ring_free(parser->free_queue);
 }
 
 /****************************************************************************
@@ -290,9 +520,6 @@ block_end(struct ZoneFileParser *parser)
 void
 block_flush(struct ZoneFileParser *parser)
 {
-    while (rte_ring_count(parser->free_queue) != 63) {
-        pixie_usleep(100);
-    }
+    rte_ring_wait_count(parser->free_queue, 63);
 }
 
-
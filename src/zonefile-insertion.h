@@ -2,7 +2,17 @@
 #define ZONEFILE_BLOCK_H
 #include <stdint.h>
 #include "domainname.h"
+#include "db-entry.h"
 struct ZoneFileParser;
+struct rte_ring;
+
+/**
+ * The maximum number of insertion threads per parser. Records are
+ * partitioned among threads by the low bits of their hash, so this must
+ * not be larger than the smallest zone hash-table (see zone_create_buckets()),
+ * and must be a power of two
+ */
+#define MAX_INSERTION_THREADS 16
 
 
 /****************************************************************************
@@ -41,6 +51,33 @@ struct ParsedBlock
     unsigned char buf[256*1024];
     unsigned offset;
     unsigned offset_start;
+
+    /* The number of SOA records in this block. Since SOA records create
+     * zones, all insertion threads must wait for them to be inserted
+     * before inserting any other records from the block */
+    unsigned soa_count;
+
+    /* With multiple insertion threads, every thread sees every block,
+     * but only inserts the records in its own partition. This counts
+     * the threads that still need to process the block */
+    volatile unsigned refcount;
+
+    /* The number of threads that haven't yet inserted their SOA
+     * records from this block */
+    volatile unsigned soa_remaining;
+};
+
+/****************************************************************************
+ * An insertion thread. Each thread owns a disjoint slice of the hash
+ * buckets of every zone, so no locks are needed when inserting.
+ ****************************************************************************/
+struct InsertionThread
+{
+    struct ZoneFileParser *parser;
+    struct rte_ring *queue;
+    unsigned index;
+    size_t handle;
+    struct EntryStatistics stats;
 };
 
 
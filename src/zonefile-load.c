@@ -1,6 +1,13 @@
 #include "db.h"
 #include "db-zone.h"
 #include "zonefile-load.h"
+#include "db-xdomain.h"
+#include "logger.h"
+#include "util-realloc2.h"
+#include "unusedparm.h"
+#include "string_s.h"
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 
 /******************************************************************************
@@ -13,20 +20,24 @@ format_domain(char *dst, size_t sizeof_dst,
     unsigned i;
     unsigned d = 0;
     
-    for (i=0; i<domain.length; i++) {
+    for (i=0; i<domain.length; i += domain.name[i] + 1) {
         unsigned j;
         unsigned len = domain.name[i];
-        const unsigned char *p = domain.name+1;
+        const unsigned char *p = domain.name+i+1;
+        if (len == 0)
+            break;
         for (j=0; j<len && d+1<sizeof_dst; j++)
             dst[d++] = p[j];
         if (d+1<sizeof_dst)
             dst[d++] = '.';
     }
     
-    for (i=0; i<origin.length; i++) {
+    for (i=0; i<origin.length; i += origin.name[i] + 1) {
         unsigned j;
         unsigned len = origin.name[i];
-        const unsigned char *p = origin.name+1;
+        const unsigned char *p = origin.name+i+1;
+        if (len == 0)
+            break;
         for (j=0; j<len && d+1<sizeof_dst; j++)
             dst[d++] = p[j];
         if (d+1<sizeof_dst)
@@ -105,3 +116,236 @@ zonefile_load(
     return Success;
 }
 
+/****************************************************************************
+ * The counting pass. Records are counted against the most recent SOA,
+ * since zonefiles put the SOA at the start of each zone. To count distinct
+ * owners (rather than records) we keep a set of hashes of the owner names
+ * seen so far in the current zone.
+ ****************************************************************************/
+struct ZoneCount
+{
+    unsigned char name[256];
+    unsigned name_length;
+    uint64_t owner_count;
+    struct DBZone *zone;
+};
+
+struct ZoneCounter
+{
+    struct Catalog *db;
+
+    struct ZoneCount *list;
+    unsigned count;
+    unsigned max;
+
+    /* open-addressing set of owner hashes for the current zone */
+    uint64_t *owners;
+    unsigned owners_mask;
+    unsigned owners_count;
+    uint64_t last_hash;
+};
+
+/****************************************************************************
+ ****************************************************************************/
+struct ZoneCounter *
+zonecount_create(struct Catalog *db)
+{
+    struct ZoneCounter *counter;
+
+    counter = MALLOC2(sizeof(*counter));
+    memset(counter, 0, sizeof(*counter));
+    counter->db = db;
+    return counter;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+zonecount_destroy(struct ZoneCounter *counter)
+{
+    free(counter->owners);
+    free(counter->list);
+    free(counter);
+}
+
+/****************************************************************************
+ * Hash the owner name, case-insensitively. The parser has already appended
+ * the $ORIGIN to relative names (see mm_domain_end()), so the name in the
+ * block is fully-qualified and is hashed up to its root label. The origin
+ * that comes along with it isn't part of the name and isn't hashed, so
+ * the same owner under two different $ORIGINs is counted once.
+ ****************************************************************************/
+static uint64_t
+owner_hash(const struct DomainPointer *domain)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned i = 0;
+
+    while (i < domain->length && domain->name[i]) {
+        unsigned end = i + domain->name[i] + 1;
+
+        for ( ; i < end && i < domain->length; i++)
+            hash = (hash ^ tolower(domain->name[i])) * 0x100000001b3ULL;
+    }
+
+    /* zero marks empty slots in the set */
+    return hash | 1;
+}
+
+/****************************************************************************
+ * Add the hash to the set, returning 1 if it wasn't already there.
+ ****************************************************************************/
+static int
+owners_insert(struct ZoneCounter *counter, uint64_t hash)
+{
+    unsigned i;
+
+    /* Keep the set no more than half full */
+    if (counter->owners == NULL || counter->owners_count * 2 >= counter->owners_mask) {
+        uint64_t *old = counter->owners;
+        unsigned old_size = old ? counter->owners_mask + 1 : 0;
+        unsigned new_size = old ? old_size * 2 : 1024;
+
+        counter->owners = MALLOC2(new_size * sizeof(counter->owners[0]));
+        memset(counter->owners, 0, new_size * sizeof(counter->owners[0]));
+        counter->owners_mask = new_size - 1;
+        counter->owners_count = 0;
+        for (i=0; i<old_size; i++) {
+            if (old[i])
+                owners_insert(counter, old[i]);
+        }
+        free(old);
+    }
+
+    for (i = (unsigned)hash & counter->owners_mask; counter->owners[i]; i = (i + 1) & counter->owners_mask) {
+        if (counter->owners[i] == hash)
+            return 0;
+    }
+    counter->owners[i] = hash;
+    counter->owners_count++;
+    return 1;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+owners_clear(struct ZoneCounter *counter)
+{
+    if (counter->owners)
+        memset(counter->owners, 0, (counter->owners_mask + 1) * sizeof(counter->owners[0]));
+    counter->owners_count = 0;
+    counter->last_hash = 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+enum SuccessFailure
+zonefile_count(
+        struct DomainPointer domain,
+        struct DomainPointer origin,
+	    unsigned type,
+        unsigned ttl,
+        unsigned rdlength,
+        const unsigned char *rdata,
+        uint64_t filesize,
+	    void *userdata,
+        const char *filename,
+        unsigned line_number)
+{
+    struct ZoneCounter *counter = (struct ZoneCounter *)userdata;
+    uint64_t hash;
+
+    UNUSEDPARM(ttl);
+    UNUSEDPARM(rdlength);
+    UNUSEDPARM(rdata);
+    UNUSEDPARM(filesize);
+    UNUSEDPARM(filename);
+    UNUSEDPARM(line_number);
+
+    /*
+     * An SOA starts a new zone
+     */
+    if (type == TYPE_SOA) {
+        struct ZoneCount *zc;
+
+        if (domain.length + origin.length > sizeof(zc->name))
+            return Failure;
+
+        if (counter->count >= counter->max) {
+            counter->max = counter->max * 2 + 16;
+            counter->list = REALLOC2(counter->list, counter->max, sizeof(counter->list[0]));
+        }
+        zc = &counter->list[counter->count++];
+        memset(zc, 0, sizeof(*zc));
+        memcpy(zc->name, domain.name, domain.length);
+        memcpy(zc->name + domain.length, origin.name, origin.length);
+        zc->name_length = domain.length + origin.length;
+
+        owners_clear(counter);
+    }
+
+    /* Records before the first SOA will fail to load anyway */
+    if (counter->count == 0)
+        return Success;
+
+    /* Records for the same owner are almost always grouped together, so
+     * this skips most of the set lookups */
+    hash = owner_hash(&domain);
+    if (hash == counter->last_hash)
+        return Success;
+    counter->last_hash = hash;
+
+    if (owners_insert(counter, hash))
+        counter->list[counter->count - 1].owner_count++;
+
+    return Success;
+}
+
+/****************************************************************************
+ * After the counting pass, create the zones with the right sizes.
+ ****************************************************************************/
+void
+zonecount_create_zones(struct ZoneCounter *counter, const char *filename)
+{
+    unsigned i;
+
+    for (i=0; i<counter->count; i++) {
+        struct ZoneCount *zc = &counter->list[i];
+        struct DomainPointer name;
+        struct DB_XDomain xdomain[1];
+
+        name.name = zc->name;
+        name.length = zc->name_length;
+        xdomain_reverse3(xdomain, &name, 0);
+
+        zc->zone = catalog_create_zone_exact(counter->db, xdomain, zc->owner_count, filename);
+    }
+}
+
+/****************************************************************************
+ * After the loading pass, compact the zones.
+ ****************************************************************************/
+void
+zonecount_pack_zones(struct ZoneCounter *counter)
+{
+    unsigned i;
+
+    for (i=0; i<counter->count; i++) {
+        struct ZoneCount *zc = &counter->list[i];
+        struct DomainPointer name;
+        struct DomainPointer none = {0, 0};
+        char name_string[300];
+        uint64_t bytes;
+
+        if (zc->zone == NULL)
+            continue;
+
+        bytes = zone_pack(zc->zone);
+
+        name.name = zc->name;
+        name.length = zc->name_length;
+        format_domain(name_string, sizeof(name_string), name, none);
+        LOG_DBG(C_ZONEFILE, 1, "%s: %" PRIu64 " owners, %" PRIu64 " bytes packed\n",
+            name_string, zc->owner_count, bytes);
+    }
+}
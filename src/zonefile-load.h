@@ -16,5 +16,33 @@ zonefile_load(
         const char *filename,
         unsigned line_number);
 
+/**
+ * For loading a zonefile in two passes. The first pass parses the file
+ * with zonefile_count() as the callback, counting the distinct owner
+ * names in each zone. Then zonecount_create_zones() creates the zones
+ * with exactly sized hash tables. The second pass loads the file normally
+ * with zonefile_load(), then zonecount_pack_zones() compacts the zones.
+ */
+struct ZoneCounter;
+struct Catalog;
+
+struct ZoneCounter *zonecount_create(struct Catalog *db);
+void zonecount_destroy(struct ZoneCounter *counter);
+void zonecount_create_zones(struct ZoneCounter *counter, const char *filename);
+void zonecount_pack_zones(struct ZoneCounter *counter);
+
+enum SuccessFailure
+zonefile_count(
+        struct DomainPointer domain,
+        struct DomainPointer origin,
+	    unsigned type,
+        unsigned ttl,
+        unsigned rdlength,
+        const unsigned char *rdata,
+        uint64_t filesize,
+	    void *userdata,
+        const char *filename,
+        unsigned line_number);
+
 
 #endif
\ No newline at end of file
@@ -810,8 +810,10 @@ rr_end:
 			/* We founda TYPE field, as we expected. Therefore,
 			 * mark this type then move onto the RR contents */
 
-            /* First, align the start of the buffer */
-            *(unsigned*)(&block->buf[block->offset]) = parser->src.line_number;
+            /* First, the line number, which won't be aligned */
+            memcpy(&block->buf[block->offset], &parser->src.line_number, 4);
+            block->offset += 4;
+            memset(&block->buf[block->offset], 0, 4); /* placeholder for the owner hash */
             block->offset += 4;
             block->buf[block->offset++] = (unsigned char)(type>>8);
             block->buf[block->offset++] = (unsigned char)(type>>0);
@@ -1008,7 +1010,7 @@ rr_end:
 		x_parse_ttl(parser, buf, &i, length);
 		if (i >= length)
 			break;
-        mm_integer32_end(parser);
+        mm_integer16_end(parser);
         mm_domain_start(parser);
 		s = $RR_MX_DOMAIN;
 		parser->s2 = 0;
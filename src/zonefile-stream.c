@@ -0,0 +1,721 @@
+/*
+    ZONEFILE STREAM
+
+  Reads a zonefile on a separate thread, decompressing it if necessary,
+  handing chunks to the parsing thread through a pair of rings: one of
+  full chunks waiting to be parsed, one of empty chunks waiting to be
+  filled.
+
+  Compressed files are detected by their "magic" bytes, not by their
+  names, so a ".zone" file that happens to be gzipped still works.
+
+  The zlib and libzstd libraries are loaded at runtime, the same as
+  libpcap, so that they are only needed if there are compressed files.
+  We therefore declare the few bits of their APIs that we need ourselves,
+  rather than including their headers.
+*/
+#include "zonefile-stream.h"
+#include "rte-ring.h"
+#include "pixie.h"
+#include "pixie-threads.h"
+#include "logger.h"
+#include "string_s.h"
+#include "success-failure.h"
+#include "util-realloc2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM_CHUNK_SIZE   (256*1024)
+#define STREAM_CHUNK_COUNT  4
+
+enum StreamCompression {
+    Compression_None,
+    Compression_Gzip,
+    Compression_Zstd,
+};
+
+/****************************************************************************
+ * The parts of <zlib.h> that we use
+ ****************************************************************************/
+#define Z_OK            0
+#define Z_STREAM_END    1
+#define Z_BUF_ERROR     (-5)
+#define Z_NO_FLUSH      0
+struct z_stream_s {
+    const unsigned char *next_in;
+    unsigned avail_in;
+    unsigned long total_in;
+    unsigned char *next_out;
+    unsigned avail_out;
+    unsigned long total_out;
+    const char *msg;
+    void *state;
+    void *zalloc;
+    void *zfree;
+    void *opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+};
+typedef int (*INFLATEINIT2_)(struct z_stream_s *strm, int window_bits, const char *version, int stream_size);
+typedef int (*INFLATE)(struct z_stream_s *strm, int flush);
+typedef int (*INFLATERESET)(struct z_stream_s *strm);
+typedef int (*INFLATEEND)(struct z_stream_s *strm);
+
+/****************************************************************************
+ * The parts of <zstd.h> that we use
+ ****************************************************************************/
+struct ZSTD_inBuffer_s {
+    const void *src;
+    size_t size;
+    size_t pos;
+};
+struct ZSTD_outBuffer_s {
+    void *dst;
+    size_t size;
+    size_t pos;
+};
+#define ZSTD_CONTENTSIZE_UNKNOWN (0ULL - 1)
+#define ZSTD_CONTENTSIZE_ERROR   (0ULL - 2)
+typedef void *(*ZSTD_CREATEDSTREAM)(void);
+typedef size_t (*ZSTD_INITDSTREAM)(void *zds);
+typedef size_t (*ZSTD_DECOMPRESSSTREAM)(void *zds, struct ZSTD_outBuffer_s *output, struct ZSTD_inBuffer_s *input);
+typedef size_t (*ZSTD_FREEDSTREAM)(void *zds);
+typedef unsigned (*ZSTD_ISERROR)(size_t code);
+typedef const char *(*ZSTD_GETERRORNAME)(size_t code);
+typedef unsigned long long (*ZSTD_GETFRAMECONTENTSIZE)(const void *src, size_t src_size);
+
+static struct {
+    unsigned is_initialized;
+
+    unsigned is_zlib;
+    INFLATEINIT2_ inflateInit2_;
+    INFLATE inflate;
+    INFLATERESET inflateReset;
+    INFLATEEND inflateEnd;
+
+    unsigned is_zstd;
+    ZSTD_CREATEDSTREAM ZSTD_createDStream;
+    ZSTD_INITDSTREAM ZSTD_initDStream;
+    ZSTD_DECOMPRESSSTREAM ZSTD_decompressStream;
+    ZSTD_FREEDSTREAM ZSTD_freeDStream;
+    ZSTD_ISERROR ZSTD_isError;
+    ZSTD_GETERRORNAME ZSTD_getErrorName;
+    ZSTD_GETFRAMECONTENTSIZE ZSTD_getFrameContentSize;
+} lib;
+
+/****************************************************************************
+ ****************************************************************************/
+struct StreamChunk
+{
+    size_t length;
+    unsigned char buf[STREAM_CHUNK_SIZE];
+};
+
+struct ZoneStream
+{
+    char *filename;
+    FILE *fp;
+    enum StreamCompression compression;
+    uint64_t size_hint;
+
+    volatile unsigned is_running;
+    volatile unsigned is_error;
+    unsigned is_eof;
+    size_t thread_handle;
+
+    /* chunks filled by the thread, waiting to be parsed */
+    struct rte_ring *full;
+
+    /* chunks returned by the parser, waiting to be filled */
+    struct rte_ring *empty;
+
+    /* the chunk currently being parsed */
+    struct StreamChunk *current;
+
+    struct StreamChunk chunks[STREAM_CHUNK_COUNT];
+
+    /* compressed data read from the file */
+    unsigned char inbuf[65536];
+};
+
+
+/****************************************************************************
+ ****************************************************************************/
+static void *
+load_library(const char *names[])
+{
+    unsigned i;
+
+    for (i=0; names[i]; i++) {
+        void *h = pixie_load_library(names[i]);
+        if (h)
+            return h;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+void
+zonestream_init(void)
+{
+    static const char *zlib_names[] = {
+#if defined(WIN32)
+        "zlib1.dll", "zlib.dll",
+#elif defined(__APPLE__)
+        "libz.dylib", "libz.1.dylib",
+#else
+        "libz.so.1", "libz.so",
+#endif
+        0};
+    static const char *zstd_names[] = {
+#if defined(WIN32)
+        "libzstd.dll", "zstd.dll",
+#elif defined(__APPLE__)
+        "libzstd.dylib", "libzstd.1.dylib",
+#else
+        "libzstd.so.1", "libzstd.so",
+#endif
+        0};
+    void *h;
+
+    if (lib.is_initialized)
+        return;
+    lib.is_initialized = 1;
+
+    h = load_library(zlib_names);
+    if (h) {
+        lib.inflateInit2_ = (INFLATEINIT2_)pixie_get_proc_symbol(h, "inflateInit2_");
+        lib.inflate = (INFLATE)pixie_get_proc_symbol(h, "inflate");
+        lib.inflateReset = (INFLATERESET)pixie_get_proc_symbol(h, "inflateReset");
+        lib.inflateEnd = (INFLATEEND)pixie_get_proc_symbol(h, "inflateEnd");
+        lib.is_zlib = lib.inflateInit2_ && lib.inflate && lib.inflateReset && lib.inflateEnd;
+    }
+
+    h = load_library(zstd_names);
+    if (h) {
+        lib.ZSTD_createDStream = (ZSTD_CREATEDSTREAM)pixie_get_proc_symbol(h, "ZSTD_createDStream");
+        lib.ZSTD_initDStream = (ZSTD_INITDSTREAM)pixie_get_proc_symbol(h, "ZSTD_initDStream");
+        lib.ZSTD_decompressStream = (ZSTD_DECOMPRESSSTREAM)pixie_get_proc_symbol(h, "ZSTD_decompressStream");
+        lib.ZSTD_freeDStream = (ZSTD_FREEDSTREAM)pixie_get_proc_symbol(h, "ZSTD_freeDStream");
+        lib.ZSTD_isError = (ZSTD_ISERROR)pixie_get_proc_symbol(h, "ZSTD_isError");
+        lib.ZSTD_getErrorName = (ZSTD_GETERRORNAME)pixie_get_proc_symbol(h, "ZSTD_getErrorName");
+        lib.ZSTD_getFrameContentSize = (ZSTD_GETFRAMECONTENTSIZE)pixie_get_proc_symbol(h, "ZSTD_getFrameContentSize");
+        lib.is_zstd = lib.ZSTD_createDStream && lib.ZSTD_initDStream
+                    && lib.ZSTD_decompressStream && lib.ZSTD_freeDStream
+                    && lib.ZSTD_isError && lib.ZSTD_getErrorName;
+    }
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+ends_with(const char *string, const char *suffix)
+{
+    size_t string_length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+
+    if (suffix_length > string_length)
+        return 0;
+
+    return memcmp(string+string_length-suffix_length, suffix, suffix_length) == 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+zonestream_is_zonefile_name(const char *filename)
+{
+    return ends_with(filename, ".zone")
+        || ends_with(filename, ".zone.gz")
+        || ends_with(filename, ".zone.zst");
+}
+
+/****************************************************************************
+ * Get an empty chunk to fill.
+ * @return a chunk, or NULL if the stream is being closed
+ ****************************************************************************/
+static struct StreamChunk *
+stream_get_empty(struct ZoneStream *s)
+{
+    struct StreamChunk *chunk;
+
+    if (rte_ring_dequeue_wait(s->empty, (void**)&chunk, &s->is_running) != 0)
+        return 0;
+    chunk->length = 0;
+    return chunk;
+}
+
+/****************************************************************************
+ * Hand a filled chunk to the parser.
+ ****************************************************************************/
+static void
+stream_put_full(struct ZoneStream *s, struct StreamChunk *chunk)
+{
+    rte_ring_enqueue_notify(s->full, chunk);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+stream_error(struct ZoneStream *s, const char *msg)
+{
+    LOG_ERR(C_ZONEFILE, "%s: %s\n", s->filename, msg);
+    s->is_error = 1;
+}
+
+/****************************************************************************
+ * Uncompressed files: just read them, but on this thread so that the
+ * reads overlap with parsing.
+ ****************************************************************************/
+static struct StreamChunk *
+stream_read_plain(struct ZoneStream *s)
+{
+    struct StreamChunk *chunk;
+
+    while ((chunk = stream_get_empty(s)) != NULL) {
+        chunk->length = fread(chunk->buf, 1, sizeof(chunk->buf), s->fp);
+        if (chunk->length == 0)
+            break;
+        stream_put_full(s, chunk);
+    }
+    if (ferror(s->fp))
+        stream_error(s, "read error");
+    return chunk;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct StreamChunk *
+stream_read_gzip(struct ZoneStream *s)
+{
+    struct z_stream_s z;
+    struct StreamChunk *chunk;
+    int is_end = 0;
+    int err;
+
+    memset(&z, 0, sizeof(z));
+    err = lib.inflateInit2_(&z, 15 + 32, "1.2.3", (int)sizeof(z));
+    if (err != Z_OK) {
+        stream_error(s, "zlib: init failed");
+        return stream_get_empty(s);
+    }
+
+    chunk = stream_get_empty(s);
+    while (chunk) {
+        /* Refill the input */
+        if (z.avail_in == 0) {
+            z.avail_in = (unsigned)fread(s->inbuf, 1, sizeof(s->inbuf), s->fp);
+            z.next_in = s->inbuf;
+            if (z.avail_in == 0)
+                break;
+
+            /* A file can have several gzip "members" one after another, as
+             * when files are concatenated. We only get here after the end
+             * of one member if there is more data following it */
+            if (is_end) {
+                lib.inflateReset(&z);
+                is_end = 0;
+            }
+        }
+
+        z.next_out = chunk->buf + chunk->length;
+        z.avail_out = (unsigned)(sizeof(chunk->buf) - chunk->length);
+
+        err = lib.inflate(&z, Z_NO_FLUSH);
+        chunk->length = sizeof(chunk->buf) - z.avail_out;
+
+        if (err == Z_STREAM_END) {
+            is_end = 1;
+            if (z.avail_in) {
+                lib.inflateReset(&z);
+                is_end = 0;
+            }
+        } else if (err != Z_OK && err != Z_BUF_ERROR) {
+            stream_error(s, z.msg ? z.msg : "zlib: corrupt data");
+            break;
+        }
+
+        if (chunk->length == sizeof(chunk->buf)) {
+            stream_put_full(s, chunk);
+            chunk = stream_get_empty(s);
+        }
+    }
+
+    if (!is_end && !s->is_error && s->is_running)
+        stream_error(s, "gzip: file truncated");
+    if (ferror(s->fp))
+        stream_error(s, "read error");
+
+    lib.inflateEnd(&z);
+
+    /* hand over the final partial chunk */
+    if (chunk && chunk->length) {
+        stream_put_full(s, chunk);
+        chunk = stream_get_empty(s);
+    }
+    return chunk;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct StreamChunk *
+stream_read_zstd(struct ZoneStream *s)
+{
+    void *zds;
+    struct ZSTD_inBuffer_s in;
+    struct StreamChunk *chunk;
+    size_t result = 0;
+
+    zds = lib.ZSTD_createDStream();
+    if (zds == NULL) {
+        stream_error(s, "zstd: init failed");
+        return stream_get_empty(s);
+    }
+    lib.ZSTD_initDStream(zds);
+
+    in.src = s->inbuf;
+    in.size = 0;
+    in.pos = 0;
+
+    chunk = stream_get_empty(s);
+    while (chunk) {
+        struct ZSTD_outBuffer_s out;
+
+        /* Refill the input */
+        if (in.pos == in.size) {
+            in.size = fread(s->inbuf, 1, sizeof(s->inbuf), s->fp);
+            in.pos = 0;
+            if (in.size == 0)
+                break;
+        }
+
+        out.dst = chunk->buf;
+        out.size = sizeof(chunk->buf);
+        out.pos = chunk->length;
+
+        /* Returns zero at the end of a frame, and continues on with
+         * the next frame if there is one */
+        result = lib.ZSTD_decompressStream(zds, &out, &in);
+        if (lib.ZSTD_isError(result)) {
+            stream_error(s, lib.ZSTD_getErrorName(result));
+            break;
+        }
+        chunk->length = out.pos;
+
+        if (chunk->length == sizeof(chunk->buf)) {
+            stream_put_full(s, chunk);
+            chunk = stream_get_empty(s);
+        }
+    }
+
+    if (result != 0 && !s->is_error && s->is_running)
+        stream_error(s, "zstd: file truncated");
+    if (ferror(s->fp))
+        stream_error(s, "read error");
+
+    lib.ZSTD_freeDStream(zds);
+
+    /* hand over the final partial chunk */
+    if (chunk && chunk->length) {
+        stream_put_full(s, chunk);
+        chunk = stream_get_empty(s);
+    }
+    return chunk;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static void
+stream_thread(void *v)
+{
+    struct ZoneStream *s = (struct ZoneStream *)v;
+    struct StreamChunk *chunk;
+
+    switch (s->compression) {
+    case Compression_Gzip:
+        chunk = stream_read_gzip(s);
+        break;
+    case Compression_Zstd:
+        chunk = stream_read_zstd(s);
+        break;
+    default:
+        chunk = stream_read_plain(s);
+        break;
+    }
+
+    /* An empty chunk marks the end of the file */
+    if (chunk) {
+        chunk->length = 0;
+        stream_put_full(s, chunk);
+    }
+}
+
+/****************************************************************************
+ * Guess the decompressed size of the file.
+ ****************************************************************************/
+static uint64_t
+stream_size_hint(FILE *fp, enum StreamCompression compression, const unsigned char *header, size_t header_length)
+{
+    uint64_t filesize;
+    uint64_t result;
+
+    if (fseek(fp, 0, SEEK_END) != 0)
+        return 0;
+    filesize = (uint64_t)ftell(fp);
+    result = filesize;
+
+    switch (compression) {
+    case Compression_Gzip:
+        /* The last four bytes of the file are the uncompressed size
+         * (modulo 4-gigabytes) of the last gzip member */
+        if (filesize > 18 && fseek(fp, -4, SEEK_END) == 0) {
+            unsigned char isize[4];
+            if (fread(isize, 1, 4, fp) == 4)
+                result = isize[0] | isize[1]<<8 | isize[2]<<16 | (uint64_t)isize[3]<<24;
+        }
+        break;
+    case Compression_Zstd:
+        if (lib.ZSTD_getFrameContentSize) {
+            unsigned long long size;
+            size = lib.ZSTD_getFrameContentSize(header, header_length);
+            if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR)
+                result = size;
+        }
+        break;
+    default:
+        break;
+    }
+
+    /* Zonefiles compress around 8-to-1. If the size in the header looks
+     * wrong, like when there are multiple members/frames, or the file
+     * is larger than 4-gigabytes, use that instead */
+    if (compression != Compression_None && result < filesize * 2)
+        result = filesize * 8;
+
+    return result;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static struct ZoneStream *
+stream_start(FILE *fp, const char *filename)
+{
+    struct ZoneStream *s;
+    unsigned char header[18];
+    size_t header_length;
+    unsigned i;
+
+    zonestream_init();
+
+    s = MALLOC2(sizeof(*s));
+    memset(s, 0, offsetof(struct ZoneStream, chunks));
+    s->filename = STRDUP2(filename);
+    s->fp = fp;
+
+    /*
+     * Detect the type of file from its first few bytes
+     */
+    header_length = fread(header, 1, sizeof(header), fp);
+    if (header_length >= 4 && memcmp(header, "\x28\xb5\x2f\xfd", 4) == 0)
+        s->compression = Compression_Zstd;
+    else if (header_length >= 2 && header[0] == 0x1f && header[1] == 0x8b)
+        s->compression = Compression_Gzip;
+    else
+        s->compression = Compression_None;
+
+    if (s->compression == Compression_Gzip && !lib.is_zlib) {
+        LOG_ERR(C_ZONEFILE, "%s: gzip compressed, but couldn't load zlib\n", filename);
+        goto fail;
+    }
+    if (s->compression == Compression_Zstd && !lib.is_zstd) {
+        LOG_ERR(C_ZONEFILE, "%s: zstd compressed, but couldn't load libzstd\n", filename);
+        goto fail;
+    }
+
+    s->size_hint = stream_size_hint(fp, s->compression, header, header_length);
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+        LOG_ERR(C_ZONEFILE, "%s: seek failed\n", filename);
+        goto fail;
+    }
+
+    /*
+     * Start the thread, giving it all the chunks to fill
+     */
+    s->full = rte_ring_create(2*STREAM_CHUNK_COUNT, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    s->empty = rte_ring_create(2*STREAM_CHUNK_COUNT, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    for (i=0; i<STREAM_CHUNK_COUNT; i++)
+        rte_ring_enqueue(s->empty, &s->chunks[i]);
+
+    s->is_running = 1;
+    s->thread_handle = pixie_begin_thread(stream_thread, 0, s);
+    return s;
+
+fail:
+    fclose(fp);
+    free(s->filename);
+    free(s);
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+struct ZoneStream *
+zonestream_open(const char *filename)
+{
+    FILE *fp;
+    int err;
+
+    err = fopen_s(&fp, filename, "rb");
+    if (err || fp == NULL) {
+        perror(filename);
+        return 0;
+    }
+
+    return stream_start(fp, filename);
+}
+
+/****************************************************************************
+ ****************************************************************************/
+uint64_t
+zonestream_size_hint(const struct ZoneStream *s)
+{
+    return s->size_hint;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+const unsigned char *
+zonestream_next(struct ZoneStream *s, size_t *length)
+{
+    struct StreamChunk *chunk;
+
+    /* Give the previous chunk back to be refilled */
+    if (s->current) {
+        rte_ring_enqueue_notify(s->empty, s->current);
+        s->current = 0;
+    }
+
+    if (s->is_eof)
+        return 0;
+
+    rte_ring_dequeue_wait(s->full, (void**)&chunk, 0);
+    if (chunk->length == 0) {
+        s->is_eof = 1;
+        rte_ring_enqueue_notify(s->empty, chunk);
+        return 0;
+    }
+
+    s->current = chunk;
+    *length = chunk->length;
+    return chunk->buf;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+zonestream_close(struct ZoneStream *s)
+{
+    int result;
+
+    /* If we stopped before reaching the end, the thread may be waiting
+     * for us to return a chunk, so wake it up */
+    s->is_running = 0;
+    rte_ring_notify(s->empty);
+    pixie_join(s->thread_handle, 0);
+
+    result = s->is_error ? Failure : Success;
+
+    rte_ring_free(s->full);
+    rte_ring_free(s->empty);
+    fclose(s->fp);
+    free(s->filename);
+    free(s);
+    return result;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+static int
+selftest_stream(const unsigned char *data, size_t data_length, const char *expected)
+{
+    struct ZoneStream *s;
+    FILE *fp;
+    char result[256];
+    size_t result_length = 0;
+    const unsigned char *buf;
+    size_t length;
+
+    fp = tmpfile();
+    if (fp == NULL)
+        return 0; /* can't test, so don't fail */
+    fwrite(data, 1, data_length, fp);
+    rewind(fp);
+
+    s = stream_start(fp, "<selftest>");
+    if (s == NULL)
+        return 1;
+    while ((buf = zonestream_next(s, &length)) != NULL) {
+        if (result_length + length > sizeof(result))
+            break;
+        memcpy(result + result_length, buf, length);
+        result_length += length;
+    }
+    if (zonestream_close(s) != Success)
+        return 1;
+
+    if (result_length != strlen(expected) || memcmp(result, expected, result_length) != 0)
+        return 1;
+    return 0;
+}
+
+/****************************************************************************
+ ****************************************************************************/
+int
+zonestream_selftest(void)
+{
+    static const char plain[] = "example.com. 60 IN A 1.2.3.4\n";
+
+    /* two concatenated gzip members */
+    static const unsigned char gz[] =
+        "\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\x4b\xad\x48\xcc\x2d\xc8"
+        "\x49\xd5\x4b\xce\xcf\xd5\x53\x30\x33\x50\xf0\xf4\x53\x70\x54\x30"
+        "\xd4\x33\xd2\x33\xd6\x33\xe1\x4a\x25\x5b\x12\x00\x64\x5b\xa4\x4e"
+        "\x57\x00\x00\x00\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\x2b\x2f"
+        "\x2f\x57\x30\x33\x50\xf0\xf4\x53\x70\x54\x30\xd5\x33\xd3\x33\xd7"
+        "\xb3\xe0\x02\x00\xde\x1f\x4b\x76\x14\x00\x00\x00";
+
+    /* a zstd frame with a single uncompressed block */
+    static const unsigned char zst[] =
+        "\x28\xb5\x2f\xfd\x20\x1d\xe9\x00\x00"
+        "example.com. 60 IN A 1.2.3.4\n";
+
+    if (selftest_stream((const unsigned char*)plain, sizeof(plain)-1, plain) != 0) {
+        fprintf(stderr, "zonestream: plain failed\n");
+        return 1;
+    }
+
+    zonestream_init();
+
+    if (lib.is_zlib) {
+        if (selftest_stream(gz, sizeof(gz)-1,
+                            "example.com. 60 IN A 1.2.3.4\n"
+                            "example.com. 60 IN A 1.2.3.4\n"
+                            "example.com. 60 IN A 1.2.3.4\n"
+                            "www 60 IN A 5.6.7.8\n") != 0) {
+            fprintf(stderr, "zonestream: gzip failed\n");
+            return 1;
+        }
+    }
+
+    if (lib.is_zstd) {
+        if (selftest_stream(zst, sizeof(zst)-1, plain) != 0) {
+            fprintf(stderr, "zonestream: zstd failed\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef ZONEFILE_STREAM_H
+#define ZONEFILE_STREAM_H
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Reads a zonefile in chunks for feeding into zonefile_parse(). If the
+ * file is gzip or zstd compressed, it's decompressed on the fly. The
+ * reading/decompressing happens on a separate thread, so that it
+ * overlaps with parsing.
+ *
+ * We don't link with zlib or libzstd, but load them at runtime the first
+ * time they are needed, so that they are only required when there are
+ * compressed zonefiles.
+ */
+struct ZoneStream;
+
+/**
+ * Loads the decompression libraries. This is done automatically when
+ * needed, but should be called before starting multiple threads.
+ */
+void zonestream_init(void);
+
+/**
+ * Whether the filename looks like a zonefile that we can read, such as
+ * "example.com.zone", "example.com.zone.gz", or "example.com.zone.zst".
+ */
+int zonestream_is_zonefile_name(const char *filename);
+
+/**
+ * Open the file, detecting whether it's compressed from the first few
+ * bytes, and start the thread reading it.
+ * @return a stream, or NULL on failure (an error will have been logged)
+ */
+struct ZoneStream *zonestream_open(const char *filename);
+
+/**
+ * A guess at the size of the file once decompressed, for use as the
+ * 'filesize' hint when creating zones.
+ */
+uint64_t zonestream_size_hint(const struct ZoneStream *stream);
+
+/**
+ * Get the next chunk of the file. The chunk remains valid until the
+ * next call.
+ * @return a pointer to the data, or NULL at the end of the file
+ */
+const unsigned char *zonestream_next(struct ZoneStream *stream, size_t *length);
+
+/**
+ * Stop the thread and close the file.
+ * @return Success, or Failure if there was an error reading or
+ *      decompressing the file
+ */
+int zonestream_close(struct ZoneStream *stream);
+
+int zonestream_selftest(void);
+
+#endif